@@ -46,6 +46,8 @@ class build_ext(setuptools.command.build_ext.build_ext):
                 extra_link_args.append("-Wl,-so%s" % file_name)
             else:
                 extra_link_args.append("-Wl,-soname,%s" % file_name)
+            if sys.platform.startswith("linux"):
+                ext.libraries = ["rt"]
         super().build_extension(ext)
 
     def finalize_options(self):
@@ -92,6 +94,9 @@ export_symbols = [
     "StartLoggingEx",
     "StartLoggingForPythonThread",
     "StartLoggingForPythonThreadEx",
+    "StartLoggingForPythonThreadWithOptions",
+    "StartLoggingWithOptions",
+    "InitializeLoggingOptions",
     "StartLoggingStderr",
     "StartLoggingStderrEx",
     "StartLoggingStdout",
@@ -116,10 +121,30 @@ export_symbols = [
     "LogPythonException",
     "LogPythonExceptionWithTraceback",
     "LogConfiguredException",
+    "BeginRecord",
+    "BeginRecordForPython",
+    "AppendLine",
+    "AppendLineVaList",
+    "CommitRecord",
     "GetLoggingState",
     "SetLoggingState",
     "IsLoggingStarted",
     "IsLoggingAtLevelForPython",
+    "EnableLoggingStats",
+    "GetLoggingStats",
+    "ResetLoggingStats",
+    "GetLatencyHistogramLowerBound",
+    "GetLoggingCounters",
+    "RunLoggingCollector",
+    "StopLoggingCollector",
+    "CreateLoggingSink",
+    "CreateFileSink",
+    "CreateStderrSink",
+    "CreateStdoutSink",
+    "CreateCallbackSink",
+    "FreeLoggingSink",
+    "AddLoggingSink",
+    "AddLoggingSinkForPython",
 ]
 
 if sys.platform == "win32":
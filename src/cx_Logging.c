@@ -13,6 +13,7 @@
 
 #define KEY_LOGGING_STATE       "cx_Logging_LoggingState"
 #define KEY_ENCODING            "cx_Logging_Encoding"
+#define KEY_ENCODING_TYPE       "cx_Logging_EncodingType"
 #define KEY_EXC_BASE_CLASS      "cx_Logging_ExcBaseClass"
 #define KEY_EXC_MESSAGE         "cx_Logging_ExcMessage"
 #define KEY_EXC_BUILDER         "cx_Logging_ExcBuilder"
@@ -23,21 +24,115 @@
 #define ENV_NAME_PREFIX         "CX_LOGGING_PREFIX"
 #define THREAD_FORMAT           "%.5ld"
 #define DATE_FORMAT             "%.4d/%.2d/%.2d"
+#define DAILY_STAMP_FORMAT      ".%.4d-%.2d-%.2d"
+#define HOURLY_STAMP_FORMAT     ".%.4d-%.2d-%.2d-%.2d"
+#define MAX_STAMP_LENGTH        16
 #define TIME_FORMAT             "%.2d:%.2d:%.2d.%.3d"
 #define TICKS_FORMAT            "%.10d"
+#define MAX_DIRECTIVE_LENGTH    40
+#define RATE_LIMIT_NUM_SLOTS    1024
+#define RATE_LIMIT_NUM_PROBES   8
+#define FNV_OFFSET_BASIS        14695981039346656037ULL
+#define FNV_PRIME               1099511628211ULL
+#define LOCK_FILE_SUFFIX        ".lock"
+#define SEQ_FILE_SUFFIX         ".seq"
+#define SEQ_FILE_TEMP_SUFFIX    ".seq.tmp"
+#define SOURCE_CACHE_SIZE       256
+#define MAX_CHAINED_EXCEPTIONS  16
+#define EXCEPTION_CACHE_SIZE    64
+#define ENCODING_TYPE_UTF8      0
+#define ENCODING_TYPE_ASCII     1
+#define ENCODING_TYPE_LATIN1    2
+#define ENCODING_TYPE_OTHER     3
+#define MULTI_PROCESS_BUF_SIZE  65536
+#define MULTI_PROCESS_CHECK_INTERVAL    64
+#define COLLECTOR_IOVECS        1024
+#define RECORD_IOVECS           1024
+#define COLLECTOR_TEXT_SIZE     65536
+#define COLLECTOR_NOTICE_SIZE   128
+#define COLLECTOR_POLL_INTERVAL 10
+#define COLLECTOR_PROCESSES     64
+#define COLLECTOR_RING_SIZE     262144
+#define SYSLOG_ADDRESS          "/dev/log"
+#define SYSLOG_FACILITY_USER    1
+#define SYSLOG_HEADER_SIZE      256
+#define SYSLOG_SEND_TIMEOUT     1
+#define JOURNALD_ADDRESS        "/run/systemd/journal/socket"
+#define ASYNC_QUEUE_SIZE        1048576
+#define ASYNC_BATCH_SIZE        64
+#define ASYNC_PYTHON_INTERVAL   100
+#define ASYNC_PADDING           0xffffffffU
+#define MAX_SYSLOG_IDENT_LENGTH 48
+#define MAX_SYSLOG_HOST_LENGTH  64
+#define NETWORK_BUFFER_SIZE     1048576
+#define NETWORK_MAX_SPILL_SIZE  268435456
+#define NETWORK_CHUNK_SIZE      65536
+#define NETWORK_RETRY_INTERVAL  1000
+#define NETWORK_SEND_TIMEOUT    5
+#define MAX_NETWORK_HOST_LENGTH 255
+#define MAX_NETWORK_PORT_LENGTH 31
 
 
 // define platform specific methods for manipulating locks
 #ifdef MS_WINDOWS
 #include <malloc.h>
+#define THREAD_LOCAL            __declspec(thread)
 #define INITIALIZE_LOCK(lock)   InitializeCriticalSection(&lock)
 #define ACQUIRE_LOCK(lock)      EnterCriticalSection(&lock)
 #define RELEASE_LOCK(lock)      LeaveCriticalSection(&lock)
+#include <io.h>
+#define SYNC_FILE(fd)           (FlushFileBuffers((HANDLE) \
+        _get_osfhandle(fd)) ? 0 : -1)
 #else
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#define THREAD_LOCAL            __thread
 #define INITIALIZE_LOCK(lock)   sem_init(&lock, 0, 1)
 #define ACQUIRE_LOCK(lock)      sem_wait(&lock)
 #define RELEASE_LOCK(lock)      sem_post(&lock)
+#ifdef __APPLE__
+#define SYNC_FILE(fd)           fsync(fd)
+#else
+#define SYNC_FILE(fd)           fdatasync(fd)
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL            0
+#endif
+#endif
+
+// define platform specific methods for manipulating counters atomically
+#ifdef MS_WINDOWS
+#define ATOMIC_ADD(var, value)  InterlockedExchangeAdd64((LONG64*) &(var), \
+        (LONG64) (value))
+#define ATOMIC_EXCHANGE(var, value) \
+        InterlockedExchange64((LONG64*) &(var), (LONG64) (value))
+#define ATOMIC_CAS(var, expected, desired) \
+        (InterlockedCompareExchange64((LONG64*) &(var), (LONG64) (desired), \
+        (LONG64) (expected)) == (LONG64) (expected))
+#define ATOMIC_FENCE()          MemoryBarrier()
+#define ATOMIC_LOAD(var)        InterlockedCompareExchange64((LONG64*) &(var), \
+        0, 0)
+#define ATOMIC_STORE(var, value) \
+        InterlockedExchange64((LONG64*) &(var), (LONG64) (value))
+#else
+#define ATOMIC_ADD(var, value)  __atomic_fetch_add(&(var), value, \
+        __ATOMIC_RELAXED)
+#define ATOMIC_EXCHANGE(var, value) \
+        __atomic_exchange_n(&(var), value, __ATOMIC_RELAXED)
+#define ATOMIC_CAS(var, expected, desired) \
+        __atomic_compare_exchange_n(&(var), &(expected), desired, 0, \
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define ATOMIC_FENCE()          __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD(var)        __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(var, value) \
+        __atomic_store_n(&(var), value, __ATOMIC_RELEASE)
 #endif
 
 // define macro to get the build version as a string
@@ -46,19 +141,850 @@
 #define BUILD_VERSION_STRING    xstr(BUILD_VERSION)
 
 
-// define global logging state
+// define global logging state; the level and options of the global state are
+// also kept separately so that messages can be filtered without acquiring the
+// lock; the counters of messages filtered in this manner are kept separately
+// as well
 static LoggingState *gLoggingState;
 static LOCK_TYPE gLoggingStateLock;
+static unsigned long gLoggingLevel = LOG_LEVEL_NONE;
+static LoggingOptions gLoggingOptions;
+static LoggingCounters gLoggingUnlockedCounters;
+
+
+// define list of logging states for Python; this is protected by the global
+// logging state lock
+static udt_LoggingState *gPythonLoggingStates;
+
+
+// define thread local state used for sampling messages
+static THREAD_LOCAL unsigned long long tSampleCounters[LOG_NUM_LEVEL_INDEXES];
+static THREAD_LOCAL unsigned long long tRandomState;
+
+
+// define structure for managing the rate at which a call site logs; the key is
+// zero until the slot is claimed by a call site and the theoretical arrival
+// time is that of the generic cell rate algorithm which implements a token
+// bucket with a single compare and swap; once that time has passed and no
+// dropped messages remain to be reported, the slot is idle and may be claimed
+// by another call site
+typedef struct {
+    unsigned long long key;
+    unsigned long long theoreticalArrivalTime;
+    unsigned long long dropped;
+} RateLimitSlot;
+
+
+// define structure for building a record made up of multiple lines, which is
+// written as a whole; the lines are separated by line feeds
+typedef struct {
+    char *data;
+    size_t length;
+    size_t allocated;
+    unsigned long numLines;
+} TextBuffer;
+
+
+// define structure for building a record on the current thread with
+// BeginRecord(), AppendLine() and CommitRecord(); records that are begun while
+// another is being built are nested within it and their lines are written as
+// part of the outermost record, at its level, when it is committed
+typedef struct {
+    TextBuffer buffer;
+    unsigned long level;
+    unsigned long depth;
+    int enabled;
+    int forPython;
+} RecordBuilder;
+static THREAD_LOCAL RecordBuilder tRecordBuilder;
+
+
+// define structure for a record built from Python, which is used as a context
+// manager; the number of times it has been entered is tracked so that lines
+// are only appended while it is being built
+typedef struct {
+    PyObject_HEAD
+    unsigned long level;
+    unsigned long depth;
+} udt_Record;
+
+
+// define cache of the lines of source files used when formatting tracebacks;
+// this is only accessed while the GIL is held
+static PyObject *gSourceLines;
+
+
+// define interned key under which the type of encoding of a Python thread is
+// stored in its thread state dictionary; the type is resolved from the name of
+// the encoding when it is set so that it is not looked up for each message
+static PyObject *gEncodingTypeKey;
+
+
+// define structure for managing an exception logged recently, identified by a
+// fingerprint of its type and the code objects and instructions in its
+// traceback, so that it can be referred to when it is repeated; the cache of
+// such exceptions is only accessed while the GIL is held and the least
+// recently used entry is replaced when a new exception is logged
+typedef struct {
+    unsigned long long fingerprint;
+    unsigned long long loggedTime;
+    unsigned long long lastUsed;
+    unsigned long long repeatCount;
+    unsigned long id;
+} ExceptionCacheEntry;
+static ExceptionCacheEntry gExceptionCache[EXCEPTION_CACHE_SIZE];
+static unsigned long long gExceptionCacheTicks;
+static unsigned long gLastExceptionId;
+
+
+// define rate limiting slots shared by all logging states
+static RateLimitSlot gRateLimitSlots[RATE_LIMIT_NUM_SLOTS];
+
+
+// define flight recorder used by the global logging state; its entries are
+// never freed since messages are recorded without acquiring the lock
+static FlightRecorderEntry
+        gFlightRecorderEntries[LOG_FLIGHT_RECORDER_MAX_ENTRIES];
+static FlightRecorder gFlightRecorder = { 0, 0, 0, gFlightRecorderEntries };
+
+
+#ifndef MS_WINDOWS
+// define state used when a fatal signal is received; only the file descriptor
+// of the global logging state is used by the signal handler since the state
+// itself may be in the process of being modified or freed
+#define NUM_FATAL_SIGNALS       5
+static const int gFatalSignals[NUM_FATAL_SIGNALS] = { SIGSEGV, SIGBUS,
+        SIGILL, SIGFPE, SIGABRT };
+static struct sigaction gOrigFatalSignalActions[NUM_FATAL_SIGNALS];
+static int gFatalSignalHandlersInstalled;
+static volatile int gEmergencyFileDescriptor = -1;
+#endif
+
+
+#ifndef MS_WINDOWS
+// define structure for managing a collector process which creates shared
+// memory and writes the messages placed in it by other processes to a file;
+// the messages are written in batches with a single vectored write directly
+// from shared memory, so the tail of each ring is only advanced once the batch
+// containing its messages has been written
+typedef struct {
+    LoggingState *state;
+    SharedMemoryHeader *header;
+    size_t size;
+    char name[NAME_MAX + 1];
+    unsigned long long *pendingTails;
+    struct iovec *iovecs;
+    int numIovecs;
+    char *text;
+    size_t textSize;
+    size_t textUsed;
+    size_t batchBytes;
+    int needsNewline;
+    unsigned long long position;
+} LoggingCollector;
+
+
+// define flag used to stop the collector
+static volatile int gStopLoggingCollector;
+#endif
+
+
+// define structure for managing a sink which calls a function supplied by the
+// caller for each record
+typedef struct {
+    LoggingSinkCallback callback;
+    void *context;
+} CallbackSink;
+
+
+#ifndef MS_WINDOWS
+// define structure for a message sent by a syslog sink; a batch of them is
+// sent with a single call to sendmmsg() where it is available
+#ifdef __linux__
+typedef struct mmsghdr SyslogMessage;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+} SyslogMessage;
+#endif
+
+
+// define structure for managing a sink which sends each record as a datagram
+// to the local syslog daemon (or journald) listening on a Unix domain socket;
+// the header of each record in a batch is formatted into its own slot
+typedef struct {
+    int fd;
+    unsigned long facility;
+    unsigned long format;
+    char ident[MAX_SYSLOG_IDENT_LENGTH + 1];
+    char hostName[MAX_SYSLOG_HOST_LENGTH + 1];
+    char address[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    char *headers;
+    struct iovec *vectors;
+    SyslogMessage *messages;
+    size_t capacity;
+} SyslogSink;
+
+
+// define structure for managing a sink which streams framed records to a
+// collector over TCP (or sends each frame as a UDP datagram); frames which
+// have not been sent are held in a bounded buffer in memory and, when that is
+// full, appended to a spill file, from which they are replayed before those
+// in memory once the collector can be reached again
+typedef struct {
+    int fd;
+    int socketType;
+    unsigned long framing;
+    char host[MAX_NETWORK_HOST_LENGTH + 1];
+    char port[MAX_NETWORK_PORT_LENGTH + 1];
+    char *buffer;
+    size_t bufferSize;
+    size_t bufferStart;
+    size_t bufferEnd;
+    char *spillFileName;
+    int spillFd;
+    unsigned long long spillStart;
+    unsigned long long spillEnd;
+    unsigned long long maxSpillSize;
+    char *chunk;
+    size_t chunkSize;
+    unsigned long long nextConnectTime;
+} NetworkSink;
+
+
+// define structure for a record placed in the queue of an asynchronous sink;
+// it is followed by the message and the text, each terminated by a null byte,
+// and padded to a multiple of eight bytes
+typedef struct {
+    unsigned long long timestamp;
+    long long threadId;
+    unsigned long long level;
+    unsigned int messageLength;
+    unsigned int textLength;
+} AsyncRecord;
+
+
+// define structure for managing a sink whose records are placed in a bounded
+// queue by the threads logging messages and written to the target sink in
+// batches by a writer thread; the queue is a ring in which each record is
+// contiguous, with the head advanced by the logging threads and the tail by
+// the writer thread once the records have been written, so that the records
+// are passed to the target sink directly from the ring; failures of the
+// target sink are reported when the next record is queued
+typedef struct {
+    LoggingSink *target;
+    char *ring;
+    unsigned long long ringSize;
+    unsigned long long head;
+    unsigned long long tail;
+    unsigned long numQueued;
+    unsigned long numFailed;
+    ExceptionInfo failure;
+    unsigned long batchSize;
+    unsigned long intervalMs;
+    unsigned long forkGeneration;
+    LoggingSinkRecord *batch;
+    int stopping;
+    int writerWaiting;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    pthread_t thread;
+} AsyncSink;
+
+
+// define number of times the process has forked, as seen by the child, so
+// that writer threads which do not exist in the child are not used
+static unsigned long gForkGeneration;
+#endif
+
+
+// define global logging statistics
+static LoggingStats gLoggingStats;
+static int gLoggingStatsEnabled;
 
 
 // define keywords for common Python methods
 static char *gStartLoggingWithFileKeywordList[] = {"fileName", "level",
         "maxFiles", "maxFileSize", "prefix", "encoding", "reuse", "rotate",
-        NULL};
+        "rateLimit", "suppressRepeats", "sampleRates", "sampleRandomly",
+        "flightRecorderSize", "flightRecorderLevel", "flightRecorderTrigger",
+        "emergencyFlush", "reopenAfterFork", "multiProcess", "sharedMemory",
+        "bufferSize", "directWrite", "durability", "syncInterval",
+        "durableLevel", "rotateInterval", "exceptionDedupWindow",
+        "sortArguments", "routes", NULL};
 static char *gStartLoggingNoFileKeywordList[] = {"level", "prefix", "encoding",
         NULL};
 
 
+//-----------------------------------------------------------------------------
+// GetTimeInNanoseconds()
+//   Return a monotonic time in nanoseconds for use in measuring latency.
+//-----------------------------------------------------------------------------
+static unsigned long long GetTimeInNanoseconds(void)
+{
+#ifdef MS_WINDOWS
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (unsigned long long) (counter.QuadPart / frequency.QuadPart) *
+            1000000000ULL + (unsigned long long) (counter.QuadPart %
+            frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// LatencyHistogram_GetBucket()
+//   Return the bucket in which the given number of nanoseconds is recorded.
+// Values below 4 have a bucket of their own; after that there are four
+// buckets for each power of two.
+//-----------------------------------------------------------------------------
+static int LatencyHistogram_GetBucket(
+    unsigned long long value)           // value to place in a bucket
+{
+    int msb, bucket;
+
+    if (value < 4)
+        return (int) value;
+    for (msb = 2; msb < 63 && (value >> (msb + 1)); msb++);
+    bucket = 4 + (msb - 2) * 4 + (int) ((value >> (msb - 2)) & 3);
+    if (bucket >= LOG_STATS_NUM_BUCKETS)
+        return LOG_STATS_NUM_BUCKETS - 1;
+    return bucket;
+}
+
+
+//-----------------------------------------------------------------------------
+// LatencyHistogram_Record()
+//   Record the elapsed time in the histogram. Atomic operations are used since
+// the histograms are shared by all logging states and their locks.
+//-----------------------------------------------------------------------------
+static void LatencyHistogram_Record(
+    LatencyHistogram *histogram,        // histogram to update
+    unsigned long long startTime)       // time at which operation started
+{
+    unsigned long long elapsed, maxNs;
+
+    elapsed = GetTimeInNanoseconds() - startTime;
+    ATOMIC_ADD(histogram->count, 1);
+    ATOMIC_ADD(histogram->totalNs, elapsed);
+    ATOMIC_ADD(histogram->buckets[LatencyHistogram_GetBucket(elapsed)], 1);
+    maxNs = histogram->maxNs;
+    while (elapsed > maxNs) {
+        if (ATOMIC_CAS(histogram->maxNs, maxNs, elapsed))
+            break;
+        maxNs = histogram->maxNs;
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// AcquireLockForWriting()
+//   Acquire the lock in preparation for writing, recording the amount of time
+// spent waiting for it if statistics are being collected.
+//-----------------------------------------------------------------------------
+static void AcquireLockForWriting(
+    LOCK_TYPE *lock)                    // lock to acquire
+{
+    unsigned long long startTime;
+
+    if (!gLoggingStatsEnabled) {
+        ACQUIRE_LOCK(*lock);
+        return;
+    }
+    startTime = GetTimeInNanoseconds();
+    ACQUIRE_LOCK(*lock);
+    LatencyHistogram_Record(&gLoggingStats.lockWait, startTime);
+}
+
+
+//-----------------------------------------------------------------------------
+// HashBytes()
+//   Return the FNV-1a hash of the given bytes.
+//-----------------------------------------------------------------------------
+static unsigned long long HashBytes(
+    const char *value,                  // value to hash
+    size_t length)                      // length of value to hash
+{
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) value[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+
+//-----------------------------------------------------------------------------
+// RateLimit_GetSlot()
+//   Return the slot used for managing the rate at which the call site
+// identified by the key logs. The slots following the one to which the key
+// hashes are probed and a free slot is claimed with a compare and swap. If
+// none of them is free, the first idle slot found is claimed instead, since
+// its bucket is full and it has nothing left to report, so that call sites
+// which have stopped logging (such as messages logged without a format) do not
+// occupy slots forever. Only if none is idle either is the slot to which the
+// key hashes shared with the call sites already using it, which are then
+// limited together; the history of a slot in use is never discarded.
+//-----------------------------------------------------------------------------
+static RateLimitSlot *RateLimit_GetSlot(
+    unsigned long long key,             // key identifying call site
+    unsigned long long now)             // current time in nanoseconds
+{
+    unsigned long long slotKey, idleKey = 0;
+    RateLimitSlot *slot, *idleSlot = NULL;
+    unsigned long index, i;
+
+    index = (unsigned long) ((key >> 32) % RATE_LIMIT_NUM_SLOTS);
+    for (i = 0; i < RATE_LIMIT_NUM_PROBES; i++) {
+        slot = &gRateLimitSlots[(index + i) % RATE_LIMIT_NUM_SLOTS];
+        slotKey = ATOMIC_LOAD(slot->key);
+        if (slotKey == 0) {
+            if (ATOMIC_CAS(slot->key, slotKey, key))
+                return slot;
+            slotKey = ATOMIC_LOAD(slot->key);
+        }
+        if (slotKey == key)
+            return slot;
+        if (!idleSlot && ATOMIC_LOAD(slot->theoreticalArrivalTime) <= now &&
+                ATOMIC_LOAD(slot->dropped) == 0) {
+            idleSlot = slot;
+            idleKey = slotKey;
+        }
+    }
+    if (idleSlot && ATOMIC_CAS(idleSlot->key, idleKey, key))
+        return idleSlot;
+    return &gRateLimitSlots[index];
+}
+
+
+//-----------------------------------------------------------------------------
+// IsRateLimited()
+//   Return a boolean indicating if the call site identified by the key has
+// exceeded the number of messages per second it is permitted to log. A burst
+// of up to one second's worth of messages is permitted. No lock is acquired.
+// If the call site is permitted to log, the number of messages it had
+// suppressed since it was last permitted to log is returned so that the caller
+// can record that fact.
+//-----------------------------------------------------------------------------
+static int IsRateLimited(
+    unsigned long rateLimit,            // messages per second permitted
+    unsigned long long key,             // key identifying call site
+    unsigned long long *dropped)        // number of dropped messages (OUT)
+{
+    unsigned long long now, interval, arrivalTime, newArrivalTime;
+    RateLimitSlot *slot;
+
+    key = key * FNV_PRIME + 1;
+    now = GetTimeInNanoseconds();
+    slot = RateLimit_GetSlot((key) ? key : 1, now);
+    interval = 1000000000ULL / rateLimit;
+    while (1) {
+        arrivalTime = slot->theoreticalArrivalTime;
+        newArrivalTime = (arrivalTime > now) ? arrivalTime + interval :
+                now + interval;
+        if (newArrivalTime - now > interval * rateLimit) {
+            ATOMIC_ADD(slot->dropped, 1);
+            return 1;
+        }
+        if (ATOMIC_CAS(slot->theoreticalArrivalTime, arrivalTime,
+                newArrivalTime))
+            break;
+    }
+    *dropped = (slot->dropped) ? ATOMIC_EXCHANGE(slot->dropped, 0) : 0;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_SetFileNameMask()
+//   Set the mask used for building the names of the files written. If the
+// files are rotated at intervals, the local date (and hour) of the interval
+// containing the given time is added to the name and the time at which the
+// interval ends is retained, so that checking for it while writing only
+// requires a comparison. If files are rotated by size, a sequence number is
+// added to the name as well. Any extension is kept at the end of the name.
+//-----------------------------------------------------------------------------
+static void LoggingState_SetFileNameMask(
+    LoggingState *state,                // logging state to set mask for
+    time_t now)                         // time for which to set mask
+{
+    char seqNumTemp[100], *mask;
+    struct tm time;
+    size_t length;
+    char *tmp;
+
+    // copy the name, without its extension
+    tmp = strrchr(state->baseFileName, '.');
+    length = (tmp) ? (size_t) (tmp - state->baseFileName) :
+            strlen(state->baseFileName);
+    memcpy(state->fileNameMask, state->baseFileName, length);
+    mask = state->fileNameMask + length;
+
+    // add the stamp of the current interval and determine when it ends
+    if (state->options.rotateInterval != LOG_ROTATE_NONE) {
+#ifdef MS_WINDOWS
+        localtime_s(&time, &now);
+#else
+        localtime_r(&now, &time);
+#endif
+        time.tm_min = time.tm_sec = 0;
+        if (state->options.rotateInterval == LOG_ROTATE_DAILY) {
+            mask += sprintf(mask, DAILY_STAMP_FORMAT, time.tm_year + 1900,
+                    time.tm_mon + 1, time.tm_mday);
+            time.tm_hour = 0;
+            time.tm_mday++;
+            time.tm_isdst = -1;
+            state->rotateDeadline = mktime(&time);
+        } else {
+            mask += sprintf(mask, HOURLY_STAMP_FORMAT, time.tm_year + 1900,
+                    time.tm_mon + 1, time.tm_mday, time.tm_hour);
+            state->rotateDeadline = mktime(&time) + 3600;
+        }
+        if (state->rotateDeadline <= now)
+            state->rotateDeadline = now + 3600;
+    }
+
+    // add the sequence number and the extension
+    if (state->maxFiles > 1) {
+        sprintf(seqNumTemp, "%ld", state->maxFiles);
+        mask += sprintf(mask, ".%%.%ldld",
+                (unsigned long) strlen(seqNumTemp));
+    }
+    strcpy(mask, (tmp) ? tmp : "");
+}
+
+
+#ifndef UNDER_CE
+//-----------------------------------------------------------------------------
+// LoggingState_GetSeqFileName()
+//   Return the name of the file in which the sequence number of the file
+// being written is recorded, or of the temporary file used to replace it. The
+// caller is responsible for freeing the name.
+//-----------------------------------------------------------------------------
+static char *LoggingState_GetSeqFileName(
+    LoggingState *state,                // state to use
+    const char *suffix)                 // suffix to add to base file name
+{
+    char *seqFileName;
+
+    seqFileName = malloc(strlen(state->baseFileName) + strlen(suffix) + 1);
+    if (seqFileName) {
+        strcpy(seqFileName, state->baseFileName);
+        strcat(seqFileName, suffix);
+    }
+    return seqFileName;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_ReadSeqFile()
+//   Read the sequence number of the file most recently written from the
+// sequence file. Zero is returned if the sequence file does not exist or does
+// not refer to an existing file with the current file name mask, in which
+// case the files themselves have to be examined.
+//-----------------------------------------------------------------------------
+static unsigned long LoggingState_ReadSeqFile(
+    LoggingState *state)                // state to use
+{
+    char *seqFileName, *fileName;
+    struct stat statBuffer;
+    unsigned long seqNum;
+    size_t length;
+    FILE *fp;
+    int ok;
+
+    seqFileName = LoggingState_GetSeqFileName(state, SEQ_FILE_SUFFIX);
+    if (!seqFileName)
+        return 0;
+    fp = fopen(seqFileName, "r");
+    free(seqFileName);
+    if (!fp)
+        return 0;
+    length = strlen(state->fileNameMask) + 23;
+    fileName = malloc(length + 1);
+    ok = (fileName && fscanf(fp, "%lu", &seqNum) == 1 && seqNum > 0 &&
+            seqNum <= state->maxFiles && fgetc(fp) == '\n' &&
+            fgets(fileName, (int) length + 1, fp));
+    fclose(fp);
+    if (ok) {
+        fileName[strcspn(fileName, "\n")] = '\0';
+        sprintf(state->fileName, state->fileNameMask, seqNum);
+        ok = (strcmp(fileName, state->fileName) == 0 &&
+                stat(state->fileName, &statBuffer) == 0);
+    }
+    if (fileName)
+        free(fileName);
+    return (ok) ? seqNum : 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_WriteSeqFile()
+//   Record the sequence number and name of the file being written in the
+// sequence file, so that the next process to log to the same files can
+// resume without examining all of them. The file is replaced atomically by
+// renaming a temporary file over it. Failures are ignored since the files
+// can always be examined instead.
+//-----------------------------------------------------------------------------
+static void LoggingState_WriteSeqFile(
+    LoggingState *state)                // state to use
+{
+    char *seqFileName, *tempFileName;
+    FILE *fp;
+    int ok;
+
+    seqFileName = LoggingState_GetSeqFileName(state, SEQ_FILE_SUFFIX);
+    tempFileName = LoggingState_GetSeqFileName(state, SEQ_FILE_TEMP_SUFFIX);
+    if (seqFileName && tempFileName) {
+        fp = fopen(tempFileName, "w");
+        if (fp) {
+            ok = (fprintf(fp, "%lu\n%s\n", state->seqNum,
+                    state->fileName) > 0);
+            if (fclose(fp) != 0)
+                ok = 0;
+#ifdef MS_WINDOWS
+            if (ok)
+                ok = MoveFileExA(tempFileName, seqFileName,
+                        MOVEFILE_REPLACE_EXISTING);
+#else
+            if (ok)
+                ok = (rename(tempFileName, seqFileName) == 0);
+#endif
+            if (!ok)
+                remove(tempFileName);
+        }
+    }
+    if (seqFileName)
+        free(seqFileName);
+    if (tempFileName)
+        free(tempFileName);
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_InitializeSeqNum()
+//   Initialize the sequence number to start logging at when rotating files.
+// The sequence number to use is the one following the most recent log file,
+// which is normally found in the sequence file without examining any of the
+// log files, even if log files with other sequence numbers have since been
+// removed; if existing files are not reused and that file exists, the log
+// files are examined instead. Otherwise, the sequence number to use is the one
+// following the most recent log file if all possible log file names are
+// already used. If there is an available log file name, the lowest sequence
+// number is used.
+//-----------------------------------------------------------------------------
+static void LoggingState_InitializeSeqNum(
+    LoggingState *state)                // logging state just created
+{
+    struct stat statBuffer;
+    unsigned long seqNum;
+    time_t mtime = 0;
+
+    seqNum = LoggingState_ReadSeqFile(state);
+    if (seqNum) {
+        state->seqNum = seqNum + 1;
+        if (state->seqNum > state->maxFiles)
+            state->seqNum = 1;
+        sprintf(state->fileName, state->fileNameMask, state->seqNum);
+        if (state->reuseExistingFiles ||
+                stat(state->fileName, &statBuffer) < 0)
+            return;
+    }
+    for (seqNum = 1; seqNum <= state->maxFiles; seqNum++) {
+        sprintf(state->fileName, state->fileNameMask, seqNum);
+        if (stat(state->fileName, &statBuffer) < 0) {
+            state->seqNum = seqNum;
+            break;
+        }
+        if (statBuffer.st_mtime > mtime) {
+            state->seqNum = seqNum + 1;
+            if (state->seqNum > state->maxFiles)
+                state->seqNum = 1;
+            mtime = statBuffer.st_mtime;
+        }
+    }
+    sprintf(state->fileName, state->fileNameMask, state->seqNum);
+}
+#endif
+
+
+#ifndef MS_WINDOWS
+//-----------------------------------------------------------------------------
+// LoggingState_OpenFileForAppending()
+//   Open the file for appending when it is shared by multiple processes. The
+// file is fully buffered and flushed after each message so that each message
+// is written with a single write() which the operating system appends to the
+// end of the file regardless of what other processes have written. The size
+// of the file when it is opened is retained for determining when it is full.
+//-----------------------------------------------------------------------------
+static int LoggingState_OpenFileForAppending(
+    LoggingState *state,                // state to use for writing
+    int truncate)                       // truncate file?
+{
+    struct stat statBuffer;
+    int fd, flags;
+
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+    if (truncate)
+        flags |= O_TRUNC;
+    fd = open(state->fileName, flags, 0666);
+    if (fd < 0) {
+        sprintf(state->exceptionInfo.message,
+                "Failed to open file %s: OS error %d", state->fileName, errno);
+        return -1;
+    }
+    state->fp = fdopen(fd, "a");
+    if (!state->fp) {
+        close(fd);
+        sprintf(state->exceptionInfo.message,
+                "Failed to open file from descriptor for %s", state->fileName);
+        return -1;
+    }
+    setvbuf(state->fp, NULL, _IOFBF,
+            (state->options.bufferSize > MULTI_PROCESS_BUF_SIZE) ?
+            state->options.bufferSize : MULTI_PROCESS_BUF_SIZE);
+    state->sharedFileSize = (fstat(fd, &statBuffer) == 0) ?
+            (unsigned long long) statBuffer.st_size : 0;
+    state->sharedFilePosition = state->bytesWritten;
+    state->sharedFileWrites = 0;
+
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_OpenLockFile()
+//   Open the lock file used to coordinate the rotation of files shared by
+// multiple processes. The lock file contains the sequence number of the file
+// that all processes should be writing to.
+//-----------------------------------------------------------------------------
+static int LoggingState_OpenLockFile(
+    LoggingState *state)                // state to use
+{
+    char *lockFileName;
+
+    lockFileName = malloc(strlen(state->baseFileName) +
+            strlen(LOCK_FILE_SUFFIX) + 1);
+    if (!lockFileName) {
+        strcpy(state->exceptionInfo.message,
+                "Failed to allocate memory for lock file name.");
+        return -1;
+    }
+    strcpy(lockFileName, state->baseFileName);
+    strcat(lockFileName, LOCK_FILE_SUFFIX);
+    state->lockFileDescriptor = open(lockFileName, O_RDWR | O_CREAT, 0666);
+    if (state->lockFileDescriptor < 0) {
+        sprintf(state->exceptionInfo.message,
+                "Failed to open lock file %s: OS error %d", lockFileName,
+                errno);
+        free(lockFileName);
+        return -1;
+    }
+    free(lockFileName);
+
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_ReadSharedSeqNum()
+//   Return the sequence number stored in the lock file or 0 if no valid
+// sequence number has been stored yet. The lock file must be locked.
+//-----------------------------------------------------------------------------
+static unsigned long LoggingState_ReadSharedSeqNum(
+    LoggingState *state)                // state to use
+{
+    unsigned long seqNum;
+    char buffer[24];
+    ssize_t length;
+
+    length = pread(state->lockFileDescriptor, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0)
+        return 0;
+    buffer[length] = '\0';
+    seqNum = strtoul(buffer, NULL, 10);
+    if (seqNum > state->maxFiles)
+        return 0;
+    return seqNum;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_WriteSharedSeqNum()
+//   Store the sequence number in the lock file. The lock file must be locked.
+//-----------------------------------------------------------------------------
+static int LoggingState_WriteSharedSeqNum(
+    LoggingState *state)                // state to use
+{
+    char buffer[24];
+    size_t length;
+
+    length = sprintf(buffer, "%lu\n", state->seqNum);
+    if (ftruncate(state->lockFileDescriptor, 0) < 0 ||
+            pwrite(state->lockFileDescriptor, buffer, length, 0) !=
+                    (ssize_t) length) {
+        sprintf(state->exceptionInfo.message,
+                "Failed to write lock file for %s: OS error %d",
+                state->fileName, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_OpenSharedFile()
+//   Open the file when it is shared by multiple processes. The file is never
+// truncated unless files are being rotated and no other process has logged to
+// them yet, in which case the sequence number is determined in the normal
+// fashion and stored in the lock file for the other processes to use.
+//-----------------------------------------------------------------------------
+static int LoggingState_OpenSharedFile(
+    LoggingState *state)                // state to use for writing
+{
+    int result, truncate = 0;
+    unsigned long seqNum;
+
+    if (!state->rotateFiles || state->maxFiles <= 1)
+        return LoggingState_OpenFileForAppending(state, 0);
+    if (state->lockFileDescriptor < 0 && LoggingState_OpenLockFile(state) < 0)
+        return -1;
+    if (flock(state->lockFileDescriptor, LOCK_EX) < 0) {
+        sprintf(state->exceptionInfo.message,
+                "Failed to lock lock file for %s: OS error %d",
+                state->fileName, errno);
+        return -1;
+    }
+    seqNum = LoggingState_ReadSharedSeqNum(state);
+    if (seqNum) {
+        state->seqNum = seqNum;
+        sprintf(state->fileName, state->fileNameMask, state->seqNum);
+        result = 0;
+    } else {
+        LoggingState_InitializeSeqNum(state);
+        result = LoggingState_WriteSharedSeqNum(state);
+        truncate = 1;
+    }
+    if (result == 0)
+        result = LoggingState_OpenFileForAppending(state, truncate);
+    flock(state->lockFileDescriptor, LOCK_UN);
+    return result;
+}
+#endif
+
+
 //-----------------------------------------------------------------------------
 // LoggingState_OpenFileForWriting()
 //   Open the file for writing, if possible. In order to workaround the nasty
@@ -80,6 +1006,12 @@ static int LoggingState_OpenFileForWriting(
     #endif
 #endif
 
+    // files shared by multiple processes are always reused
+#ifndef MS_WINDOWS
+    if (state->options.multiProcess)
+        return LoggingState_OpenSharedFile(state);
+#endif
+
     // verify that a file is not reused if such is not supposed to take place
     if (!state->reuseExistingFiles &&
             stat(state->fileName, &statBuffer) == 0) {
@@ -130,64 +1062,417 @@ static int LoggingState_OpenFileForWriting(
     #endif
 #endif
 
+    // use a larger buffer, if requested
+    if (state->options.bufferSize)
+        setvbuf(state->fp, NULL, _IOFBF, state->options.bufferSize);
+
+    // retain the number of bytes written when the file was opened so that
+    // the position in the file is known when writing directly
+    state->bytesWrittenAtOpen = state->bytesWritten;
+
     return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// WriteString()
-//   Write string to the file.
+// GetLevelIndex()
+//   Return the index used for the counters kept by level. Levels that do not
+// correspond to one of the predefined levels are counted with the closest
+// predefined level below them.
 //-----------------------------------------------------------------------------
-static int WriteString(
-    LoggingState *state,                // state to use for writing
-    const char *string)                 // string to write to the file
+static int GetLevelIndex(
+    unsigned long level)                // level to examine
 {
-    if (fputs(string, state->fp) == EOF) {
-        sprintf(state->exceptionInfo.message,
-                "Failed to write to file %s: OS error %d.", state->fileName,
-                errno);
-        return -1;
+    if (level >= LOG_LEVEL_NONE)
+        return LOG_LEVEL_INDEX_NONE;
+    if (level >= LOG_LEVEL_CRITICAL)
+        return LOG_LEVEL_INDEX_CRITICAL;
+    if (level >= LOG_LEVEL_ERROR)
+        return LOG_LEVEL_INDEX_ERROR;
+    if (level >= LOG_LEVEL_WARNING)
+        return LOG_LEVEL_INDEX_WARNING;
+    if (level >= LOG_LEVEL_INFO)
+        return LOG_LEVEL_INDEX_INFO;
+    return LOG_LEVEL_INDEX_DEBUG;
+}
+
+
+//-----------------------------------------------------------------------------
+// CountSuppressed()
+//   Count a message that was not written because of its level. This may take
+// place without holding the lock so the counter is updated atomically.
+//-----------------------------------------------------------------------------
+static void CountSuppressed(
+    LoggingCounters *counters,          // counters to update
+    unsigned long level)                // level of suppressed message
+{
+    ATOMIC_ADD(counters->suppressed[GetLevelIndex(level)], 1);
+}
+
+
+//-----------------------------------------------------------------------------
+// IsSampledOut()
+//   Return a boolean indicating if the message should be skipped because only
+// a sample of the messages at its level are to be written. Either one in every
+// N messages is written or each message is written with a probability of 1/N
+// using a fast thread local random number generator. Neither requires any
+// lock or atomic operation except for counting the skipped message.
+//-----------------------------------------------------------------------------
+static int IsSampledOut(
+    const LoggingOptions *options,      // options in effect
+    LoggingCounters *counters,          // counters to update
+    unsigned long level)                // level of message
+{
+    unsigned long sampleRate;
+    int levelIndex, skip;
+
+    levelIndex = GetLevelIndex(level);
+    sampleRate = options->sampleRates[levelIndex];
+    if (sampleRate <= 1)
+        return 0;
+    if (options->sampleRandomly) {
+        if (!tRandomState)
+            tRandomState = (GetTimeInNanoseconds() ^
+                    (unsigned long long) (size_t) &tRandomState) | 1;
+        tRandomState ^= tRandomState >> 12;
+        tRandomState ^= tRandomState << 25;
+        tRandomState ^= tRandomState >> 27;
+        skip = ((tRandomState * 2685821657736338717ULL) >> 32) %
+                sampleRate != 0;
+    } else skip = tSampleCounters[levelIndex]++ % sampleRate != 0;
+    if (skip)
+        ATOMIC_ADD(counters->sampled[levelIndex], 1);
+    return skip;
+}
+
+
+//-----------------------------------------------------------------------------
+// IsFlightRecorded()
+//   Return a boolean indicating if a message that was not written because of
+// its level should be kept in the flight recorder.
+//-----------------------------------------------------------------------------
+static int IsFlightRecorded(
+    const LoggingOptions *options,      // options in effect
+    unsigned long level)                // level of message
+{
+    return (options->flightRecorderSize &&
+            level >= options->flightRecorderLevel);
+}
+
+
+//-----------------------------------------------------------------------------
+// FlightRecorder_New()
+//   Create a new flight recorder with the given number of entries.
+//-----------------------------------------------------------------------------
+static FlightRecorder *FlightRecorder_New(
+    unsigned long numEntries,           // number of entries to keep
+    ExceptionInfo *exceptionInfo)       // exception info (OUT)
+{
+    FlightRecorder *recorder;
+
+    if (numEntries > LOG_FLIGHT_RECORDER_MAX_ENTRIES)
+        numEntries = LOG_FLIGHT_RECORDER_MAX_ENTRIES;
+    recorder = (FlightRecorder*) calloc(1, sizeof(FlightRecorder) +
+            numEntries * sizeof(FlightRecorderEntry));
+    if (!recorder) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for flight recorder.");
+        return NULL;
+    }
+    recorder->numEntries = numEntries;
+    recorder->entries = (FlightRecorderEntry*) (recorder + 1);
+    return recorder;
+}
+
+
+//-----------------------------------------------------------------------------
+// FlightRecorder_BeginEntry()
+//   Claim the next entry in the flight recorder and mark it as being written.
+// No lock is acquired; a single atomic increment hands out the entries and a
+// compare and swap on the sequence makes the writer the only one that writes
+// to the entry until it is ended. NULL is returned if the flight recorder has
+// no entries, if the entry is still being written by a writer that has been
+// lapped or if it has already been written by a writer that lapped this one;
+// the message is discarded in the latter two cases.
+//-----------------------------------------------------------------------------
+static FlightRecorderEntry *FlightRecorder_BeginEntry(
+    FlightRecorder *recorder,           // flight recorder to use
+    unsigned long level,                // level of message
+    unsigned long long *ticket)         // ticket of entry (OUT)
+{
+#ifdef MS_WINDOWS
+    FILETIME fileTime;
+#else
+    struct timeval timeOfDay;
+#endif
+    unsigned long long sequence;
+    FlightRecorderEntry *entry;
+    unsigned long numEntries;
+
+    numEntries = recorder->numEntries;
+    if (!numEntries)
+        return NULL;
+    *ticket = ATOMIC_ADD(recorder->nextTicket, 1);
+    entry = &recorder->entries[*ticket % numEntries];
+    while (1) {
+        sequence = ATOMIC_LOAD(entry->sequence);
+        if ((sequence & 1) || sequence >= *ticket * 2 + 2)
+            return NULL;
+        if (ATOMIC_CAS(entry->sequence, sequence, *ticket * 2 + 1))
+            break;
+    }
+    ATOMIC_FENCE();
+#ifdef MS_WINDOWS
+    GetSystemTimeAsFileTime(&fileTime);
+    entry->timestamp = ((unsigned long long) fileTime.dwHighDateTime << 32) |
+            fileTime.dwLowDateTime;
+    entry->threadId = (long) GetCurrentThreadId();
+#else
+    gettimeofday(&timeOfDay, NULL);
+    entry->timestamp = (unsigned long long) timeOfDay.tv_sec * 1000000ULL +
+            timeOfDay.tv_usec;
+    entry->threadId = (long) pthread_self();
+#endif
+    entry->level = level;
+    return entry;
+}
+
+
+//-----------------------------------------------------------------------------
+// FlightRecorder_EndEntry()
+//   Mark the entry as completely written so that it can be dumped. The entry
+// is only marked if it is still marked as being written by this writer.
+//-----------------------------------------------------------------------------
+static void FlightRecorder_EndEntry(
+    FlightRecorderEntry *entry,         // entry that was written
+    unsigned long long ticket)          // ticket of entry
+{
+    unsigned long long sequence = ticket * 2 + 1;
+
+    entry->message[LOG_FLIGHT_RECORDER_MESSAGE_SIZE - 1] = '\0';
+    ATOMIC_FENCE();
+    ATOMIC_CAS(entry->sequence, sequence, ticket * 2 + 2);
+}
+
+
+//-----------------------------------------------------------------------------
+// FlightRecorder_RecordMessage()
+//   Record the message in the flight recorder, truncating it if necessary.
+//-----------------------------------------------------------------------------
+static void FlightRecorder_RecordMessage(
+    FlightRecorder *recorder,           // flight recorder to use
+    unsigned long level,                // level of message
+    const char *message)                // message to record
+{
+    FlightRecorderEntry *entry;
+    unsigned long long ticket;
+
+    entry = FlightRecorder_BeginEntry(recorder, level, &ticket);
+    if (entry) {
+        strncpy(entry->message, (message) ? message : "(null)",
+                LOG_FLIGHT_RECORDER_MESSAGE_SIZE - 1);
+        FlightRecorder_EndEntry(entry, ticket);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// FlightRecorder_RecordFormat()
+//   Format the message directly into the flight recorder, truncating it if
+// necessary.
+//-----------------------------------------------------------------------------
+static void FlightRecorder_RecordFormat(
+    FlightRecorder *recorder,           // flight recorder to use
+    unsigned long level,                // level of message
+    const char *format,                 // format of message
+    va_list arguments)                  // argument list
+{
+    FlightRecorderEntry *entry;
+    unsigned long long ticket;
+
+    entry = FlightRecorder_BeginEntry(recorder, level, &ticket);
+    if (entry) {
+        if (vsnprintf(entry->message, LOG_FLIGHT_RECORDER_MESSAGE_SIZE, format,
+                arguments) < 0)
+            entry->message[0] = '\0';
+        FlightRecorder_EndEntry(entry, ticket);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// FormatTimestamp()
+//   Format the timestamp recorded in a flight recorder entry.
+//-----------------------------------------------------------------------------
+static void FormatTimestamp(
+    unsigned long long timestamp,       // timestamp to format
+    char *buffer)                       // buffer to format into
+{
+#ifdef MS_WINDOWS
+    FILETIME fileTime, localFileTime;
+    SYSTEMTIME time;
+
+    fileTime.dwHighDateTime = (DWORD) (timestamp >> 32);
+    fileTime.dwLowDateTime = (DWORD) timestamp;
+    FileTimeToLocalFileTime(&fileTime, &localFileTime);
+    FileTimeToSystemTime(&localFileTime, &time);
+    sprintf(buffer, DATE_FORMAT " " TIME_FORMAT, time.wYear, time.wMonth,
+            time.wDay, time.wHour, time.wMinute, time.wSecond,
+            time.wMilliseconds);
+#else
+    struct tm time;
+    time_t seconds;
+
+    seconds = (time_t) (timestamp / 1000000ULL);
+    localtime_r(&seconds, &time);
+    sprintf(buffer, DATE_FORMAT " " TIME_FORMAT, time.tm_year + 1900,
+            time.tm_mon + 1, time.tm_mday, time.tm_hour, time.tm_min,
+            time.tm_sec, (int) ((timestamp % 1000000ULL) / 1000));
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteText()
+//   Write text of the given length to the file.
+//-----------------------------------------------------------------------------
+static int WriteText(
+    LoggingState *state,                // state to use for writing
+    const char *text,                   // text to write to the file
+    size_t length)                      // length of text to write
+{
+    if (fwrite(text, 1, length, state->fp) != length) {
+        sprintf(state->exceptionInfo.message,
+                "Failed to write to file %s: OS error %d.", state->fileName,
+                errno);
+        return -1;
     }
+    state->bytesWritten += length;
     return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// WriteLevel()
-//   Write the level to the file.
+// WriteString()
+//   Write string to the file.
 //-----------------------------------------------------------------------------
-static int WriteLevel(
+static int WriteString(
     LoggingState *state,                // state to use for writing
-    unsigned long level)                // level to write to the file
+    const char *string)                 // string to write to the file
+{
+    return WriteText(state, string, strlen(string));
+}
+
+
+#ifndef MS_WINDOWS
+//-----------------------------------------------------------------------------
+// WriteVectors()
+//   Write the vectors directly to the file descriptor, bypassing the C
+// library, with as few calls to writev() as possible. Partial writes are
+// continued, which means that the vectors may be modified.
+//-----------------------------------------------------------------------------
+static int WriteVectors(
+    LoggingState *state,                // state to use for writing
+    struct iovec *vectors,              // vectors to write
+    int numVectors)                     // number of vectors to write
 {
-    char temp[20];
+    ssize_t result;
+
+    while (numVectors > 0) {
+        result = writev(fileno(state->fp), vectors, numVectors);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            sprintf(state->exceptionInfo.message,
+                    "Failed to write to file %s: OS error %d.",
+                    state->fileName, errno);
+            return -1;
+        }
+        while (numVectors > 0 && (size_t) result >= vectors->iov_len) {
+            result -= vectors->iov_len;
+            vectors++;
+            numVectors--;
+        }
+        if (numVectors > 0) {
+            vectors->iov_base = (char*) vectors->iov_base + result;
+            vectors->iov_len -= result;
+        }
+    }
+    return 0;
+}
+#endif
 
+
+//-----------------------------------------------------------------------------
+// GetLevelName()
+//   Return the name of the level or NULL if the level is not one of the
+// predefined levels.
+//-----------------------------------------------------------------------------
+static const char *GetLevelName(
+    unsigned long level)                // level to examine
+{
     switch(level) {
         case LOG_LEVEL_DEBUG:
-            return WriteString(state, "DEBUG");
+            return "DEBUG";
         case LOG_LEVEL_INFO:
-            return WriteString(state, "INFO");
+            return "INFO";
         case LOG_LEVEL_WARNING:
-            return WriteString(state, "WARN");
+            return "WARN";
         case LOG_LEVEL_ERROR:
-            return WriteString(state, "ERROR");
+            return "ERROR";
         case LOG_LEVEL_CRITICAL:
-            return WriteString(state, "CRIT");
+            return "CRIT";
         case LOG_LEVEL_NONE:
-            return WriteString(state, "TRACE");
+            return "TRACE";
     }
-    sprintf(temp, "%ld", level);
-    return WriteString(state, temp);
+    return NULL;
 }
 
 
 //-----------------------------------------------------------------------------
-// WritePrefix()
-//   Write the prefix to the file.
+// FormatLevel()
+//   Format the level into the buffer, using its name if it has one.
 //-----------------------------------------------------------------------------
-static int WritePrefix(
+static void FormatLevel(
+    unsigned long level,                // level to format
+    char *buffer)                       // buffer to format into
+{
+    const char *name;
+
+    name = GetLevelName(level);
+    if (name)
+        strcpy(buffer, name);
+    else sprintf(buffer, "%ld", level);
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteLevel()
+//   Write the level to the file.
+//-----------------------------------------------------------------------------
+static int WriteLevel(
     LoggingState *state,                // state to use for writing
-    unsigned long level)                // level at which to write
+    unsigned long level)                // level to write to the file
+{
+    char temp[24];
+
+    FormatLevel(level, temp);
+    return WriteString(state, temp);
+}
+
+
+//-----------------------------------------------------------------------------
+// FormatPrefix()
+//   Format the prefix into the buffer, which must be at least as large as the
+// maximum prefix length of the state, and return its length. If a record
+// received from another process is being written, the time, thread and
+// process are taken from it instead.
+//-----------------------------------------------------------------------------
+static size_t FormatPrefix(
+    LoggingState *state,                // state to use for formatting
+    unsigned long level,                // level at which to write
+    const SharedRecord *record,         // record being written (or NULL)
+    char *buffer)                       // buffer to format into
 {
 #ifdef MS_WINDOWS
     SYSTEMTIME time;
@@ -198,31 +1483,40 @@ static int WritePrefix(
     struct timeval timeOfDay;
     struct tm time;
 #endif
-    char temp[40], *ptr;
+    char *ptr, *out;
     int gotTime;
 
     gotTime = 0;
     ptr = state->prefix;
+    out = buffer;
     while (*ptr) {
         if (*ptr != '%') {
-            if (fputc(*ptr++, state->fp) == EOF) {
-                sprintf(state->exceptionInfo.message,
-                        "Failed to write character to file %s.",
-                        state->fileName);
-                return -1;
-            }
+            *out++ = *ptr++;
             continue;
         }
         ptr++;
         switch(*ptr) {
             case 'i':
+                if (record)
+                    out += sprintf(out, THREAD_FORMAT,
+                            (long) record->threadId);
+                else
 #ifdef MS_WINDOWS
-                sprintf(temp, THREAD_FORMAT, (long) GetCurrentThreadId());
+                    out += sprintf(out, THREAD_FORMAT,
+                            (long) GetCurrentThreadId());
 #else
-                sprintf(temp, THREAD_FORMAT, (long) pthread_self());
+                    out += sprintf(out, THREAD_FORMAT, (long) pthread_self());
+#endif
+                break;
+            case 'p':
+                if (record)
+                    out += sprintf(out, "%ld", (long) record->processId);
+                else
+#ifdef MS_WINDOWS
+                    out += sprintf(out, "%ld", (long) GetCurrentProcessId());
+#else
+                    out += sprintf(out, "%ld", (long) getpid());
 #endif
-                if (WriteString(state, temp) < 0)
-                    return -1;
                 break;
             case 'd':
             case 't':
@@ -234,734 +1528,4419 @@ static int WritePrefix(
                     ticks = GetTickCount();
     #endif
 #else
-                    gettimeofday(&timeOfDay, NULL);
+                    if (record) {
+                        timeOfDay.tv_sec =
+                                (time_t) (record->timestamp / 1000000ULL);
+                        timeOfDay.tv_usec =
+                                (suseconds_t) (record->timestamp % 1000000ULL);
+                    } else gettimeofday(&timeOfDay, NULL);
                     localtime_r(&timeOfDay.tv_sec, &time);
 #endif
                 }
 #ifdef MS_WINDOWS
                 if (*ptr == 'd')
-                    sprintf(temp, DATE_FORMAT, time.wYear, time.wMonth,
+                    out += sprintf(out, DATE_FORMAT, time.wYear, time.wMonth,
                             time.wDay);
                 else
     #if defined UNDER_CE
-                    sprintf(temp, TICKS_FORMAT, ticks);
+                    out += sprintf(out, TICKS_FORMAT, ticks);
     #else
-                    sprintf(temp, TIME_FORMAT, time.wHour, time.wMinute,
+                    out += sprintf(out, TIME_FORMAT, time.wHour, time.wMinute,
                             time.wSecond, time.wMilliseconds);
     #endif
 #else
                 if (*ptr == 'd')
-                    sprintf(temp, DATE_FORMAT, time.tm_year + 1900,
+                    out += sprintf(out, DATE_FORMAT, time.tm_year + 1900,
                             time.tm_mon + 1, time.tm_mday);
                 else
-                    sprintf(temp, TIME_FORMAT, time.tm_hour, time.tm_min,
-                            time.tm_sec, (int) (timeOfDay.tv_usec / 1000));
+                    out += sprintf(out, TIME_FORMAT, time.tm_hour,
+                            time.tm_min, time.tm_sec,
+                            (int) (timeOfDay.tv_usec / 1000));
 #endif
-                if (WriteString(state, temp) < 0)
-                    return -1;
                 break;
             case 'l':
-                if (WriteLevel(state, level) < 0)
-                    return -1;
+                FormatLevel(level, out);
+                out += strlen(out);
                 break;
             case '\0':
                 break;
             default:
-                if (fputc('%', state->fp) == EOF ||
-                        fputc(*ptr, state->fp) == EOF) {
-                    sprintf(state->exceptionInfo.message,
-                            "Failed to write %% directive to file %s.",
-                            state->fileName);
-                    return -1;
-                }
+                *out++ = '%';
+                *out++ = *ptr;
         }
         if (*ptr)
             ptr++;
     }
-    if (*state->prefix) {
-        if (fputc(' ', state->fp) == EOF) {
-            sprintf(state->exceptionInfo.message,
-                    "Failed to write separator to file %s.", state->fileName);
-            return -1;
-        }
-    }
+    if (*state->prefix)
+        *out++ = ' ';
+    *out = '\0';
 
-    return 0;
+    return (size_t) (out - buffer);
 }
 
 
 //-----------------------------------------------------------------------------
-// WriteTrailer()
-//   Write the trailing line feed to the file and flush it.
+// WritePrefixForRecord()
+//   Write the prefix to the file.
 //-----------------------------------------------------------------------------
-static int WriteTrailer(
-    LoggingState *state)                // state to use for writing
+static int WritePrefixForRecord(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    const SharedRecord *record)         // record being written (or NULL)
 {
-    if (WriteString(state, "\n") < 0)
-        return -1;
-    if (fflush(state->fp) == EOF) {
+    size_t length;
+
+    length = FormatPrefix(state, level, record, state->prefixBuffer);
+    if (length > 0 && fwrite(state->prefixBuffer, 1, length,
+            state->fp) != length) {
         sprintf(state->exceptionInfo.message,
-                "Cannot flush file %s", state->fileName);
+                "Failed to write prefix to file %s.", state->fileName);
         return -1;
     }
+    state->bytesWritten += length;
 
     return 0;
 }
 
 
-#ifndef UNDER_CE
 //-----------------------------------------------------------------------------
-// SwitchLogFiles()
-//   Switch log files by moving to the next file in sequence. An exception is
-// raised if the file exists and reuse has not been specified.
+// WritePrefix()
+//   Write the prefix to the file.
 //-----------------------------------------------------------------------------
-static int SwitchLogFiles(
-    LoggingState *state)                // state to use
+static int WritePrefix(
+    LoggingState *state,                // state to use for writing
+    unsigned long level)                // level at which to write
 {
-    state->seqNum++;
-    if (state->seqNum > state->maxFiles)
-        state->seqNum = 1;
-    sprintf(state->fileName, state->fileNameMask, state->seqNum);
-    if (LoggingState_OpenFileForWriting(state) < 0)
-        return -1;
+    return WritePrefixForRecord(state, level, NULL);
+}
 
+
+#ifndef MS_WINDOWS
+//-----------------------------------------------------------------------------
+// WriteMessageDirect()
+//   Write the prefix, the message and the trailing line feed to the file with
+// a single vectored write, bypassing the C library. The message is written
+// directly from the buffer supplied by the caller without being copied. The C
+// library buffer is always empty at this point since everything written
+// through it is flushed immediately. Since nothing is buffered, the time
+// taken is recorded only as part of the time taken to write the message.
+//-----------------------------------------------------------------------------
+static int WriteMessageDirect(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    const char *message)                // message to write
+{
+    struct iovec vectors[3];
+    size_t length;
+
+    vectors[0].iov_base = state->prefixBuffer;
+    vectors[0].iov_len = FormatPrefix(state, level, NULL,
+            state->prefixBuffer);
+    vectors[1].iov_base = (char*) message;
+    vectors[1].iov_len = strlen(message);
+    vectors[2].iov_base = "\n";
+    vectors[2].iov_len = 1;
+    length = vectors[0].iov_len + vectors[1].iov_len + 1;
+    if (WriteVectors(state, vectors, 3) < 0)
+        return -1;
+    state->bytesWritten += length;
+    state->counters.flushes++;
     return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// CheckForLogFileFull()
-//   Checks to determine if the current file has reached its maximum size and
-// if so, starts a new one.
+// WriteRecordDirect()
+//   Write a record made up of one or more lines, separated by line feeds, to
+// the file with a single vectored write, bypassing the C library, and return
+// the number of lines written. The prefix is formatted once and referenced by
+// each line, which is written directly from the text together with the line
+// feed that separates it from the next. If the record has too many lines for
+// a single vectored write, it is copied into a buffer of its own instead.
 //-----------------------------------------------------------------------------
-static int CheckForLogFileFull(
-    LoggingState *state)                // state to use for writing
+static long WriteRecordDirect(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    const char *text)                   // text to write
 {
-    unsigned long position;
-
-    if (state->rotateFiles && state->maxFiles > 1) {
-        if (state->fp) {
-            position = ftell(state->fp);
-            if (position < 0) {
-                sprintf(state->exceptionInfo.message,
-                        "Cannot get file position for %s: OS error %d.",
-                        state->fileName, errno);
-                return -1;
-            }
-        }
-        if (!state->fp || position >= state->maxFileSize) {
-            if (state->fp) {
-                if (WritePrefix(state, LOG_LEVEL_NONE) < 0)
-                    return -1;
-                if (WriteString(state, "switching to a new log file\n") < 0)
-                    return -1;
-                fclose(state->fp);
-                state->fp = NULL;
-            }
-            if (SwitchLogFiles(state) < 0)
-                return -1;
-            if (WritePrefix(state, LOG_LEVEL_NONE) < 0)
-                return -1;
-            if (WriteString(state,
-                    "starting logging (after switch) at level ") < 0)
-                return -1;
-            if (WriteLevel(state, state->level) < 0)
-                return -1;
-            if (WriteTrailer(state) < 0)
-                return -1;
+    size_t prefixLength, textLength, length, lineLength;
+    const char *line, *next;
+    struct iovec *vectors;
+    unsigned long numLines;
+    int numVectors, i;
+    char *buffer, *ptr;
+
+    // determine the number of lines and the total length
+    for (numLines = 1, line = text; (line = strchr(line, '\n')); line++)
+        numLines++;
+    prefixLength = FormatPrefix(state, level, NULL, state->prefixBuffer);
+    textLength = strlen(text);
+    length = numLines * prefixLength + textLength + 1;
+
+    // build the vectors referencing the prefix and the lines or, if there
+    // are too many lines, a single vector referencing a copy of the record
+    buffer = NULL;
+    numVectors = (numLines * 2 + 1 <= RECORD_IOVECS) ?
+            (int) numLines * 2 + 1 : 1;
+    vectors = malloc(numVectors * sizeof(struct iovec));
+    if (vectors && numVectors == 1)
+        buffer = malloc(length);
+    if (!vectors || (numVectors == 1 && !buffer)) {
+        if (vectors)
+            free(vectors);
+        strcpy(state->exceptionInfo.message,
+                "Failed to allocate memory for record.");
+        return -1;
+    }
+    for (i = 0, ptr = buffer, line = text; line; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            next++;
+        lineLength = (next) ? (size_t) (next - line) : strlen(line);
+        if (buffer) {
+            memcpy(ptr, state->prefixBuffer, prefixLength);
+            memcpy(ptr + prefixLength, line, lineLength);
+            ptr += prefixLength + lineLength;
+            continue;
         }
+        vectors[i].iov_base = state->prefixBuffer;
+        vectors[i++].iov_len = prefixLength;
+        vectors[i].iov_base = (char*) line;
+        vectors[i++].iov_len = lineLength;
     }
-    return 0;
+    if (buffer) {
+        *ptr = '\n';
+        vectors[0].iov_base = buffer;
+        vectors[0].iov_len = length;
+    } else {
+        vectors[i].iov_base = "\n";
+        vectors[i].iov_len = 1;
+    }
+
+    // write the record
+    i = WriteVectors(state, vectors, numVectors);
+    free(vectors);
+    if (buffer)
+        free(buffer);
+    if (i < 0)
+        return -1;
+    state->bytesWritten += length;
+    state->counters.flushes++;
+    return (long) numLines;
 }
 #endif
 
 
 //-----------------------------------------------------------------------------
-// WriteMessage()
-//   Write the message to the file.
+// FlushFile()
+//   Flush the file.
 //-----------------------------------------------------------------------------
-static int WriteMessage(
-    LoggingState *state,                // state to use for writing
-    unsigned long level,                // level at which to write
-    const char *message)                // message to write
+static int FlushFile(
+    LoggingState *state)                // state to use for writing
 {
-#ifndef UNDER_CE
-    if (CheckForLogFileFull(state) < 0)
+    unsigned long long startTime = 0;
+
+    if (gLoggingStatsEnabled)
+        startTime = GetTimeInNanoseconds();
+    if (fflush(state->fp) == EOF) {
+        sprintf(state->exceptionInfo.message,
+                "Cannot flush file %s", state->fileName);
         return -1;
-#endif
-    if (state->fp) {
-        if (WritePrefix(state, level) < 0)
-            return -1;
-        if (!message)
-            message = "(null)";
-        if (WriteString(state, message) < 0)
-            return -1;
-        if (WriteTrailer(state) < 0)
-            return -1;
     }
+    if (startTime)
+        LatencyHistogram_Record(&gLoggingStats.flush, startTime);
+    state->counters.flushes++;
+
     return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// WriteMessageWithFormat()
-//   Write the formatted message to the file given a variable number of
-// arguments.
+// WriteTrailer()
+//   Write the trailing line feed to the file and flush it.
 //-----------------------------------------------------------------------------
-static int WriteMessageWithFormat(
-    LoggingState *state,                // state to stop logging for
-    unsigned long level,                // level at which message is written
-    const char *format,                 // format of message to log
-    va_list arguments)                  // argument list
+static int WriteTrailer(
+    LoggingState *state)                // state to use for writing
 {
-#ifndef UNDER_CE
-    if (CheckForLogFileFull(state) < 0)
+    if (WriteString(state, "\n") < 0)
         return -1;
-#endif
-    if (state->fp) {
-        if (WritePrefix(state, level) < 0)
-            return -1;
-        if (vfprintf(state->fp, format, arguments) < 0) {
-            sprintf(state->exceptionInfo.message,
-                    "Cannot write formatted message to file %s",
-                    state->fileName);
-            return -1;
-        }
-        if (WriteTrailer(state) < 0)
-            return -1;
-    }
-    return 0;
+    return FlushFile(state);
 }
 
 
 //-----------------------------------------------------------------------------
-// IsLoggingAtLevelForPython()
-//   Return a boolean indicating if the current logging state is such that a
-// message at the given level should be logged. This is only used for cases
-// where the amount of time required to calculate the message to log is
-// sufficient that checking first would be helpful; otherwise, the overhead of
-// acquiring and releasing the lock twice would be detrimental to performance.
+// WriteLine()
+//   Write a line with its prefix to the file, flushing it if requested. When
+// writing directly to the file the line is written with a single vectored
+// write and is always flushed.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) IsLoggingAtLevelForPython(
-    unsigned long level)                // desired level
+static int WriteLine(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    const char *line,                   // line to write
+    int flush)                          // flush the file?
 {
-    udt_LoggingState *loggingState;
-    int result;
-
-    loggingState = GetLoggingState();
-    if (loggingState)
-        result = (level >= loggingState->state->level);
-    else {
-        ACQUIRE_LOCK(gLoggingStateLock);
-        result = (gLoggingState && level >= gLoggingState->level);
-        RELEASE_LOCK(gLoggingStateLock);
-    }
-    return result;
+#ifndef MS_WINDOWS
+    if (state->options.directWrite)
+        return WriteMessageDirect(state, level, line);
+#endif
+    if (WritePrefix(state, level) < 0 || WriteString(state, line) < 0)
+        return -1;
+    if (flush)
+        return WriteTrailer(state);
+    return WriteString(state, "\n");
 }
 
 
 //-----------------------------------------------------------------------------
-// GetThreadStateDictionary()
-//   Return the thread state dictionary and sets an exception if it is not
-// available.
+// SyncFile()
+//   Sync the data written to the file descriptor to the storage device. This
+// may be called without holding the lock for the state.
 //-----------------------------------------------------------------------------
-static PyObject* GetThreadStateDictionary(void)
+static int SyncFile(
+    int fileDescriptor)                 // file descriptor to sync
 {
-    PyObject *dict;
+    unsigned long long startTime = 0;
 
-    dict = PyThreadState_GetDict();
-    if (!dict) {
-        LogMessage(LOG_LEVEL_WARNING, "no thread state dictionary");
-        return NULL;
-    }
-    return dict;
+    if (gLoggingStatsEnabled)
+        startTime = GetTimeInNanoseconds();
+    if (SYNC_FILE(fileDescriptor) < 0)
+        return -1;
+    if (startTime)
+        LatencyHistogram_Record(&gLoggingStats.sync, startTime);
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// GetEncodedStringForPython()
-//   Return an encoded string given a Python string or Unicode value.
+// LoggingState_SyncFile()
+//   Flush the file and sync it to the storage device.
 //-----------------------------------------------------------------------------
-static int GetEncodedStringForPython(
-    PyObject *value,                    // value to encode
-    PyObject **encodedValue)            // encoded value (OUT)
+static int LoggingState_SyncFile(
+    LoggingState *state)                // state to use for syncing
 {
-    PyObject *dict, *encodingObj;
-    char *encoding = NULL;
-
-    if (PyUnicode_Check(value)) {
-        dict = GetThreadStateDictionary();
-        if (dict) {
-            encodingObj = PyDict_GetItemString(dict, KEY_ENCODING);
-            if (encodingObj)
-                encoding = PyBytes_AS_STRING(encodingObj);
-        }
-        *encodedValue = PyUnicode_AsEncodedString(value, encoding, NULL);
-        if (!*encodedValue)
-            return -1;
-    } else if (PyBytes_Check(value)) {
-        Py_INCREF(value);
-        *encodedValue = value;
-    } else {
-        PyErr_SetString(PyExc_TypeError, "expecting a string");
+    if (fflush(state->fp) == EOF) {
+        sprintf(state->exceptionInfo.message,
+                "Cannot flush file %s", state->fileName);
         return -1;
     }
-
+    if (SyncFile(fileno(state->fp)) < 0) {
+        sprintf(state->exceptionInfo.message,
+                "Cannot sync file %s: OS error %d", state->fileName, errno);
+        return -1;
+    }
+    state->lastSyncTime = GetTimeInNanoseconds();
+    state->counters.syncs++;
     return 0;
 }
 
 
+#ifndef MS_WINDOWS
 //-----------------------------------------------------------------------------
-// SetEncodingHelper()
-//   Set the encoding value for Python.
+// LoggingState_WaitForSync()
+//   Wait until the message just written has been synced to the storage
+// device. The first writer to find that no sync is in progress syncs the file
+// on behalf of every message written so far with the lock released, so that
+// other writers can continue; writers that arrive in the meantime wait for it
+// to complete and then either find that their message was covered or start
+// the next sync. A duplicate of the file descriptor is synced so that the
+// file can be rotated while the sync is in progress.
 //-----------------------------------------------------------------------------
-static PyObject* SetEncodingHelper(
-    PyObject *encoding)                 // encoding value to use
+static int LoggingState_WaitForSync(
+    LoggingState *state)                // state to use for syncing
 {
-    PyObject *dict, *encodedEncoding;
+    unsigned long long ticket, target;
+    int fileDescriptor, result = 0, osError = 0;
+
+    ticket = ++state->writeTicket;
+    state->durableWriters++;
+    while (state->syncedTicket < ticket) {
+
+        // another writer is syncing the file; wait for it to complete
+        if (state->syncInProgress) {
+            state->syncWaiters++;
+            RELEASE_LOCK(*state->lock);
+            while (sem_wait(&state->syncDone) < 0 && errno == EINTR);
+            ACQUIRE_LOCK(*state->lock);
+            continue;
+        }
 
-    if (encoding) {
-        dict = GetThreadStateDictionary();
-        if (!dict) {
-            PyErr_SetString(PyExc_RuntimeError,
-                    "unable to get thread state dictionary");
-            return NULL;
+        // become the writer that syncs the file for all of the others
+        fileDescriptor = dup(fileno(state->fp));
+        if (fileDescriptor < 0) {
+            sprintf(state->exceptionInfo.message,
+                    "Cannot duplicate file descriptor for %s: OS error %d",
+                    state->fileName, errno);
+            result = -1;
+            break;
         }
-        if (GetEncodedStringForPython(encoding, &encodedEncoding) < 0)
-            return NULL;
-        if (PyDict_SetItemString(dict, KEY_ENCODING, encodedEncoding) < 0) {
-            Py_DECREF(encodedEncoding);
-            return NULL;
+        state->syncInProgress = 1;
+        target = state->writeTicket;
+        RELEASE_LOCK(*state->lock);
+        result = SyncFile(fileDescriptor);
+        if (result < 0)
+            osError = errno;
+        close(fileDescriptor);
+        ACQUIRE_LOCK(*state->lock);
+        state->syncInProgress = 0;
+        for (; state->syncWaiters > 0; state->syncWaiters--)
+            sem_post(&state->syncDone);
+        if (result < 0) {
+            sprintf(state->exceptionInfo.message,
+                    "Cannot sync file %s: OS error %d", state->fileName,
+                    osError);
+            break;
         }
-        Py_DECREF(encodedEncoding);
+        state->lastSyncTime = GetTimeInNanoseconds();
+        state->counters.syncs++;
+        state->syncedTicket = target;
+
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    // the last writer to leave wakes the thread freeing the state, if any
+    if (--state->durableWriters == 0 && state->freeWaiting) {
+        state->freeWaiting = 0;
+        sem_post(&state->writersDone);
+    }
+    return result;
 }
+#endif
 
 
 //-----------------------------------------------------------------------------
-// WriteMessageForPython()
-//   Write a message for Python given the known logging state.
+// LoggingState_MakeDurable()
+//   Make the message just written durable, as required by the durability
+// policy in effect.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) WriteMessageForPython(
-    unsigned long level,                // level at which message is written
-    PyObject *messageObj)               // message object to write
+static int LoggingState_MakeDurable(
+    LoggingState *state,                // state to use for syncing
+    unsigned long level)                // level of message just written
 {
-    udt_LoggingState *loggingState;
-    PyObject *encodedMessage;
-    int result = 0;
-
-    // determine actual message to write
-    if (GetEncodedStringForPython(messageObj, &encodedMessage) < 0)
-        return -1;
-
-    // actually write the message
-    loggingState = GetLoggingState();
-    Py_BEGIN_ALLOW_THREADS
-    if (loggingState) {
-        ACQUIRE_LOCK(loggingState->lock);
-        result = WriteMessage(loggingState->state, level,
-                PyBytes_AS_STRING(encodedMessage));
-        RELEASE_LOCK(loggingState->lock);
-    } else {
-        ACQUIRE_LOCK(gLoggingStateLock);
-        if (gLoggingState)
-            result = WriteMessage(gLoggingState, level,
-                    PyBytes_AS_STRING(encodedMessage));
-        RELEASE_LOCK(gLoggingStateLock);
+    switch (state->options.durability) {
+        case LOG_DURABILITY_INTERVAL:
+            if (GetTimeInNanoseconds() - state->lastSyncTime <
+                    state->options.syncInterval * 1000000ULL)
+                return 0;
+            return LoggingState_SyncFile(state);
+        case LOG_DURABILITY_LEVEL:
+            if (level < state->options.durableLevel)
+                return 0;
+            return LoggingState_SyncFile(state);
+#ifndef MS_WINDOWS
+        case LOG_DURABILITY_GROUP_COMMIT:
+            if (level < state->options.durableLevel)
+                return 0;
+            if (!state->lock)
+                return LoggingState_SyncFile(state);
+            return LoggingState_WaitForSync(state);
+#endif
     }
-    Py_END_ALLOW_THREADS
-    Py_DECREF(encodedMessage);
-    return result;
+    return 0;
 }
 
 
+#ifndef UNDER_CE
 //-----------------------------------------------------------------------------
-// LoggingState_Free()
-//   Free the logging state.
+// SwitchLogFiles()
+//   Switch log files by moving to the next file in sequence. An exception is
+// raised if the file exists and reuse has not been specified.
 //-----------------------------------------------------------------------------
-static void LoggingState_Free(
-    LoggingState *state)                // state to stop logging for
+static int SwitchLogFiles(
+    LoggingState *state)                // state to use
 {
-    if (state->fp) {
-        if (state->fileOwned) {
-            WriteMessage(state, LOG_LEVEL_NONE, "ending logging");
-            fclose(state->fp);
-        }
-    }
-    if (state->fileName)
-        free(state->fileName);
-    if (state->fileNameMask)
-        free(state->fileNameMask);
-    if (state->prefix)
-        free(state->prefix);
-    free(state);
+    state->seqNum++;
+    if (state->seqNum > state->maxFiles)
+        state->seqNum = 1;
+    sprintf(state->fileName, state->fileNameMask, state->seqNum);
+    if (LoggingState_OpenFileForWriting(state) < 0)
+        return -1;
+    if (state->maxFiles > 1)
+        LoggingState_WriteSeqFile(state);
+#ifndef MS_WINDOWS
+    if (state == gLoggingState && gFatalSignalHandlersInstalled)
+        gEmergencyFileDescriptor = fileno(state->fp);
+#endif
+
+    return 0;
 }
 
 
-#ifndef UNDER_CE
+#ifndef MS_WINDOWS
 //-----------------------------------------------------------------------------
-// LoggingState_InitializeSeqNum()
-//   Initialize the sequence number to start logging at when rotating files.
-// The sequence number to use is the one following the most recent log file
-// if all possible log file names are already used. If there is an available
-// log file name, the lowest sequence number is used.
+// CheckForSharedLogFileFull()
+//   Checks to determine if the current file shared by multiple processes has
+// reached its maximum size and if so, switches to the file that all processes
+// should be writing to. The size of the file includes what other processes
+// have written, so it is only known when it is requested from the operating
+// system; in between, the size is estimated from what this process has
+// written since, which is checked before each message is written. The size is
+// requested while holding the lock on the lock file every so many messages or
+// once the estimate reaches the maximum size. The first process to find that
+// the file is full starts a new one and records its sequence number in the
+// lock file; the others simply switch to that file.
 //-----------------------------------------------------------------------------
-static void LoggingState_InitializeSeqNum(
-    LoggingState *state)                // logging state just created
+static int CheckForSharedLogFileFull(
+    LoggingState *state)                // state to use for writing
 {
+    unsigned long long startTime = 0, estimatedSize;
     struct stat statBuffer;
     unsigned long seqNum;
-    time_t mtime = 0;
+    int rotated, result;
 
-    for (seqNum = 1; seqNum <= state->maxFiles; seqNum++) {
-        sprintf(state->fileName, state->fileNameMask, seqNum);
-        if (stat(state->fileName, &statBuffer) < 0) {
-            state->seqNum = seqNum;
-            break;
+    if (!state->rotateFiles || state->maxFiles <= 1)
+        return 0;
+    if (state->fp) {
+        estimatedSize = state->sharedFileSize + state->bytesWritten -
+                state->sharedFilePosition;
+        if (++state->sharedFileWrites < MULTI_PROCESS_CHECK_INTERVAL &&
+                estimatedSize < state->maxFileSize)
+            return 0;
+        state->sharedFileWrites = 0;
+    }
+    if (gLoggingStatsEnabled)
+        startTime = GetTimeInNanoseconds();
+    if (flock(state->lockFileDescriptor, LOCK_EX) < 0) {
+        sprintf(state->exceptionInfo.message,
+                "Failed to lock lock file for %s: OS error %d",
+                state->fileName, errno);
+        return -1;
+    }
+    if (state->fp) {
+        if (fstat(fileno(state->fp), &statBuffer) < 0) {
+            sprintf(state->exceptionInfo.message,
+                    "Cannot get file size for %s: OS error %d.",
+                    state->fileName, errno);
+            flock(state->lockFileDescriptor, LOCK_UN);
+            return -1;
         }
-        if (statBuffer.st_mtime > mtime) {
-            state->seqNum = seqNum + 1;
-            if (state->seqNum > state->maxFiles)
-                state->seqNum = 1;
-            mtime = statBuffer.st_mtime;
+        state->sharedFileSize = (unsigned long long) statBuffer.st_size;
+        state->sharedFilePosition = state->bytesWritten;
+        if (state->sharedFileSize < state->maxFileSize) {
+            flock(state->lockFileDescriptor, LOCK_UN);
+            return 0;
+        }
+    }
+    seqNum = LoggingState_ReadSharedSeqNum(state);
+    rotated = (state->fp && (!seqNum || seqNum == state->seqNum));
+    if (!seqNum)
+        seqNum = state->seqNum;
+    if (rotated) {
+        if (WritePrefix(state, LOG_LEVEL_NONE) < 0 ||
+                WriteString(state, "switching to a new log file\n") < 0) {
+            flock(state->lockFileDescriptor, LOCK_UN);
+            return -1;
         }
+        seqNum = state->seqNum + 1;
+        if (seqNum > state->maxFiles)
+            seqNum = 1;
+    }
+    if (state->fp && state->options.durability &&
+            LoggingState_SyncFile(state) < 0) {
+        flock(state->lockFileDescriptor, LOCK_UN);
+        return -1;
+    }
+    if (state->fp) {
+        fclose(state->fp);
+        state->fp = NULL;
     }
+    state->seqNum = seqNum;
     sprintf(state->fileName, state->fileNameMask, state->seqNum);
+    result = 0;
+    if (rotated)
+        result = LoggingState_WriteSharedSeqNum(state);
+    if (result == 0)
+        result = LoggingState_OpenFileForAppending(state, rotated);
+    flock(state->lockFileDescriptor, LOCK_UN);
+    if (result < 0)
+        return -1;
+    if (rotated) {
+        if (WritePrefix(state, LOG_LEVEL_NONE) < 0)
+            return -1;
+        if (WriteString(state,
+                "starting logging (after switch) at level ") < 0)
+            return -1;
+        if (WriteLevel(state, state->level) < 0)
+            return -1;
+        if (WriteTrailer(state) < 0)
+            return -1;
+        state->counters.rotations++;
+    }
+    if (startTime)
+        LatencyHistogram_Record(&gLoggingStats.rotate, startTime);
+    return 0;
 }
 #endif
 
 
 //-----------------------------------------------------------------------------
-// LoggingState_OnCreate()
-//   Called when the logging state is created and a file needs to be opened. It
-// opens the file and writes the initial log messages to it.
+// RotateLogFile()
+//   Close the current file, if one is open, and start a new one. If the
+// rotation interval has ended, the new file is the first one of the next
+// interval; the files of earlier intervals are left in place since the
+// maximum number of files only applies within an interval.
 //-----------------------------------------------------------------------------
-static int LoggingState_OnCreate(
-    LoggingState *state)                // logging state just created
+static int RotateLogFile(
+    LoggingState *state,                // state to use for writing
+    time_t now)                         // time if interval ended (or 0)
 {
-    // open the file
-#ifndef UNDER_CE
-    if (state->rotateFiles && state->maxFiles > 1)
-        LoggingState_InitializeSeqNum(state);
-#endif
-    state->fileOwned = 1;
-    if (LoggingState_OpenFileForWriting(state) < 0)
-        return -1;
+    unsigned long long startTime = 0;
 
-    // put out an initial message regardless of level
+    if (gLoggingStatsEnabled)
+        startTime = GetTimeInNanoseconds();
+    if (state->fp) {
+        if (WritePrefix(state, LOG_LEVEL_NONE) < 0)
+            return -1;
+        if (WriteString(state, "switching to a new log file\n") < 0)
+            return -1;
+        if (state->options.durability && LoggingState_SyncFile(state) < 0)
+            return -1;
+        fclose(state->fp);
+        state->fp = NULL;
+    }
+    if (now) {
+        LoggingState_SetFileNameMask(state, now);
+        state->seqNum = 0;
+    }
+    if (SwitchLogFiles(state) < 0)
+        return -1;
     if (WritePrefix(state, LOG_LEVEL_NONE) < 0)
         return -1;
-    if (WriteString(state, "starting logging at level ") < 0)
+    if (WriteString(state, "starting logging (after switch) at level ") < 0)
         return -1;
     if (WriteLevel(state, state->level) < 0)
         return -1;
     if (WriteTrailer(state) < 0)
         return -1;
-
-    // open the file
+    if (startTime)
+        LatencyHistogram_Record(&gLoggingStats.rotate, startTime);
+    state->counters.rotations++;
     return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// LoggingState_New()
-//   Create a new logging state.
+// CheckForLogFileFull()
+//   Checks to determine if the rotation interval has ended or the current file
+// has reached its maximum size and if so, starts a new one.
 //-----------------------------------------------------------------------------
-static LoggingState* LoggingState_New(
-    FILE *fp,                           // file to associate
-    const char *fileName,               // name of file to open
-    unsigned long level,                // level to use
-    unsigned long maxFiles,             // maximum number of files
-    unsigned long maxFileSize,          // maximum size of each file
-    const char *prefix,                 // prefix to use
-    int reuseExistingFiles,             // reuse existing files?
-    int rotateFiles,                    // rotate files?
-    ExceptionInfo *exceptionInfo)       // exception info
+static int CheckForLogFileFull(
+    LoggingState *state)                // state to use for writing
 {
-    char seqNumTemp[100];
-    LoggingState *state;
-    char *tmp;
+    unsigned long position;
+    time_t now;
 
-    // initialize the logging state
-    state = (LoggingState*) malloc(sizeof(LoggingState));
-    if (!state) {
-        strcpy(exceptionInfo->message,
-                "Failed to allocate memory for logging state.");
-        return NULL;
+#ifndef MS_WINDOWS
+    if (state->options.multiProcess)
+        return CheckForSharedLogFileFull(state);
+#endif
+    if (state->rotateDeadline) {
+        now = time(NULL);
+        if (now >= state->rotateDeadline)
+            return RotateLogFile(state, now);
     }
-    state->fp = fp;
-    state->fileOwned = 0;
-    state->level = level;
-    state->fileName = NULL;
-    state->fileNameMask = NULL;
-    state->prefix = NULL;
-    state->reuseExistingFiles = reuseExistingFiles;
-    state->rotateFiles = rotateFiles;
-    if (maxFiles == 0)
-        state->maxFiles = 1;
-    else state->maxFiles = maxFiles;
-#ifdef UNDER_CE
     if (state->rotateFiles && state->maxFiles > 1) {
-        strcpy(exceptionInfo->message,
-                "Rotating log files not supported on Windows CE.");
-        LoggingState_Free(state);
-        return NULL;
-    }
-#endif
-    if (maxFileSize == 0)
-        state->maxFileSize = DEFAULT_MAX_FILE_SIZE;
-    else state->maxFileSize = maxFileSize;
-
-    // allocate space for a file name mask
-    state->fileNameMask = malloc(strlen(fileName) + 23);
-    if (!state->fileNameMask) {
-        strcpy(exceptionInfo->message,
-                "Failed to allocate memory for file name mask.");
-        LoggingState_Free(state);
-        return NULL;
-    }
-
-    // build the file name mask
-    // if max files = 1 then use the file name exactly as is
-    strcpy(state->fileNameMask, fileName);
-    if (state->maxFiles > 1) {
-        sprintf(seqNumTemp, "%ld", state->maxFiles);
-        tmp = strrchr(fileName, '.');
-        if (tmp) {
-            sprintf(state->fileNameMask + (tmp - fileName), ".%%.%ldld",
-                    (unsigned long) strlen(seqNumTemp));
-            strcat(state->fileNameMask, tmp);
-        } else {
-            sprintf(state->fileNameMask + strlen(fileName), ".%%.%ldld",
-                    (unsigned long) strlen(seqNumTemp));
+        if (state->fp && state->options.directWrite)
+            position = (unsigned long) (state->bytesWritten -
+                    state->bytesWrittenAtOpen);
+        else if (state->fp) {
+            position = ftell(state->fp);
+            if (position < 0) {
+                sprintf(state->exceptionInfo.message,
+                        "Cannot get file position for %s: OS error %d.",
+                        state->fileName, errno);
+                return -1;
+            }
         }
+        if (!state->fp || position >= state->maxFileSize)
+            return RotateLogFile(state, 0);
     }
+    return 0;
+}
+#endif
 
-    // allocate space for the file name
-    state->fileName = malloc(strlen(fileName) + 23);
-    if (!state->fileName) {
-        strcpy(exceptionInfo->message,
-                "Failed to allocate memory for file name.");
-        LoggingState_Free(state);
-        return NULL;
-    }
-    strcpy(state->fileName, fileName);
-
-    // copy the prefix
-    state->prefix = malloc(strlen(prefix) + 1);
-    if (!state->prefix) {
-        strcpy(exceptionInfo->message,
-                "Failed to allocate memory for prefix.");
-        LoggingState_Free(state);
-        return NULL;
-    }
-    strcpy(state->prefix, prefix);
 
-    // open the file, if necessary and write any initial messages
-    if (!state->fp && LoggingState_OnCreate(state) < 0) {
-        strcpy(exceptionInfo->message, state->exceptionInfo.message);
-        LoggingState_Free(state);
-        return NULL;
-    }
+//-----------------------------------------------------------------------------
+// WriteRepeatNotice()
+//   Write a notice indicating how many times the last message was repeated
+// without being written.
+//-----------------------------------------------------------------------------
+static int WriteRepeatNotice(
+    LoggingState *state)                // state to use for writing
+{
+    char temp[80];
 
-    return state;
+    sprintf(temp, "last message repeated %llu times", state->repeatCount);
+    state->counters.repeated += state->repeatCount;
+    state->repeatCount = 0;
+    return WriteLine(state, state->lastMessageLevel, temp, 1);
 }
 
 
 //-----------------------------------------------------------------------------
-// LoggingState_SetLevel()
-//   Set the level for the logging state.
+// WriteFlightRecorder()
+//   Write the messages kept in the flight recorder that have not already been
+// written, if the message about to be written is at or above the level that
+// triggers this. Entries that are overwritten while they are being copied are
+// skipped.
 //-----------------------------------------------------------------------------
-static int LoggingState_SetLevel(
-    LoggingState *state,                // state on which to change level
-    unsigned long newLevel)             // new level to set
+static int WriteFlightRecorder(
+    LoggingState *state,                // state to use for writing
+    unsigned long level)                // level of message about to be written
 {
-    if (WritePrefix(state, LOG_LEVEL_NONE) < 0)
-        return -1;
-    if (WriteString(state, "switched logging level from ") < 0)
-        return -1;
-    if (WriteLevel(state, state->level) < 0)
-        return -1;
-    if (WriteString(state, " to ") < 0)
-        return -1;
-    if (WriteLevel(state, newLevel) < 0)
-        return -1;
-    if (WriteTrailer(state) < 0)
+    unsigned long long ticket, startTicket, endTicket, sequence;
+    FlightRecorder *recorder = state->flightRecorder;
+    char temp[LOG_FLIGHT_RECORDER_MESSAGE_SIZE + 100];
+    FlightRecorderEntry *entry, copy;
+    size_t length;
+
+    if (!recorder || level < state->options.flightRecorderTrigger ||
+            level >= LOG_LEVEL_NONE)
+        return 0;
+    endTicket = recorder->nextTicket;
+    startTicket = (endTicket > recorder->numEntries) ?
+            endTicket - recorder->numEntries : 0;
+    if (startTicket < recorder->dumpedTicket)
+        startTicket = recorder->dumpedTicket;
+    recorder->dumpedTicket = endTicket;
+    if (startTicket == endTicket)
+        return 0;
+
+    sprintf(temp, "flight recorder: %llu recent messages below level ",
+            endTicket - startTicket);
+    FormatLevel(state->level, temp + strlen(temp));
+    if (WriteLine(state, LOG_LEVEL_NONE, temp, 0) < 0)
         return -1;
-    state->level = newLevel;
-    return 0;
+    for (ticket = startTicket; ticket < endTicket; ticket++) {
+        entry = &recorder->entries[ticket % recorder->numEntries];
+        sequence = ATOMIC_LOAD(entry->sequence);
+        if (sequence != ticket * 2 + 2)
+            continue;
+        ATOMIC_FENCE();
+        memcpy(&copy, entry, sizeof(FlightRecorderEntry));
+        ATOMIC_FENCE();
+        if (ATOMIC_LOAD(entry->sequence) != sequence)
+            continue;
+        copy.message[LOG_FLIGHT_RECORDER_MESSAGE_SIZE - 1] = '\0';
+        temp[0] = '[';
+        FormatTimestamp(copy.timestamp, temp + 1);
+        length = strlen(temp);
+        length += sprintf(temp + length, " " THREAD_FORMAT "] ",
+                copy.threadId);
+        strcpy(temp + length, copy.message);
+        if (WriteLine(state, copy.level, temp, 0) < 0)
+            return -1;
+    }
+    return WriteLine(state, LOG_LEVEL_NONE,
+            "flight recorder: end of recent messages", 1);
 }
 
 
+#ifndef MS_WINDOWS
 //-----------------------------------------------------------------------------
-// PythonLoggingState_Free()
-//   Called when a Python logging state variable is freed.
+// SharedRing_Copy()
+//   Copy bytes into or out of the data of a ring in shared memory, wrapping
+// around to the start of the data if necessary.
 //-----------------------------------------------------------------------------
-void PythonLoggingState_Free(
-    udt_LoggingState *self)             // object being freed
+static void SharedRing_Copy(
+    char *data,                         // data of the ring
+    unsigned long long ringSize,        // size of the data of the ring
+    unsigned long long position,        // position in the ring
+    char *buffer,                       // buffer to copy to or from
+    size_t length,                      // number of bytes to copy
+    int toRing)                         // copy to the ring?
 {
-    if (self->state) {
-        LoggingState_Free(self->state);
-        LogMessage(LOG_LEVEL_INFO, "stopping logging for Python thread");
+    size_t offset, chunk;
+
+    offset = (size_t) (position % ringSize);
+    chunk = (size_t) ringSize - offset;
+    if (chunk > length)
+        chunk = length;
+    if (toRing) {
+        memcpy(data + offset, buffer, chunk);
+        memcpy(data, buffer + chunk, length - chunk);
+    } else {
+        memcpy(buffer, data + offset, chunk);
+        memcpy(buffer + chunk, data, length - chunk);
     }
-    Py_TYPE(self)->tp_free((PyObject*) self);
 }
 
 
-// define logging state Python type
-static PyTypeObject gPythonLoggingStateType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "cx_Logging.LoggingState",          // tp_name
-    sizeof(udt_LoggingState),           // tp_basicsize
-    0,                                  // tp_itemsize
-    (destructor) PythonLoggingState_Free,
-                                        // tp_dealloc
-    0,                                  // tp_print
-    0,                                  // tp_getattr
-    0,                                  // tp_setattr
-    0,                                  // tp_compare
-    0,                                  // tp_repr
-    0,                                  // tp_as_number
-    0,                                  // tp_as_sequence
-    0,                                  // tp_as_mapping
-    0,                                  // tp_hash
-    0,                                  // tp_call
-    0,                                  // tp_str
-    0,                                  // tp_getattro
-    0,                                  // tp_setattro
-    0,                                  // tp_as_buffer
-    Py_TPFLAGS_DEFAULT,                 // tp_flags
-    0,                                  // tp_doc
-    0,                                  // tp_traverse
-    0,                                  // tp_clear
-    0,                                  // tp_richcompare
-    0,                                  // tp_weaklistoffset
-    0,                                  // tp_iter
-    0,                                  // tp_iternext
-    0,                                  // tp_methods
-    0,                                  // tp_members
-    0,                                  // tp_getset
-    0,                                  // tp_base
-    0,                                  // tp_dict
-    0,                                  // tp_descr_get
-    0,                                  // tp_descr_set
-    0,                                  // tp_dictoffset
-    0,                                  // tp_init
-    0,                                  // tp_alloc
-    0,                                  // tp_new
-    0,                                  // tp_free
-    0,                                  // tp_is_gc
-    0                                   // tp_bases
-};
+//-----------------------------------------------------------------------------
+// SharedRing_Write()
+//   Write the message to the ring in shared memory claimed by the state. The
+// state is the only writer of the ring and the collector process the only
+// reader so the head is published only after the record has been copied. If
+// the collector has not kept up and there is no room in the ring the message
+// is dropped and counted so that the collector can report it.
+//-----------------------------------------------------------------------------
+static int SharedRing_Write(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    const char *message)                // message to write
+{
+    unsigned long long head, tail, ringSize, recordSize;
+    SharedRing *ring = state->sharedRing;
+    struct timeval timeOfDay;
+    SharedRecord record;
+    size_t length;
+    int levelIndex;
+
+    // no ring is available if one could not be claimed after a fork
+    if (!ring) {
+        state->counters.dropped++;
+        return 0;
+    }
+    length = strlen(message);
+    ringSize = state->sharedMemory->ringSize;
+    if (sizeof(SharedRecord) + length > ringSize)
+        length = (size_t) ringSize - sizeof(SharedRecord);
+    recordSize = (sizeof(SharedRecord) + length + 7) & ~7ULL;
+    levelIndex = GetLevelIndex(level);
+    head = ring->head;
+    tail = ATOMIC_LOAD(ring->tail);
+    if (ringSize - (head - tail) < recordSize) {
+        ATOMIC_ADD(ring->dropped, 1);
+        state->counters.dropped++;
+        return 0;
+    }
+    gettimeofday(&timeOfDay, NULL);
+    record.timestamp = (unsigned long long) timeOfDay.tv_sec * 1000000ULL +
+            timeOfDay.tv_usec;
+    record.processId = state->processId;
+    record.threadId = (long long) pthread_self();
+    record.level = (unsigned int) level;
+    record.length = (unsigned int) length;
+    SharedRing_Copy((char*) (ring + 1), ringSize, head, (char*) &record,
+            sizeof(SharedRecord), 1);
+    SharedRing_Copy((char*) (ring + 1), ringSize,
+            head + sizeof(SharedRecord), (char*) message, length, 1);
+    ATOMIC_STORE(ring->head, head + recordSize);
+    state->counters.messages[levelIndex]++;
+    state->counters.bytes[levelIndex] += length;
+    return 0;
+}
 
 
 //-----------------------------------------------------------------------------
-// StartLogging()
-//   Start logging to the specified file.
+// SharedRing_WriteMessage()
+//   Write the message to the ring in shared memory, preceded by the notice of
+// repeated messages, if applicable.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) StartLogging(
-    const char *fileName,               // name of file to write to
-    unsigned long level,                // level to use for logging
-    unsigned long maxFiles,             // maximum number of files to have
-    unsigned long maxFileSize,          // maximum size of each file
-    const char *prefix)                 // prefix to use in logging
+static int SharedRing_WriteMessage(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    const char *message)                // message to write
 {
-    ExceptionInfo exceptionInfo;
+    char temp[80];
 
-    return StartLoggingEx(fileName, level, maxFiles, maxFileSize, prefix, 1, 1,
-            &exceptionInfo);
+    if (state->repeatCount > 0) {
+        sprintf(temp, "last message repeated %llu times", state->repeatCount);
+        state->counters.repeated += state->repeatCount;
+        state->repeatCount = 0;
+        SharedRing_Write(state, state->lastMessageLevel, temp);
+    }
+    return SharedRing_Write(state, level, message);
 }
+#endif
 
 
 //-----------------------------------------------------------------------------
-// StartLoggingEx()
-//   Start logging to the specified file.
+// FormatMessage()
+//   Format the message into the message buffer of the state, enlarging the
+// buffer if needed.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) StartLoggingEx(
-    const char *fileName,               // name of file to write to
-    unsigned long level,                // level to use for logging
-    unsigned long maxFiles,             // maximum number of files to have
-    unsigned long maxFileSize,          // maximum size of each file
-    const char *prefix,                 // prefix to use in logging
-    int reuseExistingFiles,             // reuse existing files?
-    int rotateFiles,                    // rotate files?
-    ExceptionInfo* exceptionInfo)       // exception information (OUT)
+static int FormatMessage(
+    LoggingState *state,                // state to use for formatting
+    const char *format,                 // format of message
+    va_list arguments)                  // argument list
 {
-    LoggingState *loggingState, *origLoggingState;
-
-    loggingState = LoggingState_New(NULL, fileName, level, maxFiles,
-            maxFileSize, prefix, reuseExistingFiles, rotateFiles,
-            exceptionInfo);
-    if (!loggingState)
+    va_list argumentsCopy;
+    char *newBuffer;
+    int length;
+
+    va_copy(argumentsCopy, arguments);
+    length = vsnprintf(state->messageBuffer, state->messageBufferSize, format,
+            argumentsCopy);
+    va_end(argumentsCopy);
+    if (length < 0) {
+        sprintf(state->exceptionInfo.message,
+                "Cannot format message for file %s", state->fileName);
         return -1;
-    ACQUIRE_LOCK(gLoggingStateLock);
-    origLoggingState = gLoggingState;
-    gLoggingState = loggingState;
-    RELEASE_LOCK(gLoggingStateLock);
-    if (origLoggingState)
-        LoggingState_Free(origLoggingState);
+    }
+    if ((size_t) length >= state->messageBufferSize) {
+        newBuffer = realloc(state->messageBuffer, length + 1);
+        if (!newBuffer) {
+            strcpy(state->exceptionInfo.message,
+                    "Failed to allocate memory for message.");
+            return -1;
+        }
+        state->messageBuffer = newBuffer;
+        state->messageBufferSize = length + 1;
+        vsnprintf(state->messageBuffer, state->messageBufferSize, format,
+                arguments);
+    }
     return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// StartLoggingForPythonThread()
-//   Start logging to the specified file for the given Python thread. It is
-// assumed at this point that the Python interpreter lock is held.
+// TextBuffer_AppendLineV()
+//   Append a line to the text buffer given a variable number of arguments,
+// enlarging the buffer if needed.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) StartLoggingForPythonThread(
-    const char *fileName,               // name of file to write to
-    unsigned long level,                // level to use for logging
-    unsigned long maxFiles,             // maximum number of files to have
-    unsigned long maxFileSize,          // maximum size of each file
-    const char *prefix)                 // prefix to use in logging
+static int TextBuffer_AppendLineV(
+    TextBuffer *buffer,                 // buffer to append to
+    const char *format,                 // format of line
+    va_list arguments)                  // argument list
 {
-    return StartLoggingForPythonThreadEx(fileName, level, maxFiles,
-            maxFileSize, prefix, 1, 1);
+    size_t available, allocated;
+    va_list argumentsCopy;
+    char *newData;
+    int length;
+
+    // the line is formatted into the space following the separator that
+    // precedes it; if there is not enough space, it is formatted again
+    available = 0;
+    if (buffer->data)
+        available = buffer->allocated - buffer->length - 1;
+    va_copy(argumentsCopy, arguments);
+    length = vsnprintf((available) ? buffer->data + buffer->length + 1 : NULL,
+            available, format, argumentsCopy);
+    va_end(argumentsCopy);
+    if (length < 0)
+        return -1;
+    if ((size_t) length >= available) {
+        allocated = buffer->allocated * 2;
+        if (allocated < buffer->length + length + 2)
+            allocated = buffer->length + length + 2;
+        if (allocated < 256)
+            allocated = 256;
+        newData = realloc(buffer->data, allocated);
+        if (!newData)
+            return -1;
+        buffer->data = newData;
+        buffer->allocated = allocated;
+        vsnprintf(buffer->data + buffer->length + 1, length + 1, format,
+                arguments);
+    }
+
+    // remove the separator for the first line
+    if (buffer->numLines == 0)
+        memmove(buffer->data, buffer->data + 1, length + 1);
+    else buffer->data[buffer->length++] = '\n';
+    buffer->length += length;
+    buffer->numLines++;
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// StartLoggingForPythonThreadEx()
-//   Start logging to the specified file for the given Python thread. It is
-// assumed at this point that the Python interpreter lock is held.
+// TextBuffer_AppendLine()
+//   Append a line to the text buffer.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) StartLoggingForPythonThreadEx(
-    const char *fileName,               // name of file to write to
-    unsigned long level,                // level to use for logging
-    unsigned long maxFiles,             // maximum number of files to have
-    unsigned long maxFileSize,          // maximum size of each file
-    const char *prefix,                 // prefix to use in logging
-    int reuseExistingFiles,             // reuse existing files?
-    int rotateFiles)                    // rotate files?
+static int TextBuffer_AppendLine(
+    TextBuffer *buffer,                 // buffer to append to
+    const char *format,                 // format of line
+    ...)                                // arguments required for format
 {
-    udt_LoggingState *loggingState;
-    ExceptionInfo exceptionInfo;
+    va_list arguments;
     int result;
 
-    // create a new logging state object
-    loggingState = (udt_LoggingState*)
-            gPythonLoggingStateType.tp_alloc(&gPythonLoggingStateType, 0);
-    if (!loggingState)
-        return -1;
-    INITIALIZE_LOCK(loggingState->lock);
-    loggingState->state = LoggingState_New(NULL, fileName, level, maxFiles,
-            maxFileSize, prefix, reuseExistingFiles, rotateFiles,
-            &exceptionInfo);
-    if (!loggingState->state) {
-        Py_DECREF(loggingState);
-        PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
-        return -1;
-    }
+    va_start(arguments, format);
+    result = TextBuffer_AppendLineV(buffer, format, arguments);
+    va_end(arguments);
+    return result;
+}
 
-    // set the logging state
-    if (LogMessage(LOG_LEVEL_INFO, "starting logging for Python thread") < 0 ||
-            LogMessageV(LOG_LEVEL_INFO, "    fileName => %s",
-                    loggingState->state->fileName) < 0 ||
-            LogMessageV(LOG_LEVEL_INFO, "    level => %d",
+
+//-----------------------------------------------------------------------------
+// LoggingState_FormatSinkRecord()
+//   Format the record that is written to the file and to each of the sinks
+// into the sink text buffer of the state, enlarging the buffer if needed. The
+// time and thread are determined once so that the prefix and the record
+// agree. If the message is split into lines, each line is given its own
+// prefix; otherwise, the message is formatted as a single line.
+//-----------------------------------------------------------------------------
+static int LoggingState_FormatSinkRecord(
+    LoggingState *state,                // state to use for formatting
+    unsigned long level,                // level at which to write
+    const char *message,                // message to format
+    int splitLines)                     // split message into lines?
+{
+#ifdef MS_WINDOWS
+    ULARGE_INTEGER fileTime;
+    FILETIME now;
+#else
+    struct timeval timeOfDay;
+#endif
+    size_t prefixLength, messageLength, size;
+    const char *line, *next;
+    unsigned long numLines;
+    SharedRecord record;
+    char *newText, *out;
+
+    // determine the time and thread which are used for the prefix
+#ifdef MS_WINDOWS
+    GetSystemTimeAsFileTime(&now);
+    fileTime.LowPart = now.dwLowDateTime;
+    fileTime.HighPart = now.dwHighDateTime;
+    record.timestamp = (fileTime.QuadPart - 116444736000000000ULL) / 10;
+    record.processId = (long long) GetCurrentProcessId();
+    record.threadId = (long long) GetCurrentThreadId();
+#else
+    gettimeofday(&timeOfDay, NULL);
+    record.timestamp = (unsigned long long) timeOfDay.tv_sec * 1000000ULL +
+            timeOfDay.tv_usec;
+    record.processId = (long long) getpid();
+    record.threadId = (long long) pthread_self();
+#endif
+    prefixLength = FormatPrefix(state, level, &record, state->prefixBuffer);
+
+    // ensure the buffer is large enough for the prefix of each line
+    messageLength = strlen(message);
+    numLines = 1;
+    if (splitLines) {
+        for (line = strchr(message, '\n'); line; line = strchr(line + 1, '\n'))
+            numLines++;
+    }
+    size = numLines * (prefixLength + 1) + messageLength + 1;
+    if (size > state->sinkTextSize) {
+        newText = realloc(state->sinkText, size);
+        if (!newText) {
+            strcpy(state->exceptionInfo.message,
+                    "Failed to allocate memory for record.");
+            return -1;
+        }
+        state->sinkText = newText;
+        state->sinkTextSize = size;
+    }
+
+    // format the text with the prefix at the start of each line
+    out = state->sinkText;
+    for (line = message; line; line = next) {
+        next = (splitLines) ? strchr(line, '\n') : NULL;
+        size = (next) ? (size_t) (next++ - line) :
+                messageLength - (size_t) (line - message);
+        memcpy(out, state->prefixBuffer, prefixLength);
+        memcpy(out + prefixLength, line, size);
+        out += prefixLength + size;
+        *out++ = '\n';
+    }
+    *out = '\0';
+
+    // populate the record passed to the sinks
+    state->sinkRecord.timestamp = record.timestamp;
+    state->sinkRecord.threadId = record.threadId;
+    state->sinkRecord.level = level;
+    state->sinkRecord.message = message;
+    state->sinkRecord.messageLength = messageLength;
+    state->sinkRecord.text = state->sinkText;
+    state->sinkRecord.textLength = (size_t) (out - state->sinkText);
+    return (int) numLines;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingSink_Write()
+//   Write the records to the sink, giving it the opportunity to rotate before
+// they are written and flushing it afterwards.
+//-----------------------------------------------------------------------------
+static int LoggingSink_Write(
+    LoggingSink *sink,                  // sink to write to
+    const LoggingSinkRecord *records,   // records to write
+    size_t numRecords)                  // number of records to write
+{
+    if (sink->type->rotate && sink->type->rotate(sink) < 0)
+        return -1;
+    if (sink->type->writeBatch(sink, records, numRecords) < 0)
+        return -1;
+    if (sink->type->flush && sink->type->flush(sink) < 0)
+        return -1;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_WriteToSinks()
+//   Write the formatted record to each of the sinks whose level permits it.
+// A sink that fails is counted but does not prevent the record from being
+// written to the file or to the remaining sinks.
+//-----------------------------------------------------------------------------
+static void LoggingState_WriteToSinks(
+    LoggingState *state,                // state to use for writing
+    unsigned long level)                // level at which to write
+{
+    LoggingSink *sink;
+
+    for (sink = state->sinks; sink; sink = sink->next) {
+        if (level < sink->level || level > sink->maxLevel)
+            continue;
+        if (LoggingSink_Write(sink, &state->sinkRecord, 1) < 0) {
+            sink->errors++;
+            state->counters.errors++;
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteSinkRecord()
+//   Write the message to the file and to each of the sinks of the state. The
+// message is formatted once and the same text is written to each of them. The
+// sinks are written after the file, once any rotation and the messages that
+// precede the message in the file have been written, and are written even if
+// writing the file fails.
+//-----------------------------------------------------------------------------
+static int WriteSinkRecord(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    const char *message,                // message to write
+    int splitLines)                     // split message into lines?
+{
+    unsigned long long startTime = 0;
+#ifndef MS_WINDOWS
+    struct iovec vector;
+#endif
+    int levelIndex, numLines, result = 0;
+
+    if (gLoggingStatsEnabled)
+        startTime = GetTimeInNanoseconds();
+    numLines = LoggingState_FormatSinkRecord(state, level, message,
+            splitLines);
+    if (numLines < 0) {
+        state->counters.errors++;
+        return -1;
+    }
+#ifndef UNDER_CE
+    if (CheckForLogFileFull(state) < 0)
+        result = -1;
+#endif
+    if (result == 0 && state->fp) {
+        if (WriteFlightRecorder(state, level) < 0)
+            result = -1;
+        else if (state->repeatCount > 0 && WriteRepeatNotice(state) < 0)
+            result = -1;
+#ifndef MS_WINDOWS
+        else if (state->options.directWrite) {
+            vector.iov_base = state->sinkText;
+            vector.iov_len = state->sinkRecord.textLength;
+            if (WriteVectors(state, &vector, 1) < 0)
+                result = -1;
+            else {
+                state->bytesWritten += state->sinkRecord.textLength;
+                state->counters.flushes++;
+            }
+        }
+#endif
+        else if (WriteText(state, state->sinkText,
+                state->sinkRecord.textLength) < 0 || FlushFile(state) < 0)
+            result = -1;
+        if (result == 0) {
+            levelIndex = GetLevelIndex(level);
+            state->counters.messages[levelIndex] += numLines;
+            state->counters.bytes[levelIndex] +=
+                    state->sinkRecord.textLength;
+        }
+    }
+    LoggingState_WriteToSinks(state, level);
+    if (result < 0) {
+        state->counters.errors++;
+        return -1;
+    }
+    if (startTime)
+        LatencyHistogram_Record(&gLoggingStats.write, startTime);
+    if (state->fp && state->options.durability &&
+            LoggingState_MakeDurable(state, level) < 0) {
+        state->counters.errors++;
+        return -1;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteMessage()
+//   Write the message to the file. If repeated messages are being suppressed
+// and the message is the same as the last one, only the number of times it
+// has been repeated is retained.
+//-----------------------------------------------------------------------------
+static int WriteMessage(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    const char *message)                // message to write
+{
+    unsigned long long startTime = 0, bytesWritten, hash;
+    int levelIndex;
+
+    if (!message)
+        message = "(null)";
+    if (state->options.suppressRepeats) {
+        hash = HashBytes(message, strlen(message));
+        if (hash == state->lastMessageHash &&
+                level == state->lastMessageLevel) {
+            state->repeatCount++;
+            return 0;
+        }
+        state->lastMessageHash = hash;
+        state->lastMessageLevel = level;
+    }
+#ifndef MS_WINDOWS
+    if (state->sharedMemory)
+        return SharedRing_WriteMessage(state, level, message);
+#endif
+    if (state->sinks)
+        return WriteSinkRecord(state, level, message, 0);
+    if (gLoggingStatsEnabled)
+        startTime = GetTimeInNanoseconds();
+#ifndef UNDER_CE
+    if (CheckForLogFileFull(state) < 0) {
+        state->counters.errors++;
+        return -1;
+    }
+#endif
+    if (state->fp) {
+        if (WriteFlightRecorder(state, level) < 0) {
+            state->counters.errors++;
+            return -1;
+        }
+        if (state->repeatCount > 0 && WriteRepeatNotice(state) < 0) {
+            state->counters.errors++;
+            return -1;
+        }
+        bytesWritten = state->bytesWritten;
+#ifndef MS_WINDOWS
+        if (state->options.directWrite) {
+            if (WriteMessageDirect(state, level, message) < 0) {
+                state->counters.errors++;
+                return -1;
+            }
+        } else
+#endif
+        if (WritePrefix(state, level) < 0 ||
+                WriteString(state, message) < 0 ||
+                WriteTrailer(state) < 0) {
+            state->counters.errors++;
+            return -1;
+        }
+        levelIndex = GetLevelIndex(level);
+        state->counters.messages[levelIndex]++;
+        state->counters.bytes[levelIndex] +=
+                state->bytesWritten - bytesWritten;
+    }
+    if (startTime)
+        LatencyHistogram_Record(&gLoggingStats.write, startTime);
+    if (state->fp && state->options.durability &&
+            LoggingState_MakeDurable(state, level) < 0) {
+        state->counters.errors++;
+        return -1;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteMessageWithFormat()
+//   Write the formatted message to the file given a variable number of
+// arguments.
+//-----------------------------------------------------------------------------
+static int WriteMessageWithFormat(
+    LoggingState *state,                // state to stop logging for
+    unsigned long level,                // level at which message is written
+    const char *format,                 // format of message to log
+    va_list arguments)                  // argument list
+{
+    unsigned long long startTime = 0, bytesWritten;
+    int levelIndex, length;
+
+    // repeated messages can only be detected after the message is formatted
+    // and messages sent to shared memory, written directly or written to
+    // sinks are written as a whole
+    if (state->options.suppressRepeats || state->options.directWrite ||
+            state->sharedMemory || state->sinks) {
+        if (FormatMessage(state, format, arguments) < 0) {
+            state->counters.errors++;
+            return -1;
+        }
+        return WriteMessage(state, level, state->messageBuffer);
+    }
+
+    if (gLoggingStatsEnabled)
+        startTime = GetTimeInNanoseconds();
+#ifndef UNDER_CE
+    if (CheckForLogFileFull(state) < 0) {
+        state->counters.errors++;
+        return -1;
+    }
+#endif
+    if (state->fp) {
+        if (WriteFlightRecorder(state, level) < 0) {
+            state->counters.errors++;
+            return -1;
+        }
+        bytesWritten = state->bytesWritten;
+        if (WritePrefix(state, level) < 0) {
+            state->counters.errors++;
+            return -1;
+        }
+        length = vfprintf(state->fp, format, arguments);
+        if (length < 0) {
+            sprintf(state->exceptionInfo.message,
+                    "Cannot write formatted message to file %s",
+                    state->fileName);
+            state->counters.errors++;
+            return -1;
+        }
+        state->bytesWritten += length;
+        if (WriteTrailer(state) < 0) {
+            state->counters.errors++;
+            return -1;
+        }
+        levelIndex = GetLevelIndex(level);
+        state->counters.messages[levelIndex]++;
+        state->counters.bytes[levelIndex] +=
+                state->bytesWritten - bytesWritten;
+    }
+    if (startTime)
+        LatencyHistogram_Record(&gLoggingStats.write, startTime);
+    if (state->fp && state->options.durability &&
+            LoggingState_MakeDurable(state, level) < 0) {
+        state->counters.errors++;
+        return -1;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteRecord()
+//   Write a record made up of one or more lines, separated by line feeds, to
+// the file. Each line is written with its own prefix but the record is
+// checked for rotation, written and flushed as a whole so that it is not
+// split across files and requires only a single acquisition of the lock by
+// the caller. When writing directly to the file or to shared memory, the
+// record is committed with a single write so that it is never interleaved
+// with other messages. The text is modified as it is written.
+//-----------------------------------------------------------------------------
+static int WriteRecord(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    char *text)                         // text to write
+{
+    unsigned long long startTime = 0, bytesWritten, hash;
+    long numLines = 0;
+    char *line, *next;
+    int levelIndex;
+
+    if (state->options.suppressRepeats) {
+        hash = HashBytes(text, strlen(text));
+        if (hash == state->lastMessageHash &&
+                level == state->lastMessageLevel) {
+            state->repeatCount++;
+            return 0;
+        }
+        state->lastMessageHash = hash;
+        state->lastMessageLevel = level;
+    }
+#ifndef MS_WINDOWS
+    if (state->sharedMemory)
+        return SharedRing_WriteMessage(state, level, text);
+#endif
+    if (state->sinks)
+        return WriteSinkRecord(state, level, text, 1);
+    if (gLoggingStatsEnabled)
+        startTime = GetTimeInNanoseconds();
+#ifndef UNDER_CE
+    if (CheckForLogFileFull(state) < 0) {
+        state->counters.errors++;
+        return -1;
+    }
+#endif
+    if (state->fp) {
+        if (WriteFlightRecorder(state, level) < 0) {
+            state->counters.errors++;
+            return -1;
+        }
+        if (state->repeatCount > 0 && WriteRepeatNotice(state) < 0) {
+            state->counters.errors++;
+            return -1;
+        }
+        bytesWritten = state->bytesWritten;
+#ifndef MS_WINDOWS
+        if (state->options.directWrite) {
+            numLines = WriteRecordDirect(state, level, text);
+            if (numLines < 0) {
+                state->counters.errors++;
+                return -1;
+            }
+        } else
+#endif
+        {
+            for (line = text; line; line = next, numLines++) {
+                next = strchr(line, '\n');
+                if (next)
+                    *next++ = '\0';
+                if (WritePrefix(state, level) < 0 ||
+                        WriteString(state, line) < 0 ||
+                        (next && WriteString(state, "\n") < 0)) {
+                    state->counters.errors++;
+                    return -1;
+                }
+            }
+            if (WriteTrailer(state) < 0) {
+                state->counters.errors++;
+                return -1;
+            }
+        }
+        levelIndex = GetLevelIndex(level);
+        state->counters.messages[levelIndex] += numLines;
+        state->counters.bytes[levelIndex] +=
+                state->bytesWritten - bytesWritten;
+    }
+    if (startTime)
+        LatencyHistogram_Record(&gLoggingStats.write, startTime);
+    if (state->fp && state->options.durability &&
+            LoggingState_MakeDurable(state, level) < 0) {
+        state->counters.errors++;
+        return -1;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteRateLimitNotice()
+//   Write a notice indicating how many messages from a call site were
+// suppressed because the call site exceeded the rate limit.
+//-----------------------------------------------------------------------------
+static int WriteRateLimitNotice(
+    LoggingState *state,                // state to use for writing
+    unsigned long level,                // level at which to write
+    unsigned long long dropped)         // number of messages dropped
+{
+    char temp[100];
+
+    state->counters.rateLimited += dropped;
+    sprintf(temp, "rate limit exceeded: %llu messages were suppressed",
+            dropped);
+    return WriteMessage(state, level, temp);
+}
+
+
+//-----------------------------------------------------------------------------
+// IsLoggingAtLevelForPython()
+//   Return a boolean indicating if the current logging state is such that a
+// message at the given level should be logged. No lock is acquired so this is
+// inexpensive but the level is checked again when the message is written.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) IsLoggingAtLevelForPython(
+    unsigned long level)                // desired level
+{
+    udt_LoggingState *loggingState;
+    int result;
+
+    loggingState = GetLoggingState();
+    if (loggingState) {
+        result = (level >= loggingState->state->level);
+        if (!result)
+            CountSuppressed(&loggingState->state->counters, level);
+    } else {
+        result = (gLoggingState && level >= gLoggingLevel);
+        if (gLoggingState && !result)
+            CountSuppressed(&gLoggingUnlockedCounters, level);
+    }
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// GetThreadStateDictionary()
+//   Return the thread state dictionary and sets an exception if it is not
+// available.
+//-----------------------------------------------------------------------------
+static PyObject* GetThreadStateDictionary(void)
+{
+    PyObject *dict;
+
+    dict = PyThreadState_GetDict();
+    if (!dict) {
+        LogMessage(LOG_LEVEL_WARNING, "no thread state dictionary");
+        return NULL;
+    }
+    return dict;
+}
+
+
+//-----------------------------------------------------------------------------
+// GetEncodingType()
+//   Return the type of encoding given its name. The name is normalized in the
+// same way as the codec registry does so that the common aliases of UTF-8,
+// ASCII and Latin-1 are recognized; all other encodings are handled by the
+// codec registry.
+//-----------------------------------------------------------------------------
+static int GetEncodingType(
+    const char *encoding)               // name of encoding
+{
+    char normalized[16];
+    size_t length = 0;
+
+    for (; *encoding; encoding++) {
+        if (*encoding == '-' || *encoding == '_' || *encoding == ' ')
+            continue;
+        if (length == sizeof(normalized) - 1)
+            return ENCODING_TYPE_OTHER;
+        normalized[length++] = (char) tolower((unsigned char) *encoding);
+    }
+    normalized[length] = '\0';
+    if (strcmp(normalized, "utf8") == 0 || strcmp(normalized, "u8") == 0 ||
+            strcmp(normalized, "utf") == 0)
+        return ENCODING_TYPE_UTF8;
+    if (strcmp(normalized, "ascii") == 0 ||
+            strcmp(normalized, "usascii") == 0 ||
+            strcmp(normalized, "646") == 0)
+        return ENCODING_TYPE_ASCII;
+    if (strcmp(normalized, "latin1") == 0 ||
+            strcmp(normalized, "latin") == 0 ||
+            strcmp(normalized, "l1") == 0 ||
+            strcmp(normalized, "iso88591") == 0 ||
+            strcmp(normalized, "8859") == 0 ||
+            strcmp(normalized, "cp819") == 0)
+        return ENCODING_TYPE_LATIN1;
+    return ENCODING_TYPE_OTHER;
+}
+
+
+//-----------------------------------------------------------------------------
+// GetEncodingTypeForPython()
+//   Return the type of encoding used by the current Python thread and the name
+// of the encoding to pass to the codec registry when a string cannot be
+// handled directly. Threads for which no encoding has been set use the default
+// encoding, which is UTF-8.
+//-----------------------------------------------------------------------------
+static int GetEncodingTypeForPython(
+    const char **encoding)              // name of encoding (OUT)
+{
+    PyObject *dict, *typeObj, *encodingObj;
+
+    *encoding = NULL;
+    if (!gEncodingTypeKey) {
+        gEncodingTypeKey = PyUnicode_InternFromString(KEY_ENCODING_TYPE);
+        if (!gEncodingTypeKey) {
+            PyErr_Clear();
+            return ENCODING_TYPE_OTHER;
+        }
+    }
+    dict = PyThreadState_GetDict();
+    if (!dict)
+        return ENCODING_TYPE_UTF8;
+    typeObj = PyDict_GetItem(dict, gEncodingTypeKey);
+    if (!typeObj)
+        return ENCODING_TYPE_UTF8;
+    switch (PyLong_AS_LONG(typeObj)) {
+        case ENCODING_TYPE_UTF8:
+            return ENCODING_TYPE_UTF8;
+        case ENCODING_TYPE_ASCII:
+            *encoding = "ascii";
+            return ENCODING_TYPE_ASCII;
+        case ENCODING_TYPE_LATIN1:
+            *encoding = "latin-1";
+            return ENCODING_TYPE_LATIN1;
+    }
+    encodingObj = PyDict_GetItemString(dict, KEY_ENCODING);
+    if (encodingObj)
+        *encoding = PyBytes_AS_STRING(encodingObj);
+    return ENCODING_TYPE_OTHER;
+}
+
+
+//-----------------------------------------------------------------------------
+// GetEncodedStringForPython()
+//   Return the encoded text of a Python string or bytes value, along with a
+// reference to the object that owns it, which must be released once the text
+// is no longer needed. When the encoding is UTF-8 or the string can be
+// represented in ASCII or Latin-1 as required, the text held by the string
+// itself is used and no new object is created; otherwise the string is
+// encoded using the codec registry.
+//-----------------------------------------------------------------------------
+static int GetEncodedStringForPython(
+    PyObject *value,                    // value to encode
+    PyObject **encodedValue,            // owner of encoded text (OUT)
+    const char **text)                  // encoded text (OUT)
+{
+    const char *encoding;
+    int encodingType;
+
+    if (PyUnicode_Check(value)) {
+        encodingType = GetEncodingTypeForPython(&encoding);
+        if (encodingType == ENCODING_TYPE_UTF8) {
+            *text = PyUnicode_AsUTF8(value);
+            if (!*text)
+                return -1;
+        } else if ((encodingType == ENCODING_TYPE_ASCII &&
+                        PyUnicode_IS_ASCII(value)) ||
+                (encodingType == ENCODING_TYPE_LATIN1 &&
+                        PyUnicode_KIND(value) == PyUnicode_1BYTE_KIND)) {
+            *text = (const char*) PyUnicode_DATA(value);
+        } else {
+            *encodedValue = PyUnicode_AsEncodedString(value, encoding, NULL);
+            if (!*encodedValue)
+                return -1;
+            *text = PyBytes_AS_STRING(*encodedValue);
+            return 0;
+        }
+    } else if (PyBytes_Check(value)) {
+        *text = PyBytes_AS_STRING(value);
+    } else {
+        PyErr_SetString(PyExc_TypeError, "expecting a string");
+        return -1;
+    }
+
+    Py_INCREF(value);
+    *encodedValue = value;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// SetEncodingHelper()
+//   Set the encoding value for Python. The type of encoding is resolved at
+// this point so that messages written in UTF-8, ASCII or Latin-1 can avoid the
+// codec registry.
+//-----------------------------------------------------------------------------
+static PyObject* SetEncodingHelper(
+    PyObject *encoding)                 // encoding value to use
+{
+    PyObject *dict, *encodedEncoding, *encodingTypeObj;
+    const char *text;
+    int result;
+
+    if (encoding) {
+        dict = GetThreadStateDictionary();
+        if (!dict) {
+            PyErr_SetString(PyExc_RuntimeError,
+                    "unable to get thread state dictionary");
+            return NULL;
+        }
+        if (GetEncodedStringForPython(encoding, &encodedEncoding, &text) < 0)
+            return NULL;
+        encodingTypeObj = PyLong_FromLong(GetEncodingType(text));
+        if (!encodingTypeObj) {
+            Py_DECREF(encodedEncoding);
+            return NULL;
+        }
+        if (!PyBytes_Check(encodedEncoding)) {
+            Py_DECREF(encodedEncoding);
+            encodedEncoding = PyBytes_FromString(text);
+        }
+        result = (encodedEncoding) ? PyDict_SetItemString(dict, KEY_ENCODING,
+                encodedEncoding) : -1;
+        if (result == 0)
+            result = PyDict_SetItemString(dict, KEY_ENCODING_TYPE,
+                    encodingTypeObj);
+        Py_XDECREF(encodedEncoding);
+        Py_DECREF(encodingTypeObj);
+        if (result < 0)
+            return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+//-----------------------------------------------------------------------------
+// IsFilteredForPython()
+//   Return a boolean indicating if the message should be skipped because it
+// was not chosen by sampling or because the call site identified by the format
+// has exceeded the rate limit of the logging state in use by the current
+// Python thread. The hash of a string is cached so this is inexpensive for the
+// constant strings that are normally used as formats.
+//-----------------------------------------------------------------------------
+static int IsFilteredForPython(
+    unsigned long level,                // level at which to log
+    PyObject *format,                   // format identifying call site
+    unsigned long long *dropped)        // number of dropped messages (OUT)
+{
+    udt_LoggingState *loggingState;
+    const LoggingOptions *options;
+    LoggingCounters *counters;
+    unsigned long rateLimit;
+    Py_hash_t hash;
+
+    *dropped = 0;
+    loggingState = GetLoggingState();
+    if (loggingState) {
+        options = &loggingState->state->options;
+        counters = &loggingState->state->counters;
+    } else {
+        options = &gLoggingOptions;
+        counters = &gLoggingUnlockedCounters;
+    }
+    if (IsSampledOut(options, counters, level))
+        return 1;
+    rateLimit = options->rateLimit;
+    if (!rateLimit)
+        return 0;
+    hash = PyObject_Hash(format);
+    if (hash == -1) {
+        PyErr_Clear();
+        hash = (Py_hash_t) format;
+    }
+    return IsRateLimited(rateLimit, (unsigned long long) hash ^ level,
+            dropped);
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteMessageForPythonHelper()
+//   Write a message for Python given the known logging state, first writing a
+// notice if messages from the call site were dropped due to rate limiting.
+//-----------------------------------------------------------------------------
+static int WriteMessageForPythonHelper(
+    unsigned long level,                // level at which message is written
+    PyObject *messageObj,               // message object to write
+    unsigned long long dropped)         // messages dropped by rate limiting
+{
+    udt_LoggingState *loggingState;
+    PyObject *encodedMessage;
+    const char *message;
+    int result = 0;
+
+    // determine actual message to write
+    if (GetEncodedStringForPython(messageObj, &encodedMessage, &message) < 0)
+        return -1;
+
+    // actually write the message
+    loggingState = GetLoggingState();
+    Py_BEGIN_ALLOW_THREADS
+    if (loggingState) {
+        AcquireLockForWriting(&loggingState->lock);
+        if (dropped)
+            WriteRateLimitNotice(loggingState->state, level, dropped);
+        result = WriteMessage(loggingState->state, level, message);
+        RELEASE_LOCK(loggingState->lock);
+    } else {
+        AcquireLockForWriting(&gLoggingStateLock);
+        if (gLoggingState) {
+            if (dropped)
+                WriteRateLimitNotice(gLoggingState, level, dropped);
+            result = WriteMessage(gLoggingState, level, message);
+        }
+        RELEASE_LOCK(gLoggingStateLock);
+    }
+    Py_END_ALLOW_THREADS
+    Py_DECREF(encodedMessage);
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteRecordForPython()
+//   Write a record made up of multiple lines for Python given the known
+// logging state, acquiring the lock only once.
+//-----------------------------------------------------------------------------
+static int WriteRecordForPython(
+    unsigned long level,                // level at which record is written
+    char *text)                         // text of record to write
+{
+    udt_LoggingState *loggingState;
+    int result = 0;
+
+    loggingState = GetLoggingState();
+    Py_BEGIN_ALLOW_THREADS
+    if (loggingState) {
+        AcquireLockForWriting(&loggingState->lock);
+        result = WriteRecord(loggingState->state, level, text);
+        RELEASE_LOCK(loggingState->lock);
+    } else {
+        AcquireLockForWriting(&gLoggingStateLock);
+        if (gLoggingState)
+            result = WriteRecord(gLoggingState, level, text);
+        RELEASE_LOCK(gLoggingStateLock);
+    }
+    Py_END_ALLOW_THREADS
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteMessageForPython()
+//   Write a message for Python given the known logging state.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) WriteMessageForPython(
+    unsigned long level,                // level at which message is written
+    PyObject *messageObj)               // message object to write
+{
+    return WriteMessageForPythonHelper(level, messageObj, 0);
+}
+
+
+#ifndef MS_WINDOWS
+//-----------------------------------------------------------------------------
+// GetSharedMemoryName()
+//   Return the name of the shared memory used to send messages to a collector
+// process. A leading slash is added if one was not specified.
+//-----------------------------------------------------------------------------
+static int GetSharedMemoryName(
+    const char *name,                   // name specified by the caller
+    char *buffer,                       // buffer to place name into
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    if (strlen(name) + 2 > NAME_MAX) {
+        sprintf(exceptionInfo->message,
+                "Shared memory name %.100s is too long.", name);
+        return -1;
+    }
+    if (*name == '/')
+        strcpy(buffer, name);
+    else sprintf(buffer, "/%s", name);
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// GetSharedRing()
+//   Return the ring in shared memory at the given index.
+//-----------------------------------------------------------------------------
+static SharedRing *GetSharedRing(
+    SharedMemoryHeader *header,         // header of shared memory
+    unsigned long long ringIndex)       // index of ring to return
+{
+    return (SharedRing*) ((char*) (header + 1) +
+            ringIndex * (sizeof(SharedRing) + header->ringSize));
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_ClaimSharedRing()
+//   Claim a ring in shared memory which is not being used by any process. A
+// ring is only released by the collector once it has been emptied so a
+// claimed ring is always empty.
+//-----------------------------------------------------------------------------
+static int LoggingState_ClaimSharedRing(
+    LoggingState *state)                // state to use
+{
+    long long expected;
+    unsigned long long i;
+    SharedRing *ring;
+
+    state->sharedRing = NULL;
+    state->processId = (long) getpid();
+    for (i = 0; i < state->sharedMemory->numRings; i++) {
+        ring = GetSharedRing(state->sharedMemory, i);
+        expected = 0;
+        if (ring->ownerPid == 0 && ATOMIC_CAS(ring->ownerPid, expected,
+                (long long) state->processId)) {
+            ATOMIC_FENCE();
+            state->sharedRing = ring;
+            return 0;
+        }
+    }
+    sprintf(state->exceptionInfo.message,
+            "No free ring in shared memory %s for process %ld.",
+            state->fileName, state->processId);
+    return -1;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_AttachSharedMemory()
+//   Attach to the shared memory created by a collector process and claim a
+// ring in it to which messages are written instead of to a file.
+//-----------------------------------------------------------------------------
+static int LoggingState_AttachSharedMemory(
+    LoggingState *state)                // state to use
+{
+    SharedMemoryHeader *header;
+    struct stat statBuffer;
+    char temp[100];
+    void *memory;
+    int fd;
+
+    if (GetSharedMemoryName(state->baseFileName, state->fileName,
+            &state->exceptionInfo) < 0)
+        return -1;
+    fd = shm_open(state->fileName, O_RDWR, 0);
+    if (fd < 0) {
+        sprintf(state->exceptionInfo.message,
+                "Failed to open shared memory %s: OS error %d",
+                state->fileName, errno);
+        return -1;
+    }
+    if (fstat(fd, &statBuffer) < 0 ||
+            (size_t) statBuffer.st_size < sizeof(SharedMemoryHeader)) {
+        close(fd);
+        sprintf(state->exceptionInfo.message,
+                "Shared memory %s has not been created by a collector.",
+                state->fileName);
+        return -1;
+    }
+    memory = mmap(NULL, (size_t) statBuffer.st_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        sprintf(state->exceptionInfo.message,
+                "Failed to map shared memory %s: OS error %d",
+                state->fileName, errno);
+        return -1;
+    }
+    state->sharedMemory = header = (SharedMemoryHeader*) memory;
+    state->sharedMemorySize = (size_t) statBuffer.st_size;
+    if (ATOMIC_LOAD(header->magic) != LOG_SHARED_MEMORY_MAGIC ||
+            header->ringSize < sizeof(SharedRecord) ||
+            sizeof(SharedMemoryHeader) + header->numRings *
+                    (sizeof(SharedRing) + header->ringSize) >
+                    state->sharedMemorySize) {
+        sprintf(state->exceptionInfo.message,
+                "Shared memory %s has not been created by a collector.",
+                state->fileName);
+        return -1;
+    }
+    if (LoggingState_ClaimSharedRing(state) < 0)
+        return -1;
+
+    // put out an initial message regardless of level
+    strcpy(temp, "starting logging at level ");
+    FormatLevel(state->level, temp + strlen(temp));
+    return SharedRing_Write(state, LOG_LEVEL_NONE, temp);
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_DetachSharedMemory()
+//   Release the ring claimed in shared memory and detach from it. The ring is
+// marked as detached rather than free so that the collector can empty it
+// before it is claimed again.
+//-----------------------------------------------------------------------------
+static void LoggingState_DetachSharedMemory(
+    LoggingState *state)                // state to use
+{
+    if (state->sharedRing) {
+        SharedRing_WriteMessage(state, LOG_LEVEL_NONE, "ending logging");
+        ATOMIC_FENCE();
+        ATOMIC_EXCHANGE(state->sharedRing->ownerPid,
+                -(long long) state->processId);
+        state->sharedRing = NULL;
+    }
+    munmap(state->sharedMemory, state->sharedMemorySize);
+    state->sharedMemory = NULL;
+}
+#endif
+
+
+//-----------------------------------------------------------------------------
+// FreeLoggingSink()
+//   Close the sink and free the memory associated with it. Sinks that have
+// been added to a logging state are freed when logging stops so this is only
+// needed for sinks that are never added.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(void) FreeLoggingSink(
+    LoggingSink *sink)                  // sink to free
+{
+    if (sink->type->close)
+        sink->type->close(sink);
+    free(sink);
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_Free()
+//   Free the logging state.
+//-----------------------------------------------------------------------------
+static void LoggingState_Free(
+    LoggingState *state)                // state to stop logging for
+{
+    LoggingSink *sink;
+
+#ifndef MS_WINDOWS
+    // wait for any writers still waiting for a group commit; the lock is not
+    // held by the caller so the final message is synced directly
+    if (state->lock) {
+        ACQUIRE_LOCK(*state->lock);
+        while (state->durableWriters > 0) {
+            state->freeWaiting = 1;
+            RELEASE_LOCK(*state->lock);
+            while (sem_wait(&state->writersDone) < 0 && errno == EINTR);
+            ACQUIRE_LOCK(*state->lock);
+        }
+        RELEASE_LOCK(*state->lock);
+        state->lock = NULL;
+    }
+    if (state->sharedMemory)
+        LoggingState_DetachSharedMemory(state);
+#endif
+    while (state->sinks) {
+        sink = state->sinks;
+        state->sinks = sink->next;
+        FreeLoggingSink(sink);
+    }
+    if (state->fp) {
+        if (state->repeatCount > 0)
+            WriteRepeatNotice(state);
+        if (state->fileOwned) {
+            WriteMessage(state, LOG_LEVEL_NONE, "ending logging");
+            fclose(state->fp);
+        }
+    }
+#ifndef MS_WINDOWS
+    if (state->lockFileDescriptor >= 0)
+        close(state->lockFileDescriptor);
+#endif
+    if (state->baseFileName)
+        free(state->baseFileName);
+    if (state->fileName)
+        free(state->fileName);
+    if (state->fileNameMask)
+        free(state->fileNameMask);
+    if (state->prefix)
+        free(state->prefix);
+    if (state->prefixBuffer)
+        free(state->prefixBuffer);
+    if (state->messageBuffer)
+        free(state->messageBuffer);
+    if (state->sinkText)
+        free(state->sinkText);
+    if (state->flightRecorder && state->flightRecorder != &gFlightRecorder)
+        free(state->flightRecorder);
+    if (state->options.routes)
+        free((void*) state->options.routes);
+#ifndef MS_WINDOWS
+    sem_destroy(&state->syncDone);
+    sem_destroy(&state->writersDone);
+#endif
+    free(state);
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_OnCreate()
+//   Called when the logging state is created and a file needs to be opened. It
+// opens the file and writes the initial log messages to it.
+//-----------------------------------------------------------------------------
+static int LoggingState_OnCreate(
+    LoggingState *state)                // logging state just created
+{
+    // messages sent to a collector process are not written to a file
+#ifndef MS_WINDOWS
+    if (state->options.sharedMemory)
+        return LoggingState_AttachSharedMemory(state);
+#endif
+
+    // open the file
+#ifndef UNDER_CE
+    if (state->rotateFiles && state->maxFiles > 1 &&
+            !state->options.multiProcess)
+        LoggingState_InitializeSeqNum(state);
+#endif
+    state->fileOwned = 1;
+    if (LoggingState_OpenFileForWriting(state) < 0)
+        return -1;
+#ifndef UNDER_CE
+    if (state->rotateFiles && state->maxFiles > 1 &&
+            !state->options.multiProcess)
+        LoggingState_WriteSeqFile(state);
+#endif
+
+    // put out an initial message regardless of level
+    if (WritePrefix(state, LOG_LEVEL_NONE) < 0)
+        return -1;
+    if (WriteString(state, "starting logging at level ") < 0)
+        return -1;
+    if (WriteLevel(state, state->level) < 0)
+        return -1;
+    if (WriteTrailer(state) < 0)
+        return -1;
+
+    // open the file
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_New()
+//   Create a new logging state.
+//-----------------------------------------------------------------------------
+static LoggingState* LoggingState_New(
+    FILE *fp,                           // file to associate
+    const char *fileName,               // name of file to open
+    unsigned long level,                // level to use
+    unsigned long maxFiles,             // maximum number of files
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix,                 // prefix to use
+    int reuseExistingFiles,             // reuse existing files?
+    int rotateFiles,                    // rotate files?
+    const LoggingOptions *options,      // optional behavior (or NULL)
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    LoggingState *state;
+
+    // initialize the logging state
+    state = (LoggingState*) malloc(sizeof(LoggingState));
+    if (!state) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for logging state.");
+        return NULL;
+    }
+    state->fp = fp;
+    state->fileOwned = 0;
+    state->lockFileDescriptor = -1;
+    state->level = level;
+    state->baseFileName = NULL;
+    state->fileName = NULL;
+    state->fileNameMask = NULL;
+    state->prefix = NULL;
+    state->prefixBuffer = NULL;
+    state->maxPrefixLength = 0;
+    state->reuseExistingFiles = reuseExistingFiles;
+    state->rotateFiles = rotateFiles;
+    state->bytesWritten = 0;
+    state->bytesWrittenAtOpen = 0;
+    state->sharedFileSize = 0;
+    state->sharedFilePosition = 0;
+    state->sharedFileWrites = 0;
+    memset(&state->counters, 0, sizeof(LoggingCounters));
+    if (options)
+        state->options = *options;
+    else InitializeLoggingOptions(&state->options);
+    state->options.routes = NULL;
+    state->options.numRoutes = 0;
+    state->lastMessageHash = 0;
+    state->lastMessageLevel = 0;
+    state->repeatCount = 0;
+    state->messageBuffer = NULL;
+    state->messageBufferSize = 0;
+    state->flightRecorder = NULL;
+    state->sharedMemory = NULL;
+    state->sharedMemorySize = 0;
+    state->sharedRing = NULL;
+    state->processId = 0;
+    state->rotateDeadline = 0;
+    state->lock = NULL;
+    state->lastSyncTime = GetTimeInNanoseconds();
+    state->writeTicket = 0;
+    state->syncedTicket = 0;
+    state->syncInProgress = 0;
+    state->syncWaiters = 0;
+    state->durableWriters = 0;
+    state->freeWaiting = 0;
+#ifndef MS_WINDOWS
+    sem_init(&state->syncDone, 0, 0);
+    sem_init(&state->writersDone, 0, 0);
+#endif
+    state->sinks = NULL;
+    memset(&state->sinkRecord, 0, sizeof(LoggingSinkRecord));
+    state->sinkText = NULL;
+    state->sinkTextSize = 0;
+    if (maxFiles == 0)
+        state->maxFiles = 1;
+    else state->maxFiles = maxFiles;
+#ifdef UNDER_CE
+    if (state->rotateFiles && state->maxFiles > 1) {
+        strcpy(exceptionInfo->message,
+                "Rotating log files not supported on Windows CE.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+#endif
+#ifdef MS_WINDOWS
+    if (state->options.emergencyFlush) {
+        strcpy(exceptionInfo->message,
+                "Emergency flush on fatal signals not supported on Windows.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+    if (state->options.multiProcess) {
+        strcpy(exceptionInfo->message,
+                "Logging from multiple processes not supported on Windows.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+    if (state->options.sharedMemory) {
+        strcpy(exceptionInfo->message,
+                "Logging to shared memory not supported on Windows.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+    if (state->options.directWrite) {
+        strcpy(exceptionInfo->message,
+                "Writing directly to files not supported on Windows.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+    if (state->options.durability == LOG_DURABILITY_GROUP_COMMIT) {
+        strcpy(exceptionInfo->message,
+                "Group commit durability not supported on Windows.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+#endif
+
+    // messages are written to files shared by multiple processes with a single
+    // call each, however long they are, so that they are never interleaved
+    if (state->options.multiProcess)
+        state->options.directWrite = 1;
+    if (state->options.rotateInterval > LOG_ROTATE_DAILY) {
+        sprintf(exceptionInfo->message, "Invalid rotation interval %lu.",
+                state->options.rotateInterval);
+        LoggingState_Free(state);
+        return NULL;
+    }
+    if (state->options.rotateInterval != LOG_ROTATE_NONE &&
+            (state->options.multiProcess || state->options.sharedMemory)) {
+        strcpy(exceptionInfo->message,
+                "Rotating files at intervals not supported with multiple "
+                "processes.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+    if (state->options.durability > LOG_DURABILITY_GROUP_COMMIT) {
+        sprintf(exceptionInfo->message, "Invalid durability policy %lu.",
+                state->options.durability);
+        LoggingState_Free(state);
+        return NULL;
+    }
+    if (maxFileSize == 0)
+        state->maxFileSize = DEFAULT_MAX_FILE_SIZE;
+    else state->maxFileSize = maxFileSize;
+
+    // retain the file name as specified
+    state->baseFileName = malloc(strlen(fileName) + 1);
+    if (!state->baseFileName) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for base file name.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+    strcpy(state->baseFileName, fileName);
+
+    // allocate space for a file name mask
+    state->fileNameMask = malloc(strlen(fileName) + 23 + MAX_STAMP_LENGTH);
+    if (!state->fileNameMask) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for file name mask.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+
+    // build the file name mask
+    // if max files = 1 then use the file name exactly as is
+    LoggingState_SetFileNameMask(state, time(NULL));
+
+    // allocate space for the file name
+    state->fileName = malloc(strlen(fileName) + 23 + MAX_STAMP_LENGTH);
+    if (!state->fileName) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for file name.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+    if (state->options.rotateInterval != LOG_ROTATE_NONE) {
+        state->seqNum = 1;
+        sprintf(state->fileName, state->fileNameMask, state->seqNum);
+    } else strcpy(state->fileName, fileName);
+
+    // copy the prefix
+    state->prefix = malloc(strlen(prefix) + 1);
+    if (!state->prefix) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for prefix.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+    strcpy(state->prefix, prefix);
+
+    // allocate space for the formatted prefix; each directive expands to at
+    // most MAX_DIRECTIVE_LENGTH characters and a separator is added
+    state->maxPrefixLength = strlen(prefix) * MAX_DIRECTIVE_LENGTH / 2 + 2;
+    state->prefixBuffer = malloc(state->maxPrefixLength);
+    if (!state->prefixBuffer) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for prefix buffer.");
+        LoggingState_Free(state);
+        return NULL;
+    }
+
+    // open the file, if necessary and write any initial messages
+    if (!state->fp && LoggingState_OnCreate(state) < 0) {
+        strcpy(exceptionInfo->message, state->exceptionInfo.message);
+        LoggingState_Free(state);
+        return NULL;
+    }
+
+    return state;
+}
+
+
+//-----------------------------------------------------------------------------
+// CreateLoggingSink()
+//   Create a sink of the given type. The context is retained by the sink and
+// is passed to the operations of its type; if the sink cannot be created, the
+// context remains the responsibility of the caller.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(LoggingSink*) CreateLoggingSink(
+    const LoggingSinkType *type,        // type of sink
+    void *context,                      // context for the type of sink
+    unsigned long level,                // level at which to write records
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    LoggingSink *sink;
+
+    if (!type || !type->writeBatch) {
+        strcpy(exceptionInfo->message, "Sink type must support writing.");
+        return NULL;
+    }
+    sink = (LoggingSink*) malloc(sizeof(LoggingSink));
+    if (!sink) {
+        strcpy(exceptionInfo->message, "Failed to allocate memory for sink.");
+        return NULL;
+    }
+    sink->type = type;
+    sink->context = context;
+    sink->level = level;
+    sink->maxLevel = (unsigned long) -1;
+    sink->errors = 0;
+    sink->asynchronous = 0;
+    sink->next = NULL;
+    sink->exceptionInfo.message[0] = '\0';
+    return sink;
+}
+
+
+//-----------------------------------------------------------------------------
+// FileSink_WriteBatch()
+//   Write the records to the file managed by the sink.
+//-----------------------------------------------------------------------------
+static int FileSink_WriteBatch(
+    LoggingSink *sink,                  // sink to write to
+    const LoggingSinkRecord *records,   // records to write
+    size_t numRecords)                  // number of records to write
+{
+    LoggingState *state = (LoggingState*) sink->context;
+    int levelIndex;
+    size_t i;
+
+    if (!state->fp)
+        return 0;
+    for (i = 0; i < numRecords; i++) {
+        if (WriteText(state, records[i].text, records[i].textLength) < 0) {
+            strcpy(sink->exceptionInfo.message, state->exceptionInfo.message);
+            state->counters.errors++;
+            return -1;
+        }
+        levelIndex = GetLevelIndex(records[i].level);
+        state->counters.messages[levelIndex]++;
+        state->counters.bytes[levelIndex] += records[i].textLength;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// FileSink_Flush()
+//   Flush the file managed by the sink.
+//-----------------------------------------------------------------------------
+static int FileSink_Flush(
+    LoggingSink *sink)                  // sink to flush
+{
+    LoggingState *state = (LoggingState*) sink->context;
+
+    if (state->fp && FlushFile(state) < 0) {
+        strcpy(sink->exceptionInfo.message, state->exceptionInfo.message);
+        return -1;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// FileSink_Rotate()
+//   Switch to the next file managed by the sink, if the current one is full.
+//-----------------------------------------------------------------------------
+static int FileSink_Rotate(
+    LoggingSink *sink)                  // sink to rotate
+{
+#ifndef UNDER_CE
+    LoggingState *state = (LoggingState*) sink->context;
+
+    if (CheckForLogFileFull(state) < 0) {
+        strcpy(sink->exceptionInfo.message, state->exceptionInfo.message);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// FileSink_Close()
+//   Close the file managed by the sink.
+//-----------------------------------------------------------------------------
+static void FileSink_Close(
+    LoggingSink *sink)                  // sink to close
+{
+    LoggingState_Free((LoggingState*) sink->context);
+}
+
+
+// define type for sinks which write to files
+static const LoggingSinkType gFileSinkType = {
+    "file",
+    FileSink_WriteBatch,
+    FileSink_Flush,
+    FileSink_Rotate,
+    FileSink_Close
+};
+
+
+//-----------------------------------------------------------------------------
+// CreateFileSink()
+//   Create a sink which writes to a file with its own rotation; the prefix is
+// only used for the messages written when the file is opened and closed since
+// the records written to it are formatted with the prefix of the logging state
+// to which it is added.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(LoggingSink*) CreateFileSink(
+    const char *fileName,               // name of file to write to
+    unsigned long level,                // level at which to write records
+    unsigned long maxFiles,             // maximum number of files
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix,                 // prefix to use
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    LoggingState *state;
+    LoggingSink *sink;
+
+    state = LoggingState_New(NULL, fileName, level, maxFiles, maxFileSize,
+            prefix, 1, 1, NULL, exceptionInfo);
+    if (!state)
+        return NULL;
+    sink = CreateLoggingSink(&gFileSinkType, state, level, exceptionInfo);
+    if (!sink)
+        LoggingState_Free(state);
+    return sink;
+}
+
+
+//-----------------------------------------------------------------------------
+// StreamSink_WriteBatch()
+//   Write the records to the stream managed by the sink.
+//-----------------------------------------------------------------------------
+static int StreamSink_WriteBatch(
+    LoggingSink *sink,                  // sink to write to
+    const LoggingSinkRecord *records,   // records to write
+    size_t numRecords)                  // number of records to write
+{
+    FILE *fp = (FILE*) sink->context;
+    size_t i;
+
+    for (i = 0; i < numRecords; i++) {
+        if (fwrite(records[i].text, 1, records[i].textLength, fp) !=
+                records[i].textLength) {
+            sprintf(sink->exceptionInfo.message,
+                    "Failed to write to stream: OS error %d.", errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// StreamSink_Flush()
+//   Flush the stream managed by the sink.
+//-----------------------------------------------------------------------------
+static int StreamSink_Flush(
+    LoggingSink *sink)                  // sink to flush
+{
+    if (fflush((FILE*) sink->context) == EOF) {
+        sprintf(sink->exceptionInfo.message,
+                "Cannot flush stream: OS error %d.", errno);
+        return -1;
+    }
+    return 0;
+}
+
+
+// define type for sinks which write to stderr or stdout
+static const LoggingSinkType gStreamSinkType = {
+    "stream",
+    StreamSink_WriteBatch,
+    StreamSink_Flush,
+    NULL,
+    NULL
+};
+
+
+//-----------------------------------------------------------------------------
+// CreateStderrSink()
+//   Create a sink which writes to stderr.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(LoggingSink*) CreateStderrSink(
+    unsigned long level,                // level at which to write records
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    return CreateLoggingSink(&gStreamSinkType, stderr, level, exceptionInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// CreateStdoutSink()
+//   Create a sink which writes to stdout.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(LoggingSink*) CreateStdoutSink(
+    unsigned long level,                // level at which to write records
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    return CreateLoggingSink(&gStreamSinkType, stdout, level, exceptionInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// CallbackSink_WriteBatch()
+//   Call the function supplied by the caller for each of the records.
+//-----------------------------------------------------------------------------
+static int CallbackSink_WriteBatch(
+    LoggingSink *sink,                  // sink to write to
+    const LoggingSinkRecord *records,   // records to write
+    size_t numRecords)                  // number of records to write
+{
+    CallbackSink *callbackSink = (CallbackSink*) sink->context;
+    size_t i;
+
+    for (i = 0; i < numRecords; i++) {
+        if (callbackSink->callback(callbackSink->context, &records[i]) < 0) {
+            strcpy(sink->exceptionInfo.message, "Sink callback failed.");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// CallbackSink_Close()
+//   Free the memory associated with the callback sink.
+//-----------------------------------------------------------------------------
+static void CallbackSink_Close(
+    LoggingSink *sink)                  // sink to close
+{
+    free(sink->context);
+}
+
+
+// define type for sinks which call a function for each record
+static const LoggingSinkType gCallbackSinkType = {
+    "callback",
+    CallbackSink_WriteBatch,
+    NULL,
+    NULL,
+    CallbackSink_Close
+};
+
+
+//-----------------------------------------------------------------------------
+// CreateCallbackSink()
+//   Create a sink which calls the given function for each record. The function
+// is called while the lock of the logging state is held so it must not log
+// messages itself.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(LoggingSink*) CreateCallbackSink(
+    LoggingSinkCallback callback,       // function to call for each record
+    void *context,                      // context passed to function
+    unsigned long level,                // level at which to write records
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    CallbackSink *callbackSink;
+    LoggingSink *sink;
+
+    callbackSink = (CallbackSink*) malloc(sizeof(CallbackSink));
+    if (!callbackSink) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for callback sink.");
+        return NULL;
+    }
+    callbackSink->callback = callback;
+    callbackSink->context = context;
+    sink = CreateLoggingSink(&gCallbackSinkType, callbackSink, level,
+            exceptionInfo);
+    if (!sink)
+        free(callbackSink);
+    return sink;
+}
+
+
+#ifndef MS_WINDOWS
+//-----------------------------------------------------------------------------
+// GetSyslogSeverity()
+//   Return the syslog severity corresponding to the level.
+//-----------------------------------------------------------------------------
+static int GetSyslogSeverity(
+    unsigned long level)                // level to convert
+{
+    if (level >= LOG_LEVEL_NONE)
+        return 5;
+    if (level >= LOG_LEVEL_CRITICAL)
+        return 2;
+    if (level >= LOG_LEVEL_ERROR)
+        return 3;
+    if (level >= LOG_LEVEL_WARNING)
+        return 4;
+    if (level >= LOG_LEVEL_INFO)
+        return 6;
+    return 7;
+}
+
+
+//-----------------------------------------------------------------------------
+// SyslogSink_Connect()
+//   Connect to the socket on which the syslog daemon is listening, closing the
+// existing connection, if any. Sends which wait for the daemon give up after
+// a short time so that a daemon which has stopped reading cannot stop the
+// writer thread indefinitely.
+//-----------------------------------------------------------------------------
+static int SyslogSink_Connect(
+    LoggingSink *sink)                  // sink to connect
+{
+    SyslogSink *syslogSink = (SyslogSink*) sink->context;
+    struct sockaddr_un address;
+    struct timeval timeout;
+
+    if (syslogSink->fd >= 0) {
+        close(syslogSink->fd);
+        syslogSink->fd = -1;
+    }
+    syslogSink->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (syslogSink->fd < 0) {
+        sprintf(sink->exceptionInfo.message,
+                "Cannot create socket for %s: OS error %d.",
+                syslogSink->address, errno);
+        return -1;
+    }
+    fcntl(syslogSink->fd, F_SETFD, FD_CLOEXEC);
+    timeout.tv_sec = SYSLOG_SEND_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(syslogSink->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+            sizeof(timeout));
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, syslogSink->address);
+    if (connect(syslogSink->fd, (struct sockaddr*) &address,
+            sizeof(address)) < 0) {
+        sprintf(sink->exceptionInfo.message,
+                "Cannot connect to %s: OS error %d.", syslogSink->address,
+                errno);
+        close(syslogSink->fd);
+        syslogSink->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// SyslogSink_Reserve()
+//   Ensure that the headers, vectors and messages of the sink have room for
+// the given number of records.
+//-----------------------------------------------------------------------------
+static int SyslogSink_Reserve(
+    LoggingSink *sink,                  // sink to reserve space in
+    size_t numRecords)                  // number of records to send
+{
+    SyslogSink *syslogSink = (SyslogSink*) sink->context;
+    SyslogMessage *messages;
+    struct iovec *vectors;
+    char *headers;
+
+    if (numRecords <= syslogSink->capacity)
+        return 0;
+    headers = realloc(syslogSink->headers, numRecords * SYSLOG_HEADER_SIZE);
+    if (headers)
+        syslogSink->headers = headers;
+    vectors = realloc(syslogSink->vectors,
+            numRecords * 3 * sizeof(struct iovec));
+    if (vectors)
+        syslogSink->vectors = vectors;
+    messages = realloc(syslogSink->messages,
+            numRecords * sizeof(SyslogMessage));
+    if (messages)
+        syslogSink->messages = messages;
+    if (!headers || !vectors || !messages) {
+        strcpy(sink->exceptionInfo.message,
+                "Failed to allocate memory for syslog records.");
+        return -1;
+    }
+    syslogSink->capacity = numRecords;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// SyslogSink_FormatHeader()
+//   Format the header which precedes the message in the datagram sent for the
+// record and return its length. The trailer which follows the message is
+// also determined. For journald, the message is sent as a binary field, with
+// its length preceding it, so that it may contain line feeds.
+//-----------------------------------------------------------------------------
+static size_t SyslogSink_FormatHeader(
+    SyslogSink *syslogSink,             // sink for which to format
+    const LoggingSinkRecord *record,    // record to format header for
+    char *header,                       // buffer to format header into
+    size_t *trailerLength)              // length of trailer (output)
+{
+    unsigned long long length;
+    unsigned long priority;
+    struct tm time;
+    time_t seconds;
+    char *out;
+    int i;
+
+    priority = syslogSink->facility * 8 + GetSyslogSeverity(record->level);
+    *trailerLength = 0;
+    switch (syslogSink->format) {
+        case LOG_SYSLOG_FORMAT_RFC5424:
+            seconds = (time_t) (record->timestamp / 1000000ULL);
+            gmtime_r(&seconds, &time);
+            return (size_t) sprintf(header, "<%lu>1 %.4d-%.2d-%.2dT"
+                    "%.2d:%.2d:%.2d.%.6luZ %s %s %ld - - ", priority,
+                    time.tm_year + 1900, time.tm_mon + 1, time.tm_mday,
+                    time.tm_hour, time.tm_min, time.tm_sec,
+                    (unsigned long) (record->timestamp % 1000000ULL),
+                    syslogSink->hostName, syslogSink->ident,
+                    (long) getpid());
+        case LOG_SYSLOG_FORMAT_JOURNALD:
+            out = header + sprintf(header, "PRIORITY=%d\n"
+                    "SYSLOG_FACILITY=%lu\nSYSLOG_IDENTIFIER=%s\n"
+                    "SYSLOG_PID=%ld\nMESSAGE\n",
+                    GetSyslogSeverity(record->level), syslogSink->facility,
+                    syslogSink->ident, (long) getpid());
+            length = record->messageLength;
+            for (i = 0; i < 8; i++, length >>= 8)
+                *out++ = (char) (length & 0xff);
+            *trailerLength = 1;
+            return (size_t) (out - header);
+    }
+    return (size_t) sprintf(header, "<%lu>%s[%ld]: ", priority,
+            syslogSink->ident, (long) getpid());
+}
+
+
+//-----------------------------------------------------------------------------
+// SyslogSink_WriteBatch()
+//   Send each of the records to the syslog daemon as a separate datagram,
+// using a single call to sendmmsg() for the batch where it is available. The
+// header and trailer are sent from separate vectors so that the message is
+// not copied. If the daemon has been restarted, the sink reconnects and sends
+// the remaining records again. Unless the sink is written to by a writer
+// thread, records are never waited for; if the daemon is not keeping up, they
+// are dropped and the failure is reported instead.
+//-----------------------------------------------------------------------------
+static int SyslogSink_WriteBatch(
+    LoggingSink *sink,                  // sink to write to
+    const LoggingSinkRecord *records,   // records to write
+    size_t numRecords)                  // number of records to write
+{
+    SyslogSink *syslogSink = (SyslogSink*) sink->context;
+    size_t i, numSent, trailerLength;
+    int flags, numDropped, reconnected;
+    struct iovec *vectors;
+    struct msghdr *header;
+    char *headerText;
+    int result;
+
+    // prepare a message for each record
+    if (SyslogSink_Reserve(sink, numRecords) < 0)
+        return -1;
+    for (i = 0; i < numRecords; i++) {
+        headerText = syslogSink->headers + i * SYSLOG_HEADER_SIZE;
+        vectors = syslogSink->vectors + i * 3;
+        vectors[0].iov_base = headerText;
+        vectors[0].iov_len = SyslogSink_FormatHeader(syslogSink, &records[i],
+                headerText, &trailerLength);
+        vectors[1].iov_base = (char*) records[i].message;
+        vectors[1].iov_len = records[i].messageLength;
+        vectors[2].iov_base = "\n";
+        vectors[2].iov_len = trailerLength;
+        header = &syslogSink->messages[i].msg_hdr;
+        memset(header, 0, sizeof(struct msghdr));
+        header->msg_iov = vectors;
+        header->msg_iovlen = (trailerLength > 0) ? 3 : 2;
+    }
+
+    // send the messages; a message that is too large is dropped on its own
+    flags = (sink->asynchronous) ? 0 : MSG_DONTWAIT;
+    numSent = numDropped = reconnected = 0;
+    while (numSent < numRecords) {
+        result = -1;
+        errno = ENOTCONN;
+        if (syslogSink->fd >= 0) {
+#ifdef __linux__
+            result = sendmmsg(syslogSink->fd, syslogSink->messages + numSent,
+                    (unsigned int) (numRecords - numSent), flags);
+#else
+            if (sendmsg(syslogSink->fd, &syslogSink->messages[numSent].msg_hdr,
+                    flags) >= 0)
+                result = 1;
+#endif
+        }
+        if (result > 0) {
+            numSent += result;
+            continue;
+        }
+        if (errno == EMSGSIZE) {
+            numSent++;
+            numDropped++;
+            continue;
+        }
+        if (!reconnected && (errno == ECONNREFUSED || errno == ENOTCONN)) {
+            reconnected = 1;
+            if (SyslogSink_Connect(sink) < 0)
+                return -1;
+            continue;
+        }
+        sprintf(sink->exceptionInfo.message,
+                "Cannot send to %s: OS error %d.", syslogSink->address, errno);
+        return -1;
+    }
+    if (numDropped > 0) {
+        sprintf(sink->exceptionInfo.message,
+                "%d records too large to send to %s.", numDropped,
+                syslogSink->address);
+        return -1;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// SyslogSink_Close()
+//   Close the connection to the syslog daemon.
+//-----------------------------------------------------------------------------
+static void SyslogSink_Close(
+    LoggingSink *sink)                  // sink to close
+{
+    SyslogSink *syslogSink = (SyslogSink*) sink->context;
+
+    if (syslogSink->fd >= 0)
+        close(syslogSink->fd);
+    if (syslogSink->headers)
+        free(syslogSink->headers);
+    if (syslogSink->vectors)
+        free(syslogSink->vectors);
+    if (syslogSink->messages)
+        free(syslogSink->messages);
+    free(syslogSink);
+}
+
+
+// define type for sinks which send records to the syslog daemon
+static const LoggingSinkType gSyslogSinkType = {
+    "syslog",
+    SyslogSink_WriteBatch,
+    NULL,
+    NULL,
+    SyslogSink_Close
+};
+
+
+//-----------------------------------------------------------------------------
+// CreateSyslogSink()
+//   Create a sink which sends records in the given format to the syslog
+// daemon (or journald) listening on the given Unix domain socket; if no
+// socket is given, /dev/log is used (or the native socket of journald). Each
+// record is tagged with the identifier (or cx_Logging if NULL, truncated if
+// needed) and the facility.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(LoggingSink*) CreateSyslogSink(
+    const char *address,                // path of socket (or NULL)
+    const char *ident,                  // identifier for records (or NULL)
+    unsigned long facility,             // facility for records
+    unsigned long format,               // format of records
+    unsigned long level,                // level at which to write records
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    SyslogSink *syslogSink;
+    LoggingSink *sink;
+
+    if (format > LOG_SYSLOG_FORMAT_JOURNALD) {
+        sprintf(exceptionInfo->message, "Invalid syslog format %lu.", format);
+        return NULL;
+    }
+    if (!address)
+        address = (format == LOG_SYSLOG_FORMAT_JOURNALD) ?
+                JOURNALD_ADDRESS : SYSLOG_ADDRESS;
+    if (strlen(address) >= sizeof(syslogSink->address)) {
+        sprintf(exceptionInfo->message, "Socket path %.100s is too long.",
+                address);
+        return NULL;
+    }
+    if (facility > 23) {
+        sprintf(exceptionInfo->message, "Invalid syslog facility %lu.",
+                facility);
+        return NULL;
+    }
+    syslogSink = (SyslogSink*) malloc(sizeof(SyslogSink));
+    if (!syslogSink) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for syslog sink.");
+        return NULL;
+    }
+    syslogSink->fd = -1;
+    syslogSink->facility = facility;
+    syslogSink->format = format;
+    strcpy(syslogSink->address, address);
+    syslogSink->ident[0] = '\0';
+    strncat(syslogSink->ident, (ident) ? ident : "cx_Logging",
+            MAX_SYSLOG_IDENT_LENGTH);
+    if (gethostname(syslogSink->hostName, sizeof(syslogSink->hostName)) < 0
+            || !syslogSink->hostName[0])
+        strcpy(syslogSink->hostName, "-");
+    syslogSink->hostName[sizeof(syslogSink->hostName) - 1] = '\0';
+    syslogSink->headers = NULL;
+    syslogSink->vectors = NULL;
+    syslogSink->messages = NULL;
+    syslogSink->capacity = 0;
+    sink = CreateLoggingSink(&gSyslogSinkType, syslogSink, level,
+            exceptionInfo);
+    if (!sink) {
+        free(syslogSink);
+        return NULL;
+    }
+    if (SyslogSink_Connect(sink) < 0) {
+        strcpy(exceptionInfo->message, sink->exceptionInfo.message);
+        FreeLoggingSink(sink);
+        return NULL;
+    }
+    return sink;
+}
+
+
+//-----------------------------------------------------------------------------
+// AsyncSink_Push()
+//   Place the record in the queue of the sink. The record is placed after the
+// end of the ring, if there is not room for all of it before the end, so that
+// it is contiguous and can be passed to the target sink without being copied
+// again. If there is no room in the queue, the record is dropped.
+//-----------------------------------------------------------------------------
+static int AsyncSink_Push(
+    AsyncSink *asyncSink,               // sink to place record in
+    const LoggingSinkRecord *record)    // record to place in queue
+{
+    unsigned long long entrySize, offset, padding;
+    AsyncRecord *entry;
+    char *data;
+
+    entrySize = (sizeof(AsyncRecord) + record->messageLength +
+            record->textLength + 2 + 7) & ~7ULL;
+    offset = asyncSink->head % asyncSink->ringSize;
+    padding = 0;
+    if (asyncSink->ringSize - offset < entrySize)
+        padding = asyncSink->ringSize - offset;
+    if (asyncSink->ringSize - (asyncSink->head - asyncSink->tail) <
+            entrySize + padding)
+        return -1;
+    if (padding > 0) {
+        if (padding >= sizeof(AsyncRecord)) {
+            entry = (AsyncRecord*) (asyncSink->ring + offset);
+            entry->messageLength = ASYNC_PADDING;
+        }
+        asyncSink->head += padding;
+        offset = 0;
+    }
+    entry = (AsyncRecord*) (asyncSink->ring + offset);
+    entry->timestamp = record->timestamp;
+    entry->threadId = record->threadId;
+    entry->level = record->level;
+    entry->messageLength = (unsigned int) record->messageLength;
+    entry->textLength = (unsigned int) record->textLength;
+    data = (char*) (entry + 1);
+    memcpy(data, record->message, record->messageLength);
+    data[record->messageLength] = '\0';
+    data += record->messageLength + 1;
+    memcpy(data, record->text, record->textLength);
+    data[record->textLength] = '\0';
+    asyncSink->head += entrySize;
+    asyncSink->numQueued++;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// AsyncSink_WriteBatch()
+//   Place the records in the queue of the sink and wake the writer thread if a
+// batch is ready. This is called by the thread logging the message so it
+// never waits for the target sink. Records which were dropped because the
+// queue was full or could not be written by the writer thread are reported.
+//-----------------------------------------------------------------------------
+static int AsyncSink_WriteBatch(
+    LoggingSink *sink,                  // sink to write to
+    const LoggingSinkRecord *records,   // records to write
+    size_t numRecords)                  // number of records to write
+{
+    AsyncSink *asyncSink = (AsyncSink*) sink->context;
+    unsigned long numDropped = 0, numFailed;
+    size_t i;
+
+    if (asyncSink->forkGeneration != gForkGeneration) {
+        strcpy(sink->exceptionInfo.message,
+                "Writer thread of sink not available after fork.");
+        return -1;
+    }
+    pthread_mutex_lock(&asyncSink->mutex);
+    for (i = 0; i < numRecords; i++) {
+        if (AsyncSink_Push(asyncSink, &records[i]) < 0)
+            numDropped++;
+    }
+    if (asyncSink->writerWaiting && (asyncSink->intervalMs == 0 ||
+            asyncSink->numQueued >= asyncSink->batchSize))
+        pthread_cond_signal(&asyncSink->wakeup);
+    numFailed = asyncSink->numFailed;
+    if (numFailed > 0) {
+        sprintf(sink->exceptionInfo.message,
+                "%lu records not written to sink: %.200s", numFailed,
+                asyncSink->failure.message);
+        asyncSink->numFailed = 0;
+    }
+    pthread_mutex_unlock(&asyncSink->mutex);
+    if (numDropped > 0) {
+        sprintf(sink->exceptionInfo.message,
+                "Queue of sink full: %lu records dropped.", numDropped);
+        return -1;
+    }
+    return (numFailed > 0) ? -1 : 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// AsyncSink_WriteQueued()
+//   Write the records in the queue between the given positions to the target
+// sink in batches, advancing the tail of the queue after each batch so that
+// room is made for more records. The lock for the queue is not held.
+//-----------------------------------------------------------------------------
+static void AsyncSink_WriteQueued(
+    AsyncSink *asyncSink,               // sink whose records to write
+    unsigned long long position,        // position of first record
+    unsigned long long head)            // position after last record
+{
+    unsigned long long offset;
+    size_t numRecords;
+    AsyncRecord *entry;
+    int failed;
+    char *data;
+
+    while (position < head) {
+        numRecords = 0;
+        while (position < head && numRecords < asyncSink->batchSize) {
+            offset = position % asyncSink->ringSize;
+            entry = (AsyncRecord*) (asyncSink->ring + offset);
+            if (asyncSink->ringSize - offset < sizeof(AsyncRecord) ||
+                    entry->messageLength == ASYNC_PADDING) {
+                position += asyncSink->ringSize - offset;
+                continue;
+            }
+            data = (char*) (entry + 1);
+            asyncSink->batch[numRecords].timestamp = entry->timestamp;
+            asyncSink->batch[numRecords].threadId = entry->threadId;
+            asyncSink->batch[numRecords].level = (unsigned long) entry->level;
+            asyncSink->batch[numRecords].message = data;
+            asyncSink->batch[numRecords].messageLength = entry->messageLength;
+            asyncSink->batch[numRecords].text =
+                    data + entry->messageLength + 1;
+            asyncSink->batch[numRecords].textLength = entry->textLength;
+            numRecords++;
+            position += (sizeof(AsyncRecord) + entry->messageLength +
+                    entry->textLength + 2 + 7) & ~7ULL;
+        }
+        failed = (numRecords > 0 && LoggingSink_Write(asyncSink->target,
+                asyncSink->batch, numRecords) < 0);
+        pthread_mutex_lock(&asyncSink->mutex);
+        asyncSink->tail = position;
+        asyncSink->numQueued -= (unsigned long) numRecords;
+        if (failed) {
+            asyncSink->target->errors++;
+            asyncSink->numFailed += (unsigned long) numRecords;
+            strcpy(asyncSink->failure.message,
+                    asyncSink->target->exceptionInfo.message);
+        }
+        pthread_mutex_unlock(&asyncSink->mutex);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// AsyncSink_Run()
+//   Run the writer thread of the sink, which waits until a batch of records is
+// ready (or the interval has elapsed with records in the queue) and writes
+// them to the target sink. When the sink is stopped, the records that remain
+// in the queue are written before the thread ends.
+//-----------------------------------------------------------------------------
+static void *AsyncSink_Run(
+    void *arg)                          // sink to run writer thread for
+{
+    AsyncSink *asyncSink = (AsyncSink*) arg;
+    unsigned long long position, head;
+    struct timespec deadline;
+    unsigned long threshold;
+
+    threshold = (asyncSink->intervalMs > 0) ? asyncSink->batchSize : 1;
+    pthread_mutex_lock(&asyncSink->mutex);
+    while (1) {
+        if (asyncSink->intervalMs > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += asyncSink->intervalMs / 1000;
+            deadline.tv_nsec += (asyncSink->intervalMs % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+        }
+        while (!asyncSink->stopping && asyncSink->numQueued < threshold) {
+            asyncSink->writerWaiting = 1;
+            if (asyncSink->intervalMs == 0)
+                pthread_cond_wait(&asyncSink->wakeup, &asyncSink->mutex);
+            else if (pthread_cond_timedwait(&asyncSink->wakeup,
+                    &asyncSink->mutex, &deadline) == ETIMEDOUT) {
+                asyncSink->writerWaiting = 0;
+                break;
+            }
+            asyncSink->writerWaiting = 0;
+        }
+        if (asyncSink->numQueued == 0) {
+            if (asyncSink->stopping)
+                break;
+            continue;
+        }
+        position = asyncSink->tail;
+        head = asyncSink->head;
+        pthread_mutex_unlock(&asyncSink->mutex);
+        AsyncSink_WriteQueued(asyncSink, position, head);
+        pthread_mutex_lock(&asyncSink->mutex);
+    }
+    pthread_mutex_unlock(&asyncSink->mutex);
+    return NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// AsyncSink_Stop()
+//   Stop the writer thread once it has written the records remaining in the
+// queue.
+//-----------------------------------------------------------------------------
+static void AsyncSink_Stop(
+    AsyncSink *asyncSink)               // sink to stop
+{
+    pthread_mutex_lock(&asyncSink->mutex);
+    asyncSink->stopping = 1;
+    pthread_cond_signal(&asyncSink->wakeup);
+    pthread_mutex_unlock(&asyncSink->mutex);
+    pthread_join(asyncSink->thread, NULL);
+    pthread_cond_destroy(&asyncSink->wakeup);
+    pthread_mutex_destroy(&asyncSink->mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+// AsyncSink_Free()
+//   Free the memory associated with the queue and the target sink.
+//-----------------------------------------------------------------------------
+static void AsyncSink_Free(
+    AsyncSink *asyncSink)               // sink to free
+{
+    if (asyncSink->target)
+        FreeLoggingSink(asyncSink->target);
+    if (asyncSink->ring)
+        free(asyncSink->ring);
+    if (asyncSink->batch)
+        free(asyncSink->batch);
+    free(asyncSink);
+}
+
+
+//-----------------------------------------------------------------------------
+// AsyncSink_Close()
+//   Stop the writer thread and close the target sink. If the writer thread
+// could not be started again in a child process after a fork, the records in
+// the queue are discarded.
+//-----------------------------------------------------------------------------
+static void AsyncSink_Close(
+    LoggingSink *sink)                  // sink to close
+{
+    AsyncSink *asyncSink = (AsyncSink*) sink->context;
+
+    if (asyncSink->forkGeneration == gForkGeneration)
+        AsyncSink_Stop(asyncSink);
+    AsyncSink_Free(asyncSink);
+}
+
+
+// define type for sinks which write to another sink on a writer thread
+static const LoggingSinkType gAsyncSinkType = {
+    "async",
+    AsyncSink_WriteBatch,
+    NULL,
+    NULL,
+    AsyncSink_Close
+};
+
+
+//-----------------------------------------------------------------------------
+// AsyncSink_Start()
+//   Start the writer thread of the sink with all signals blocked so that they
+// continue to be handled by the other threads of the process. The result of
+// creating the thread is returned.
+//-----------------------------------------------------------------------------
+static int AsyncSink_Start(
+    AsyncSink *asyncSink)               // sink to start writer thread for
+{
+    sigset_t allSignals, origSignals;
+    int result;
+
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &origSignals);
+    result = pthread_create(&asyncSink->thread, NULL, AsyncSink_Run,
+            asyncSink);
+    pthread_sigmask(SIG_SETMASK, &origSignals, NULL);
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// CreateAsyncSink()
+//   Create a sink which places records in a queue of the given size (in bytes)
+// from which a writer thread writes them to the target sink in batches of up
+// to the given size. If an interval (in milliseconds) is given, the writer
+// thread waits for a full batch or for the interval to elapse; otherwise,
+// it is woken as soon as a record is queued. Records are dropped if the queue
+// is full. The target sink is owned by the new sink and is freed if the new
+// sink cannot be created.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(LoggingSink*) CreateAsyncSink(
+    LoggingSink *target,                // sink to write to on writer thread
+    unsigned long queueSize,            // size of queue, in bytes
+    unsigned long batchSize,            // maximum records in each batch
+    unsigned long intervalMs,           // interval between batches (or 0)
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    AsyncSink *asyncSink;
+    LoggingSink *sink;
+    int result;
+
+    // create the queue
+    asyncSink = (AsyncSink*) calloc(1, sizeof(AsyncSink));
+    if (!asyncSink) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for asynchronous sink.");
+        FreeLoggingSink(target);
+        return NULL;
+    }
+    asyncSink->target = target;
+    asyncSink->ringSize = (queueSize > 0) ? queueSize : ASYNC_QUEUE_SIZE;
+    asyncSink->ringSize = (asyncSink->ringSize + 7) & ~7ULL;
+    asyncSink->batchSize = (batchSize > 0) ? batchSize : ASYNC_BATCH_SIZE;
+    asyncSink->intervalMs = intervalMs;
+    asyncSink->forkGeneration = gForkGeneration;
+    asyncSink->ring = malloc((size_t) asyncSink->ringSize);
+    asyncSink->batch = malloc(asyncSink->batchSize *
+            sizeof(LoggingSinkRecord));
+    if (!asyncSink->ring || !asyncSink->batch) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for sink queue.");
+        AsyncSink_Free(asyncSink);
+        return NULL;
+    }
+
+    // start the writer thread
+    target->asynchronous = 1;
+    pthread_mutex_init(&asyncSink->mutex, NULL);
+    pthread_cond_init(&asyncSink->wakeup, NULL);
+    result = AsyncSink_Start(asyncSink);
+    if (result != 0) {
+        sprintf(exceptionInfo->message,
+                "Cannot start writer thread for sink: OS error %d.", result);
+        pthread_cond_destroy(&asyncSink->wakeup);
+        pthread_mutex_destroy(&asyncSink->mutex);
+        AsyncSink_Free(asyncSink);
+        return NULL;
+    }
+
+    // create the sink which places records in the queue
+    sink = CreateLoggingSink(&gAsyncSinkType, asyncSink, target->level,
+            exceptionInfo);
+    if (!sink) {
+        AsyncSink_Stop(asyncSink);
+        AsyncSink_Free(asyncSink);
+        return NULL;
+    }
+    sink->maxLevel = target->maxLevel;
+    return sink;
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_GetFrameLength()
+//   Return the length of the frame at the start of the data or 0 if the data
+// does not begin with a complete frame. Frames are either lines terminated by
+// a line feed or text preceded by its length as a 32-bit big-endian integer.
+//-----------------------------------------------------------------------------
+static size_t NetworkSink_GetFrameLength(
+    NetworkSink *networkSink,           // sink whose framing to use
+    const char *data,                   // data to examine
+    size_t length)                      // length of data
+{
+    const unsigned char *header = (const unsigned char*) data;
+    unsigned long long frameLength;
+    const char *end;
+
+    if (networkSink->framing == LOG_FRAMING_LENGTH) {
+        if (length < 4)
+            return 0;
+        frameLength = 4 + (((unsigned long long) header[0] << 24) |
+                ((unsigned long long) header[1] << 16) |
+                ((unsigned long long) header[2] << 8) | header[3]);
+        return (frameLength <= length) ? (size_t) frameLength : 0;
+    }
+    end = memchr(data, '\n', length);
+    return (end) ? (size_t) (end - data) + 1 : 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_GetCompleteLength()
+//   Return the length of the complete frames at the start of the data.
+//-----------------------------------------------------------------------------
+static size_t NetworkSink_GetCompleteLength(
+    NetworkSink *networkSink,           // sink whose framing to use
+    const char *data,                   // data to examine
+    size_t length)                      // length of data
+{
+    size_t completeLength = 0, frameLength;
+
+    while (1) {
+        frameLength = NetworkSink_GetFrameLength(networkSink,
+                data + completeLength, length - completeLength);
+        if (frameLength == 0)
+            return completeLength;
+        completeLength += frameLength;
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_Disconnect()
+//   Close the connection to the collector, if any, and wait for the retry
+// interval before attempting to connect again.
+//-----------------------------------------------------------------------------
+static void NetworkSink_Disconnect(
+    NetworkSink *networkSink)           // sink to disconnect
+{
+    if (networkSink->fd >= 0) {
+        close(networkSink->fd);
+        networkSink->fd = -1;
+    }
+    networkSink->nextConnectTime = GetTimeInNanoseconds() +
+            NETWORK_RETRY_INTERVAL * 1000000ULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_Connect()
+//   Connect to the collector, trying each of the addresses to which its host
+// name resolves, unless the last attempt was made within the retry interval.
+// Sends (and, on most platforms, connecting) give up after a time so that a
+// collector which has stopped reading cannot stop the writer thread
+// indefinitely.
+//-----------------------------------------------------------------------------
+static int NetworkSink_Connect(
+    LoggingSink *sink)                  // sink to connect
+{
+    NetworkSink *networkSink = (NetworkSink*) sink->context;
+    struct addrinfo hints, *addresses, *address;
+    int result, fd, error = 0;
+    struct timeval timeout;
+#ifdef SO_NOSIGPIPE
+    int enable = 1;
+#endif
+
+    if (GetTimeInNanoseconds() < networkSink->nextConnectTime)
+        return -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = networkSink->socketType;
+    result = getaddrinfo(networkSink->host, networkSink->port, &hints,
+            &addresses);
+    if (result != 0) {
+        sprintf(sink->exceptionInfo.message, "Cannot resolve %s: %s.",
+                networkSink->host, gai_strerror(result));
+        NetworkSink_Disconnect(networkSink);
+        return -1;
+    }
+    timeout.tv_sec = NETWORK_SEND_TIMEOUT;
+    timeout.tv_usec = 0;
+    for (address = addresses; address; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype,
+                address->ai_protocol);
+        if (fd < 0) {
+            error = errno;
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+#endif
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+            networkSink->fd = fd;
+            break;
+        }
+        error = errno;
+        close(fd);
+    }
+    freeaddrinfo(addresses);
+    if (networkSink->fd < 0) {
+        sprintf(sink->exceptionInfo.message,
+                "Cannot connect to %s:%s: OS error %d.", networkSink->host,
+                networkSink->port, error);
+        NetworkSink_Disconnect(networkSink);
+        return -1;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_Send()
+//   Send the frames to the collector and return the length of those that were
+// sent completely. Over TCP, a frame which was only partly sent when the
+// connection failed is sent again in full on the next connection; over UDP,
+// each frame is sent as a separate datagram and one which is too large is
+// dropped. If sending fails, the connection is closed.
+//-----------------------------------------------------------------------------
+static size_t NetworkSink_Send(
+    LoggingSink *sink,                  // sink to send with
+    const char *data,                   // frames to send
+    size_t length)                      // length of frames
+{
+    NetworkSink *networkSink = (NetworkSink*) sink->context;
+    size_t numSent = 0, frameLength;
+    ssize_t result;
+
+    while (numSent < length) {
+        if (networkSink->socketType == SOCK_DGRAM) {
+            frameLength = NetworkSink_GetFrameLength(networkSink,
+                    data + numSent, length - numSent);
+            result = send(networkSink->fd, data + numSent, frameLength,
+                    MSG_NOSIGNAL);
+            if (result < 0 && errno == EMSGSIZE)
+                result = (ssize_t) frameLength;
+        } else result = send(networkSink->fd, data + numSent,
+                length - numSent, MSG_NOSIGNAL);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            sprintf(sink->exceptionInfo.message,
+                    "Cannot send to %s:%s: OS error %d.", networkSink->host,
+                    networkSink->port, errno);
+            NetworkSink_Disconnect(networkSink);
+            return NetworkSink_GetCompleteLength(networkSink, data, numSent);
+        }
+        numSent += (size_t) result;
+    }
+    return numSent;
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_Spill()
+//   Append the data to the spill file, if there is one and it has room. The
+// end of the spill file is only advanced once all of the data has been
+// written so that a failure cannot leave part of a frame in it.
+//-----------------------------------------------------------------------------
+static int NetworkSink_Spill(
+    LoggingSink *sink,                  // sink to spill frames for
+    const struct iovec *vectors,        // data to append
+    int numVectors)                     // number of vectors
+{
+    NetworkSink *networkSink = (NetworkSink*) sink->context;
+    unsigned long long position;
+    size_t offset;
+    ssize_t result;
+    int i;
+
+    if (networkSink->spillFd < 0)
+        return -1;
+    position = networkSink->spillEnd;
+    for (i = 0; i < numVectors; i++)
+        position += vectors[i].iov_len;
+    if (position - networkSink->spillStart > networkSink->maxSpillSize)
+        return -1;
+    position = networkSink->spillEnd;
+    for (i = 0; i < numVectors; i++) {
+        for (offset = 0; offset < vectors[i].iov_len; offset += result) {
+            result = pwrite(networkSink->spillFd,
+                    (char*) vectors[i].iov_base + offset,
+                    vectors[i].iov_len - offset, (off_t) (position + offset));
+            if (result < 0) {
+                if (errno == EINTR) {
+                    result = 0;
+                    continue;
+                }
+                sprintf(sink->exceptionInfo.message,
+                        "Cannot write to spill file %s: OS error %d.",
+                        networkSink->spillFileName, errno);
+                return -1;
+            }
+        }
+        position += vectors[i].iov_len;
+    }
+    networkSink->spillEnd = position;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_Queue()
+//   Frame the text of the record and place it in the buffer of frames waiting
+// to be sent. If there is no room in the buffer, the frames already in it are
+// moved to the spill file first and a frame larger than the buffer is
+// appended to the spill file directly. If there is no room in the spill file
+// either (or there is none), the record is dropped.
+//-----------------------------------------------------------------------------
+static int NetworkSink_Queue(
+    LoggingSink *sink,                  // sink to queue record for
+    const LoggingSinkRecord *record)    // record to queue
+{
+    NetworkSink *networkSink = (NetworkSink*) sink->context;
+    struct iovec vectors[2], bufferVector;
+    size_t frameLength, pendingLength;
+    unsigned char header[4];
+
+    // frame the record
+    vectors[0].iov_base = header;
+    vectors[0].iov_len = 0;
+    if (networkSink->framing == LOG_FRAMING_LENGTH) {
+        header[0] = (unsigned char) (record->textLength >> 24);
+        header[1] = (unsigned char) (record->textLength >> 16);
+        header[2] = (unsigned char) (record->textLength >> 8);
+        header[3] = (unsigned char) record->textLength;
+        vectors[0].iov_len = 4;
+    }
+    vectors[1].iov_base = (char*) record->text;
+    vectors[1].iov_len = record->textLength;
+    frameLength = vectors[0].iov_len + vectors[1].iov_len;
+
+    // make room in the buffer, moving its frames to the spill file if needed
+    if (frameLength > networkSink->bufferSize - networkSink->bufferEnd) {
+        pendingLength = networkSink->bufferEnd - networkSink->bufferStart;
+        memmove(networkSink->buffer,
+                networkSink->buffer + networkSink->bufferStart,
+                pendingLength);
+        networkSink->bufferStart = 0;
+        networkSink->bufferEnd = pendingLength;
+    }
+    if (frameLength > networkSink->bufferSize - networkSink->bufferEnd &&
+            networkSink->bufferEnd > 0) {
+        bufferVector.iov_base = networkSink->buffer;
+        bufferVector.iov_len = networkSink->bufferEnd;
+        if (NetworkSink_Spill(sink, &bufferVector, 1) < 0)
+            return -1;
+        networkSink->bufferEnd = 0;
+    }
+
+    // place the frame in the buffer or, if it is too large, the spill file
+    if (frameLength > networkSink->bufferSize)
+        return NetworkSink_Spill(sink, vectors, 2);
+    memcpy(networkSink->buffer + networkSink->bufferEnd, header,
+            vectors[0].iov_len);
+    memcpy(networkSink->buffer + networkSink->bufferEnd + vectors[0].iov_len,
+            record->text, record->textLength);
+    networkSink->bufferEnd += frameLength;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_ReplaySpill()
+//   Send the frames in the spill file to the collector, reading as many
+// complete frames as fit in the chunk at a time, and truncate the spill file
+// once they have all been sent. An incomplete frame at the end of the spill
+// file, left by a process which ended while writing it, is discarded.
+//-----------------------------------------------------------------------------
+static int NetworkSink_ReplaySpill(
+    LoggingSink *sink)                  // sink whose spill file to replay
+{
+    NetworkSink *networkSink = (NetworkSink*) sink->context;
+    size_t length, completeLength;
+    unsigned long long remaining;
+    ssize_t result;
+    char *chunk;
+
+    while (networkSink->spillStart < networkSink->spillEnd) {
+        remaining = networkSink->spillEnd - networkSink->spillStart;
+        length = (remaining < networkSink->chunkSize) ? (size_t) remaining :
+                networkSink->chunkSize;
+        result = pread(networkSink->spillFd, networkSink->chunk, length,
+                (off_t) networkSink->spillStart);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            sprintf(sink->exceptionInfo.message,
+                    "Cannot read spill file %s: OS error %d.",
+                    networkSink->spillFileName, errno);
+            networkSink->spillStart = networkSink->spillEnd;
+            return -1;
+        }
+        completeLength = NetworkSink_GetCompleteLength(networkSink,
+                networkSink->chunk, (size_t) result);
+        if (completeLength == 0) {
+            if ((size_t) result < length || length == remaining) {
+                networkSink->spillStart = networkSink->spillEnd;
+                break;
+            }
+            chunk = realloc(networkSink->chunk, networkSink->chunkSize * 2);
+            if (!chunk) {
+                strcpy(sink->exceptionInfo.message,
+                        "Failed to allocate memory for spilled frames.");
+                return -1;
+            }
+            networkSink->chunk = chunk;
+            networkSink->chunkSize *= 2;
+            continue;
+        }
+        networkSink->spillStart += NetworkSink_Send(sink, networkSink->chunk,
+                completeLength);
+        if (networkSink->fd < 0)
+            return 0;
+    }
+    if (networkSink->spillEnd > 0 && ftruncate(networkSink->spillFd, 0) < 0) {
+        sprintf(sink->exceptionInfo.message,
+                "Cannot truncate spill file %s: OS error %d.",
+                networkSink->spillFileName, errno);
+        return -1;
+    }
+    networkSink->spillStart = networkSink->spillEnd = 0;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_WriteBatch()
+//   Queue the records and send all of the frames waiting to be sent, starting
+// with those in the spill file, connecting to the collector first if needed.
+// While the collector cannot be reached, frames remain queued and another
+// attempt is made when records are next written; only records which could
+// not be queued are reported as failures.
+//-----------------------------------------------------------------------------
+static int NetworkSink_WriteBatch(
+    LoggingSink *sink,                  // sink to write to
+    const LoggingSinkRecord *records,   // records to write
+    size_t numRecords)                  // number of records to write
+{
+    NetworkSink *networkSink = (NetworkSink*) sink->context;
+    unsigned long numDropped = 0;
+    int result = 0;
+    size_t i;
+
+    for (i = 0; i < numRecords; i++) {
+        if (NetworkSink_Queue(sink, &records[i]) < 0)
+            numDropped++;
+    }
+    if (networkSink->fd >= 0 || NetworkSink_Connect(sink) == 0) {
+        result = NetworkSink_ReplaySpill(sink);
+        if (networkSink->fd >= 0 &&
+                networkSink->spillStart == networkSink->spillEnd) {
+            networkSink->bufferStart += NetworkSink_Send(sink,
+                    networkSink->buffer + networkSink->bufferStart,
+                    networkSink->bufferEnd - networkSink->bufferStart);
+            if (networkSink->bufferStart == networkSink->bufferEnd)
+                networkSink->bufferStart = networkSink->bufferEnd = 0;
+        }
+    }
+    if (numDropped > 0) {
+        sprintf(sink->exceptionInfo.message,
+                "No room to hold %lu records for %s:%s.", numDropped,
+                networkSink->host, networkSink->port);
+        return -1;
+    }
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_Free()
+//   Free the memory and close the files associated with the network sink.
+//-----------------------------------------------------------------------------
+static void NetworkSink_Free(
+    NetworkSink *networkSink)           // sink to free
+{
+    if (networkSink->fd >= 0)
+        close(networkSink->fd);
+    if (networkSink->spillFd >= 0)
+        close(networkSink->spillFd);
+    if (networkSink->spillFileName)
+        free(networkSink->spillFileName);
+    if (networkSink->buffer)
+        free(networkSink->buffer);
+    if (networkSink->chunk)
+        free(networkSink->chunk);
+    free(networkSink);
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_Close()
+//   Close the network sink. The frames that have not been sent are kept at the
+// start of the spill file, if there is one, so that they are replayed by the
+// next sink which uses it; if there are none, the spill file is removed.
+//-----------------------------------------------------------------------------
+static void NetworkSink_Close(
+    LoggingSink *sink)                  // sink to close
+{
+    NetworkSink *networkSink = (NetworkSink*) sink->context;
+    unsigned long long position = 0;
+    struct iovec bufferVector;
+    size_t length;
+    ssize_t result;
+
+    if (networkSink->spillFd >= 0) {
+        bufferVector.iov_base = networkSink->buffer + networkSink->bufferStart;
+        bufferVector.iov_len = networkSink->bufferEnd -
+                networkSink->bufferStart;
+        if (bufferVector.iov_len > 0)
+            NetworkSink_Spill(sink, &bufferVector, 1);
+        if (networkSink->spillStart > 0) {
+            while (networkSink->spillStart < networkSink->spillEnd) {
+                length = networkSink->chunkSize;
+                if (networkSink->spillEnd - networkSink->spillStart < length)
+                    length = (size_t) (networkSink->spillEnd -
+                            networkSink->spillStart);
+                result = pread(networkSink->spillFd, networkSink->chunk,
+                        length, (off_t) networkSink->spillStart);
+                if (result <= 0 || pwrite(networkSink->spillFd,
+                        networkSink->chunk, (size_t) result,
+                        (off_t) position) != result)
+                    break;
+                networkSink->spillStart += result;
+                position += result;
+            }
+            networkSink->spillEnd =
+                    (networkSink->spillStart == networkSink->spillEnd) ?
+                    position : 0;
+        }
+        if (networkSink->spillEnd == 0)
+            unlink(networkSink->spillFileName);
+        else if (ftruncate(networkSink->spillFd,
+                (off_t) networkSink->spillEnd) < 0)
+            networkSink->spillEnd = 0;
+    }
+    NetworkSink_Free(networkSink);
+}
+
+
+// define type for sinks which stream records to a collector
+static const LoggingSinkType gNetworkSinkType = {
+    "network",
+    NetworkSink_WriteBatch,
+    NULL,
+    NULL,
+    NetworkSink_Close
+};
+
+
+//-----------------------------------------------------------------------------
+// CreateNetworkSink()
+//   Create a sink which streams records, framed as given, to the collector at
+// the given address (host:port, with an IPv6 host in brackets) over TCP or
+// UDP. While the collector cannot be reached, up to the given number of bytes
+// of frames are held in memory; beyond that, they are appended to the spill
+// file, if one is given, up to the given maximum size. Frames left in the
+// spill file by an earlier sink are replayed first. Since sending waits for
+// the collector, the sink is meant to be written to by the writer thread of
+// an asynchronous sink.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(LoggingSink*) CreateNetworkSink(
+    const char *address,                // host:port of collector
+    unsigned long protocol,             // LOG_SINK_TCP or LOG_SINK_UDP
+    unsigned long framing,              // framing of records
+    unsigned long bufferSize,           // size of buffer, in bytes (or 0)
+    const char *spillFileName,          // name of spill file (or NULL)
+    unsigned long long maxSpillSize,    // maximum size of spill file (or 0)
+    unsigned long level,                // level at which to write records
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    const char *hostStart, *hostEnd, *portStart;
+    NetworkSink *networkSink;
+    LoggingSink *sink;
+    off_t spillSize;
+
+    // validate parameters
+    if (protocol != LOG_SINK_TCP && protocol != LOG_SINK_UDP) {
+        sprintf(exceptionInfo->message, "Invalid network protocol %lu.",
+                protocol);
+        return NULL;
+    }
+    if (framing > LOG_FRAMING_LENGTH) {
+        sprintf(exceptionInfo->message, "Invalid framing %lu.", framing);
+        return NULL;
+    }
+    hostStart = address;
+    hostEnd = portStart = (address) ? strrchr(address, ':') : NULL;
+    if (portStart && address[0] == '[') {
+        hostStart = address + 1;
+        hostEnd = strchr(address, ']');
+        if (hostEnd && hostEnd + 1 != portStart)
+            hostEnd = NULL;
+    }
+    if (!portStart || !hostEnd || hostEnd == hostStart || !portStart[1] ||
+            hostEnd - hostStart > MAX_NETWORK_HOST_LENGTH ||
+            strlen(portStart + 1) > MAX_NETWORK_PORT_LENGTH) {
+        sprintf(exceptionInfo->message,
+                "Invalid collector address %.200s (expecting host:port).",
+                (address) ? address : "(none)");
+        return NULL;
+    }
+
+    // create the sink
+    networkSink = (NetworkSink*) calloc(1, sizeof(NetworkSink));
+    if (!networkSink) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for network sink.");
+        return NULL;
+    }
+    networkSink->fd = networkSink->spillFd = -1;
+    networkSink->socketType =
+            (protocol == LOG_SINK_UDP) ? SOCK_DGRAM : SOCK_STREAM;
+    networkSink->framing = framing;
+    memcpy(networkSink->host, hostStart, hostEnd - hostStart);
+    strcpy(networkSink->port, portStart + 1);
+    networkSink->bufferSize = (bufferSize > 0) ? bufferSize :
+            NETWORK_BUFFER_SIZE;
+    networkSink->maxSpillSize = (maxSpillSize > 0) ? maxSpillSize :
+            NETWORK_MAX_SPILL_SIZE;
+    networkSink->chunkSize = NETWORK_CHUNK_SIZE;
+    networkSink->buffer = malloc(networkSink->bufferSize);
+    networkSink->chunk = malloc(networkSink->chunkSize);
+    if (spillFileName)
+        networkSink->spillFileName = strdup(spillFileName);
+    if (!networkSink->buffer || !networkSink->chunk ||
+            (spillFileName && !networkSink->spillFileName)) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for network sink buffers.");
+        NetworkSink_Free(networkSink);
+        return NULL;
+    }
+
+    // open the spill file, keeping any frames left in it
+    if (spillFileName) {
+        networkSink->spillFd = open(spillFileName, O_RDWR | O_CREAT, 0644);
+        spillSize = (networkSink->spillFd < 0) ? -1 :
+                lseek(networkSink->spillFd, 0, SEEK_END);
+        if (spillSize < 0) {
+            sprintf(exceptionInfo->message,
+                    "Cannot open spill file %s: OS error %d.", spillFileName,
+                    errno);
+            NetworkSink_Free(networkSink);
+            return NULL;
+        }
+        fcntl(networkSink->spillFd, F_SETFD, FD_CLOEXEC);
+        networkSink->spillEnd = (unsigned long long) spillSize;
+    }
+
+    sink = CreateLoggingSink(&gNetworkSinkType, networkSink, level,
+            exceptionInfo);
+    if (!sink)
+        NetworkSink_Free(networkSink);
+    return sink;
+}
+#endif
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_AddSink()
+//   Add the sink to the end of the list of sinks of the state. The lock for
+// the state must be held by the caller.
+//-----------------------------------------------------------------------------
+static int LoggingState_AddSink(
+    LoggingState *state,                // state to add sink to
+    LoggingSink *sink,                  // sink to add
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    LoggingSink **link;
+
+    if (state->sharedMemory) {
+        strcpy(exceptionInfo->message,
+                "Sinks not supported when logging to shared memory.");
+        return -1;
+    }
+    for (link = &state->sinks; *link; link = &(*link)->next);
+    *link = sink;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_AddRoutes()
+//   Add a file sink to the state for each of the routes in the options. The
+// records at levels within the range of a route are written to its file as
+// formatted for the log file and each file is rotated by its sink. A copy of
+// the routes, including the names of their files, is retained by the state in
+// a single allocation so that they can be added again to the state used by a
+// child process after a fork. The routes must be added before any other sink
+// so that the sinks for the routes are always the first sinks of the state.
+//-----------------------------------------------------------------------------
+static int LoggingState_AddRoutes(
+    LoggingState *state,                // state to add routes to
+    const LoggingOptions *options,      // options containing routes
+    const char *prefix,                 // prefix for opening and closing
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    const LoggingRoute *route;
+    LoggingRoute *routes;
+    LoggingSink *sink;
+    unsigned long i;
+    size_t size;
+    char *ptr;
+
+    // retain a copy of the routes
+    if (options->numRoutes == 0)
+        return 0;
+    size = options->numRoutes * sizeof(LoggingRoute);
+    for (i = 0; i < options->numRoutes; i++)
+        size += strlen(options->routes[i].fileName) + 1;
+    routes = malloc(size);
+    if (!routes) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for routes.");
+        return -1;
+    }
+    ptr = (char*) (routes + options->numRoutes);
+    for (i = 0; i < options->numRoutes; i++) {
+        routes[i] = options->routes[i];
+        strcpy(ptr, options->routes[i].fileName);
+        routes[i].fileName = ptr;
+        ptr += strlen(ptr) + 1;
+    }
+    state->options.routes = routes;
+    state->options.numRoutes = options->numRoutes;
+
+    // add a file sink for each route
+    for (i = 0; i < options->numRoutes; i++) {
+        route = &routes[i];
+        if (route->maxLevel > 0 && route->maxLevel < route->minLevel) {
+            sprintf(exceptionInfo->message,
+                    "Invalid range of levels %lu to %lu for route to %.200s.",
+                    route->minLevel, route->maxLevel, route->fileName);
+            return -1;
+        }
+        sink = CreateFileSink(route->fileName, route->minLevel,
+                route->maxFiles, route->maxFileSize, prefix, exceptionInfo);
+        if (!sink)
+            return -1;
+        if (route->maxLevel > 0)
+            sink->maxLevel = route->maxLevel;
+        if (LoggingState_AddSink(state, sink, exceptionInfo) < 0) {
+            FreeLoggingSink(sink);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_SetLevel()
+//   Set the level for the logging state.
+//-----------------------------------------------------------------------------
+static int LoggingState_SetLevel(
+    LoggingState *state,                // state on which to change level
+    unsigned long newLevel)             // new level to set
+{
+#ifndef MS_WINDOWS
+    char temp[80];
+
+    if (state->sharedMemory) {
+        strcpy(temp, "switched logging level from ");
+        FormatLevel(state->level, temp + strlen(temp));
+        strcat(temp, " to ");
+        FormatLevel(newLevel, temp + strlen(temp));
+        state->level = newLevel;
+        return SharedRing_Write(state, LOG_LEVEL_NONE, temp);
+    }
+#endif
+    if (WritePrefix(state, LOG_LEVEL_NONE) < 0)
+        return -1;
+    if (WriteString(state, "switched logging level from ") < 0)
+        return -1;
+    if (WriteLevel(state, state->level) < 0)
+        return -1;
+    if (WriteString(state, " to ") < 0)
+        return -1;
+    if (WriteLevel(state, newLevel) < 0)
+        return -1;
+    if (WriteTrailer(state) < 0)
+        return -1;
+    state->level = newLevel;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// PythonLoggingState_Free()
+//   Called when a Python logging state variable is freed.
+//-----------------------------------------------------------------------------
+void PythonLoggingState_Free(
+    udt_LoggingState *self)             // object being freed
+{
+    ACQUIRE_LOCK(gLoggingStateLock);
+    if (self->prev)
+        self->prev->next = self->next;
+    else if (gPythonLoggingStates == self)
+        gPythonLoggingStates = self->next;
+    if (self->next)
+        self->next->prev = self->prev;
+    RELEASE_LOCK(gLoggingStateLock);
+    if (self->state) {
+        Py_BEGIN_ALLOW_THREADS
+        LoggingState_Free(self->state);
+        LogMessage(LOG_LEVEL_INFO, "stopping logging for Python thread");
+        Py_END_ALLOW_THREADS
+    }
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+
+// define logging state Python type
+static PyTypeObject gPythonLoggingStateType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "cx_Logging.LoggingState",          // tp_name
+    sizeof(udt_LoggingState),           // tp_basicsize
+    0,                                  // tp_itemsize
+    (destructor) PythonLoggingState_Free,
+                                        // tp_dealloc
+    0,                                  // tp_print
+    0,                                  // tp_getattr
+    0,                                  // tp_setattr
+    0,                                  // tp_compare
+    0,                                  // tp_repr
+    0,                                  // tp_as_number
+    0,                                  // tp_as_sequence
+    0,                                  // tp_as_mapping
+    0,                                  // tp_hash
+    0,                                  // tp_call
+    0,                                  // tp_str
+    0,                                  // tp_getattro
+    0,                                  // tp_setattro
+    0,                                  // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,                 // tp_flags
+    0,                                  // tp_doc
+    0,                                  // tp_traverse
+    0,                                  // tp_clear
+    0,                                  // tp_richcompare
+    0,                                  // tp_weaklistoffset
+    0,                                  // tp_iter
+    0,                                  // tp_iternext
+    0,                                  // tp_methods
+    0,                                  // tp_members
+    0,                                  // tp_getset
+    0,                                  // tp_base
+    0,                                  // tp_dict
+    0,                                  // tp_descr_get
+    0,                                  // tp_descr_set
+    0,                                  // tp_dictoffset
+    0,                                  // tp_init
+    0,                                  // tp_alloc
+    0,                                  // tp_new
+    0,                                  // tp_free
+    0,                                  // tp_is_gc
+    0                                   // tp_bases
+};
+
+
+#ifndef MS_WINDOWS
+//-----------------------------------------------------------------------------
+// WriteAllForSignal()
+//   Write all of the bytes to the file descriptor using only functions that
+// are safe to call from a signal handler.
+//-----------------------------------------------------------------------------
+static void WriteAllForSignal(
+    int fd,                             // file descriptor to write to
+    const char *value,                  // value to write
+    size_t length)                      // length of value to write
+{
+    ssize_t bytesWritten;
+
+    while (length > 0) {
+        bytesWritten = write(fd, value, length);
+        if (bytesWritten < 0 && errno == EINTR)
+            continue;
+        if (bytesWritten <= 0)
+            break;
+        value += bytesWritten;
+        length -= bytesWritten;
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// WriteNumberForSignal()
+//   Write the number to the file descriptor in decimal, padded with zeroes to
+// the given minimum number of digits, using only functions that are safe to
+// call from a signal handler.
+//-----------------------------------------------------------------------------
+static void WriteNumberForSignal(
+    int fd,                             // file descriptor to write to
+    unsigned long long value,           // value to write
+    int minDigits)                      // minimum number of digits
+{
+    char buffer[24];
+    int pos = sizeof(buffer);
+
+    do {
+        buffer[--pos] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0 || (int) sizeof(buffer) - pos < minDigits);
+    WriteAllForSignal(fd, buffer + pos, sizeof(buffer) - pos);
+}
+
+
+//-----------------------------------------------------------------------------
+// EmergencyFlush()
+//   Write the messages kept in the flight recorder that have not already been
+// written to the file descriptor, using only functions that are safe to call
+// from a signal handler. No lock is acquired since the thread that received
+// the signal may already hold it. Times are written as seconds since the
+// epoch since converting them to local time is not safe. The records queued
+// for asynchronous sinks are not written since they have already been
+// written to the log file.
+//-----------------------------------------------------------------------------
+static void EmergencyFlush(
+    int fd,                             // file descriptor to write to
+    int signalNumber)                   // signal that was received
+{
+    unsigned long long ticket, startTicket, endTicket, sequence;
+    FlightRecorderEntry *entry, copy;
+    const char *levelName;
+    unsigned long numEntries;
+
+    WriteAllForSignal(fd, "fatal signal ", 13);
+    WriteNumberForSignal(fd, signalNumber, 1);
+    WriteAllForSignal(fd, " received\n", 10);
+    numEntries = gFlightRecorder.numEntries;
+    if (!gLoggingOptions.flightRecorderSize || !numEntries)
+        return;
+    endTicket = gFlightRecorder.nextTicket;
+    startTicket = (endTicket > numEntries) ? endTicket - numEntries : 0;
+    if (startTicket < gFlightRecorder.dumpedTicket)
+        startTicket = gFlightRecorder.dumpedTicket;
+    gFlightRecorder.dumpedTicket = endTicket;
+    for (ticket = startTicket; ticket < endTicket; ticket++) {
+        entry = &gFlightRecorder.entries[ticket % numEntries];
+        sequence = ATOMIC_LOAD(entry->sequence);
+        if (sequence != ticket * 2 + 2)
+            continue;
+        ATOMIC_FENCE();
+        memcpy(&copy, entry, sizeof(FlightRecorderEntry));
+        ATOMIC_FENCE();
+        if (ATOMIC_LOAD(entry->sequence) != sequence)
+            continue;
+        WriteAllForSignal(fd, "[", 1);
+        WriteNumberForSignal(fd, copy.timestamp / 1000000ULL, 1);
+        WriteAllForSignal(fd, ".", 1);
+        WriteNumberForSignal(fd, copy.timestamp % 1000000ULL, 6);
+        WriteAllForSignal(fd, " ", 1);
+        WriteNumberForSignal(fd, (unsigned long) copy.threadId, 5);
+        WriteAllForSignal(fd, "] ", 2);
+        levelName = GetLevelName(copy.level);
+        if (levelName)
+            WriteAllForSignal(fd, levelName, strlen(levelName));
+        else WriteNumberForSignal(fd, copy.level, 1);
+        WriteAllForSignal(fd, " ", 1);
+        WriteAllForSignal(fd, copy.message,
+                strnlen(copy.message, LOG_FLIGHT_RECORDER_MESSAGE_SIZE - 1));
+        WriteAllForSignal(fd, "\n", 1);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// FatalSignalHandler()
+//   Called when a fatal signal is received. The pending log data is written
+// and the original handler is restored before the signal is raised again.
+//-----------------------------------------------------------------------------
+static void FatalSignalHandler(
+    int signalNumber)                   // signal that was received
+{
+    int i, fd, savedErrno = errno;
+
+    fd = gEmergencyFileDescriptor;
+    gEmergencyFileDescriptor = -1;
+    if (fd >= 0)
+        EmergencyFlush(fd, signalNumber);
+    for (i = 0; i < NUM_FATAL_SIGNALS; i++) {
+        if (gFatalSignals[i] == signalNumber)
+            sigaction(signalNumber, &gOrigFatalSignalActions[i], NULL);
+    }
+    errno = savedErrno;
+    raise(signalNumber);
+}
+
+
+//-----------------------------------------------------------------------------
+// UpdateFatalSignalHandlers()
+//   Install the handlers for fatal signals if the logging state requests an
+// emergency flush and restore the original handlers otherwise. This is called
+// while the global logging state lock is held.
+//-----------------------------------------------------------------------------
+static void UpdateFatalSignalHandlers(
+    LoggingState *state)                // new global logging state (or NULL)
+{
+    struct sigaction action;
+    int i;
+
+    if (state && state->options.emergencyFlush && state->fp) {
+        gEmergencyFileDescriptor = fileno(state->fp);
+        if (!gFatalSignalHandlersInstalled) {
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = FatalSignalHandler;
+            sigemptyset(&action.sa_mask);
+            for (i = 0; i < NUM_FATAL_SIGNALS; i++)
+                sigaction(gFatalSignals[i], &action,
+                        &gOrigFatalSignalActions[i]);
+            gFatalSignalHandlersInstalled = 1;
+        }
+    } else {
+        gEmergencyFileDescriptor = -1;
+        if (gFatalSignalHandlersInstalled) {
+            for (i = 0; i < NUM_FATAL_SIGNALS; i++)
+                sigaction(gFatalSignals[i], &gOrigFatalSignalActions[i],
+                        NULL);
+            gFatalSignalHandlersInstalled = 0;
+        }
+    }
+}
+#endif
+
+
+//-----------------------------------------------------------------------------
+// ReplaceGlobalLoggingState()
+//   Replace the global logging state and return the original one so that it
+// can be freed by the caller after the lock has been released.
+//-----------------------------------------------------------------------------
+static LoggingState *ReplaceGlobalLoggingState(
+    LoggingState *loggingState)         // new logging state (or NULL)
+{
+    LoggingState *origLoggingState;
+
+    ACQUIRE_LOCK(gLoggingStateLock);
+    origLoggingState = gLoggingState;
+    gLoggingState = loggingState;
+    if (loggingState) {
+        loggingState->lock = &gLoggingStateLock;
+        if (loggingState->options.flightRecorderSize) {
+            gFlightRecorder.numEntries =
+                    loggingState->options.flightRecorderSize;
+            if (gFlightRecorder.numEntries > LOG_FLIGHT_RECORDER_MAX_ENTRIES)
+                gFlightRecorder.numEntries = LOG_FLIGHT_RECORDER_MAX_ENTRIES;
+            gFlightRecorder.dumpedTicket = gFlightRecorder.nextTicket;
+            loggingState->flightRecorder = &gFlightRecorder;
+        }
+        gLoggingLevel = loggingState->level;
+        gLoggingOptions = loggingState->options;
+    } else {
+        gLoggingLevel = LOG_LEVEL_NONE;
+        InitializeLoggingOptions(&gLoggingOptions);
+    }
+    memset(&gLoggingUnlockedCounters, 0, sizeof(LoggingCounters));
+#ifndef MS_WINDOWS
+    UpdateFatalSignalHandlers(loggingState);
+#endif
+    RELEASE_LOCK(gLoggingStateLock);
+    return origLoggingState;
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLogging()
+//   Start logging to the specified file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLogging(
+    const char *fileName,               // name of file to write to
+    unsigned long level,                // level to use for logging
+    unsigned long maxFiles,             // maximum number of files to have
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix)                 // prefix to use in logging
+{
+    ExceptionInfo exceptionInfo;
+
+    return StartLoggingEx(fileName, level, maxFiles, maxFileSize, prefix, 1, 1,
+            &exceptionInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingEx()
+//   Start logging to the specified file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingEx(
+    const char *fileName,               // name of file to write to
+    unsigned long level,                // level to use for logging
+    unsigned long maxFiles,             // maximum number of files to have
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix,                 // prefix to use in logging
+    int reuseExistingFiles,             // reuse existing files?
+    int rotateFiles,                    // rotate files?
+    ExceptionInfo* exceptionInfo)       // exception information (OUT)
+{
+    return StartLoggingWithOptions(fileName, level, maxFiles, maxFileSize,
+            prefix, reuseExistingFiles, rotateFiles, NULL, exceptionInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// InitializeLoggingOptions()
+//   Initialize the optional logging behavior to its defaults.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(void) InitializeLoggingOptions(
+    LoggingOptions *options)            // options to initialize
+{
+    memset(options, 0, sizeof(LoggingOptions));
+    options->flightRecorderTrigger = LOG_LEVEL_ERROR;
+    options->syncInterval = 1000;
+    options->durableLevel = LOG_LEVEL_ERROR;
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingWithOptions()
+//   Start logging to the specified file with optional behavior, including the
+// routes of messages at particular levels to files of their own.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingWithOptions(
+    const char *fileName,               // name of file to write to
+    unsigned long level,                // level to use for logging
+    unsigned long maxFiles,             // maximum number of files to have
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix,                 // prefix to use in logging
+    int reuseExistingFiles,             // reuse existing files?
+    int rotateFiles,                    // rotate files?
+    const LoggingOptions *options,      // optional behavior (or NULL)
+    ExceptionInfo* exceptionInfo)       // exception information (OUT)
+{
+    LoggingState *loggingState, *origLoggingState;
+
+    loggingState = LoggingState_New(NULL, fileName, level, maxFiles,
+            maxFileSize, prefix, reuseExistingFiles, rotateFiles, options,
+            exceptionInfo);
+    if (!loggingState)
+        return -1;
+    if (options && LoggingState_AddRoutes(loggingState, options, prefix,
+            exceptionInfo) < 0) {
+        LoggingState_Free(loggingState);
+        return -1;
+    }
+    origLoggingState = ReplaceGlobalLoggingState(loggingState);
+    if (origLoggingState)
+        LoggingState_Free(origLoggingState);
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingForPythonThread()
+//   Start logging to the specified file for the given Python thread. It is
+// assumed at this point that the Python interpreter lock is held.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingForPythonThread(
+    const char *fileName,               // name of file to write to
+    unsigned long level,                // level to use for logging
+    unsigned long maxFiles,             // maximum number of files to have
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix)                 // prefix to use in logging
+{
+    return StartLoggingForPythonThreadEx(fileName, level, maxFiles,
+            maxFileSize, prefix, 1, 1);
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingForPythonThreadEx()
+//   Start logging to the specified file for the given Python thread. It is
+// assumed at this point that the Python interpreter lock is held.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingForPythonThreadEx(
+    const char *fileName,               // name of file to write to
+    unsigned long level,                // level to use for logging
+    unsigned long maxFiles,             // maximum number of files to have
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix,                 // prefix to use in logging
+    int reuseExistingFiles,             // reuse existing files?
+    int rotateFiles)                    // rotate files?
+{
+    return StartLoggingForPythonThreadWithOptions(fileName, level, maxFiles,
+            maxFileSize, prefix, reuseExistingFiles, rotateFiles, NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingForPythonThreadWithOptions()
+//   Start logging to the specified file for the given Python thread with
+// optional behavior. It is assumed at this point that the Python interpreter
+// lock is held.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingForPythonThreadWithOptions(
+    const char *fileName,               // name of file to write to
+    unsigned long level,                // level to use for logging
+    unsigned long maxFiles,             // maximum number of files to have
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix,                 // prefix to use in logging
+    int reuseExistingFiles,             // reuse existing files?
+    int rotateFiles,                    // rotate files?
+    const LoggingOptions *options)      // optional behavior (or NULL)
+{
+    udt_LoggingState *loggingState;
+    ExceptionInfo exceptionInfo;
+    int result;
+
+    // create a new logging state object
+    loggingState = (udt_LoggingState*)
+            gPythonLoggingStateType.tp_alloc(&gPythonLoggingStateType, 0);
+    if (!loggingState)
+        return -1;
+    INITIALIZE_LOCK(loggingState->lock);
+    ACQUIRE_LOCK(gLoggingStateLock);
+    loggingState->next = gPythonLoggingStates;
+    if (gPythonLoggingStates)
+        gPythonLoggingStates->prev = loggingState;
+    gPythonLoggingStates = loggingState;
+    RELEASE_LOCK(gLoggingStateLock);
+    loggingState->state = LoggingState_New(NULL, fileName, level, maxFiles,
+            maxFileSize, prefix, reuseExistingFiles, rotateFiles, options,
+            &exceptionInfo);
+    if (!loggingState->state) {
+        Py_DECREF(loggingState);
+        PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
+        return -1;
+    }
+    loggingState->state->lock = &loggingState->lock;
+    if (loggingState->state->options.flightRecorderSize) {
+        loggingState->state->flightRecorder = FlightRecorder_New(
+                loggingState->state->options.flightRecorderSize,
+                &exceptionInfo);
+        if (!loggingState->state->flightRecorder) {
+            Py_DECREF(loggingState);
+            PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
+            return -1;
+        }
+    }
+    if (options && LoggingState_AddRoutes(loggingState->state, options,
+            prefix, &exceptionInfo) < 0) {
+        Py_DECREF(loggingState);
+        PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
+        return -1;
+    }
+
+    // set the logging state
+    if (LogMessage(LOG_LEVEL_INFO, "starting logging for Python thread") < 0 ||
+            LogMessageV(LOG_LEVEL_INFO, "    fileName => %s",
+                    loggingState->state->fileName) < 0 ||
+            LogMessageV(LOG_LEVEL_INFO, "    level => %d",
                     loggingState->state->level) < 0 ||
             LogMessageV(LOG_LEVEL_INFO, "    maxFiles => %d",
                     loggingState->state->maxFiles) < 0 ||
@@ -971,799 +5950,2208 @@ CX_LOGGING_API(int) StartLoggingForPythonThreadEx(
         PyErr_SetFromErrno(PyExc_OSError);
         return -1;
     }
-
-    result = SetLoggingState(loggingState);
-    Py_DECREF(loggingState);
-    return result;
+
+    result = SetLoggingState(loggingState);
+    Py_DECREF(loggingState);
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingStderr()
+//   Start logging to stderr.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingStderr(
+    unsigned long level,                // level to use for logging
+    const char *prefix)                 // prefix to use for logging
+{
+    ExceptionInfo exceptionInfo;
+
+    return StartLoggingStderrEx(level, prefix, &exceptionInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingStderrEx()
+//   Start logging to stderr.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingStderrEx(
+    unsigned long level,                // level to use for logging
+    const char *prefix,                 // prefix to use for logging
+    ExceptionInfo *exceptionInfo)       // exception info (OUT)
+{
+    LoggingState *loggingState, *origLoggingState;
+
+    loggingState = LoggingState_New(stderr, "<stderr>", level, 1, 0, prefix, 1,
+            1, NULL, exceptionInfo);
+    if (!loggingState)
+        return -1;
+    origLoggingState = ReplaceGlobalLoggingState(loggingState);
+    if (origLoggingState)
+        LoggingState_Free(origLoggingState);
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingStdout()
+//   Start logging to stdout.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingStdout(
+    unsigned long level,                // level to use for logging
+    const char *prefix)                 // prefix to use for logging
+{
+    ExceptionInfo exceptionInfo;
+
+    return StartLoggingStdoutEx(level, prefix, &exceptionInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingStdoutEx()
+//   Start logging to stdout.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingStdoutEx(
+    unsigned long level,                // level to use for logging
+    const char *prefix,                 // prefix to use for logging
+    ExceptionInfo *exceptionInfo)       // exception info (OUT)
+{
+    LoggingState *loggingState, *origLoggingState;
+
+    loggingState = LoggingState_New(stdout, "<stdout>", level, 1, 0, prefix, 1,
+            1, NULL, exceptionInfo);
+    if (!loggingState)
+        return -1;
+    origLoggingState = ReplaceGlobalLoggingState(loggingState);
+    if (origLoggingState)
+        LoggingState_Free(origLoggingState);
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// StartLoggingFromEnvironment()
+//   Start logging using the parameters specified in the environment.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) StartLoggingFromEnvironment(void)
+{
+    char *fileName, *valueAsString, *temp, *prefix;
+    unsigned long level, maxFiles, maxFileSize;
+
+    fileName = getenv(ENV_NAME_FILE_NAME);
+    if (!fileName)
+        return -1;
+    valueAsString = getenv(ENV_NAME_LEVEL);
+    if (!valueAsString)
+        return -1;
+    level = strtol(valueAsString, &temp, 10);
+    if (*temp)
+        return -1;
+    valueAsString = getenv(ENV_NAME_MAX_FILES);
+    if (!valueAsString) {
+        maxFiles = 1;
+    } else {
+        maxFiles = strtol(valueAsString, &temp, 10);
+        if (*temp)
+            return -1;
+    }
+    valueAsString = getenv(ENV_NAME_MAX_FILE_SIZE);
+    if (!valueAsString) {
+        maxFileSize = DEFAULT_MAX_FILE_SIZE;
+    } else {
+        maxFileSize = strtol(valueAsString, &temp, 10);
+        if (*temp)
+            return -1;
+    }
+    prefix = getenv(ENV_NAME_PREFIX);
+    if (!prefix)
+        prefix = DEFAULT_PREFIX;
+    return StartLogging(fileName, level, maxFiles, maxFileSize, prefix);
+}
+
+
+//-----------------------------------------------------------------------------
+// StopLogging()
+//   Stop logging to the specified file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(void) StopLogging(void)
+{
+    LoggingState *loggingState;
+
+    loggingState = ReplaceGlobalLoggingState(NULL);
+    if (loggingState)
+        LoggingState_Free(loggingState);
+}
+
+
+//-----------------------------------------------------------------------------
+// StopLoggingForPythonThread()
+//   Stop logging to a different file for the current Python thread.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(void) StopLoggingForPythonThread(void)
+{
+    PyObject *dict;
+
+    dict = GetThreadStateDictionary();
+    if (dict && PyDict_DelItemString(dict, KEY_LOGGING_STATE) < 0) {
+        PyErr_Clear();
+        LogMessage(LOG_LEVEL_WARNING,
+                "tried to stop logging without starting first");
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// LogMessageVaList()
+//   Log a message to the log file with a variable number of argument specified
+// as a va_list.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogMessageVaList(
+    unsigned long level,                // level to check for
+    const char *format,                 // format of message to log
+    va_list arguments)                  // argument list
+{
+    unsigned long long dropped = 0;
+    int result = 0;
+
+    if (gLoggingState) {
+        if (level < gLoggingLevel) {
+            CountSuppressed(&gLoggingUnlockedCounters, level);
+            if (IsFlightRecorded(&gLoggingOptions, level))
+                FlightRecorder_RecordFormat(&gFlightRecorder, level, format,
+                        arguments);
+            return 0;
+        }
+        if (IsSampledOut(&gLoggingOptions, &gLoggingUnlockedCounters, level))
+            return 0;
+        if (gLoggingOptions.rateLimit &&
+                IsRateLimited(gLoggingOptions.rateLimit,
+                        (size_t) format ^ level, &dropped))
+            return 0;
+        AcquireLockForWriting(&gLoggingStateLock);
+        if (gLoggingState && level >= gLoggingState->level) {
+            if (dropped)
+                WriteRateLimitNotice(gLoggingState, level, dropped);
+            result = WriteMessageWithFormat(gLoggingState, level, format,
+                    arguments);
+        }
+        RELEASE_LOCK(gLoggingStateLock);
+    }
+
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// LogMessageV()
+//   Log a message to the log file with a variable number of arguments.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogMessageV(
+    unsigned long level,                // level at which to log
+    const char *format,                 // format of message to log
+    ...)                                // arguments required for format
+{
+    va_list arguments;
+    int result;
+
+    va_start(arguments, format);
+    result = LogMessageVaList(level, format, arguments);
+    va_end(arguments);
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// LogMessageForPythonV()
+//   Log a message to the log file with a variable number of arguments. The
+// Python thread state is examined first to determine if special logging for
+// this thread is desired; if not, the normal LogMessageV() is invoked.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogMessageForPythonV(
+    unsigned long level,                // level at which to log
+    const char *format,                 // format of message to log
+    ...)                                // arguments required for format
+{
+    unsigned long long dropped = 0;
+    udt_LoggingState *loggingState;
+    LoggingState *state;
+    va_list arguments;
+    int result = 0;
+
+    loggingState = GetLoggingState();
+    va_start(arguments, format);
+    if (loggingState) {
+        state = loggingState->state;
+        if (level < state->level) {
+            CountSuppressed(&state->counters, level);
+            if (IsFlightRecorded(&state->options, level))
+                FlightRecorder_RecordFormat(state->flightRecorder, level,
+                        format, arguments);
+        } else if (!IsSampledOut(&state->options, &state->counters, level) &&
+                (!state->options.rateLimit ||
+                !IsRateLimited(state->options.rateLimit,
+                        (size_t) format ^ level, &dropped))) {
+           Py_BEGIN_ALLOW_THREADS
+           AcquireLockForWriting(&loggingState->lock);
+           if (dropped)
+               WriteRateLimitNotice(loggingState->state, level, dropped);
+           result = WriteMessageWithFormat(loggingState->state, level, format,
+                   arguments);
+           RELEASE_LOCK(loggingState->lock);
+           Py_END_ALLOW_THREADS
+        }
+    } else result = LogMessageVaList(level, format, arguments);
+    va_end(arguments);
+
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// LogMessage()
+//   Log a message to the log file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogMessage(
+    unsigned long level,                // level at which to log
+    const char *message)                // message to log
+{
+    unsigned long long dropped = 0;
+    int result = 0;
+
+    if (gLoggingState) {
+        if (level < gLoggingLevel) {
+            CountSuppressed(&gLoggingUnlockedCounters, level);
+            if (IsFlightRecorded(&gLoggingOptions, level))
+                FlightRecorder_RecordMessage(&gFlightRecorder, level, message);
+            return 0;
+        }
+        if (IsSampledOut(&gLoggingOptions, &gLoggingUnlockedCounters, level))
+            return 0;
+        if (gLoggingOptions.rateLimit && message &&
+                IsRateLimited(gLoggingOptions.rateLimit,
+                        HashBytes(message, strlen(message)) ^ level,
+                        &dropped))
+            return 0;
+        AcquireLockForWriting(&gLoggingStateLock);
+        if (gLoggingState && level >= gLoggingState->level) {
+            if (dropped)
+                WriteRateLimitNotice(gLoggingState, level, dropped);
+            result = WriteMessage(gLoggingState, level, message);
+        }
+        RELEASE_LOCK(gLoggingStateLock);
+    }
+
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// StartRecord()
+//   Start building a record on the current thread, unless one is already
+// being built, in which case the new record is nested within it.
+//-----------------------------------------------------------------------------
+static void StartRecord(
+    unsigned long level,                // level at which to write record
+    int enabled,                        // is the record to be written?
+    int forPython)                      // write record for Python?
+{
+    if (tRecordBuilder.depth++ > 0)
+        return;
+    tRecordBuilder.level = level;
+    tRecordBuilder.enabled = enabled;
+    tRecordBuilder.forPython = forPython;
+    tRecordBuilder.buffer.length = 0;
+    tRecordBuilder.buffer.numLines = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// BeginRecord()
+//   Begin a record made up of multiple lines which is written to the global
+// logging state as a single contiguous write when it is committed.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) BeginRecord(
+    unsigned long level)                // level at which to write record
+{
+    int enabled = 0;
+
+    if (tRecordBuilder.depth == 0 && gLoggingState) {
+        enabled = (level >= gLoggingLevel);
+        if (!enabled)
+            CountSuppressed(&gLoggingUnlockedCounters, level);
+    }
+    StartRecord(level, enabled, 0);
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// BeginRecordForPython()
+//   Begin a record made up of multiple lines which is written as a single
+// contiguous write when it is committed. The Python thread state is examined
+// to determine the logging state to which the record is written.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) BeginRecordForPython(
+    unsigned long level)                // level at which to write record
+{
+    int enabled = 0;
+
+    if (tRecordBuilder.depth == 0)
+        enabled = IsLoggingAtLevelForPython(level);
+    StartRecord(level, enabled, 1);
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// GetRecordBuffer()
+//   Return the buffer for the record being built on the current thread or
+// NULL if no record is being built or the record is not going to be written.
+//-----------------------------------------------------------------------------
+static TextBuffer *GetRecordBuffer(void)
+{
+    if (tRecordBuilder.depth == 0 || !tRecordBuilder.enabled)
+        return NULL;
+    return &tRecordBuilder.buffer;
+}
+
+
+//-----------------------------------------------------------------------------
+// AppendLineVaList()
+//   Append a line to the record being built on the current thread with a
+// variable number of arguments specified as a va_list.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) AppendLineVaList(
+    const char *format,                 // format of line to append
+    va_list arguments)                  // argument list
+{
+    if (tRecordBuilder.depth == 0)
+        return -1;
+    if (!tRecordBuilder.enabled)
+        return 0;
+    return TextBuffer_AppendLineV(&tRecordBuilder.buffer, format, arguments);
+}
+
+
+//-----------------------------------------------------------------------------
+// AppendLine()
+//   Append a line to the record being built on the current thread with a
+// variable number of arguments.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) AppendLine(
+    const char *format,                 // format of line to append
+    ...)                                // arguments required for format
+{
+    va_list arguments;
+    int result;
+
+    va_start(arguments, format);
+    result = AppendLineVaList(format, arguments);
+    va_end(arguments);
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// CommitRecord()
+//   Commit the record being built on the current thread. If the record is
+// nested within another, nothing is written until the outermost record is
+// committed; the lines of the outermost record are then written as one,
+// acquiring the lock only once.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) CommitRecord(void)
+{
+    TextBuffer *buffer = &tRecordBuilder.buffer;
+    int result = 0;
+
+    if (tRecordBuilder.depth == 0)
+        return -1;
+    if (--tRecordBuilder.depth > 0)
+        return 0;
+    if (tRecordBuilder.enabled && buffer->numLines > 0) {
+        if (tRecordBuilder.forPython)
+            result = WriteRecordForPython(tRecordBuilder.level, buffer->data);
+        else {
+            AcquireLockForWriting(&gLoggingStateLock);
+            if (gLoggingState && tRecordBuilder.level >= gLoggingState->level)
+                result = WriteRecord(gLoggingState, tRecordBuilder.level,
+                        buffer->data);
+            RELEASE_LOCK(gLoggingStateLock);
+        }
+    }
+    if (buffer->data)
+        free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = buffer->allocated = 0;
+    buffer->numLines = 0;
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// LogDebug()
+//   Log a message at level LOG_LEVEL_DEBUG to the log file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogDebug(
+    const char *message)                // message to log
+{
+    return LogMessage(LOG_LEVEL_DEBUG, message);
+}
+
+
+//-----------------------------------------------------------------------------
+// LogInfo()
+//   Log a message at level LOG_LEVEL_INFO to the log file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogInfo(
+    const char *message)                // message to log
+{
+    return LogMessage(LOG_LEVEL_INFO, message);
+}
+
+
+//-----------------------------------------------------------------------------
+// LogWarning()
+//   Log a message at level LOG_LEVEL_WARNING to the log file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogWarning(
+    const char *message)                // message to log
+{
+    return LogMessage(LOG_LEVEL_WARNING, message);
+}
+
+
+//-----------------------------------------------------------------------------
+// LogError()
+//   Log a message at level LOG_LEVEL_ERROR to the log file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogError(
+    const char *message)                // message to log
+{
+    return LogMessage(LOG_LEVEL_ERROR, message);
+}
+
+
+//-----------------------------------------------------------------------------
+// LogCritical()
+//   Log a message at level LOG_LEVEL_CRITICAL to the log file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogCritical(
+    const char *message)                // message to log
+{
+    return LogMessage(LOG_LEVEL_CRITICAL, message);
+}
+
+
+//-----------------------------------------------------------------------------
+// LogTrace()
+//   Log a message regardless of the current logging level to the log file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogTrace(
+    const char *message)                // message to log
+{
+    return LogMessage(LOG_LEVEL_NONE, message);
+}
+
+
+//-----------------------------------------------------------------------------
+// GetLoggingLevel()
+//   Return the current logging level.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(unsigned long) GetLoggingLevel(void)
+{
+    unsigned long level = LOG_LEVEL_NONE;
+
+    ACQUIRE_LOCK(gLoggingStateLock);
+    if (gLoggingState)
+        level = gLoggingState->level;
+    RELEASE_LOCK(gLoggingStateLock);
+    return level;
+}
+
+
+//-----------------------------------------------------------------------------
+// SetLoggingLevel()
+//   Set the current logging level.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) SetLoggingLevel(
+    unsigned long newLevel)             // new level to use
+{
+    int result = 0;
+
+    ACQUIRE_LOCK(gLoggingStateLock);
+    if (gLoggingState) {
+        result = LoggingState_SetLevel(gLoggingState, newLevel);
+        gLoggingLevel = gLoggingState->level;
+    }
+    RELEASE_LOCK(gLoggingStateLock);
+
+    return result;
+}
+
+
+#if defined MS_WINDOWS && !defined UNDER_CE
+//-----------------------------------------------------------------------------
+// LogWin32Error()
+//   Log an error message from the Win32 subsystem and return -1.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogWin32Error(
+    DWORD errorCode,                    // Win32 error code to log
+    const char *message)                // message to log
+{
+    DWORD status;
+    char *buffer;
+
+    LogMessageV(LOG_LEVEL_ERROR, "Win32 error 0x%x encountered.", errorCode);
+    LogMessageV(LOG_LEVEL_ERROR, "    Context: %s", message);
+    status = FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
+            FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+            NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+            (void*) &buffer, 0, NULL);
+    if (status == 0)
+        LogMessage(LOG_LEVEL_ERROR, "    Message: FormatMessage() failed");
+    else {
+        LogMessageV(LOG_LEVEL_ERROR, "    Message: %s", buffer);
+        LocalFree(buffer);
+    }
+    return -1;
+}
+
+
+//-----------------------------------------------------------------------------
+// LogGUID()
+//   Log a GUID in human readable format to the log file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogGUID(
+    unsigned long level,                // level at which to log
+    const char *prefix,                 // prefix to print in front of it
+    const IID *iid)                     // interface to print
+{
+    WCHAR str[128];
+    char outstr[128];
+    size_t strLength;
+    int result = 0;
+
+    ACQUIRE_LOCK(gLoggingStateLock);
+    if (gLoggingState && level >= gLoggingState->level) {
+        if (StringFromGUID2(iid, str, sizeof(str)) == 0) {
+            result = LogMessageV(LOG_LEVEL_ERROR, "%s: huh? string too long?",
+                    prefix);
+        } else {
+            strLength = wcslen(str) + 1;
+            if (WideCharToMultiByte(CP_ACP, 0, str, (int) strLength, outstr,
+                    (int) strLength, NULL, NULL) == 0) {
+                result = LogMessageV(LOG_LEVEL_ERROR,
+                        "%s: huh? can't convert string?", prefix);
+            } else result = LogMessageV(level, "%s: %s", prefix, outstr);
+        }
+    }
+    RELEASE_LOCK(gLoggingStateLock);
+
+    return result;
+}
+#endif
+
+
+
+//-----------------------------------------------------------------------------
+// LogPythonObject()
+//   Log the string representation of the Python object to the log file.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) LogPythonObject(
+    unsigned long logLevel,             // log level
+    const char *prefix,                 // prefix for message
+    const char *name,                   // name to display
+    PyObject *object)                   // object to log
+{
+    PyObject *stringRep, *encodedStringRep;
+    const char *text;
+    int result = 0;
+
+    if (!object) {
+        result = LogMessageForPythonV(logLevel, "%s%s => NULL", prefix, name);
+    } else if (IsLoggingAtLevelForPython(logLevel)) {
+        stringRep = PyObject_Str(object);
+        if (stringRep) {
+            if (GetEncodedStringForPython(stringRep, &encodedStringRep,
+                    &text) < 0) {
+                Py_DECREF(stringRep);
+                return -1;
+            }
+            Py_DECREF(stringRep);
+            result = LogMessageForPythonV(logLevel, "%s%s => %s", prefix, name,
+                    text);
+            Py_DECREF(encodedStringRep);
+        } else {
+            result = LogMessageForPythonV(logLevel,
+                    "%s%s => unable to stringify", prefix, name);
+            PyErr_Clear();
+        }
+    }
+
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// TextBuffer_AppendPythonObject()
+//   Append a line describing a Python object to the text buffer, in the same
+// form as LogPythonObject().
+//-----------------------------------------------------------------------------
+static int TextBuffer_AppendPythonObject(
+    TextBuffer *buffer,                 // buffer to append to
+    const char *prefix,                 // prefix for line
+    const char *name,                   // name to display
+    PyObject *object)                   // object to describe
+{
+    PyObject *stringRep, *encodedStringRep;
+    const char *text;
+    int result;
+
+    if (!object)
+        return TextBuffer_AppendLine(buffer, "%s%s => NULL", prefix, name);
+    stringRep = PyObject_Str(object);
+    if (!stringRep) {
+        PyErr_Clear();
+        return TextBuffer_AppendLine(buffer, "%s%s => unable to stringify",
+                prefix, name);
+    }
+    if (GetEncodedStringForPython(stringRep, &encodedStringRep, &text) < 0) {
+        Py_DECREF(stringRep);
+        return -1;
+    }
+    Py_DECREF(stringRep);
+    result = TextBuffer_AppendLine(buffer, "%s%s => %s", prefix, name, text);
+    Py_DECREF(encodedStringRep);
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// BaseLogPythonException()
+//   Base method for logging a Python exception.
+//-----------------------------------------------------------------------------
+static int BaseLogPythonException(
+    const char *message,                // message to log
+    PyObject *type,                     // exception type
+    PyObject *value)                    // exception value
+{
+    TextBuffer *buffer;
+
+    BeginRecordForPython(LOG_LEVEL_ERROR);
+    buffer = GetRecordBuffer();
+    if (buffer) {
+        TextBuffer_AppendLine(buffer, "Python exception encountered:");
+        TextBuffer_AppendLine(buffer, "    Internal Message: %s", message);
+        TextBuffer_AppendPythonObject(buffer, "    ", "Type", type);
+        TextBuffer_AppendPythonObject(buffer, "    ", "Value", value);
+    }
+    CommitRecord();
+    return -1;
+}
+
+
+//-----------------------------------------------------------------------------
+// LogPythonExceptionNoTraceback()
+//   Log a Python exception without traceback.
+//-----------------------------------------------------------------------------
+static int LogPythonExceptionNoTraceback(
+    const char *message)                // message to log
+{
+    PyObject *type, *value, *traceback;
+
+    PyErr_Fetch(&type, &value, &traceback);
+    PyErr_NormalizeException(&type, &value, &traceback);
+    BaseLogPythonException(message, type, value);
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+    return -1;
+}
+
+
+//-----------------------------------------------------------------------------
+// ReadSourceLines()
+//   Read the lines of the source file with the given name and return them as
+// a list of strings, or None if the file cannot be read. The file is assumed
+// to be encoded in UTF-8.
+//-----------------------------------------------------------------------------
+static PyObject *ReadSourceLines(
+    PyObject *fileName)                 // name of file to read
+{
+    PyObject *encodedFileName, *contents, *lines = NULL;
+    char *data = NULL;
+    long size = -1;
+    FILE *fp = NULL;
+
+    encodedFileName = PyUnicode_EncodeFSDefault(fileName);
+    if (encodedFileName) {
+        fp = fopen(PyBytes_AS_STRING(encodedFileName), "rb");
+        Py_DECREF(encodedFileName);
+    }
+    if (fp && fseek(fp, 0, SEEK_END) == 0)
+        size = ftell(fp);
+    if (size >= 0 && fseek(fp, 0, SEEK_SET) == 0)
+        data = malloc(size + 1);
+    if (data && fread(data, 1, size, fp) == (size_t) size) {
+        contents = PyUnicode_DecodeUTF8(data, size, "replace");
+        if (contents) {
+            lines = PyUnicode_Splitlines(contents, 0);
+            Py_DECREF(contents);
+        }
+    }
+    if (data)
+        free(data);
+    if (fp)
+        fclose(fp);
+    if (!lines) {
+        PyErr_Clear();
+        Py_INCREF(Py_None);
+        lines = Py_None;
+    }
+    return lines;
 }
 
 
 //-----------------------------------------------------------------------------
-// StartLoggingStderr()
-//   Start logging to stderr.
+// GetSourceLine()
+//   Return the given line of the source file, stripped of surrounding white
+// space, or NULL if it is not available. The lines of each file are read and
+// cached the first time they are needed and the cache is cleared when it is
+// full; modifications made to a file after it is cached are not noticed.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) StartLoggingStderr(
-    unsigned long level,                // level to use for logging
-    const char *prefix)                 // prefix to use for logging
+static PyObject *GetSourceLine(
+    PyObject *fileName,                 // name of source file
+    long lineNumber)                    // line number (starting at 1)
 {
-    ExceptionInfo exceptionInfo;
+    PyObject *lines, *line;
 
-    return StartLoggingStderrEx(level, prefix, &exceptionInfo);
+    if (!gSourceLines) {
+        gSourceLines = PyDict_New();
+        if (!gSourceLines) {
+            PyErr_Clear();
+            return NULL;
+        }
+    }
+    lines = PyDict_GetItem(gSourceLines, fileName);
+    if (lines) {
+        Py_INCREF(lines);
+    } else {
+        lines = ReadSourceLines(fileName);
+        if (PyDict_Size(gSourceLines) >= SOURCE_CACHE_SIZE)
+            PyDict_Clear(gSourceLines);
+        if (PyDict_SetItem(gSourceLines, fileName, lines) < 0)
+            PyErr_Clear();
+    }
+    line = NULL;
+    if (PyList_Check(lines) && lineNumber > 0 &&
+            lineNumber <= PyList_GET_SIZE(lines)) {
+        line = PyObject_CallMethod(PyList_GET_ITEM(lines, lineNumber - 1),
+                "strip", NULL);
+        if (!line)
+            PyErr_Clear();
+    }
+    Py_DECREF(lines);
+    return line;
 }
 
 
 //-----------------------------------------------------------------------------
-// StartLoggingStderrEx()
-//   Start logging to stderr.
+// TextBuffer_AppendEncodedLine()
+//   Append a line made up of a prefix and an encoded string to the text
+// buffer.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) StartLoggingStderrEx(
-    unsigned long level,                // level to use for logging
-    const char *prefix,                 // prefix to use for logging
-    ExceptionInfo *exceptionInfo)       // exception info (OUT)
+static int TextBuffer_AppendEncodedLine(
+    TextBuffer *buffer,                 // buffer to append to
+    const char *prefix,                 // prefix for line
+    PyObject *value)                    // string to append
 {
-    LoggingState *loggingState, *origLoggingState;
+    PyObject *encodedValue;
+    const char *text;
+    int result;
 
-    loggingState = LoggingState_New(stderr, "<stderr>", level, 1, 0, prefix, 1,
-            1, exceptionInfo);
-    if (!loggingState)
+    if (GetEncodedStringForPython(value, &encodedValue, &text) < 0)
         return -1;
-    ACQUIRE_LOCK(gLoggingStateLock);
-    origLoggingState = gLoggingState;
-    gLoggingState = loggingState;
-    RELEASE_LOCK(gLoggingStateLock);
-    if (origLoggingState)
-        LoggingState_Free(origLoggingState);
-    return 0;
+    result = TextBuffer_AppendLine(buffer, "%s%s", prefix, text);
+    Py_DECREF(encodedValue);
+    return result;
 }
 
 
 //-----------------------------------------------------------------------------
-// StartLoggingStdout()
-//   Start logging to stdout.
+// TextBuffer_AppendTraceback()
+//   Append the frames of a traceback to the text buffer, in the same form as
+// the traceback module. The line number of a traceback entry is computed
+// lazily in Python 3.11 and higher, in which case the attribute is used.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) StartLoggingStdout(
-    unsigned long level,                // level to use for logging
-    const char *prefix)                 // prefix to use for logging
+static int TextBuffer_AppendTraceback(
+    TextBuffer *buffer,                 // buffer to append to
+    PyObject *traceback)                // traceback to append
 {
-    ExceptionInfo exceptionInfo;
+    PyObject *fileName, *name, *lineNumberObj, *line;
+    PyTracebackObject *entry;
+    PyCodeObject *code;
+    long lineNumber;
+    int result;
 
-    return StartLoggingStdoutEx(level, prefix, &exceptionInfo);
+    if (TextBuffer_AppendLine(buffer,
+            "    Traceback (most recent call last):") < 0)
+        return -1;
+    for (entry = (PyTracebackObject*) traceback; entry;
+            entry = entry->tb_next) {
+        lineNumber = entry->tb_lineno;
+        if (lineNumber < 0) {
+            lineNumberObj = PyObject_GetAttrString((PyObject*) entry,
+                    "tb_lineno");
+            if (lineNumberObj) {
+                lineNumber = PyLong_AsLong(lineNumberObj);
+                Py_DECREF(lineNumberObj);
+            }
+            if (PyErr_Occurred()) {
+                PyErr_Clear();
+                lineNumber = -1;
+            }
+        }
+        code = PyFrame_GetCode(entry->tb_frame);
+        fileName = PyUnicode_AsEncodedString(code->co_filename,
+                Py_FileSystemDefaultEncoding, "replace");
+        name = PyUnicode_AsEncodedString(code->co_name, "utf-8", "replace");
+        result = -1;
+        if (fileName && name)
+            result = TextBuffer_AppendLine(buffer,
+                    "      File \"%s\", line %ld, in %s",
+                    PyBytes_AS_STRING(fileName), lineNumber,
+                    PyBytes_AS_STRING(name));
+        Py_XDECREF(fileName);
+        Py_XDECREF(name);
+        if (result == 0) {
+            line = GetSourceLine(code->co_filename, lineNumber);
+            if (line && PyUnicode_GET_LENGTH(line) > 0)
+                result = TextBuffer_AppendEncodedLine(buffer, "        ",
+                        line);
+            Py_XDECREF(line);
+        }
+        Py_DECREF(code);
+        if (result < 0)
+            return -1;
+    }
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// StartLoggingStdoutEx()
-//   Start logging to stdout.
+// TextBuffer_AppendExceptionOnly()
+//   Append the line describing the exception itself to the text buffer, in
+// the same form as the traceback module: the qualified name of the type,
+// including the module unless it is a builtin, followed by the value. If no
+// type is given, the type of the value is used.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) StartLoggingStdoutEx(
-    unsigned long level,                // level to use for logging
-    const char *prefix,                 // prefix to use for logging
-    ExceptionInfo *exceptionInfo)       // exception info (OUT)
+static int TextBuffer_AppendExceptionOnly(
+    TextBuffer *buffer,                 // buffer to append to
+    PyObject *type,                     // exception type (or NULL)
+    PyObject *value)                    // exception value (or NULL)
 {
-    LoggingState *loggingState, *origLoggingState;
+    PyObject *module, *name, *stringRep, *line;
+    int result;
 
-    loggingState = LoggingState_New(stdout, "<stdout>", level, 1, 0, prefix, 1,
-            1, exceptionInfo);
-    if (!loggingState)
+    if (!type)
+        type = (PyObject*) Py_TYPE((value) ? value : Py_None);
+    name = PyObject_GetAttrString(type, "__qualname__");
+    if (!name)
         return -1;
-    ACQUIRE_LOCK(gLoggingStateLock);
-    origLoggingState = gLoggingState;
-    gLoggingState = loggingState;
-    RELEASE_LOCK(gLoggingStateLock);
-    if (origLoggingState)
-        LoggingState_Free(origLoggingState);
-    return 0;
+    module = PyObject_GetAttrString(type, "__module__");
+    if (!module)
+        PyErr_Clear();
+    else if (PyUnicode_Check(module) &&
+            PyUnicode_CompareWithASCIIString(module, "builtins") != 0 &&
+            PyUnicode_CompareWithASCIIString(module, "__main__") != 0) {
+        Py_SETREF(name, PyUnicode_FromFormat("%U.%U", module, name));
+        if (!name) {
+            Py_DECREF(module);
+            return -1;
+        }
+    }
+    Py_XDECREF(module);
+    stringRep = (value) ? PyObject_Str(value) : NULL;
+    if (!stringRep)
+        PyErr_Clear();
+    if (!stringRep || PyUnicode_GET_LENGTH(stringRep) == 0) {
+        line = name;
+        Py_INCREF(line);
+    } else line = PyUnicode_FromFormat("%U: %U", name, stringRep);
+    Py_DECREF(name);
+    Py_XDECREF(stringRep);
+    if (!line)
+        return -1;
+    result = TextBuffer_AppendEncodedLine(buffer, "    ", line);
+    Py_DECREF(line);
+    return result;
 }
 
 
 //-----------------------------------------------------------------------------
-// StartLoggingFromEnvironment()
-//   Start logging using the parameters specified in the environment.
+// TextBuffer_AppendException()
+//   Append a Python exception with its traceback to the text buffer in the
+// same form as the traceback module, including any exceptions that caused it
+// or were being handled when it was raised, with the oldest first. If no
+// traceback is supplied, the one attached to the exception is used.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) StartLoggingFromEnvironment(void)
+static int TextBuffer_AppendException(
+    TextBuffer *buffer,                 // buffer to append to
+    PyObject *type,                     // exception type
+    PyObject *value,                    // exception value
+    PyObject *traceback)                // exception traceback
 {
-    char *fileName, *valueAsString, *temp, *prefix;
-    unsigned long level, maxFiles, maxFileSize;
+    const char *separators[MAX_CHAINED_EXCEPTIONS];
+    PyObject *chain[MAX_CHAINED_EXCEPTIONS], *next;
+    int numChained = 0, i, j;
+
+    // determine the chain of exceptions
+    if (value && PyExceptionInstance_Check(value)) {
+        chain[numChained++] = value;
+        while (numChained < MAX_CHAINED_EXCEPTIONS) {
+            value = chain[numChained - 1];
+            separators[numChained - 1] = "The above exception was the "
+                    "direct cause of the following exception:";
+            next = PyException_GetCause(value);
+            if (!next && !((PyBaseExceptionObject*) value)->suppress_context) {
+                separators[numChained - 1] = "During handling of the above "
+                        "exception, another exception occurred:";
+                next = PyException_GetContext(value);
+            }
+            if (!next)
+                break;
+            Py_DECREF(next);
+            for (j = 0; j < numChained && chain[j] != next; j++);
+            if (j < numChained)
+                break;
+            chain[numChained++] = next;
+        }
+    }
 
-    fileName = getenv(ENV_NAME_FILE_NAME);
-    if (!fileName)
-        return -1;
-    valueAsString = getenv(ENV_NAME_LEVEL);
-    if (!valueAsString)
-        return -1;
-    level = strtol(valueAsString, &temp, 10);
-    if (*temp)
-        return -1;
-    valueAsString = getenv(ENV_NAME_MAX_FILES);
-    if (!valueAsString) {
-        maxFiles = 1;
-    } else {
-        maxFiles = strtol(valueAsString, &temp, 10);
-        if (*temp)
+    // append the exceptions, oldest first
+    if (numChained == 0) {
+        if (traceback && traceback != Py_None &&
+                TextBuffer_AppendTraceback(buffer, traceback) < 0)
             return -1;
+        return TextBuffer_AppendExceptionOnly(buffer, type, value);
     }
-    valueAsString = getenv(ENV_NAME_MAX_FILE_SIZE);
-    if (!valueAsString) {
-        maxFileSize = DEFAULT_MAX_FILE_SIZE;
-    } else {
-        maxFileSize = strtol(valueAsString, &temp, 10);
-        if (*temp)
+    for (i = numChained - 1; i >= 0; i--) {
+        if (i == 0 && traceback && traceback != Py_None) {
+            next = traceback;
+            Py_INCREF(next);
+        } else next = PyException_GetTraceback(chain[i]);
+        if (next && next != Py_None &&
+                TextBuffer_AppendTraceback(buffer, next) < 0) {
+            Py_DECREF(next);
+            return -1;
+        }
+        Py_XDECREF(next);
+        if (TextBuffer_AppendExceptionOnly(buffer, (PyObject*)
+                Py_TYPE(chain[i]), chain[i]) < 0)
+            return -1;
+        if (i > 0 && (TextBuffer_AppendLine(buffer, "") < 0 ||
+                TextBuffer_AppendLine(buffer, "    %s",
+                        separators[i - 1]) < 0 ||
+                TextBuffer_AppendLine(buffer, "") < 0))
             return -1;
     }
-    prefix = getenv(ENV_NAME_PREFIX);
-    if (!prefix)
-        prefix = DEFAULT_PREFIX;
-    return StartLogging(fileName, level, maxFiles, maxFileSize, prefix);
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// StopLogging()
-//   Stop logging to the specified file.
+// GetExceptionFingerprint()
+//   Return a fingerprint of the exception made up of its type and the code
+// object and instruction of each entry in its traceback. Messages and local
+// variables are not included so exceptions raised at the same place with
+// different values have the same fingerprint.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(void) StopLogging(void)
+static unsigned long long GetExceptionFingerprint(
+    PyObject *type,                     // exception type
+    PyObject *traceback)                // exception traceback (or NULL)
 {
-    LoggingState *loggingState;
-
-    ACQUIRE_LOCK(gLoggingStateLock);
-    loggingState = gLoggingState;
-    gLoggingState = NULL;
-    RELEASE_LOCK(gLoggingStateLock);
-    if (loggingState)
-        LoggingState_Free(loggingState);
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    PyTracebackObject *entry;
+    PyCodeObject *code;
+
+    hash = (hash ^ (unsigned long long) (size_t) type) * FNV_PRIME;
+    if (traceback == Py_None)
+        traceback = NULL;
+    for (entry = (PyTracebackObject*) traceback; entry;
+            entry = entry->tb_next) {
+        code = PyFrame_GetCode(entry->tb_frame);
+        hash = (hash ^ (unsigned long long) (size_t) code) * FNV_PRIME;
+        hash = (hash ^ (unsigned long long) entry->tb_lasti) * FNV_PRIME;
+        Py_DECREF(code);
+    }
+    return hash;
 }
 
 
 //-----------------------------------------------------------------------------
-// StopLoggingForPythonThread()
-//   Stop logging to a different file for the current Python thread.
+// IsRepeatedException()
+//   Return a boolean indicating if the exception with the given fingerprint
+// was logged in full within the window, in which case the number of times it
+// has been repeated since is incremented. The id by which the exception is
+// referred to is returned in either case; an exception that is logged in full
+// again after the window has passed retains its id.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(void) StopLoggingForPythonThread(void)
+static int IsRepeatedException(
+    unsigned long long fingerprint,     // fingerprint of exception
+    unsigned long window,               // window in seconds
+    unsigned long *id,                  // id of exception (OUT)
+    unsigned long long *repeatCount)    // number of repeats (OUT)
 {
-    PyObject *dict;
-
-    dict = GetThreadStateDictionary();
-    if (dict && PyDict_DelItemString(dict, KEY_LOGGING_STATE) < 0) {
-        PyErr_Clear();
-        LogMessage(LOG_LEVEL_WARNING,
-                "tried to stop logging without starting first");
+    ExceptionCacheEntry *entry, *leastRecentlyUsed;
+    unsigned long long now;
+    int i;
+
+    now = GetTimeInNanoseconds();
+    leastRecentlyUsed = &gExceptionCache[0];
+    for (i = 0; i < EXCEPTION_CACHE_SIZE; i++) {
+        entry = &gExceptionCache[i];
+        if (entry->id && entry->fingerprint == fingerprint)
+            break;
+        if (entry->lastUsed < leastRecentlyUsed->lastUsed)
+            leastRecentlyUsed = entry;
     }
+    if (i == EXCEPTION_CACHE_SIZE) {
+        entry = leastRecentlyUsed;
+        entry->fingerprint = fingerprint;
+        entry->id = ++gLastExceptionId;
+    } else if (now - entry->loggedTime < window * 1000000000ULL) {
+        entry->lastUsed = ++gExceptionCacheTicks;
+        *id = entry->id;
+        *repeatCount = ++entry->repeatCount;
+        return 1;
+    }
+    entry->lastUsed = ++gExceptionCacheTicks;
+    entry->loggedTime = now;
+    entry->repeatCount = 0;
+    *id = entry->id;
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogMessageVaList()
-//   Log a message to the log file with a variable number of argument specified
-// as a va_list.
+// LogPythonExceptionWithTraceback()
+//   Log a Python exception with traceback, if possible. The traceback is
+// formatted without the use of the traceback module and the exception is
+// written as a single record. If exceptions are being deduplicated, an
+// exception that was logged in full within the window is only referred to.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogMessageVaList(
-    unsigned long level,                // level to check for
-    const char *format,                 // format of message to log
-    va_list arguments)                  // argument list
+CX_LOGGING_API(int) LogPythonExceptionWithTraceback(
+    const char *message,                // message to log
+    PyObject *type,                     // exception type
+    PyObject *value,                    // exception value
+    PyObject *traceback)                // exception traceback
 {
-    int result = 0;
+    udt_LoggingState *loggingState;
+    unsigned long long repeatCount;
+    PyObject *attachedTraceback;
+    unsigned long window, id = 0;
+    unsigned long numLines;
+    TextBuffer *buffer;
+    size_t length;
+    int ok;
+
+    BeginRecordForPython(LOG_LEVEL_ERROR);
+    buffer = GetRecordBuffer();
+    if (!buffer) {
+        CommitRecord();
+        return -1;
+    }
 
-    if (gLoggingState) {
-        ACQUIRE_LOCK(gLoggingStateLock);
-        if (gLoggingState && level >= gLoggingState->level)
-            result = WriteMessageWithFormat(gLoggingState, level, format,
-                    arguments);
-        RELEASE_LOCK(gLoggingStateLock);
+    // when no exception is being handled, None is logged as the traceback
+    // module does
+    if (!value)
+        value = Py_None;
+    if (!type)
+        type = (PyObject*) Py_TYPE(value);
+
+    // determine if the exception was logged recently
+    loggingState = GetLoggingState();
+    window = (loggingState) ?
+            loggingState->state->options.exceptionDedupWindow :
+            gLoggingOptions.exceptionDedupWindow;
+    if (window && type) {
+        attachedTraceback = NULL;
+        if ((!traceback || traceback == Py_None) && value &&
+                PyExceptionInstance_Check(value))
+            attachedTraceback = PyException_GetTraceback(value);
+        ok = IsRepeatedException(GetExceptionFingerprint(type,
+                (attachedTraceback) ? attachedTraceback : traceback), window,
+                &id, &repeatCount);
+        Py_XDECREF(attachedTraceback);
+        if (ok) {
+            TextBuffer_AppendLine(buffer, "exception #%lu repeated (%llu)",
+                    id, repeatCount);
+            CommitRecord();
+            return -1;
+        }
     }
 
-    return result;
+    // log the exception in full; if that fails, the lines appended so far are
+    // discarded and the exception is logged without traceback instead
+    length = buffer->length;
+    numLines = buffer->numLines;
+    ok = (TextBuffer_AppendLine(buffer,
+                    "Python exception encountered:") == 0 &&
+            TextBuffer_AppendLine(buffer, "    Internal Message: %s",
+                    message) == 0 &&
+            (!id || TextBuffer_AppendLine(buffer, "    Exception Id: #%lu",
+                    id) == 0) &&
+            TextBuffer_AppendPythonObject(buffer, "    ", "Type",
+                    type) == 0 &&
+            TextBuffer_AppendPythonObject(buffer, "    ", "Value",
+                    value) == 0 &&
+            TextBuffer_AppendException(buffer, type, value,
+                    traceback) == 0);
+    if (!ok) {
+        buffer->length = length;
+        buffer->numLines = numLines;
+        if (buffer->data)
+            buffer->data[length] = '\0';
+        if (!PyErr_Occurred())
+            PyErr_NoMemory();
+        LogPythonExceptionNoTraceback("cannot format traceback");
+    }
+    CommitRecord();
+
+    return -1;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogMessageV()
-//   Log a message to the log file with a variable number of arguments.
+// LogPythonException()
+//   Log a Python exception, first attempting to do so with traceback and if
+// that fails then without.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogMessageV(
-    unsigned long level,                // level at which to log
-    const char *format,                 // format of message to log
-    ...)                                // arguments required for format
+CX_LOGGING_API(int) LogPythonException(
+    const char *message)                // message to display
 {
-    va_list arguments;
-    int result;
+    PyObject *type, *value, *traceback;
 
-    va_start(arguments, format);
-    result = LogMessageVaList(level, format, arguments);
-    va_end(arguments);
-    return result;
+    PyErr_Fetch(&type, &value, &traceback);
+    PyErr_NormalizeException(&type, &value, &traceback);
+    LogPythonExceptionWithTraceback(message, type, value, traceback);
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+    return -1;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogMessageForPythonV()
-//   Log a message to the log file with a variable number of arguments. The
-// Python thread state is examined first to determine if special logging for
-// this thread is desired; if not, the normal LogMessageV() is invoked.
+// LogMessageFromErrorObj()
+//   Append the message from error object to the record.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogMessageForPythonV(
-    unsigned long level,                // level at which to log
-    const char *format,                 // format of message to log
-    ...)                                // arguments required for format
+static int LogMessageFromErrorObj(
+    TextBuffer *buffer,                 // buffer for record
+    PyObject *errorObj)                 // error object to log
 {
-    udt_LoggingState *loggingState;
-    va_list arguments;
-    int result = 0;
+    PyObject *message, *encodedMessage;
+    const char *text;
 
-    loggingState = GetLoggingState();
-    va_start(arguments, format);
-    if (loggingState) {
-        if (level >= loggingState->state->level) {
-           Py_BEGIN_ALLOW_THREADS
-           ACQUIRE_LOCK(loggingState->lock);
-           result = WriteMessageWithFormat(loggingState->state, level, format,
-                   arguments);
-           RELEASE_LOCK(loggingState->lock);
-           Py_END_ALLOW_THREADS
-        }
-    } else result = LogMessageVaList(level, format, arguments);
-    va_end(arguments);
+    message = PyObject_GetAttrString(errorObj, "message");
+    if (!message)
+        return LogPythonException("no message on error object");
+    if (GetEncodedStringForPython(message, &encodedMessage, &text) < 0) {
+        Py_DECREF(message);
+        return -1;
+    }
+    Py_DECREF(message);
+    TextBuffer_AppendLine(buffer, "    Message: %s", text);
+    Py_DECREF(encodedMessage);
+    return -1;
+}
 
-    return result;
+
+//-----------------------------------------------------------------------------
+// LogTemplateIdFromErrorObj()
+//   Append the template id from the error object to the record.
+//-----------------------------------------------------------------------------
+static int LogTemplateIdFromErrorObj(
+    TextBuffer *buffer,                 // buffer for record
+    PyObject *errorObj)                 // error object to examine
+{
+    PyObject *templateId;
+    int value;
+
+    templateId = PyObject_GetAttrString(errorObj, "templateId");
+    if (!templateId)
+        return LogPythonException("no templateId on error object");
+    value = PyLong_AsLong(templateId);
+    Py_DECREF(templateId);
+    if (PyErr_Occurred())
+        return LogPythonException("templateId attribute not an int");
+    TextBuffer_AppendLine(buffer, "    Template Id: %d", value);
+    return -1;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogMessage()
-//   Log a message to the log file.
+// TextBuffer_AppendArgument()
+//   Append a line describing one of the arguments stored on an error object to
+// the text buffer. Keys that are not strings are converted to strings first.
+// References to the key and value are held while the line is built since
+// converting them to strings may run arbitrary code.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogMessage(
-    unsigned long level,                // level at which to log
-    const char *message)                // message to log
+static int TextBuffer_AppendArgument(
+    TextBuffer *buffer,                 // buffer to append to
+    PyObject *key,                      // key of argument
+    PyObject *value)                    // value of argument
 {
-    int result = 0;
+    PyObject *keyStr, *encodedKey;
+    const char *keyText;
+    int result;
 
-    if (gLoggingState) {
-        ACQUIRE_LOCK(gLoggingStateLock);
-        if (gLoggingState && level >= gLoggingState->level)
-            result = WriteMessage(gLoggingState, level, message);
-        RELEASE_LOCK(gLoggingStateLock);
+    Py_INCREF(value);
+    if (PyUnicode_Check(key) || PyBytes_Check(key)) {
+        Py_INCREF(key);
+        keyStr = key;
+    } else keyStr = PyObject_Str(key);
+    result = (keyStr) ?
+            GetEncodedStringForPython(keyStr, &encodedKey, &keyText) : -1;
+    Py_XDECREF(keyStr);
+    if (result == 0) {
+        result = TextBuffer_AppendPythonObject(buffer, "        ", keyText,
+                value);
+        Py_DECREF(encodedKey);
     }
-
+    Py_DECREF(value);
     return result;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogDebug()
-//   Log a message at level LOG_LEVEL_DEBUG to the log file.
+// LogArgumentsFromErrorObj()
+//   Append the arguments stored on the error object to the record. The
+// dictionary is iterated directly, so the arguments appear in the order in
+// which they were added, unless sorting of the arguments was requested.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogDebug(
-    const char *message)                // message to log
+static int LogArgumentsFromErrorObj(
+    TextBuffer *buffer,                 // buffer for record
+    PyObject *errorObj,                 // error object to examine
+    int sortArguments)                  // sort arguments by key?
 {
-    return LogMessage(LOG_LEVEL_DEBUG, message);
+    PyObject *dict, *keys, *key, *value;
+    Py_ssize_t i, pos;
+    int result = 0;
+
+    dict = PyObject_GetAttrString(errorObj, "arguments");
+    if (!dict)
+        return LogPythonException("no arguments on error object");
+    if (!PyDict_Check(dict)) {
+        Py_DECREF(dict);
+        PyErr_SetString(PyExc_TypeError, "expecting a dictionary");
+        return LogPythonException("arguments attribute not a dictionary");
+    }
+    TextBuffer_AppendLine(buffer, "    Arguments:");
+    if (sortArguments) {
+        keys = PyDict_Keys(dict);
+        if (!keys || PyList_Sort(keys) < 0) {
+            Py_XDECREF(keys);
+            Py_DECREF(dict);
+            return LogPythonException("cannot sort arguments");
+        }
+        for (i = 0; i < PyList_GET_SIZE(keys) && result == 0; i++) {
+            key = PyList_GET_ITEM(keys, i);
+            value = PyDict_GetItemWithError(dict, key);
+            if (value)
+                result = TextBuffer_AppendArgument(buffer, key, value);
+            else if (PyErr_Occurred())
+                result = -1;
+        }
+        Py_DECREF(keys);
+    } else {
+        pos = 0;
+        while (result == 0 && PyDict_Next(dict, &pos, &key, &value))
+            result = TextBuffer_AppendArgument(buffer, key, value);
+    }
+    Py_DECREF(dict);
+    if (result < 0)
+        return LogPythonException("cannot log argument");
+    return -1;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogInfo()
-//   Log a message at level LOG_LEVEL_INFO to the log file.
+// LogListOfStringsFromErrorObj()
+//   Append the list of strings stored in the given attribute of the error
+// object to the record.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogInfo(
-    const char *message)                // message to log
+static int LogListOfStringsFromErrorObj(
+    TextBuffer *buffer,                 // buffer for record
+    PyObject *errorObj,                 // error object to examine
+    char *attributeName,                // attribute name to examine
+    const char *header)                 // header to log
 {
-    return LogMessage(LOG_LEVEL_INFO, message);
+    PyObject *list, *encodedValue, *value;
+    const char *text;
+    Py_ssize_t i, size;
+
+    list = PyObject_GetAttrString(errorObj, attributeName);
+    if (!list)
+        return LogPythonException("cannot get list from error object");
+    size = PyList_Size(list);
+    if (PyErr_Occurred()) {
+        Py_DECREF(list);
+        return LogPythonException("cannot get size of list");
+    }
+    TextBuffer_AppendLine(buffer, "    %s:", header);
+    for (i = 0; i < size; i++) {
+        value = PyList_GET_ITEM(list, i);
+        if (GetEncodedStringForPython(value, &encodedValue, &text) < 0) {
+            Py_DECREF(list);
+            return LogPythonException("cannot encode list entry");
+        }
+        TextBuffer_AppendLine(buffer, "        %s", text);
+        Py_DECREF(encodedValue);
+    }
+    Py_DECREF(list);
+    return -1;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogWarning()
-//   Log a message at level LOG_LEVEL_WARNING to the log file.
+// LogConfiguredException()
+//   Log a configured Python exception. All of the lines describing the
+// exception, including any describing problems examining it, are written as a
+// single record.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogWarning(
-    const char *message)                // message to log
+CX_LOGGING_API(int) LogConfiguredException(
+    PyObject *errorObj,                 // object to log
+    const char *message)                // message to prepend
 {
-    return LogMessage(LOG_LEVEL_WARNING, message);
+    udt_LoggingState *loggingState;
+    unsigned long logLevel;
+    PyObject *logLevelObj;
+    int sortArguments;
+    TextBuffer *buffer;
+
+    // determine the level at which to log
+    logLevelObj = PyObject_GetAttrString(errorObj, "logLevel");
+    if (logLevelObj) {
+        logLevel = PyLong_AsLong(logLevelObj);
+        Py_DECREF(logLevelObj);
+        if (PyErr_Occurred()) {
+            logLevel = LOG_LEVEL_ERROR;
+            LogPythonException("logLevel attribute is not an integer");
+        }
+    } else {
+        logLevel = LOG_LEVEL_ERROR;
+        LogMessageForPythonV(LOG_LEVEL_WARNING, "log level attribute missing");
+        PyErr_Clear();
+    }
+
+    // log the exception; nothing is examined if the record is not going to be
+    // written
+    BeginRecordForPython(logLevel);
+    buffer = GetRecordBuffer();
+    if (buffer) {
+        loggingState = GetLoggingState();
+        sortArguments = (loggingState) ?
+                loggingState->state->options.sortArguments :
+                gLoggingOptions.sortArguments;
+        TextBuffer_AppendLine(buffer, "%s", message);
+        LogMessageFromErrorObj(buffer, errorObj);
+        LogTemplateIdFromErrorObj(buffer, errorObj);
+        LogArgumentsFromErrorObj(buffer, errorObj, sortArguments);
+        LogListOfStringsFromErrorObj(buffer, errorObj, "traceback",
+                "Traceback");
+        LogListOfStringsFromErrorObj(buffer, errorObj, "details", "Details");
+    }
+    CommitRecord();
+    return -1;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogError()
-//   Log a message at level LOG_LEVEL_ERROR to the log file.
+// GetLoggingState()
+//   Get the current logging state for Python so that it can be retained
+// across thread boundaries (such as for COM servers).
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogError(
-    const char *message)                // message to log
+CX_LOGGING_API(udt_LoggingState*) GetLoggingState(void)
 {
-    return LogMessage(LOG_LEVEL_ERROR, message);
+    PyObject *dict;
+
+    dict = GetThreadStateDictionary();
+    if (!dict)
+        return NULL;
+    return (udt_LoggingState*) PyDict_GetItemString(dict, KEY_LOGGING_STATE);
 }
 
 
 //-----------------------------------------------------------------------------
-// LogCritical()
-//   Log a message at level LOG_LEVEL_CRITICAL to the log file.
+// SetLoggingState()
+//   Set the current logging state for Python. This is intended to be used as
+// the complement to GetLoggingState() so that logging state can be retained
+// across thread boundaries.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogCritical(
-    const char *message)                // message to log
+CX_LOGGING_API(int) SetLoggingState(
+    udt_LoggingState *loggingState)     // logging state to set
 {
-    return LogMessage(LOG_LEVEL_CRITICAL, message);
+    PyObject *dict;
+
+    dict = GetThreadStateDictionary();
+    if (!dict) {
+        PyErr_SetString(PyExc_RuntimeError,
+                "unable to get thread state dictionary");
+        return -1;
+    }
+    if (PyDict_SetItemString(dict, KEY_LOGGING_STATE,
+            (PyObject*) loggingState) < 0)
+        return LogPythonException("unable to set logging state for thread");
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogTrace()
-//   Log a message regardless of the current logging level to the log file.
+// IsLoggingStarted()
+//   Return a boolean indicating if logging is currently started.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogTrace(
-    const char *message)                // message to log
+CX_LOGGING_API(int) IsLoggingStarted(void)
 {
-    return LogMessage(LOG_LEVEL_NONE, message);
+    return (gLoggingState != NULL);
 }
 
 
 //-----------------------------------------------------------------------------
-// GetLoggingLevel()
-//   Return the current logging level.
+// AddLoggingSink()
+//   Add the sink to the global logging state. Ownership of the sink passes to
+// the logging state, even if it cannot be added, and it is freed when logging
+// is stopped.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(unsigned long) GetLoggingLevel(void)
+CX_LOGGING_API(int) AddLoggingSink(
+    LoggingSink *sink,                  // sink to add
+    ExceptionInfo *exceptionInfo)       // exception info
 {
-    unsigned long level = LOG_LEVEL_NONE;
+    int result = -1;
 
     ACQUIRE_LOCK(gLoggingStateLock);
-    if (gLoggingState)
-        level = gLoggingState->level;
+    if (!gLoggingState)
+        strcpy(exceptionInfo->message, "Logging has not been started.");
+    else result = LoggingState_AddSink(gLoggingState, sink, exceptionInfo);
     RELEASE_LOCK(gLoggingStateLock);
-    return level;
+    if (result < 0)
+        FreeLoggingSink(sink);
+    return result;
 }
 
 
 //-----------------------------------------------------------------------------
-// SetLoggingLevel()
-//   Set the current logging level.
+// AddLoggingSinkForPython()
+//   Add the sink to the current logging state for Python. Ownership of the
+// sink passes to the logging state, even if it cannot be added, in which case
+// a Python exception is raised.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) SetLoggingLevel(
-    unsigned long newLevel)             // new level to use
+CX_LOGGING_API(int) AddLoggingSinkForPython(
+    LoggingSink *sink)                  // sink to add
 {
-    int result = 0;
-
-    ACQUIRE_LOCK(gLoggingStateLock);
-    if (gLoggingState)
-        result = LoggingState_SetLevel(gLoggingState, newLevel);
-    RELEASE_LOCK(gLoggingStateLock);
+    udt_LoggingState *loggingState;
+    ExceptionInfo exceptionInfo;
+    int result = -1;
 
+    loggingState = GetLoggingState();
+    Py_BEGIN_ALLOW_THREADS
+    if (loggingState) {
+        ACQUIRE_LOCK(loggingState->lock);
+        result = LoggingState_AddSink(loggingState->state, sink,
+                &exceptionInfo);
+        RELEASE_LOCK(loggingState->lock);
+    } else {
+        ACQUIRE_LOCK(gLoggingStateLock);
+        if (!gLoggingState)
+            strcpy(exceptionInfo.message, "Logging has not been started.");
+        else result = LoggingState_AddSink(gLoggingState, sink,
+                &exceptionInfo);
+        RELEASE_LOCK(gLoggingStateLock);
+    }
+    Py_END_ALLOW_THREADS
+    if (result < 0) {
+        FreeLoggingSink(sink);
+        PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
+    }
     return result;
 }
 
 
-#if defined MS_WINDOWS && !defined UNDER_CE
 //-----------------------------------------------------------------------------
-// LogWin32Error()
-//   Log an error message from the Win32 subsystem and return -1.
+// EnableLoggingStats()
+//   Enable or disable the collection of logging statistics.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogWin32Error(
-    DWORD errorCode,                    // Win32 error code to log
-    const char *message)                // message to log
+CX_LOGGING_API(void) EnableLoggingStats(
+    int enabled)                        // enable statistics?
 {
-    DWORD status;
-    char *buffer;
-
-    LogMessageV(LOG_LEVEL_ERROR, "Win32 error 0x%x encountered.", errorCode);
-    LogMessageV(LOG_LEVEL_ERROR, "    Context: %s", message);
-    status = FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
-            FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-            NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-            (void*) &buffer, 0, NULL);
-    if (status == 0)
-        LogMessage(LOG_LEVEL_ERROR, "    Message: FormatMessage() failed");
-    else {
-        LogMessageV(LOG_LEVEL_ERROR, "    Message: %s", buffer);
-        LocalFree(buffer);
-    }
-    return -1;
+    gLoggingStatsEnabled = enabled;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogGUID()
-//   Log a GUID in human readable format to the log file.
+// GetLoggingStats()
+//   Return a copy of the logging statistics collected so far.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogGUID(
-    unsigned long level,                // level at which to log
-    const char *prefix,                 // prefix to print in front of it
-    const IID *iid)                     // interface to print
+CX_LOGGING_API(void) GetLoggingStats(
+    LoggingStats *stats)                // statistics (OUT)
 {
-    WCHAR str[128];
-    char outstr[128];
-    size_t strLength;
-    int result = 0;
-
-    ACQUIRE_LOCK(gLoggingStateLock);
-    if (gLoggingState && level >= gLoggingState->level) {
-        if (StringFromGUID2(iid, str, sizeof(str)) == 0) {
-            result = LogMessageV(LOG_LEVEL_ERROR, "%s: huh? string too long?",
-                    prefix);
-        } else {
-            strLength = wcslen(str) + 1;
-            if (WideCharToMultiByte(CP_ACP, 0, str, (int) strLength, outstr,
-                    (int) strLength, NULL, NULL) == 0) {
-                result = LogMessageV(LOG_LEVEL_ERROR,
-                        "%s: huh? can't convert string?", prefix);
-            } else result = LogMessageV(level, "%s: %s", prefix, outstr);
-        }
-    }
-    RELEASE_LOCK(gLoggingStateLock);
-
-    return result;
+    memcpy(stats, &gLoggingStats, sizeof(LoggingStats));
 }
-#endif
-
 
 
 //-----------------------------------------------------------------------------
-// LogPythonObject()
-//   Log the string representation of the Python object to the log file.
+// ResetLoggingStats()
+//   Reset the logging statistics collected so far.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogPythonObject(
-    unsigned long logLevel,             // log level
-    const char *prefix,                 // prefix for message
-    const char *name,                   // name to display
-    PyObject *object)                   // object to log
+CX_LOGGING_API(void) ResetLoggingStats(void)
 {
-    PyObject *stringRep, *encodedStringRep;
-    int result = 0;
+    memset(&gLoggingStats, 0, sizeof(LoggingStats));
+}
 
-    if (!object) {
-        result = LogMessageForPythonV(logLevel, "%s%s => NULL", prefix, name);
-    } else if (IsLoggingAtLevelForPython(logLevel)) {
-        stringRep = PyObject_Str(object);
-        if (stringRep) {
-            if (GetEncodedStringForPython(stringRep, &encodedStringRep) < 0) {
-                Py_DECREF(stringRep);
-                return -1;
-            }
-            Py_DECREF(stringRep);
-            result = LogMessageForPythonV(logLevel, "%s%s => %s", prefix, name,
-                    PyBytes_AS_STRING(encodedStringRep));
-            Py_DECREF(encodedStringRep);
-        } else {
-            result = LogMessageForPythonV(logLevel,
-                    "%s%s => unable to stringify", prefix, name);
-            PyErr_Clear();
+
+//-----------------------------------------------------------------------------
+// GetLoggingCounters()
+//   Return a copy of the counters kept by the global logging state. If logging
+// has not been started, all of the counters are zero.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(int) GetLoggingCounters(
+    LoggingCounters *counters)          // counters (OUT)
+{
+    int i;
+
+    ACQUIRE_LOCK(gLoggingStateLock);
+    if (gLoggingState) {
+        memcpy(counters, &gLoggingState->counters, sizeof(LoggingCounters));
+        for (i = 0; i < LOG_NUM_LEVEL_INDEXES; i++) {
+            counters->suppressed[i] +=
+                    gLoggingUnlockedCounters.suppressed[i];
+            counters->sampled[i] += gLoggingUnlockedCounters.sampled[i];
         }
-    }
+    } else memset(counters, 0, sizeof(LoggingCounters));
+    RELEASE_LOCK(gLoggingStateLock);
+    return 0;
+}
 
-    return result;
+
+//-----------------------------------------------------------------------------
+// GetLatencyHistogramLowerBound()
+//   Return the smallest number of nanoseconds recorded in the given bucket.
+//-----------------------------------------------------------------------------
+CX_LOGGING_API(unsigned long long) GetLatencyHistogramLowerBound(
+    int bucket)                         // bucket to examine
+{
+    int msb;
+
+    if (bucket < 4)
+        return (unsigned long long) bucket;
+    msb = (bucket - 4) / 4 + 2;
+    return (1ULL << msb) | ((unsigned long long) ((bucket - 4) % 4) <<
+            (msb - 2));
 }
 
 
+#ifndef MS_WINDOWS
 //-----------------------------------------------------------------------------
-// BaseLogPythonException()
-//   Base method for logging a Python exception.
+// LoggingCollector_Free()
+//   Free the collector, removing the shared memory it created.
 //-----------------------------------------------------------------------------
-static int BaseLogPythonException(
-    const char *message,                // message to log
-    PyObject *type,                     // exception type
-    PyObject *value)                    // exception value
+static void LoggingCollector_Free(
+    LoggingCollector *collector)        // collector to free
 {
-    LogMessageForPythonV(LOG_LEVEL_ERROR, "Python exception encountered:");
-    LogMessageForPythonV(LOG_LEVEL_ERROR, "    Internal Message: %s", message);
-    LogPythonObject(LOG_LEVEL_ERROR, "    ", "Type", type);
-    LogPythonObject(LOG_LEVEL_ERROR, "    ", "Value", value);
-    return -1;
+    if (collector->state)
+        LoggingState_Free(collector->state);
+    if (collector->header) {
+        munmap(collector->header, collector->size);
+        shm_unlink(collector->name);
+    }
+    if (collector->pendingTails)
+        free(collector->pendingTails);
+    if (collector->iovecs)
+        free(collector->iovecs);
+    if (collector->text)
+        free(collector->text);
+    free(collector);
 }
 
 
 //-----------------------------------------------------------------------------
-// LogPythonExceptionNoTraceback()
-//   Log a Python exception without traceback.
+// LoggingCollector_New()
+//   Create a new collector which writes to the specified file the messages
+// that other processes place in the shared memory of the given name. Any
+// existing shared memory of that name is replaced.
 //-----------------------------------------------------------------------------
-static int LogPythonExceptionNoTraceback(
-    const char *message)                // message to log
+static LoggingCollector *LoggingCollector_New(
+    const char *name,                   // name of shared memory
+    const char *fileName,               // name of file to write to
+    unsigned long maxFiles,             // maximum number of files
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix,                 // prefix to use
+    unsigned long maxProcesses,         // maximum number of processes
+    unsigned long ringSize,             // size of ring for each process
+    ExceptionInfo *exceptionInfo)       // exception info
 {
-    PyObject *type, *value, *traceback;
+    LoggingCollector *collector;
+    void *memory;
+    int fd;
 
-    PyErr_Fetch(&type, &value, &traceback);
-    PyErr_NormalizeException(&type, &value, &traceback);
-    BaseLogPythonException(message, type, value);
-    Py_XDECREF(type);
-    Py_XDECREF(value);
-    Py_XDECREF(traceback);
-    return -1;
+    // verify parameters
+    if (maxProcesses == 0) {
+        strcpy(exceptionInfo->message,
+                "Maximum number of processes must be at least 1.");
+        return NULL;
+    }
+    ringSize = (ringSize + 7) & ~7UL;
+    if (ringSize < 4096) {
+        strcpy(exceptionInfo->message,
+                "Ring size must be at least 4096 bytes.");
+        return NULL;
+    }
+
+    // initialize the collector
+    collector = (LoggingCollector*) calloc(1, sizeof(LoggingCollector));
+    if (!collector) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for collector.");
+        return NULL;
+    }
+    if (GetSharedMemoryName(name, collector->name, exceptionInfo) < 0) {
+        free(collector);
+        return NULL;
+    }
+
+    // open the file
+    collector->state = LoggingState_New(NULL, fileName, LOG_LEVEL_DEBUG,
+            maxFiles, maxFileSize, prefix, 1, 1, NULL, exceptionInfo);
+    if (!collector->state) {
+        LoggingCollector_Free(collector);
+        return NULL;
+    }
+    collector->position = ftell(collector->state->fp);
+
+    // allocate space for the batch; the text holds the prefixes and notices
+    // and always has room for at least one of each
+    collector->textSize = COLLECTOR_TEXT_SIZE +
+            collector->state->maxPrefixLength + COLLECTOR_NOTICE_SIZE;
+    collector->text = malloc(collector->textSize);
+    collector->iovecs = malloc(COLLECTOR_IOVECS * sizeof(struct iovec));
+    collector->pendingTails = calloc(maxProcesses,
+            sizeof(unsigned long long));
+    if (!collector->text || !collector->iovecs || !collector->pendingTails) {
+        strcpy(exceptionInfo->message,
+                "Failed to allocate memory for collector batch.");
+        LoggingCollector_Free(collector);
+        return NULL;
+    }
+
+    // create the shared memory, replacing any that was left behind by a
+    // collector that did not terminate normally
+    fd = shm_open(collector->name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0 && errno == EEXIST) {
+        shm_unlink(collector->name);
+        fd = shm_open(collector->name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    }
+    if (fd < 0) {
+        sprintf(exceptionInfo->message,
+                "Failed to create shared memory %s: OS error %d",
+                collector->name, errno);
+        LoggingCollector_Free(collector);
+        return NULL;
+    }
+    collector->size = sizeof(SharedMemoryHeader) +
+            maxProcesses * (sizeof(SharedRing) + ringSize);
+    if (ftruncate(fd, collector->size) < 0) {
+        sprintf(exceptionInfo->message,
+                "Failed to size shared memory %s: OS error %d",
+                collector->name, errno);
+        close(fd);
+        shm_unlink(collector->name);
+        LoggingCollector_Free(collector);
+        return NULL;
+    }
+    memory = mmap(NULL, collector->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        sprintf(exceptionInfo->message,
+                "Failed to map shared memory %s: OS error %d",
+                collector->name, errno);
+        shm_unlink(collector->name);
+        LoggingCollector_Free(collector);
+        return NULL;
+    }
+
+    // the magic number is set last so that processes do not attach to the
+    // shared memory before it has been initialized
+    collector->header = (SharedMemoryHeader*) memory;
+    collector->header->numRings = maxProcesses;
+    collector->header->ringSize = ringSize;
+    ATOMIC_FENCE();
+    ATOMIC_STORE(collector->header->magic, LOG_SHARED_MEMORY_MAGIC);
+
+    return collector;
 }
 
 
 //-----------------------------------------------------------------------------
-// SetArgumentValue()
-//   Set an argument value for the call to make. All NULL values are
-// transformed into None values automatically.
+// LoggingCollector_Submit()
+//   Write the batch to the file with as few vectored writes as possible and
+// then advance the tail of each ring whose messages were in the batch so that
+// the space they occupied can be reused. Anything written to the file through
+// the C library, such as the messages written when files are rotated, is
+// flushed first so that the order of the file is maintained.
 //-----------------------------------------------------------------------------
-static void SetArgumentValue(
-    PyObject *args,                     // argument tuple to modify
-    int position,                       // position in tuple to modify
-    PyObject *value)                    // value to place in tuple
+static int LoggingCollector_Submit(
+    LoggingCollector *collector)        // collector to use
 {
-    if (!value)
-        value = Py_None;
-    Py_INCREF(value);
-    PyTuple_SET_ITEM(args, position, value);
+    LoggingState *state = collector->state;
+    struct iovec *iov;
+    unsigned long long i;
+    SharedRing *ring;
+
+    if (collector->numIovecs > 0) {
+        if (collector->needsNewline) {
+            iov = &collector->iovecs[collector->numIovecs++];
+            iov->iov_base = "\n";
+            iov->iov_len = 1;
+            collector->batchBytes++;
+            collector->needsNewline = 0;
+        }
+        if (fflush(state->fp) == EOF) {
+            sprintf(state->exceptionInfo.message,
+                    "Cannot flush file %s", state->fileName);
+            return -1;
+        }
+        if (WriteVectors(state, collector->iovecs, collector->numIovecs) < 0)
+            return -1;
+        collector->position += collector->batchBytes;
+        state->bytesWritten += collector->batchBytes;
+        state->counters.flushes++;
+        collector->numIovecs = 0;
+        collector->textUsed = 0;
+        collector->batchBytes = 0;
+    }
+    for (i = 0; i < collector->header->numRings; i++) {
+        ring = GetSharedRing(collector->header, i);
+        if (ring->tail != collector->pendingTails[i])
+            ATOMIC_STORE(ring->tail, collector->pendingTails[i]);
+    }
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogPythonExceptionWithTraceback()
-//   Log a Python exception with traceback, if possible.
+// LoggingCollector_Reserve()
+//   Make sure the batch has room for another message, writing the batch and
+// rotating files first if necessary. The newline ending the previous message
+// is placed in front of the prefix of the next one so that each message
+// usually requires only two entries in the batch.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogPythonExceptionWithTraceback(
-    const char *message,                // message to log
-    PyObject *type,                     // exception type
-    PyObject *value,                    // exception value
-    PyObject *traceback)                // exception traceback
+static int LoggingCollector_Reserve(
+    LoggingCollector *collector)        // collector to use
 {
-    PyObject *module, *method, *args, *result, *line, *encodedLine;
-    Py_ssize_t i, numElements;
+    LoggingState *state = collector->state;
 
-    BaseLogPythonException(message, type, value);
-    module = PyImport_ImportModule("traceback");
-    if (!module)
-        return LogPythonExceptionNoTraceback("get traceback module");
-    method = PyObject_GetAttrString(module, "format_exception");
-    Py_DECREF(module);
-    if (!method)
-        return LogPythonExceptionNoTraceback("get traceback method");
-    args = PyTuple_New(3);
-    if (!args) {
-        Py_DECREF(method);
-        return LogPythonExceptionNoTraceback("cannot create args tuple");
-    }
-    SetArgumentValue(args, 0, type);
-    SetArgumentValue(args, 1, value);
-    SetArgumentValue(args, 2, traceback);
-    result = PyObject_CallObject(method, args);
-    Py_DECREF(method);
-    Py_DECREF(args);
-    if (!result)
-        return LogPythonExceptionNoTraceback("traceback method failed");
-    numElements = PyList_Size(result);
-    if (PyErr_Occurred()) {
-        Py_DECREF(result);
-        return LogPythonExceptionNoTraceback("cannot determine size");
+    if (collector->numIovecs + 4 > COLLECTOR_IOVECS ||
+            collector->textUsed + state->maxPrefixLength +
+                    COLLECTOR_NOTICE_SIZE > collector->textSize) {
+        if (LoggingCollector_Submit(collector) < 0)
+            return -1;
     }
-    for (i = 0; i < numElements; i++) {
-        line = PyList_GET_ITEM(result, i);
-        if (GetEncodedStringForPython(line, &encodedLine) < 0)
+    if (state->rotateFiles && state->maxFiles > 1 &&
+            collector->position + collector->batchBytes >=
+                    state->maxFileSize) {
+        if (LoggingCollector_Submit(collector) < 0)
+            return -1;
+        if (CheckForLogFileFull(state) < 0)
             return -1;
-        LogMessageForPythonV(LOG_LEVEL_ERROR, "    %s",
-                PyBytes_AS_STRING(encodedLine));
-        Py_DECREF(encodedLine);
+        collector->position = ftell(state->fp);
     }
-    Py_DECREF(result);
-
-    return -1;
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogPythonException()
-//   Log a Python exception, first attempting to do so with traceback and if
-// that fails then without.
+// LoggingCollector_AddText()
+//   Add the newline ending the previous message (if needed), the prefix and
+// the text (if any) to the batch and return the number of bytes added, not
+// counting the newline.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogPythonException(
-    const char *message)                // message to display
+static size_t LoggingCollector_AddText(
+    LoggingCollector *collector,        // collector to use
+    const SharedRecord *record,         // record being added
+    const char *text)                   // text to add after prefix (or NULL)
 {
-    PyObject *type, *value, *traceback;
-
-    PyErr_Fetch(&type, &value, &traceback);
-    PyErr_NormalizeException(&type, &value, &traceback);
-    LogPythonExceptionWithTraceback(message, type, value, traceback);
-    Py_XDECREF(type);
-    Py_XDECREF(value);
-    Py_XDECREF(traceback);
-    return -1;
+    char *start, *ptr;
+    size_t length;
+
+    start = ptr = collector->text + collector->textUsed;
+    if (collector->needsNewline)
+        *ptr++ = '\n';
+    ptr += FormatPrefix(collector->state, record->level, record, ptr);
+    if (text) {
+        strcpy(ptr, text);
+        ptr += strlen(text);
+    }
+    length = ptr - start;
+    collector->iovecs[collector->numIovecs].iov_base = start;
+    collector->iovecs[collector->numIovecs++].iov_len = length;
+    collector->textUsed += length;
+    collector->batchBytes += length;
+    length -= collector->needsNewline;
+    collector->needsNewline = 1;
+    return length;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogMessageFromErrorObj()
-//   Log the message from error object.
+// LoggingCollector_AddLines()
+//   Add a chunk of the text of a record received from another process to the
+// batch, referencing it directly in the ring. The text of a record may
+// contain multiple lines; the prefix is added after each line feed so that
+// each line has a prefix, as when the record is written to a file directly.
+// Since only the collector writes to the file, the batch may be written
+// part way through a record without the record being interleaved with other
+// messages. The number of bytes added is returned, or -1 if an error occurs.
 //-----------------------------------------------------------------------------
-static int LogMessageFromErrorObj(
-    unsigned long level,                // log level
-    PyObject *errorObj)                 // error object to log
+static long LoggingCollector_AddLines(
+    LoggingCollector *collector,        // collector to use
+    const SharedRecord *record,         // record being added
+    char *data,                         // chunk of text of record
+    size_t length,                      // length of chunk
+    unsigned long *numLines)            // number of lines in record (IN/OUT)
 {
-    PyObject *message, *encodedMessage;
+    LoggingState *state = collector->state;
+    size_t lineLength;
+    long bytes = 0;
+    char *newline;
+
+    while (length > 0) {
+        newline = memchr(data, '\n', length);
+        lineLength = (newline) ? (size_t) (newline - data) + 1 : length;
+        collector->iovecs[collector->numIovecs].iov_base = data;
+        collector->iovecs[collector->numIovecs++].iov_len = lineLength;
+        collector->batchBytes += lineLength;
+        bytes += (long) lineLength;
+        data += lineLength;
+        length -= lineLength;
+        if (!newline)
+            break;
+        collector->needsNewline = 0;
+        if (collector->numIovecs + 4 > COLLECTOR_IOVECS ||
+                collector->textUsed + state->maxPrefixLength +
+                        COLLECTOR_NOTICE_SIZE > collector->textSize) {
+            if (LoggingCollector_Submit(collector) < 0)
+                return -1;
+        }
+        bytes += (long) LoggingCollector_AddText(collector, record, NULL);
+        (*numLines)++;
+    }
+    return bytes;
+}
 
-    message = PyObject_GetAttrString(errorObj, "message");
-    if (!message)
-        return LogPythonException("no message on error object");
-    if (GetEncodedStringForPython(message, &encodedMessage) < 0) {
-        Py_DECREF(message);
+
+//-----------------------------------------------------------------------------
+// LoggingCollector_AddRecord()
+//   Add a record received from another process to the batch. The message is
+// not copied but referenced directly in the ring, which means that it may
+// require two chunks if it wraps around the end of the ring.
+//-----------------------------------------------------------------------------
+static int LoggingCollector_AddRecord(
+    LoggingCollector *collector,        // collector to use
+    SharedRing *ring,                   // ring containing record
+    unsigned long long position,        // position of message in the ring
+    const SharedRecord *record)         // record to add
+{
+    unsigned long long ringSize = collector->header->ringSize;
+    char *data = (char*) (ring + 1);
+    unsigned long numLines = 1;
+    long bytes, chunkBytes;
+    size_t offset, chunk;
+    int levelIndex;
+
+    if (LoggingCollector_Reserve(collector) < 0)
         return -1;
-    }
-    Py_DECREF(message);
-    LogMessageForPythonV(level, "    Message: %s",
-            PyBytes_AS_STRING(encodedMessage));
-    Py_DECREF(encodedMessage);
-    return -1;
+    bytes = (long) LoggingCollector_AddText(collector, record, NULL) + 1;
+    offset = (size_t) (position % ringSize);
+    chunk = (size_t) ringSize - offset;
+    if (chunk > record->length)
+        chunk = record->length;
+    chunkBytes = LoggingCollector_AddLines(collector, record, data + offset,
+            chunk, &numLines);
+    if (chunkBytes < 0)
+        return -1;
+    bytes += chunkBytes;
+    chunkBytes = LoggingCollector_AddLines(collector, record, data,
+            record->length - chunk, &numLines);
+    if (chunkBytes < 0)
+        return -1;
+    bytes += chunkBytes;
+    levelIndex = GetLevelIndex(record->level);
+    collector->state->counters.messages[levelIndex] += numLines;
+    collector->state->counters.bytes[levelIndex] += bytes;
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogTemplateIdFromErrorObj()
-//   Log the template id from the error object.
+// LoggingCollector_AddNotice()
+//   Add a notice about the ring used by another process to the batch.
 //-----------------------------------------------------------------------------
-static int LogTemplateIdFromErrorObj(
-    unsigned long level,                // log level
-    PyObject *errorObj)                 // error object to examine
+static int LoggingCollector_AddNotice(
+    LoggingCollector *collector,        // collector to use
+    long long processId,                // process which owns ring
+    const char *message)                // message to add
 {
-    PyObject *templateId;
-    int value;
+    struct timeval timeOfDay;
+    SharedRecord record;
 
-    templateId = PyObject_GetAttrString(errorObj, "templateId");
-    if (!templateId)
-        return LogPythonException("no templateId on error object");
-    value = PyLong_AsLong(templateId);
-    Py_DECREF(templateId);
-    if (PyErr_Occurred())
-        return LogPythonException("templateId attribute not an int");
-    LogMessageForPythonV(level, "    Template Id: %d", value);
-    return -1;
+    if (LoggingCollector_Reserve(collector) < 0)
+        return -1;
+    gettimeofday(&timeOfDay, NULL);
+    record.timestamp = (unsigned long long) timeOfDay.tv_sec * 1000000ULL +
+            timeOfDay.tv_usec;
+    record.processId = processId;
+    record.threadId = 0;
+    record.level = LOG_LEVEL_WARNING;
+    record.length = (unsigned int) strlen(message);
+    LoggingCollector_AddText(collector, &record, message);
+    return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogArgumentsFromErrorObj()
-//   Log the arguments stored on the error object.
+// LoggingCollector_DrainRing()
+//   Add all of the records available in the ring to the batch and return the
+// number of records added, or -1 if an error occurs. Once the process which
+// owns the ring has detached from it or terminated and the ring is empty the
+// ring is released so that another process can claim it; since a process
+// only writes to the space freed by advancing the tail, this is safe even if
+// the batch has not been written yet.
 //-----------------------------------------------------------------------------
-static int LogArgumentsFromErrorObj(
-    unsigned long level,                // log level
-    PyObject *errorObj)                 // error object to examine
+static long LoggingCollector_DrainRing(
+    LoggingCollector *collector,        // collector to use
+    unsigned long long ringIndex)       // index of ring to drain
 {
-    PyObject *dict, *items, *item, *key, *encodedKey, *value;
-    Py_ssize_t i, size;
+    unsigned long long head, tail, ringSize, recordSize, dropped;
+    long long ownerPid, processId;
+    SharedRecord record;
+    long numRecords = 0;
+    SharedRing *ring;
+    char temp[100];
+
+    ring = GetSharedRing(collector->header, ringIndex);
+    ownerPid = ATOMIC_LOAD(ring->ownerPid);
+    if (ownerPid == 0)
+        return 0;
+    processId = (ownerPid < 0) ? -ownerPid : ownerPid;
+    ringSize = collector->header->ringSize;
+    head = ATOMIC_LOAD(ring->head);
+    tail = collector->pendingTails[ringIndex];
+    while (tail != head) {
+
+        // verify the record is intact; if it is not, the rest of the ring
+        // is skipped
+        recordSize = head - tail + 1;
+        if (head - tail >= sizeof(SharedRecord)) {
+            SharedRing_Copy((char*) (ring + 1), ringSize, tail,
+                    (char*) &record, sizeof(SharedRecord), 0);
+            recordSize = (sizeof(SharedRecord) + record.length + 7) & ~7ULL;
+        }
+        if (recordSize > head - tail) {
+            tail = head;
+            if (LoggingCollector_AddNotice(collector, processId,
+                    "shared memory ring is corrupt; messages were lost") < 0)
+                return -1;
+            break;
+        }
 
-    dict = PyObject_GetAttrString(errorObj, "arguments");
-    if (!dict)
-        return LogPythonException("no arguments on error object");
-    items = PyDict_Items(dict);
-    Py_DECREF(dict);
-    if (!items)
-        return LogPythonException("cannot get items from dictionary");
-    if (PyList_Sort(items) < 0) {
-        Py_DECREF(items);
-        return LogPythonException("cannot sort items");
-    }
-    size = PyList_Size(items);
-    if (PyErr_Occurred()) {
-        Py_DECREF(items);
-        return LogPythonException("cannot get length of items");
+        // add the record to the batch
+        if (LoggingCollector_AddRecord(collector, ring,
+                tail + sizeof(SharedRecord), &record) < 0)
+            return -1;
+        tail += recordSize;
+        numRecords++;
     }
-    LogMessageForPythonV(level, "    Arguments:");
-    for (i = 0; i < size; i++) {
-        item = PyList_GET_ITEM(items, i);
-        key = PyTuple_GET_ITEM(item, 0);
-        value = PyTuple_GET_ITEM(item, 1);
-        if (GetEncodedStringForPython(key, &encodedKey) < 0)
+    collector->pendingTails[ringIndex] = tail;
+
+    // report any messages dropped because the ring was full
+    dropped = (ring->dropped) ? ATOMIC_EXCHANGE(ring->dropped, 0) : 0;
+    if (dropped) {
+        collector->state->counters.dropped += dropped;
+        sprintf(temp, "shared memory ring full: %llu messages were dropped",
+                dropped);
+        if (LoggingCollector_AddNotice(collector, processId, temp) < 0)
             return -1;
-        LogPythonObject(level, "        ", PyBytes_AS_STRING(encodedKey),
-                value);
-        Py_DECREF(encodedKey);
     }
-    Py_DECREF(items);
-    return -1;
+
+    // release the ring once it is no longer in use
+    if (ownerPid < 0 || (kill((pid_t) ownerPid, 0) < 0 && errno == ESRCH)) {
+        if (ATOMIC_LOAD(ring->head) == tail)
+            ATOMIC_CAS(ring->ownerPid, ownerPid, 0);
+    }
+
+    return numRecords;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogListOfStringsFromErrorObj()
-//   Get the template id from the error object.
+// LoggingCollector_Drain()
+//   Write all of the records available in shared memory to the file and
+// return the number of records written, or -1 if an error occurs.
 //-----------------------------------------------------------------------------
-static int LogListOfStringsFromErrorObj(
-    unsigned long level,                // log level
-    PyObject *errorObj,                 // error object to examine
-    char *attributeName,                // attribute name to examine
-    const char *header)                 // header to log
+static long LoggingCollector_Drain(
+    LoggingCollector *collector)        // collector to use
 {
-    PyObject *list, *encodedValue, *value;
-    Py_ssize_t i, size;
+    long numRecords, totalRecords = 0;
+    unsigned long long i;
 
-    list = PyObject_GetAttrString(errorObj, attributeName);
-    if (!list)
-        return LogPythonException("cannot get list from error object");
-    size = PyList_Size(list);
-    if (PyErr_Occurred()) {
-        Py_DECREF(list);
-        return LogPythonException("cannot get size of list");
-    }
-    LogMessageForPythonV(level, "    %s:", header);
-    for (i = 0; i < size; i++) {
-        value = PyList_GET_ITEM(list, i);
-        if (GetEncodedStringForPython(value, &encodedValue) < 0)
+    for (i = 0; i < collector->header->numRings; i++) {
+        numRecords = LoggingCollector_DrainRing(collector, i);
+        if (numRecords < 0)
             return -1;
-        LogMessageForPythonV(level, "        %s",
-                PyBytes_AS_STRING(encodedValue));
-        Py_DECREF(encodedValue);
+        totalRecords += numRecords;
     }
-    Py_DECREF(list);
-    return -1;
+    if (LoggingCollector_Submit(collector) < 0)
+        return -1;
+    return totalRecords;
 }
 
 
 //-----------------------------------------------------------------------------
-// LogConfiguredException()
-//   Log a configured Python exception.
+// LoggingCollector_Wait()
+//   Wait a short time for more records to be placed in shared memory.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) LogConfiguredException(
-    PyObject *errorObj,                 // object to log
-    const char *message)                // message to prepend
+static void LoggingCollector_Wait(void)
 {
-    unsigned long logLevel;
-    PyObject *logLevelObj;
-
-    // determine the level at which to log
-    logLevelObj = PyObject_GetAttrString(errorObj, "logLevel");
-    if (logLevelObj) {
-        logLevel = PyLong_AsLong(logLevelObj);
-        if (PyErr_Occurred()) {
-            logLevel = LOG_LEVEL_ERROR;
-            LogPythonException("logLevel attribute is not an integer");
-        }
-    } else {
-        logLevel = LOG_LEVEL_ERROR;
-        LogMessageForPythonV(LOG_LEVEL_WARNING, "log level attribute missing");
-        PyErr_Clear();
-    }
+    struct timespec interval;
 
-    // log the exception
-    LogMessageForPythonV(logLevel, message);
-    LogMessageFromErrorObj(logLevel, errorObj);
-    LogTemplateIdFromErrorObj(logLevel, errorObj);
-    LogArgumentsFromErrorObj(logLevel, errorObj);
-    LogListOfStringsFromErrorObj(logLevel, errorObj, "traceback", "Traceback");
-    LogListOfStringsFromErrorObj(logLevel, errorObj, "details", "Details");
-    return -1;
+    interval.tv_sec = 0;
+    interval.tv_nsec = COLLECTOR_POLL_INTERVAL * 1000000L;
+    nanosleep(&interval, NULL);
 }
+#endif
 
 
 //-----------------------------------------------------------------------------
-// GetLoggingState()
-//   Get the current logging state for Python so that it can be retained
-// across thread boundaries (such as for COM servers).
+// RunLoggingCollector()
+//   Create shared memory of the given name and write the messages placed in it
+// by processes which started logging with the shared memory option to the
+// specified file until StopLoggingCollector() is called.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(udt_LoggingState*) GetLoggingState(void)
+CX_LOGGING_API(int) RunLoggingCollector(
+    const char *name,                   // name of shared memory
+    const char *fileName,               // name of file to write to
+    unsigned long maxFiles,             // maximum number of files
+    unsigned long maxFileSize,          // maximum size of each file
+    const char *prefix,                 // prefix to use
+    unsigned long maxProcesses,         // maximum number of processes
+    unsigned long ringSize,             // size of ring for each process
+    ExceptionInfo *exceptionInfo)       // exception info
 {
-    PyObject *dict;
+#ifdef MS_WINDOWS
+    strcpy(exceptionInfo->message,
+            "Logging to shared memory not supported on Windows.");
+    return -1;
+#else
+    LoggingCollector *collector;
+    long numRecords;
 
-    dict = GetThreadStateDictionary();
-    if (!dict)
-        return NULL;
-    return (udt_LoggingState*) PyDict_GetItemString(dict, KEY_LOGGING_STATE);
+    collector = LoggingCollector_New(name, fileName, maxFiles, maxFileSize,
+            prefix, maxProcesses, ringSize, exceptionInfo);
+    if (!collector)
+        return -1;
+    while (1) {
+        numRecords = LoggingCollector_Drain(collector);
+        if (numRecords < 0 || gStopLoggingCollector)
+            break;
+        if (numRecords == 0)
+            LoggingCollector_Wait();
+    }
+    gStopLoggingCollector = 0;
+    if (numRecords >= 0)
+        numRecords = LoggingCollector_Drain(collector);
+    if (numRecords < 0)
+        strcpy(exceptionInfo->message, collector->state->exceptionInfo.message);
+    LoggingCollector_Free(collector);
+    return (numRecords < 0) ? -1 : 0;
+#endif
 }
 
 
 //-----------------------------------------------------------------------------
-// SetLoggingState()
-//   Set the current logging state for Python. This is intended to be used as
-// the complement to GetLoggingState() so that logging state can be retained
-// across thread boundaries.
+// StopLoggingCollector()
+//   Stop the collector running in another thread once it has written the
+// messages that are currently in shared memory.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) SetLoggingState(
-    udt_LoggingState *loggingState)     // logging state to set
+CX_LOGGING_API(void) StopLoggingCollector(void)
 {
-    PyObject *dict;
+#ifndef MS_WINDOWS
+    gStopLoggingCollector = 1;
+#endif
+}
 
-    dict = GetThreadStateDictionary();
-    if (!dict) {
-        PyErr_SetString(PyExc_RuntimeError,
-                "unable to get thread state dictionary");
-        return -1;
-    }
-    if (PyDict_SetItemString(dict, KEY_LOGGING_STATE,
-            (PyObject*) loggingState) < 0)
-        return LogPythonException("unable to set logging state for thread");
-    return 0;
+
+//-----------------------------------------------------------------------------
+// GetFlightRecorderForPython()
+//   Return the flight recorder in which a message at the given level that is
+// not being written should be kept by the current Python thread, or NULL if
+// the message should not be kept.
+//-----------------------------------------------------------------------------
+static FlightRecorder *GetFlightRecorderForPython(
+    unsigned long level)                // level of message
+{
+    udt_LoggingState *loggingState;
+
+    loggingState = GetLoggingState();
+    if (loggingState) {
+        if (IsFlightRecorded(&loggingState->state->options, level))
+            return loggingState->state->flightRecorder;
+    } else if (gLoggingState && IsFlightRecorded(&gLoggingOptions, level))
+        return &gFlightRecorder;
+    return NULL;
 }
 
 
 //-----------------------------------------------------------------------------
-// IsLoggingStarted()
-//   Return a boolean indicating if logging is currently started.
+// RecordMessageForPython()
+//   Format the message and keep it in the flight recorder. Any errors are
+// ignored since the message would not have been written in any case.
 //-----------------------------------------------------------------------------
-CX_LOGGING_API(int) IsLoggingStarted(void)
+static void RecordMessageForPython(
+    FlightRecorder *recorder,           // flight recorder to use
+    unsigned long level,                // logging level
+    int startingIndex,                  // starting index to look at
+    PyObject *args)                     // Python arguments
 {
-    return (gLoggingState != NULL);
+    PyObject *format, *tempArgs, *temp, *encodedMessage;
+    const char *message;
+
+    format = PyTuple_GetItem(args, startingIndex);
+    if (!format || !PyUnicode_Check(format)) {
+        PyErr_Clear();
+        return;
+    }
+    tempArgs = PyTuple_GetSlice(args, startingIndex + 1,
+            PyTuple_GET_SIZE(args));
+    if (!tempArgs) {
+        PyErr_Clear();
+        return;
+    }
+    temp = PyUnicode_Format(format, tempArgs);
+    Py_DECREF(tempArgs);
+    if (!temp) {
+        PyErr_Clear();
+        return;
+    }
+    if (GetEncodedStringForPython(temp, &encodedMessage, &message) < 0) {
+        Py_DECREF(temp);
+        PyErr_Clear();
+        return;
+    }
+    Py_DECREF(temp);
+    FlightRecorder_RecordMessage(recorder, level, message);
+    Py_DECREF(encodedMessage);
 }
 
 
@@ -1777,6 +8165,8 @@ static PyObject* LogMessageForPythonWithLevel(
     PyObject *args)                     // Python arguments
 {
     PyObject *tempArgs, *temp, *format;
+    FlightRecorder *recorder;
+    unsigned long long dropped;
 
     if (IsLoggingAtLevelForPython(level)) {
         tempArgs = PyTuple_GetSlice(args, startingIndex, startingIndex + 1);
@@ -1787,6 +8177,10 @@ static PyObject* LogMessageForPythonWithLevel(
             return NULL;
         }
         Py_DECREF(tempArgs);
+        if (IsFilteredForPython(level, format, &dropped)) {
+            Py_INCREF(Py_False);
+            return Py_False;
+        }
         tempArgs = PyTuple_GetSlice(args, startingIndex + 1,
                 PyTuple_GET_SIZE(args));
         if (!tempArgs)
@@ -1801,7 +8195,7 @@ static PyObject* LogMessageForPythonWithLevel(
         Py_DECREF(tempArgs);
         if (!temp)
             return NULL;
-        if (WriteMessageForPython(level, temp) < 0) {
+        if (WriteMessageForPythonHelper(level, temp, dropped) < 0) {
             Py_DECREF(temp);
             if (PyErr_Occurred())
                 return NULL;
@@ -1812,6 +8206,9 @@ static PyObject* LogMessageForPythonWithLevel(
         return Py_True;
     }
 
+    recorder = GetFlightRecorderForPython(level);
+    if (recorder)
+        RecordMessageForPython(recorder, level, startingIndex, args);
     Py_INCREF(Py_False);
     return Py_False;
 }
@@ -1912,6 +8309,106 @@ static PyObject* LogTraceForPython(
 }
 
 
+//-----------------------------------------------------------------------------
+// SetSampleRatesForPython()
+//   Set the sample rates in the options from a dictionary mapping levels to
+// the number of messages at that level for which one message is written.
+//-----------------------------------------------------------------------------
+static int SetSampleRatesForPython(
+    PyObject *sampleRates,              // dictionary of sample rates (or NULL)
+    LoggingOptions *options)            // options to update
+{
+    PyObject *key, *value;
+    unsigned long level;
+    Py_ssize_t pos = 0;
+
+    if (!sampleRates || sampleRates == Py_None)
+        return 0;
+    if (!PyDict_Check(sampleRates)) {
+        PyErr_SetString(PyExc_TypeError,
+                "sampleRates must be a dictionary mapping levels to rates");
+        return -1;
+    }
+    while (PyDict_Next(sampleRates, &pos, &key, &value)) {
+        level = PyLong_AsUnsignedLong(key);
+        if (PyErr_Occurred())
+            return -1;
+        options->sampleRates[GetLevelIndex(level)] =
+                PyLong_AsUnsignedLong(value);
+        if (PyErr_Occurred())
+            return -1;
+    }
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// SetRoutesForPython()
+//   Set the routes in the options from a sequence of (fileName, minLevel,
+// maxLevel, maxFiles, maxFileSize) tuples, of which only the first two items
+// are required. The names of the files are held in a list which is returned
+// and must be released, along with the routes, once logging has started.
+//-----------------------------------------------------------------------------
+static int SetRoutesForPython(
+    PyObject *routesObj,                // sequence of routes (or NULL)
+    LoggingOptions *options,            // options to update
+    PyObject **fileNames)               // names of files (OUT)
+{
+    PyObject *sequence, *item, *fileName;
+    Py_ssize_t i, numRoutes;
+    LoggingRoute *routes;
+
+    *fileNames = NULL;
+    if (!routesObj || routesObj == Py_None)
+        return 0;
+    sequence = PySequence_Fast(routesObj,
+            "routes must be a sequence of tuples");
+    if (!sequence)
+        return -1;
+    numRoutes = PySequence_Fast_GET_SIZE(sequence);
+    routes = PyMem_Malloc((numRoutes + 1) * sizeof(LoggingRoute));
+    *fileNames = PyList_New(0);
+    if (!routes || !*fileNames) {
+        Py_DECREF(sequence);
+        PyMem_Free(routes);
+        Py_CLEAR(*fileNames);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < numRoutes; i++) {
+        item = PySequence_Fast_GET_ITEM(sequence, i);
+        routes[i].maxLevel = 0;
+        routes[i].maxFiles = 1;
+        routes[i].maxFileSize = DEFAULT_MAX_FILE_SIZE;
+        if (!PyTuple_Check(item)) {
+            PyErr_SetString(PyExc_TypeError,
+                    "each route must be a tuple of (fileName, minLevel, "
+                    "maxLevel, maxFiles, maxFileSize)");
+            break;
+        }
+        if (!PyArg_ParseTuple(item, "O&k|kkk", PyUnicode_FSConverter,
+                &fileName, &routes[i].minLevel, &routes[i].maxLevel,
+                &routes[i].maxFiles, &routes[i].maxFileSize))
+            break;
+        if (PyList_Append(*fileNames, fileName) < 0) {
+            Py_DECREF(fileName);
+            break;
+        }
+        routes[i].fileName = PyBytes_AS_STRING(fileName);
+        Py_DECREF(fileName);
+    }
+    Py_DECREF(sequence);
+    if (i < numRoutes) {
+        PyMem_Free(routes);
+        Py_CLEAR(*fileNames);
+        return -1;
+    }
+    options->routes = routes;
+    options->numRoutes = (unsigned long) numRoutes;
+    return 0;
+}
+
+
 //-----------------------------------------------------------------------------
 // StartLoggingForPython()
 //   Python implementation of StartLogging() exposed through the module.
@@ -1921,10 +8418,11 @@ static PyObject* StartLoggingForPython(
     PyObject *args,                     // arguments
     PyObject *keywordArgs)              // keyword arguments
 {
+    PyObject *encoding, *fileNameObj, *sampleRates, *routes, *fileNames;
     unsigned long level, maxFiles, maxFileSize;
-    PyObject *encoding, *fileNameObj;
     ExceptionInfo exceptionInfo;
-    int reuse, rotate;
+    LoggingOptions options;
+    int reuse, rotate, result;
     char *prefix;
 
     maxFiles = 1;
@@ -1932,13 +8430,35 @@ static PyObject* StartLoggingForPython(
     prefix = DEFAULT_PREFIX;
     encoding = NULL;
     reuse = rotate = 1;
-    if (!PyArg_ParseTupleAndKeywords(args, keywordArgs, "O&l|llsOpp",
-            gStartLoggingWithFileKeywordList, PyUnicode_FSConverter,
-            &fileNameObj, &level, &maxFiles, &maxFileSize, &prefix, &encoding,
-            &reuse, &rotate))
+    InitializeLoggingOptions(&options);
+    sampleRates = routes = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, keywordArgs,
+            "O&l|llsOppkpOpkkkppppkpkkkkkpO", gStartLoggingWithFileKeywordList,
+            PyUnicode_FSConverter, &fileNameObj, &level, &maxFiles,
+            &maxFileSize, &prefix, &encoding, &reuse, &rotate,
+            &options.rateLimit, &options.suppressRepeats, &sampleRates,
+            &options.sampleRandomly,
+            &options.flightRecorderSize, &options.flightRecorderLevel,
+            &options.flightRecorderTrigger, &options.emergencyFlush,
+            &options.reopenAfterFork, &options.multiProcess,
+            &options.sharedMemory, &options.bufferSize,
+            &options.directWrite, &options.durability,
+            &options.syncInterval, &options.durableLevel,
+            &options.rotateInterval, &options.exceptionDedupWindow,
+            &options.sortArguments, &routes))
+        return NULL;
+    if (SetSampleRatesForPython(sampleRates, &options) < 0)
+        return NULL;
+    if (SetRoutesForPython(routes, &options, &fileNames) < 0)
         return NULL;
-    if (StartLoggingEx(PyBytes_AS_STRING(fileNameObj), level, maxFiles,
-            maxFileSize, prefix, reuse, rotate, &exceptionInfo) < 0) {
+    Py_BEGIN_ALLOW_THREADS
+    result = StartLoggingWithOptions(PyBytes_AS_STRING(fileNameObj), level,
+            maxFiles, maxFileSize, prefix, reuse, rotate, &options,
+            &exceptionInfo);
+    Py_END_ALLOW_THREADS
+    PyMem_Free((void*) options.routes);
+    Py_XDECREF(fileNames);
+    if (result < 0) {
         PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
         return NULL;
     }
@@ -1959,13 +8479,17 @@ static PyObject* StartLoggingStderrForPython(
     unsigned long level;
     PyObject *encoding;
     char *prefix;
+    int result;
 
     encoding = NULL;
     prefix = DEFAULT_PREFIX;
     if (!PyArg_ParseTupleAndKeywords(args, keywordArgs, "l|sO",
             gStartLoggingNoFileKeywordList, &level, &prefix, &encoding))
         return NULL;
-    if (StartLoggingStderrEx(level, prefix, &exceptionInfo) < 0) {
+    Py_BEGIN_ALLOW_THREADS
+    result = StartLoggingStderrEx(level, prefix, &exceptionInfo);
+    Py_END_ALLOW_THREADS
+    if (result < 0) {
         PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
         return NULL;
     }
@@ -1986,13 +8510,17 @@ static PyObject* StartLoggingStdoutForPython(
     unsigned long level;
     PyObject *encoding;
     char *prefix;
+    int result;
 
     encoding = NULL;
     prefix = DEFAULT_PREFIX;
     if (!PyArg_ParseTupleAndKeywords(args, keywordArgs, "l|sO",
             gStartLoggingNoFileKeywordList, &level, &prefix, &encoding))
         return NULL;
-    if (StartLoggingStdoutEx(level, prefix, &exceptionInfo) < 0) {
+    Py_BEGIN_ALLOW_THREADS
+    result = StartLoggingStdoutEx(level, prefix, &exceptionInfo);
+    Py_END_ALLOW_THREADS
+    if (result < 0) {
         PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
         return NULL;
     }
@@ -2009,9 +8537,10 @@ static PyObject *StartLoggingForThreadForPython(
     PyObject *args,                     // arguments
     PyObject *keywordArgs)              // keyword arguments
 {
+    PyObject *encoding, *fileNameObj, *sampleRates, *routes, *fileNames;
     unsigned long level, maxFiles, maxFileSize;
-    PyObject *encoding, *fileNameObj;
-    int reuse, rotate;
+    LoggingOptions options;
+    int reuse, rotate, result;
     char *prefix;
 
     maxFiles = 1;
@@ -2019,13 +8548,33 @@ static PyObject *StartLoggingForThreadForPython(
     prefix = DEFAULT_PREFIX;
     encoding = NULL;
     reuse = rotate = 1;
-    if (!PyArg_ParseTupleAndKeywords(args, keywordArgs, "O&l|llsOpp",
-            gStartLoggingWithFileKeywordList, PyUnicode_FSConverter,
-            &fileNameObj, &level, &maxFiles, &maxFileSize, &prefix, &encoding,
-            &reuse, &rotate))
+    InitializeLoggingOptions(&options);
+    sampleRates = routes = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, keywordArgs,
+            "O&l|llsOppkpOpkkkppppkpkkkkkpO", gStartLoggingWithFileKeywordList,
+            PyUnicode_FSConverter, &fileNameObj, &level, &maxFiles,
+            &maxFileSize, &prefix, &encoding, &reuse, &rotate,
+            &options.rateLimit, &options.suppressRepeats, &sampleRates,
+            &options.sampleRandomly,
+            &options.flightRecorderSize, &options.flightRecorderLevel,
+            &options.flightRecorderTrigger, &options.emergencyFlush,
+            &options.reopenAfterFork, &options.multiProcess,
+            &options.sharedMemory, &options.bufferSize,
+            &options.directWrite, &options.durability,
+            &options.syncInterval, &options.durableLevel,
+            &options.rotateInterval, &options.exceptionDedupWindow,
+            &options.sortArguments, &routes))
+        return NULL;
+    if (SetSampleRatesForPython(sampleRates, &options) < 0)
         return NULL;
-    if (StartLoggingForPythonThreadEx(PyBytes_AS_STRING(fileNameObj), level,
-            maxFiles, maxFileSize, prefix, reuse, rotate) < 0)
+    if (SetRoutesForPython(routes, &options, &fileNames) < 0)
+        return NULL;
+    result = StartLoggingForPythonThreadWithOptions(
+            PyBytes_AS_STRING(fileNameObj), level, maxFiles, maxFileSize,
+            prefix, reuse, rotate, &options);
+    PyMem_Free((void*) options.routes);
+    Py_XDECREF(fileNames);
+    if (result < 0)
         return NULL;
     return SetEncodingHelper(encoding);
 }
@@ -2039,7 +8588,9 @@ static PyObject* StopLoggingForPython(
     PyObject *self,                     // passthrough argument
     PyObject *args)                     // arguments
 {
+    Py_BEGIN_ALLOW_THREADS
     StopLogging();
+    Py_END_ALLOW_THREADS
     Py_INCREF(Py_None);
     return Py_None;
 }
@@ -2109,12 +8660,13 @@ static PyObject* GetLoggingFileForPython(
     udt_LoggingState *loggingState;
     PyObject *fileObj;
 
+    // messages sent to shared memory are not written to a file
     loggingState = GetLoggingState();
-    if (loggingState)
+    if (loggingState && loggingState->state->fp)
         return PyFile_FromFd(fileno(loggingState->state->fp),
                 loggingState->state->fileName, "w", -1, NULL, NULL, NULL, 0);
     ACQUIRE_LOCK(gLoggingStateLock);
-    if (gLoggingState)
+    if (!loggingState && gLoggingState && gLoggingState->fp)
         fileObj = PyFile_FromFd(fileno(gLoggingState->fp),
                 gLoggingState->fileName, "w", -1, NULL, NULL, NULL, 0);
     else {
@@ -2284,6 +8836,465 @@ static PyObject* SetEncodingForPython(
 }
 
 
+//-----------------------------------------------------------------------------
+// EnableStatsForPython()
+//   Enable or disable the collection of logging statistics.
+//-----------------------------------------------------------------------------
+static PyObject* EnableStatsForPython(
+    PyObject *self,                     // passthrough argument
+    PyObject *args)                     // arguments
+{
+    int enabled = 1;
+
+    if (!PyArg_ParseTuple(args, "|p", &enabled))
+        return NULL;
+    EnableLoggingStats(enabled);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+//-----------------------------------------------------------------------------
+// LatencyHistogram_ToPython()
+//   Return a dictionary describing the latency histogram. Only buckets which
+// contain values are included in the list of buckets, each of which is a
+// tuple containing the lower bound of the bucket in nanoseconds and the number
+// of values recorded in it.
+//-----------------------------------------------------------------------------
+static PyObject *LatencyHistogram_ToPython(
+    LatencyHistogram *histogram)        // histogram to convert
+{
+    PyObject *buckets, *bucket;
+    int i;
+
+    buckets = PyList_New(0);
+    if (!buckets)
+        return NULL;
+    for (i = 0; i < LOG_STATS_NUM_BUCKETS; i++) {
+        if (!histogram->buckets[i])
+            continue;
+        bucket = Py_BuildValue("(KK)", GetLatencyHistogramLowerBound(i),
+                histogram->buckets[i]);
+        if (!bucket || PyList_Append(buckets, bucket) < 0) {
+            Py_XDECREF(bucket);
+            Py_DECREF(buckets);
+            return NULL;
+        }
+        Py_DECREF(bucket);
+    }
+    return Py_BuildValue("{sKsKsKsN}", "count", histogram->count, "totalNs",
+            histogram->totalNs, "maxNs", histogram->maxNs, "buckets",
+            buckets);
+}
+
+
+//-----------------------------------------------------------------------------
+// GetStatsForPython()
+//   Return the logging statistics collected so far, optionally resetting them
+// at the same time.
+//-----------------------------------------------------------------------------
+static PyObject* GetStatsForPython(
+    PyObject *self,                     // passthrough argument
+    PyObject *args,                     // arguments
+    PyObject *keywordArgs)              // keyword arguments
+{
+    static char *keywordList[] = {"reset", NULL};
+    LoggingStats stats;
+    int reset = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywordArgs, "|p", keywordList,
+            &reset))
+        return NULL;
+    GetLoggingStats(&stats);
+    if (reset)
+        ResetLoggingStats();
+    return Py_BuildValue("{sNsNsNsNsN}",
+            "lockWait", LatencyHistogram_ToPython(&stats.lockWait),
+            "write", LatencyHistogram_ToPython(&stats.write),
+            "flush", LatencyHistogram_ToPython(&stats.flush),
+            "rotate", LatencyHistogram_ToPython(&stats.rotate),
+            "sync", LatencyHistogram_ToPython(&stats.sync));
+}
+
+
+//-----------------------------------------------------------------------------
+// ResetStatsForPython()
+//   Reset the logging statistics collected so far.
+//-----------------------------------------------------------------------------
+static PyObject* ResetStatsForPython(
+    PyObject *self,                     // passthrough argument
+    PyObject *args)                     // arguments
+{
+    ResetLoggingStats();
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+//-----------------------------------------------------------------------------
+// CountersByLevel_ToPython()
+//   Return a dictionary mapping the predefined levels to the given counters.
+//-----------------------------------------------------------------------------
+static PyObject *CountersByLevel_ToPython(
+    unsigned long long *counters)       // counters indexed by level
+{
+    return Py_BuildValue("{iKiKiKiKiKiK}",
+            LOG_LEVEL_DEBUG, counters[LOG_LEVEL_INDEX_DEBUG],
+            LOG_LEVEL_INFO, counters[LOG_LEVEL_INDEX_INFO],
+            LOG_LEVEL_WARNING, counters[LOG_LEVEL_INDEX_WARNING],
+            LOG_LEVEL_ERROR, counters[LOG_LEVEL_INDEX_ERROR],
+            LOG_LEVEL_CRITICAL, counters[LOG_LEVEL_INDEX_CRITICAL],
+            LOG_LEVEL_NONE, counters[LOG_LEVEL_INDEX_NONE]);
+}
+
+
+//-----------------------------------------------------------------------------
+// GetCountersForPython()
+//   Return the counters kept by the current logging state.
+//-----------------------------------------------------------------------------
+static PyObject* GetCountersForPython(
+    PyObject *self,                     // passthrough argument
+    PyObject *args)                     // arguments
+{
+    udt_LoggingState *loggingState;
+    LoggingCounters counters;
+
+    loggingState = GetLoggingState();
+    if (loggingState) {
+        Py_BEGIN_ALLOW_THREADS
+        ACQUIRE_LOCK(loggingState->lock);
+        memcpy(&counters, &loggingState->state->counters,
+                sizeof(LoggingCounters));
+        RELEASE_LOCK(loggingState->lock);
+        Py_END_ALLOW_THREADS
+    } else GetLoggingCounters(&counters);
+    return Py_BuildValue("{sNsNsNsNsKsKsKsKsKsKsK}",
+            "messages", CountersByLevel_ToPython(counters.messages),
+            "bytes", CountersByLevel_ToPython(counters.bytes),
+            "suppressed", CountersByLevel_ToPython(counters.suppressed),
+            "sampled", CountersByLevel_ToPython(counters.sampled),
+            "rateLimited", counters.rateLimited,
+            "repeated", counters.repeated,
+            "rotations", counters.rotations,
+            "flushes", counters.flushes,
+            "errors", counters.errors,
+            "dropped", counters.dropped,
+            "syncs", counters.syncs);
+}
+
+
+//-----------------------------------------------------------------------------
+// RunCollectorForPython()
+//   Write the messages placed in shared memory by other processes to a file
+// until StopCollector() is called or a signal handler raises an exception.
+// The global interpreter lock is released while waiting for messages.
+//-----------------------------------------------------------------------------
+static PyObject* RunCollectorForPython(
+    PyObject *self,                     // passthrough argument
+    PyObject *args,                     // arguments
+    PyObject *keywordArgs)              // keyword arguments
+{
+    static char *keywordList[] = {"name", "fileName", "maxFiles",
+            "maxFileSize", "prefix", "maxProcesses", "ringSize", NULL};
+#ifdef MS_WINDOWS
+    PyErr_SetString(PyExc_RuntimeError,
+            "Logging to shared memory not supported on Windows.");
+    return NULL;
+#else
+    unsigned long maxFiles, maxFileSize, maxProcesses, ringSize;
+    LoggingCollector *collector;
+    ExceptionInfo exceptionInfo;
+    PyObject *fileNameObj;
+    char *name, *prefix;
+    long numRecords;
+
+    maxFiles = 1;
+    maxFileSize = DEFAULT_MAX_FILE_SIZE;
+    prefix = DEFAULT_PREFIX;
+    maxProcesses = COLLECTOR_PROCESSES;
+    ringSize = COLLECTOR_RING_SIZE;
+    if (!PyArg_ParseTupleAndKeywords(args, keywordArgs, "sO&|kkskk",
+            keywordList, &name, PyUnicode_FSConverter, &fileNameObj,
+            &maxFiles, &maxFileSize, &prefix, &maxProcesses, &ringSize))
+        return NULL;
+    collector = LoggingCollector_New(name, PyBytes_AS_STRING(fileNameObj),
+            maxFiles, maxFileSize, prefix, maxProcesses, ringSize,
+            &exceptionInfo);
+    Py_DECREF(fileNameObj);
+    if (!collector) {
+        PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
+        return NULL;
+    }
+    while (1) {
+        Py_BEGIN_ALLOW_THREADS
+        numRecords = LoggingCollector_Drain(collector);
+        if (numRecords == 0 && !gStopLoggingCollector)
+            LoggingCollector_Wait();
+        Py_END_ALLOW_THREADS
+        if (numRecords < 0 || gStopLoggingCollector)
+            break;
+        if (PyErr_CheckSignals() < 0)
+            break;
+    }
+    gStopLoggingCollector = 0;
+    if (numRecords >= 0)
+        numRecords = LoggingCollector_Drain(collector);
+    if (numRecords < 0 && !PyErr_Occurred())
+        PyErr_SetString(PyExc_RuntimeError,
+                collector->state->exceptionInfo.message);
+    LoggingCollector_Free(collector);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_INCREF(Py_None);
+    return Py_None;
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// StopCollectorForPython()
+//   Stop the collector running in another thread.
+//-----------------------------------------------------------------------------
+static PyObject* StopCollectorForPython(
+    PyObject *self,                     // passthrough argument
+    PyObject *args)                     // arguments
+{
+    StopLoggingCollector();
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+#ifndef MS_WINDOWS
+//-----------------------------------------------------------------------------
+// IsPythonFinalizing()
+//   Return whether the interpreter has been finalized or is being finalized,
+// after which threads which are not Python threads must not acquire the GIL.
+//-----------------------------------------------------------------------------
+static int IsPythonFinalizing(void)
+{
+    if (!Py_IsInitialized())
+        return 1;
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 13
+    return Py_IsFinalizing();
+#else
+    return _Py_IsFinalizing();
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// PythonSink_WriteBatch()
+//   Call the Python callable of the sink with a list of (timestamp, level,
+// threadId, message) tuples for the records, acquiring the GIL once for the
+// whole batch. The sink is only written to by the writer thread of an
+// asynchronous sink so the callable never runs on a thread logging messages.
+// An exception raised by the callable is reported as unraisable.
+//-----------------------------------------------------------------------------
+static int PythonSink_WriteBatch(
+    LoggingSink *sink,                  // sink to write to
+    const LoggingSinkRecord *records,   // records to write
+    size_t numRecords)                  // number of records to write
+{
+    PyObject *list, *tuple, *message, *result;
+    PyGILState_STATE gilState;
+    size_t i;
+
+    if (IsPythonFinalizing()) {
+        strcpy(sink->exceptionInfo.message,
+                "Python interpreter is being finalized.");
+        return -1;
+    }
+    gilState = PyGILState_Ensure();
+    list = PyList_New((Py_ssize_t) numRecords);
+    for (i = 0; list && i < numRecords; i++) {
+        message = PyUnicode_DecodeUTF8(records[i].message,
+                (Py_ssize_t) records[i].messageLength, "replace");
+        tuple = (message) ? Py_BuildValue("(dkLN)",
+                (double) records[i].timestamp / 1e6, records[i].level,
+                records[i].threadId, message) : NULL;
+        if (!tuple) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t) i, tuple);
+    }
+    result = (list) ? PyObject_CallFunctionObjArgs((PyObject*) sink->context,
+            list, NULL) : NULL;
+    Py_XDECREF(list);
+    if (!result) {
+        strcpy(sink->exceptionInfo.message,
+                "Exception raised by callable of Python sink.");
+        PyErr_WriteUnraisable((PyObject*) sink->context);
+        PyGILState_Release(gilState);
+        return -1;
+    }
+    Py_DECREF(result);
+    PyGILState_Release(gilState);
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// PythonSink_Close()
+//   Release the reference to the Python callable of the sink. Once the
+// interpreter has begun finalizing, the reference is left alone.
+//-----------------------------------------------------------------------------
+static void PythonSink_Close(
+    LoggingSink *sink)                  // sink to close
+{
+    PyGILState_STATE gilState;
+
+    if (IsPythonFinalizing())
+        return;
+    gilState = PyGILState_Ensure();
+    Py_DECREF((PyObject*) sink->context);
+    PyGILState_Release(gilState);
+}
+
+
+// define type for sinks which call a Python callable with batches of records
+static const LoggingSinkType gPythonSinkType = {
+    "python",
+    PythonSink_WriteBatch,
+    NULL,
+    NULL,
+    PythonSink_Close
+};
+#endif
+
+
+//-----------------------------------------------------------------------------
+// AddSinkForPython()
+//   Add a sink to the current logging state. The target is either one of the
+// constants SINK_STDERR, SINK_STDOUT, SINK_SYSLOG, SINK_TCP or SINK_UDP, a
+// callable or the name of a file. Records are sent to the syslog daemon or
+// the collector and passed to the callable by a writer thread; unless an
+// interval is given, the writer thread for a callable waits for a batch of
+// records for a short time so that the GIL is not acquired for each record.
+//-----------------------------------------------------------------------------
+static PyObject* AddSinkForPython(
+    PyObject *self,                     // passthrough argument
+    PyObject *args,                     // arguments
+    PyObject *keywordArgs)              // keyword arguments
+{
+    static char *keywordList[] = {"target", "level", "maxFiles",
+            "maxFileSize", "prefix", "ident", "facility", "address",
+            "format", "queueSize", "batchSize", "intervalMs", "framing",
+            "bufferSize", "spillFile", "maxSpillSize", "maxLevel", NULL};
+    unsigned long level, maxFiles, maxFileSize, facility, target, format;
+    unsigned long queueSize, batchSize, intervalMs, framing, bufferSize;
+    unsigned long maxLevel;
+    char *prefix, *ident, *address, *spillFileName;
+    unsigned long long maxSpillSize;
+    ExceptionInfo exceptionInfo;
+    PyObject *targetObj, *temp;
+    LoggingSink *sink;
+
+    level = LOG_LEVEL_DEBUG;
+    maxFiles = 1;
+    maxFileSize = DEFAULT_MAX_FILE_SIZE;
+    prefix = DEFAULT_PREFIX;
+    ident = address = NULL;
+    facility = SYSLOG_FACILITY_USER;
+    format = LOG_SYSLOG_FORMAT_RFC3164;
+    queueSize = ASYNC_QUEUE_SIZE;
+    batchSize = ASYNC_BATCH_SIZE;
+    intervalMs = (unsigned long) -1;
+    framing = LOG_FRAMING_NEWLINE;
+    bufferSize = NETWORK_BUFFER_SIZE;
+    spillFileName = NULL;
+    maxSpillSize = NETWORK_MAX_SPILL_SIZE;
+    maxLevel = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, keywordArgs,
+            "O|kkkszkzkkkkkkzKk", keywordList, &targetObj, &level, &maxFiles,
+            &maxFileSize, &prefix, &ident, &facility, &address, &format,
+            &queueSize, &batchSize, &intervalMs, &framing, &bufferSize,
+            &spillFileName, &maxSpillSize, &maxLevel))
+        return NULL;
+    if (intervalMs == (unsigned long) -1)
+        intervalMs = (PyCallable_Check(targetObj)) ? ASYNC_PYTHON_INTERVAL : 0;
+
+    // create the sink
+    if (PyLong_Check(targetObj)) {
+        target = PyLong_AsUnsignedLong(targetObj);
+        if (PyErr_Occurred())
+            return NULL;
+        if (target == LOG_SINK_STDERR)
+            sink = CreateStderrSink(level, &exceptionInfo);
+        else if (target == LOG_SINK_STDOUT)
+            sink = CreateStdoutSink(level, &exceptionInfo);
+        else if (target == LOG_SINK_SYSLOG) {
+#ifdef MS_WINDOWS
+            strcpy(exceptionInfo.message,
+                    "Syslog sinks not supported on Windows.");
+            sink = NULL;
+#else
+            Py_BEGIN_ALLOW_THREADS
+            sink = CreateSyslogSink(address, ident, facility, format, level,
+                    &exceptionInfo);
+            if (sink)
+                sink = CreateAsyncSink(sink, queueSize, batchSize,
+                        intervalMs, &exceptionInfo);
+            Py_END_ALLOW_THREADS
+#endif
+        } else if (target == LOG_SINK_TCP || target == LOG_SINK_UDP) {
+#ifdef MS_WINDOWS
+            strcpy(exceptionInfo.message,
+                    "Network sinks not supported on Windows.");
+            sink = NULL;
+#else
+            Py_BEGIN_ALLOW_THREADS
+            sink = CreateNetworkSink(address, target, framing, bufferSize,
+                    spillFileName, maxSpillSize, level, &exceptionInfo);
+            if (sink)
+                sink = CreateAsyncSink(sink, queueSize, batchSize,
+                        intervalMs, &exceptionInfo);
+            Py_END_ALLOW_THREADS
+#endif
+        } else {
+            PyErr_Format(PyExc_ValueError, "invalid sink target %lu",
+                    target);
+            return NULL;
+        }
+    } else if (PyCallable_Check(targetObj)) {
+#ifdef MS_WINDOWS
+        strcpy(exceptionInfo.message,
+                "Python sinks not supported on Windows.");
+        sink = NULL;
+#else
+        Py_INCREF(targetObj);
+        sink = CreateLoggingSink(&gPythonSinkType, targetObj, level,
+                &exceptionInfo);
+        if (!sink)
+            Py_DECREF(targetObj);
+        else sink = CreateAsyncSink(sink, queueSize, batchSize, intervalMs,
+                &exceptionInfo);
+#endif
+    } else {
+        if (!PyUnicode_FSConverter(targetObj, &temp))
+            return NULL;
+        Py_BEGIN_ALLOW_THREADS
+        sink = CreateFileSink(PyBytes_AS_STRING(temp), level, maxFiles,
+                maxFileSize, prefix, &exceptionInfo);
+        Py_END_ALLOW_THREADS
+        Py_DECREF(temp);
+    }
+    if (!sink) {
+        PyErr_SetString(PyExc_RuntimeError, exceptionInfo.message);
+        return NULL;
+    }
+    if (maxLevel > 0)
+        sink->maxLevel = maxLevel;
+
+    // add it to the current logging state
+    if (AddLoggingSinkForPython(sink) < 0)
+        return NULL;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
 //-----------------------------------------------------------------------------
 // LogExceptionForPython()
 //   Set the current logging state with the state acquired earlier by a call to
@@ -2298,7 +9309,7 @@ static PyObject* LogExceptionForPython(
     PyObject *excType, *excValue, *traceback;
     int isConfigured = 1, isBuilt = 0;
     PyThreadState *threadState;
-    char *message = NULL;
+    const char *message = NULL;
 
     // parse arguments
     value = configuredExcBaseClass = NULL;
@@ -2367,9 +9378,9 @@ static PyObject* LogExceptionForPython(
 
     // display message
     if (messageObj) {
-        if (GetEncodedStringForPython(messageObj, &encodedMessage) < 0)
+        if (GetEncodedStringForPython(messageObj, &encodedMessage,
+                &message) < 0)
             return NULL;
-        message = PyBytes_AS_STRING(encodedMessage);
     }
     if (isConfigured) {
         LogConfiguredException(value, message);
@@ -2390,6 +9401,177 @@ static PyObject* LogExceptionForPython(
 }
 
 
+//-----------------------------------------------------------------------------
+// Record_New()
+//   Create a new record which is built by entering it as a context manager,
+// appending lines to it and exiting it.
+//-----------------------------------------------------------------------------
+static PyObject *Record_New(
+    PyTypeObject *type,                 // type of object to create
+    PyObject *args,                     // arguments
+    PyObject *keywordArgs)              // keyword arguments
+{
+    static char *keywordList[] = { "level", NULL };
+    unsigned long level;
+    udt_Record *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywordArgs, "k", keywordList,
+            &level))
+        return NULL;
+    self = (udt_Record*) type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    self->level = level;
+    return (PyObject*) self;
+}
+
+
+//-----------------------------------------------------------------------------
+// Record_Enter()
+//   Begin building the record on the current thread.
+//-----------------------------------------------------------------------------
+static PyObject *Record_Enter(
+    udt_Record *self,                   // record being entered
+    PyObject *args)                     // arguments (unused)
+{
+    BeginRecordForPython(self->level);
+    self->depth++;
+    Py_INCREF(self);
+    return (PyObject*) self;
+}
+
+
+//-----------------------------------------------------------------------------
+// Record_Exit()
+//   Commit the record, writing it if it is not nested within another record.
+// Exceptions raised within the block are not suppressed.
+//-----------------------------------------------------------------------------
+static PyObject *Record_Exit(
+    udt_Record *self,                   // record being exited
+    PyObject *args)                     // exception information (unused)
+{
+    if (self->depth == 0) {
+        PyErr_SetString(PyExc_RuntimeError, "record has not been entered");
+        return NULL;
+    }
+    self->depth--;
+    if (CommitRecord() < 0) {
+        if (PyErr_Occurred())
+            return NULL;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_INCREF(Py_False);
+    return Py_False;
+}
+
+
+//-----------------------------------------------------------------------------
+// Record_AppendLine()
+//   Append a line to the record, formatting the arguments in the same way as
+// Debug() and friends. True is returned if the record is going to be written
+// and False otherwise.
+//-----------------------------------------------------------------------------
+static PyObject *Record_AppendLine(
+    udt_Record *self,                   // record to append to
+    PyObject *args)                     // arguments
+{
+    PyObject *format, *formatArgs, *line, *encodedLine;
+    TextBuffer *buffer;
+    const char *text;
+    int result;
+
+    if (self->depth == 0) {
+        PyErr_SetString(PyExc_RuntimeError, "record has not been entered");
+        return NULL;
+    }
+    buffer = GetRecordBuffer();
+    if (!buffer) {
+        Py_INCREF(Py_False);
+        return Py_False;
+    }
+    if (PyTuple_GET_SIZE(args) < 1 ||
+            !PyUnicode_Check(PyTuple_GET_ITEM(args, 0))) {
+        PyErr_SetString(PyExc_TypeError, "format must be a string");
+        return NULL;
+    }
+    format = PyTuple_GET_ITEM(args, 0);
+    formatArgs = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (!formatArgs)
+        return NULL;
+    line = PyUnicode_Format(format, formatArgs);
+    Py_DECREF(formatArgs);
+    if (!line)
+        return NULL;
+    result = GetEncodedStringForPython(line, &encodedLine, &text);
+    Py_DECREF(line);
+    if (result < 0)
+        return NULL;
+    result = TextBuffer_AppendLine(buffer, "%s", text);
+    Py_DECREF(encodedLine);
+    if (result < 0)
+        return PyErr_NoMemory();
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+
+//-----------------------------------------------------------------------------
+//  declaration of methods supported by the record type
+//-----------------------------------------------------------------------------
+static PyMethodDef gRecordMethods[] = {
+    { "__enter__", (PyCFunction) Record_Enter, METH_NOARGS },
+    { "__exit__", (PyCFunction) Record_Exit, METH_VARARGS },
+    { "AppendLine", (PyCFunction) Record_AppendLine, METH_VARARGS },
+    { NULL }
+};
+
+
+// define record Python type
+static PyTypeObject gRecordType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "cx_Logging.Record",                // tp_name
+    sizeof(udt_Record),                 // tp_basicsize
+    0,                                  // tp_itemsize
+    0,                                  // tp_dealloc
+    0,                                  // tp_print
+    0,                                  // tp_getattr
+    0,                                  // tp_setattr
+    0,                                  // tp_compare
+    0,                                  // tp_repr
+    0,                                  // tp_as_number
+    0,                                  // tp_as_sequence
+    0,                                  // tp_as_mapping
+    0,                                  // tp_hash
+    0,                                  // tp_call
+    0,                                  // tp_str
+    0,                                  // tp_getattro
+    0,                                  // tp_setattro
+    0,                                  // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,                 // tp_flags
+    0,                                  // tp_doc
+    0,                                  // tp_traverse
+    0,                                  // tp_clear
+    0,                                  // tp_richcompare
+    0,                                  // tp_weaklistoffset
+    0,                                  // tp_iter
+    0,                                  // tp_iternext
+    gRecordMethods,                     // tp_methods
+    0,                                  // tp_members
+    0,                                  // tp_getset
+    0,                                  // tp_base
+    0,                                  // tp_dict
+    0,                                  // tp_descr_get
+    0,                                  // tp_descr_set
+    0,                                  // tp_dictoffset
+    0,                                  // tp_init
+    0,                                  // tp_alloc
+    Record_New,                         // tp_new
+    0,                                  // tp_free
+    0,                                  // tp_is_gc
+    0                                   // tp_bases
+};
+
+
 //-----------------------------------------------------------------------------
 //  declaration of methods supported by the internal module
 //-----------------------------------------------------------------------------
@@ -2425,6 +9607,16 @@ static PyMethodDef gLoggingModuleMethods[] = {
     { "GetEncoding", (PyCFunction) GetEncodingForPython, METH_NOARGS },
     { "SetEncoding", (PyCFunction) SetEncodingForPython, METH_VARARGS },
     { "LogException", (PyCFunction) LogExceptionForPython, METH_VARARGS },
+    { "EnableStats", (PyCFunction) EnableStatsForPython, METH_VARARGS },
+    { "GetStats", (PyCFunction) GetStatsForPython,
+            METH_VARARGS | METH_KEYWORDS },
+    { "ResetStats", (PyCFunction) ResetStatsForPython, METH_NOARGS },
+    { "GetCounters", (PyCFunction) GetCountersForPython, METH_NOARGS },
+    { "RunCollector", (PyCFunction) RunCollectorForPython,
+            METH_VARARGS | METH_KEYWORDS },
+    { "StopCollector", (PyCFunction) StopCollectorForPython, METH_NOARGS },
+    { "AddSink", (PyCFunction) AddSinkForPython,
+            METH_VARARGS | METH_KEYWORDS },
     { NULL }
 };
 
@@ -2459,6 +9651,11 @@ static PyObject *Module_Initialize(void)
         return NULL;
     if (PyType_Ready(&gPythonLoggingStateType) < 0)
         return NULL;
+    if (PyType_Ready(&gRecordType) < 0)
+        return NULL;
+    Py_INCREF(&gRecordType);
+    if (PyModule_AddObject(module, "Record", (PyObject*) &gRecordType) < 0)
+        return NULL;
 
     // add version and build time for easier support
     if (PyModule_AddStringConstant(module, "__version__",
@@ -2484,6 +9681,50 @@ static PyObject *Module_Initialize(void)
         return NULL;
     if (PyModule_AddIntConstant(module, "NONE", LOG_LEVEL_NONE) < 0)
         return NULL;
+    if (PyModule_AddIntConstant(module, "DURABILITY_NONE",
+            LOG_DURABILITY_NONE) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "DURABILITY_INTERVAL",
+            LOG_DURABILITY_INTERVAL) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "DURABILITY_LEVEL",
+            LOG_DURABILITY_LEVEL) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "DURABILITY_GROUP_COMMIT",
+            LOG_DURABILITY_GROUP_COMMIT) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "ROTATE_NONE", LOG_ROTATE_NONE) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "ROTATE_HOURLY",
+            LOG_ROTATE_HOURLY) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "ROTATE_DAILY", LOG_ROTATE_DAILY) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "SINK_STDERR", LOG_SINK_STDERR) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "SINK_STDOUT", LOG_SINK_STDOUT) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "SINK_SYSLOG", LOG_SINK_SYSLOG) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "SYSLOG_FORMAT_RFC3164",
+            LOG_SYSLOG_FORMAT_RFC3164) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "SYSLOG_FORMAT_RFC5424",
+            LOG_SYSLOG_FORMAT_RFC5424) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "SYSLOG_FORMAT_JOURNALD",
+            LOG_SYSLOG_FORMAT_JOURNALD) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "SINK_TCP", LOG_SINK_TCP) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "SINK_UDP", LOG_SINK_UDP) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "FRAMING_NEWLINE",
+            LOG_FRAMING_NEWLINE) < 0)
+        return NULL;
+    if (PyModule_AddIntConstant(module, "FRAMING_LENGTH",
+            LOG_FRAMING_LENGTH) < 0)
+        return NULL;
     if (PyModule_AddStringConstant(module, "ENV_NAME_FILE_NAME",
             ENV_NAME_FILE_NAME) < 0)
         return NULL;
@@ -2667,6 +9908,399 @@ BOOL WINAPI DllMain(
     return TRUE;
 }
 #else
+//-----------------------------------------------------------------------------
+// LoggingState_LockSinkQueues()
+//   Acquire or release the locks of the queues of the asynchronous sinks of
+// the state so that no queue is being modified when the process forks.
+//-----------------------------------------------------------------------------
+static void LoggingState_LockSinkQueues(
+    LoggingState *state,                // state whose sinks to lock
+    int acquire)                        // acquire locks (or release them)?
+{
+    AsyncSink *asyncSink;
+    LoggingSink *sink;
+
+    for (sink = state->sinks; sink; sink = sink->next) {
+        if (sink->type != &gAsyncSinkType)
+            continue;
+        asyncSink = (AsyncSink*) sink->context;
+        if (acquire)
+            pthread_mutex_lock(&asyncSink->mutex);
+        else pthread_mutex_unlock(&asyncSink->mutex);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// NetworkSink_AfterFork()
+//   Called in the child after the process forks. The connection and the spill
+// file are shared with the parent and the frames waiting to be sent are the
+// parent's, so the child discards them and connects on its own without a
+// spill file.
+//-----------------------------------------------------------------------------
+static void NetworkSink_AfterFork(
+    NetworkSink *networkSink)           // sink to reset
+{
+    if (networkSink->fd >= 0) {
+        close(networkSink->fd);
+        networkSink->fd = -1;
+    }
+    if (networkSink->spillFd >= 0) {
+        close(networkSink->spillFd);
+        networkSink->spillFd = -1;
+    }
+    networkSink->bufferStart = networkSink->bufferEnd = 0;
+    networkSink->spillStart = networkSink->spillEnd = 0;
+    networkSink->nextConnectTime = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_RestartSinks()
+//   Called in the child after the process forks in order to start the writer
+// threads of the asynchronous sinks of the state again, since only the thread
+// that forked exists in the child. The records in each queue are left for
+// the parent to write and the lock and condition of the queue are initialized
+// again. If a writer thread cannot be started, the sink reports an error for
+// each record written to it.
+//-----------------------------------------------------------------------------
+static void LoggingState_RestartSinks(
+    LoggingState *state)                // state whose sinks to restart
+{
+    AsyncSink *asyncSink;
+    LoggingSink *sink;
+
+    for (sink = state->sinks; sink; sink = sink->next) {
+        if (sink->type != &gAsyncSinkType)
+            continue;
+        asyncSink = (AsyncSink*) sink->context;
+        pthread_mutex_init(&asyncSink->mutex, NULL);
+        pthread_cond_init(&asyncSink->wakeup, NULL);
+        asyncSink->tail = asyncSink->head;
+        asyncSink->numQueued = 0;
+        asyncSink->numFailed = 0;
+        asyncSink->writerWaiting = 0;
+        if (asyncSink->target->type == &gNetworkSinkType)
+            NetworkSink_AfterFork((NetworkSink*) asyncSink->target->context);
+        if (AsyncSink_Start(asyncSink) == 0)
+            asyncSink->forkGeneration = gForkGeneration;
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// PrepareForFork()
+//   Called before the process forks. All of the logging locks are acquired so
+// that no other thread is in the middle of writing when the process forks;
+// otherwise the child would wait forever for a lock held by a thread that
+// does not exist in the child.
+//-----------------------------------------------------------------------------
+static void PrepareForFork(void)
+{
+    udt_LoggingState *loggingState;
+
+    ACQUIRE_LOCK(gLoggingStateLock);
+    if (gLoggingState)
+        LoggingState_LockSinkQueues(gLoggingState, 1);
+    for (loggingState = gPythonLoggingStates; loggingState;
+            loggingState = loggingState->next) {
+        ACQUIRE_LOCK(loggingState->lock);
+        if (loggingState->state)
+            LoggingState_LockSinkQueues(loggingState->state, 1);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// AfterForkInParent()
+//   Called in the parent after the process forks. The locks acquired before
+// the process forked are released.
+//-----------------------------------------------------------------------------
+static void AfterForkInParent(void)
+{
+    udt_LoggingState *loggingState;
+
+    for (loggingState = gPythonLoggingStates; loggingState;
+            loggingState = loggingState->next) {
+        if (loggingState->state)
+            LoggingState_LockSinkQueues(loggingState->state, 0);
+        RELEASE_LOCK(loggingState->lock);
+    }
+    if (gLoggingState)
+        LoggingState_LockSinkQueues(gLoggingState, 0);
+    RELEASE_LOCK(gLoggingStateLock);
+}
+
+
+//-----------------------------------------------------------------------------
+// GetFileNameForProcess()
+//   Return the name of the file to be written by the current process instead
+// of the given file. The process id is added to the name in the same manner as
+// the sequence number when rotating files. The caller is responsible for
+// freeing the name; NULL is returned if memory cannot be allocated.
+//-----------------------------------------------------------------------------
+static char *GetFileNameForProcess(
+    const char *baseFileName)           // name of file shared with parent
+{
+    char *fileName;
+    const char *tmp;
+
+    fileName = malloc(strlen(baseFileName) + 23);
+    if (!fileName)
+        return NULL;
+    strcpy(fileName, baseFileName);
+    tmp = strrchr(baseFileName, '.');
+    if (tmp) {
+        sprintf(fileName + (tmp - baseFileName), ".%ld", (long) getpid());
+        strcat(fileName, tmp);
+    } else sprintf(fileName + strlen(fileName), ".%ld", (long) getpid());
+    return fileName;
+}
+
+
+//-----------------------------------------------------------------------------
+// DetachFileSink()
+//   Free a file sink inherited from the parent without writing anything to
+// its file, which is still written by the parent.
+//-----------------------------------------------------------------------------
+static void DetachFileSink(
+    LoggingSink *sink)                  // sink to detach
+{
+    LoggingState *state = (LoggingState*) sink->context;
+
+    if (state->fp) {
+        fclose(state->fp);
+        state->fp = NULL;
+    }
+    FreeLoggingSink(sink);
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_AddRoutesForProcess()
+//   Add the routes of the state shared with the parent to the new state of the
+// child, with the process id added to the name of the file of each route.
+//-----------------------------------------------------------------------------
+static int LoggingState_AddRoutesForProcess(
+    LoggingState *state,                // state shared with parent
+    LoggingState *newState,             // state of child
+    ExceptionInfo *exceptionInfo)       // exception info
+{
+    LoggingOptions options;
+    LoggingRoute *routes;
+    unsigned long i;
+    int result;
+
+    options = state->options;
+    routes = calloc(options.numRoutes, sizeof(LoggingRoute));
+    if (!routes)
+        return -1;
+    for (i = 0; i < options.numRoutes; i++) {
+        routes[i] = options.routes[i];
+        routes[i].fileName = GetFileNameForProcess(options.routes[i].fileName);
+        if (!routes[i].fileName)
+            break;
+    }
+    options.routes = routes;
+    result = (i < options.numRoutes) ? -1 :
+            LoggingState_AddRoutes(newState, &options, state->prefix,
+                    exceptionInfo);
+    while (i > 0)
+        free((void*) routes[--i].fileName);
+    free(routes);
+    return result;
+}
+
+
+//-----------------------------------------------------------------------------
+// CopyFileSinkForProcess()
+//   Return a copy of the file sink inherited from the parent which writes to a
+// file of its own, with the process id added to its name, or NULL if the file
+// cannot be opened.
+//-----------------------------------------------------------------------------
+static LoggingSink *CopyFileSinkForProcess(
+    LoggingSink *sink)                  // file sink shared with parent
+{
+    LoggingState *fileState = (LoggingState*) sink->context;
+    ExceptionInfo exceptionInfo;
+    LoggingSink *copy;
+    char *fileName;
+
+    fileName = GetFileNameForProcess(fileState->baseFileName);
+    if (!fileName)
+        return NULL;
+    copy = CreateFileSink(fileName, sink->level, fileState->maxFiles,
+            fileState->maxFileSize, fileState->prefix, &exceptionInfo);
+    free(fileName);
+    if (copy) {
+        copy->maxLevel = sink->maxLevel;
+        copy->asynchronous = sink->asynchronous;
+    }
+    return copy;
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_TakeSinks()
+//   Give the new state of the child the sinks of the state shared with the
+// parent, other than those for its routes, which are added again. Sinks which
+// write to files, directly or from the writer thread of an asynchronous sink,
+// are replaced by sinks which write to files of their own, with the process id
+// added to their names, and the sinks they replace are detached without
+// writing to the files of the parent; if the files cannot be opened, the sinks
+// are dropped. Other sinks are moved to the new state; the writer threads of
+// asynchronous sinks have already been started again and nothing has been
+// queued for them yet.
+//-----------------------------------------------------------------------------
+static void LoggingState_TakeSinks(
+    LoggingState *state,                // state shared with parent
+    LoggingState *newState)             // state of child
+{
+    LoggingSink *sink, *copy, *target;
+    ExceptionInfo exceptionInfo;
+    AsyncSink *asyncSink;
+    unsigned long i;
+
+    for (i = 0; state->sinks; i++) {
+        sink = state->sinks;
+        state->sinks = sink->next;
+        sink->next = NULL;
+        if (sink->type == &gFileSinkType) {
+            if (i >= state->options.numRoutes) {
+                copy = CopyFileSinkForProcess(sink);
+                if (copy)
+                    LoggingState_AddSink(newState, copy, &exceptionInfo);
+            }
+            DetachFileSink(sink);
+            continue;
+        }
+        if (sink->type == &gAsyncSinkType) {
+            asyncSink = (AsyncSink*) sink->context;
+            target = asyncSink->target;
+            if (target->type == &gFileSinkType) {
+                copy = CopyFileSinkForProcess(target);
+                pthread_mutex_lock(&asyncSink->mutex);
+                asyncSink->target = copy;
+                pthread_mutex_unlock(&asyncSink->mutex);
+                DetachFileSink(target);
+                if (!copy) {
+                    FreeLoggingSink(sink);
+                    continue;
+                }
+            }
+        }
+        LoggingState_AddSink(newState, sink, &exceptionInfo);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// ReopenAfterFork()
+//   Called in the child after the process forks in order to switch the global
+// logging state to a file of its own. The process id is added to the name of
+// the file in the same manner as the sequence number when rotating files and
+// the files of its routes and file sinks are named the same way. If the new
+// file or the files of its routes cannot be opened, the file shared with the
+// parent continues to be used.
+//-----------------------------------------------------------------------------
+static void ReopenAfterFork(void)
+{
+    LoggingState *state, *newState;
+    ExceptionInfo exceptionInfo;
+    char *fileName;
+
+    state = gLoggingState;
+    fileName = GetFileNameForProcess(state->baseFileName);
+    if (!fileName)
+        return;
+    newState = LoggingState_New(NULL, fileName, state->level, state->maxFiles,
+            state->maxFileSize, state->prefix, state->reuseExistingFiles,
+            state->rotateFiles, &state->options, &exceptionInfo);
+    free(fileName);
+    if (!newState)
+        return;
+    if (state->options.numRoutes > 0 &&
+            LoggingState_AddRoutesForProcess(state, newState,
+                    &exceptionInfo) < 0) {
+        LoggingState_Free(newState);
+        return;
+    }
+    LoggingState_TakeSinks(state, newState);
+    ReplaceGlobalLoggingState(newState);
+
+    // the file of the original state is shared with the parent so nothing
+    // further is written to it
+    state->repeatCount = 0;
+    fclose(state->fp);
+    state->fp = NULL;
+    LoggingState_Free(state);
+    LogMessageV(LOG_LEVEL_NONE, "continuing logging after fork from process %ld",
+            (long) getppid());
+}
+
+
+//-----------------------------------------------------------------------------
+// LoggingState_AfterFork()
+//   Called in the child after the process forks in order to open the lock
+// file again and to claim a ring of its own in shared memory. Locks placed on
+// a file descriptor inherited from the parent would not exclude the parent and
+// the ring inherited from the parent may only be written by the parent. Any
+// group commit in progress in the parent is abandoned.
+//-----------------------------------------------------------------------------
+static void LoggingState_AfterFork(
+    LoggingState *state)                // state to use
+{
+    if (state->lockFileDescriptor >= 0) {
+        close(state->lockFileDescriptor);
+        state->lockFileDescriptor = -1;
+        LoggingState_OpenLockFile(state);
+    }
+    if (state->sharedMemory) {
+        state->repeatCount = 0;
+        LoggingState_ClaimSharedRing(state);
+    }
+
+    state->syncInProgress = 0;
+    state->syncWaiters = 0;
+    state->durableWriters = 0;
+    state->freeWaiting = 0;
+    sem_destroy(&state->syncDone);
+    sem_init(&state->syncDone, 0, 0);
+    sem_destroy(&state->writersDone);
+    sem_init(&state->writersDone, 0, 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// AfterForkInChild()
+//   Called in the child after the process forks. Only the thread that forked
+// exists in the child so the locks are simply initialized again and the
+// writer threads of asynchronous sinks are started again.
+//-----------------------------------------------------------------------------
+static void AfterForkInChild(void)
+{
+    udt_LoggingState *loggingState;
+
+    gForkGeneration++;
+    for (loggingState = gPythonLoggingStates; loggingState;
+            loggingState = loggingState->next) {
+        INITIALIZE_LOCK(loggingState->lock);
+        if (loggingState->state) {
+            LoggingState_AfterFork(loggingState->state);
+            LoggingState_RestartSinks(loggingState->state);
+        }
+    }
+    INITIALIZE_LOCK(gLoggingStateLock);
+    if (gLoggingState) {
+        LoggingState_AfterFork(gLoggingState);
+        LoggingState_RestartSinks(gLoggingState);
+    }
+    if (gLoggingState && gLoggingState->fileOwned &&
+            gLoggingState->options.reopenAfterFork)
+        ReopenAfterFork();
+}
+
+
 //-----------------------------------------------------------------------------
 // Initialize()
 //   Called when the library is initialized.
@@ -2674,6 +10308,7 @@ BOOL WINAPI DllMain(
 void __attribute__ ((constructor)) Initialize(void)
 {
     INITIALIZE_LOCK(gLoggingStateLock);
+    pthread_atfork(PrepareForFork, AfterForkInParent, AfterForkInChild);
 }
 
 
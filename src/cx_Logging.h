@@ -37,7 +37,196 @@ typedef struct {
 } ExceptionInfo;
 
 
-// define structure for managing logging state
+// define structure for managing a latency histogram; the buckets are log
+// bucketed with four sub-buckets for each power of two nanoseconds
+#define LOG_STATS_NUM_BUCKETS           128
+typedef struct {
+    unsigned long long count;
+    unsigned long long totalNs;
+    unsigned long long maxNs;
+    unsigned long long buckets[LOG_STATS_NUM_BUCKETS];
+} LatencyHistogram;
+
+
+// define structure for managing logging statistics
+typedef struct {
+    LatencyHistogram lockWait;
+    LatencyHistogram write;
+    LatencyHistogram flush;
+    LatencyHistogram rotate;
+    LatencyHistogram sync;
+} LoggingStats;
+
+
+// define structure for managing logging counters; the counters kept by level
+// are indexed by LOG_LEVEL_INDEX_DEBUG through LOG_LEVEL_INDEX_NONE
+#define LOG_NUM_LEVEL_INDEXES           6
+typedef struct {
+    unsigned long long messages[LOG_NUM_LEVEL_INDEXES];
+    unsigned long long bytes[LOG_NUM_LEVEL_INDEXES];
+    unsigned long long suppressed[LOG_NUM_LEVEL_INDEXES];
+    unsigned long long sampled[LOG_NUM_LEVEL_INDEXES];
+    unsigned long long rateLimited;
+    unsigned long long repeated;
+    unsigned long long rotations;
+    unsigned long long flushes;
+    unsigned long long errors;
+    unsigned long long dropped;
+    unsigned long long syncs;
+} LoggingCounters;
+
+
+// define structure for routing the messages at levels within a range to a
+// file of their own, which is rotated independently of the log file; a
+// maximum level of 0 means that the range has no upper limit
+typedef struct {
+    const char *fileName;
+    unsigned long minLevel;
+    unsigned long maxLevel;
+    unsigned long maxFiles;
+    unsigned long maxFileSize;
+} LoggingRoute;
+
+
+// define structure for managing optional logging behavior; the structure
+// should be initialized with InitializeLoggingOptions() before it is used
+typedef struct {
+    unsigned long rateLimit;
+    int suppressRepeats;
+    unsigned long sampleRates[LOG_NUM_LEVEL_INDEXES];
+    int sampleRandomly;
+    unsigned long flightRecorderSize;
+    unsigned long flightRecorderLevel;
+    unsigned long flightRecorderTrigger;
+    int emergencyFlush;
+    int reopenAfterFork;
+    int multiProcess;
+    int sharedMemory;
+    unsigned long bufferSize;
+    int directWrite;
+    unsigned long durability;
+    unsigned long syncInterval;
+    unsigned long durableLevel;
+    unsigned long rotateInterval;
+    unsigned long exceptionDedupWindow;
+    int sortArguments;
+    const LoggingRoute *routes;
+    unsigned long numRoutes;
+} LoggingOptions;
+
+
+// define structure for managing an entry in the flight recorder; the sequence
+// is odd while the entry is being written so that an entry which is
+// overwritten while it is being read can be detected and skipped
+#define LOG_FLIGHT_RECORDER_MESSAGE_SIZE    224
+#define LOG_FLIGHT_RECORDER_MAX_ENTRIES     1024
+typedef struct {
+    unsigned long long sequence;
+    unsigned long long timestamp;
+    unsigned long level;
+    long threadId;
+    char message[LOG_FLIGHT_RECORDER_MESSAGE_SIZE];
+} FlightRecorderEntry;
+
+
+// define structure for managing the flight recorder, a fixed size ring of the
+// most recent messages that were not written because of their level
+typedef struct {
+    unsigned long long nextTicket;
+    unsigned long long dumpedTicket;
+    unsigned long numEntries;
+    FlightRecorderEntry *entries;
+} FlightRecorder;
+
+
+// define structures for managing the shared memory used to send messages from
+// multiple processes to a single collector process; the shared memory starts
+// with a header which is followed by a ring for each process, each of which
+// is followed by its data; records are aligned on 8 byte boundaries
+#define LOG_SHARED_MEMORY_MAGIC         0x63784c6f67536d31ULL
+typedef struct {
+    unsigned long long magic;
+    unsigned long long numRings;
+    unsigned long long ringSize;
+    char padding[40];
+} SharedMemoryHeader;
+
+typedef struct {
+    unsigned long long head;
+    char padding1[56];
+    unsigned long long tail;
+    char padding2[56];
+    long long ownerPid;
+    unsigned long long dropped;
+    char padding3[48];
+} SharedRing;
+
+typedef struct {
+    unsigned long long timestamp;
+    long long processId;
+    long long threadId;
+    unsigned int level;
+    unsigned int length;
+} SharedRecord;
+
+
+// define structure for a record written to a sink; the text is formatted only
+// once, with the prefix of the logging state at the start of each line and a
+// trailing line feed, and the same text is written to the file and to each of
+// the sinks; the message is the text that was logged, without any prefix, and
+// the timestamp is in microseconds since the epoch
+typedef struct {
+    unsigned long long timestamp;
+    long long threadId;
+    unsigned long level;
+    const char *message;
+    size_t messageLength;
+    const char *text;
+    size_t textLength;
+} LoggingSinkRecord;
+
+
+// define structure for the operations supported by a type of sink; each is
+// called while the lock of the logging state to which the sink was added is
+// held; rotate (if not NULL) is called before each batch of records is written
+// and flush (if not NULL) after it; close (if not NULL) is called when logging
+// stops; each returns -1 and places a message in the exception info of the
+// sink on failure
+struct LoggingSink;
+typedef struct {
+    const char *name;
+    int (*writeBatch)(struct LoggingSink*, const LoggingSinkRecord*, size_t);
+    int (*flush)(struct LoggingSink*);
+    int (*rotate)(struct LoggingSink*);
+    void (*close)(struct LoggingSink*);
+} LoggingSinkType;
+
+
+// define structure for managing a sink to which records at or above its level
+// (and at or below its maximum level) are written in addition to the file of
+// a logging state; a sink which is
+// asynchronous is written to by the writer thread of the asynchronous sink
+// which wraps it (instead of by the thread logging the message) and may wait
+// for its destination
+typedef struct LoggingSink {
+    const LoggingSinkType *type;
+    void *context;
+    unsigned long level;
+    unsigned long maxLevel;
+    unsigned long long errors;
+    int asynchronous;
+    struct LoggingSink *next;
+    ExceptionInfo exceptionInfo;
+} LoggingSink;
+
+
+// define function called for each record written to a callback sink
+typedef int (*LoggingSinkCallback)(void*, const LoggingSinkRecord*);
+
+
+// define structure for managing logging state; fields are only ever added at
+// the end so that extensions built against earlier versions of this header
+// continue to find the fields they use at the same offsets
 typedef struct {
     FILE *fp;
     char *fileName;
@@ -51,14 +240,55 @@ typedef struct {
     int rotateFiles;
     int fileOwned;
     ExceptionInfo exceptionInfo;
+    char *baseFileName;
+    char *prefixBuffer;
+    size_t maxPrefixLength;
+    time_t rotateDeadline;
+    int lockFileDescriptor;
+    unsigned long long bytesWritten;
+    unsigned long long bytesWrittenAtOpen;
+    LoggingCounters counters;
+    LoggingOptions options;
+    unsigned long long lastMessageHash;
+    unsigned long lastMessageLevel;
+    unsigned long long repeatCount;
+    char *messageBuffer;
+    size_t messageBufferSize;
+    FlightRecorder *flightRecorder;
+    SharedMemoryHeader *sharedMemory;
+    size_t sharedMemorySize;
+    SharedRing *sharedRing;
+    long processId;
+    LOCK_TYPE *lock;
+    unsigned long long lastSyncTime;
+    unsigned long long writeTicket;
+    unsigned long long syncedTicket;
+    int syncInProgress;
+    unsigned long syncWaiters;
+    unsigned long durableWriters;
+    int freeWaiting;
+#ifndef MS_WINDOWS
+    sem_t syncDone;
+    sem_t writersDone;
+#endif
+    LoggingSink *sinks;
+    LoggingSinkRecord sinkRecord;
+    char *sinkText;
+    size_t sinkTextSize;
+    unsigned long long sharedFileSize;
+    unsigned long long sharedFilePosition;
+    unsigned long sharedFileWrites;
 } LoggingState;
 
 
-// define structure for managing logging state for Python
-typedef struct {
+// define structure for managing logging state for Python; all such states are
+// kept in a list so that their locks can be managed when the process forks
+typedef struct udt_LoggingState {
     PyObject_HEAD
     LoggingState *state;
     LOCK_TYPE lock;
+    struct udt_LoggingState *next;
+    struct udt_LoggingState *prev;
 } udt_LoggingState;
 
 
@@ -71,6 +301,51 @@ typedef struct {
 #define LOG_LEVEL_NONE                  100
 
 
+// define indexes used for the counters kept by level
+#define LOG_LEVEL_INDEX_DEBUG           0
+#define LOG_LEVEL_INDEX_INFO            1
+#define LOG_LEVEL_INDEX_WARNING         2
+#define LOG_LEVEL_INDEX_ERROR           3
+#define LOG_LEVEL_INDEX_CRITICAL        4
+#define LOG_LEVEL_INDEX_NONE            5
+
+
+// define durability policies; with group commit, writers of messages at or
+// above the durable level wait until their message has been synced and share
+// a single sync of the file with all of the other writers that are waiting
+#define LOG_DURABILITY_NONE             0
+#define LOG_DURABILITY_INTERVAL         1
+#define LOG_DURABILITY_LEVEL            2
+#define LOG_DURABILITY_GROUP_COMMIT     3
+
+
+// define intervals at which files are rotated, in addition to rotating them
+// when they reach their maximum size; the name of each file is stamped with
+// the local date (and hour) at which the interval began
+#define LOG_ROTATE_NONE                 0
+#define LOG_ROTATE_HOURLY               1
+#define LOG_ROTATE_DAILY                2
+
+
+// define targets of the sinks that can be added from Python, other than files
+#define LOG_SINK_STDERR                 1
+#define LOG_SINK_STDOUT                 2
+#define LOG_SINK_SYSLOG                 3
+#define LOG_SINK_TCP                    4
+#define LOG_SINK_UDP                    5
+
+
+// define formats of the records sent by syslog sinks
+#define LOG_SYSLOG_FORMAT_RFC3164       0
+#define LOG_SYSLOG_FORMAT_RFC5424       1
+#define LOG_SYSLOG_FORMAT_JOURNALD      2
+
+
+// define framing of the records streamed by network sinks
+#define LOG_FRAMING_NEWLINE             0
+#define LOG_FRAMING_LENGTH              1
+
+
 // define defaults
 #define DEFAULT_MAX_FILE_SIZE           1024 * 1024
 #define DEFAULT_PREFIX                  "%t"
@@ -81,10 +356,17 @@ CX_LOGGING_API(int) StartLogging(const char*, unsigned long, unsigned long,
         unsigned long, const char *);
 CX_LOGGING_API(int) StartLoggingEx(const char*, unsigned long, unsigned long,
         unsigned long, const char *, int, int, ExceptionInfo*);
+CX_LOGGING_API(void) InitializeLoggingOptions(LoggingOptions*);
+CX_LOGGING_API(int) StartLoggingWithOptions(const char*, unsigned long,
+        unsigned long, unsigned long, const char *, int, int,
+        const LoggingOptions*, ExceptionInfo*);
 CX_LOGGING_API(int) StartLoggingForPythonThread(const char*, unsigned long,
         unsigned long, unsigned long, const char *);
 CX_LOGGING_API(int) StartLoggingForPythonThreadEx(const char*, unsigned long,
         unsigned long, unsigned long, const char *, int, int);
+CX_LOGGING_API(int) StartLoggingForPythonThreadWithOptions(const char*,
+        unsigned long, unsigned long, unsigned long, const char *, int, int,
+        const LoggingOptions*);
 CX_LOGGING_API(int) StartLoggingStderr(unsigned long, const char *);
 CX_LOGGING_API(int) StartLoggingStderrEx(unsigned long, const char *,
         ExceptionInfo*);
@@ -113,16 +395,51 @@ CX_LOGGING_API(int) LogPythonException(const char*);
 CX_LOGGING_API(int) LogPythonExceptionWithTraceback(const char*, PyObject*,
         PyObject*, PyObject*);
 CX_LOGGING_API(int) LogConfiguredException(PyObject*, const char*);
+CX_LOGGING_API(int) BeginRecord(unsigned long);
+CX_LOGGING_API(int) BeginRecordForPython(unsigned long);
+CX_LOGGING_API(int) AppendLine(const char*, ...);
+CX_LOGGING_API(int) AppendLineVaList(const char*, va_list);
+CX_LOGGING_API(int) CommitRecord(void);
 CX_LOGGING_API(udt_LoggingState*) GetLoggingState(void);
 CX_LOGGING_API(int) SetLoggingState(udt_LoggingState*);
 CX_LOGGING_API(int) IsLoggingStarted(void);
 CX_LOGGING_API(int) IsLoggingAtLevelForPython(unsigned long);
+CX_LOGGING_API(void) EnableLoggingStats(int);
+CX_LOGGING_API(void) GetLoggingStats(LoggingStats*);
+CX_LOGGING_API(void) ResetLoggingStats(void);
+CX_LOGGING_API(unsigned long long) GetLatencyHistogramLowerBound(int);
+CX_LOGGING_API(int) GetLoggingCounters(LoggingCounters*);
+CX_LOGGING_API(int) RunLoggingCollector(const char*, const char*,
+        unsigned long, unsigned long, const char*, unsigned long,
+        unsigned long, ExceptionInfo*);
+CX_LOGGING_API(void) StopLoggingCollector(void);
+CX_LOGGING_API(LoggingSink*) CreateLoggingSink(const LoggingSinkType*,
+        void*, unsigned long, ExceptionInfo*);
+CX_LOGGING_API(LoggingSink*) CreateFileSink(const char*, unsigned long,
+        unsigned long, unsigned long, const char*, ExceptionInfo*);
+CX_LOGGING_API(LoggingSink*) CreateStderrSink(unsigned long, ExceptionInfo*);
+CX_LOGGING_API(LoggingSink*) CreateStdoutSink(unsigned long, ExceptionInfo*);
+CX_LOGGING_API(LoggingSink*) CreateCallbackSink(LoggingSinkCallback, void*,
+        unsigned long, ExceptionInfo*);
+CX_LOGGING_API(void) FreeLoggingSink(LoggingSink*);
+CX_LOGGING_API(int) AddLoggingSink(LoggingSink*, ExceptionInfo*);
+CX_LOGGING_API(int) AddLoggingSinkForPython(LoggingSink*);
 
 #if defined MS_WINDOWS && !defined UNDER_CE
 CX_LOGGING_API(int) LogWin32Error(DWORD, const char*);
 CX_LOGGING_API(int) LogGUID(unsigned long, const char*, const IID*);
 #endif
 
+#ifndef MS_WINDOWS
+CX_LOGGING_API(LoggingSink*) CreateSyslogSink(const char*, const char*,
+        unsigned long, unsigned long, unsigned long, ExceptionInfo*);
+CX_LOGGING_API(LoggingSink*) CreateAsyncSink(LoggingSink*, unsigned long,
+        unsigned long, unsigned long, ExceptionInfo*);
+CX_LOGGING_API(LoggingSink*) CreateNetworkSink(const char*, unsigned long,
+        unsigned long, unsigned long, const char*, unsigned long long,
+        unsigned long, ExceptionInfo*);
+#endif
+
 #ifdef MS_WINDOWS
 CX_LOGGING_API(int) StartLoggingW(const WCHAR*, unsigned long, unsigned long,
         unsigned long, const WCHAR*);
@@ -0,0 +1,272 @@
+"""
+Benchmark the hot paths of cx_Logging.
+
+The C entry points (LogMessage, LogMessageV and LogMessageForPythonV) are
+called through ctypes from the extension module itself; the Python entry point
+Debug() is called directly. Each combination of entry point, prefix, enabled or
+disabled level and thread count is timed and the results are written as JSON
+so that they can be compared between builds:
+
+    python test/benchmark.py -o before.json
+    python test/benchmark.py -o after.json --compare before.json
+
+Log files are written to a tmpfs directory (/dev/shm) when one is available.
+With --shared, messages are also sent through shared memory to a collector
+running in another thread, which writes them to the file in batches.
+"""
+
+import argparse
+import ctypes
+import json
+import os
+import platform
+import shutil
+import sys
+import tempfile
+import threading
+import time
+
+import cx_Logging
+
+PREFIXES = ["", "%t", "[%i] %d %t %l"]
+ENTRY_POINTS = ["LogMessage", "LogMessageV", "LogMessageForPythonV", "Debug"]
+MESSAGE = b"benchmark message with a reasonable amount of text in it"
+
+# the C library is loaded twice: once with the GIL released during calls (for
+# the pure C entry points) and once with the GIL held (for the entry points
+# that examine the Python thread state)
+c_lib = ctypes.CDLL(cx_Logging.__file__)
+py_lib = ctypes.PyDLL(cx_Logging.__file__)
+c_lib.LogMessage.argtypes = [ctypes.c_ulong, ctypes.c_char_p]
+c_lib.IsLoggingStarted.argtypes = []
+
+
+def make_caller(entry_point, level):
+    """
+    Return a function which calls the given entry point the specified number
+    of times at the given level.
+    """
+    c_level = ctypes.c_ulong(level)
+    if entry_point == "LogMessage":
+        func = c_lib.LogMessage
+
+        def caller(num_calls):
+            for i in range(num_calls):
+                func(c_level, MESSAGE)
+
+    elif entry_point == "LogMessageV":
+        func = c_lib.LogMessageV
+
+        def caller(num_calls):
+            for i in range(num_calls):
+                func(c_level, b"%s %d", MESSAGE, ctypes.c_int(i))
+
+    elif entry_point == "LogMessageForPythonV":
+        func = py_lib.LogMessageForPythonV
+
+        def caller(num_calls):
+            for i in range(num_calls):
+                func(c_level, b"%s %d", MESSAGE, ctypes.c_int(i))
+
+    elif entry_point == "Debug":
+        func = cx_Logging.Debug
+        message = MESSAGE.decode() + " %d"
+
+        def caller(num_calls):
+            for i in range(num_calls):
+                func(message, i)
+
+    elif entry_point == "baseline":
+        func = c_lib.IsLoggingStarted
+
+        def caller(num_calls):
+            for i in range(num_calls):
+                func()
+
+    return caller
+
+
+def run_threads(caller, num_threads, calls_per_thread):
+    """
+    Run the caller in the specified number of threads and return the elapsed
+    time in nanoseconds from the moment all threads are released.
+    """
+    barrier = threading.Barrier(num_threads + 1)
+
+    def run():
+        barrier.wait()
+        caller(calls_per_thread)
+
+    threads = [threading.Thread(target=run) for i in range(num_threads)]
+    for thread in threads:
+        thread.start()
+    start = time.perf_counter_ns()
+    barrier.wait()
+    for thread in threads:
+        thread.join()
+    return time.perf_counter_ns() - start
+
+
+def run_scenario(args, name, entry_point, prefix, enabled, num_threads):
+    """
+    Run a single scenario and return a dictionary describing the results.
+    """
+    file_name = os.path.join(args.dir, f"{name}.log")
+    collector = None
+    if name == "shared":
+        shm_name = f"cx_Logging_bench_{os.getpid()}"
+        collector = threading.Thread(
+            target=cx_Logging.RunCollector,
+            args=(shm_name, file_name),
+            kwargs=dict(prefix=prefix, ringSize=args.ring_size),
+        )
+        collector.start()
+        for i in range(1000):
+            if os.path.exists(os.path.join("/dev/shm", shm_name)):
+                break
+            time.sleep(0.001)
+        file_name = shm_name
+    cx_Logging.StartLogging(
+        file_name,
+        level=cx_Logging.DEBUG if enabled else cx_Logging.ERROR,
+        maxFiles=args.max_files if name == "rotation" else 1,
+        maxFileSize=args.max_file_size if name == "rotation" else 1 << 30,
+        prefix=prefix,
+        sharedMemory=collector is not None,
+        directWrite=name == "direct",
+    )
+    calls_per_thread = max(1, args.calls // num_threads)
+    caller = make_caller(entry_point, cx_Logging.DEBUG)
+    try:
+        elapsed = run_threads(caller, num_threads, calls_per_thread)
+    finally:
+        cx_Logging.StopLogging()
+        if collector is not None:
+            cx_Logging.StopCollector()
+            collector.join()
+        for entry in os.listdir(args.dir):
+            if entry.startswith(name):
+                os.remove(os.path.join(args.dir, entry))
+    num_calls = calls_per_thread * num_threads
+    return dict(
+        scenario=name,
+        entry_point=entry_point,
+        prefix=prefix,
+        enabled=enabled,
+        threads=num_threads,
+        calls=num_calls,
+        seconds=elapsed / 1e9,
+        ns_per_call=elapsed / num_calls,
+        lines_per_sec=num_calls * 1e9 / elapsed if enabled else 0,
+    )
+
+
+def scenarios(args):
+    """
+    Generate the scenarios that are to be run.
+    """
+    for entry_point in args.entry_points:
+        for prefix in PREFIXES:
+            for enabled in (True, False):
+                for num_threads in args.threads:
+                    yield "basic", entry_point, prefix, enabled, num_threads
+        for num_threads in args.threads:
+            yield "rotation", entry_point, "%t", True, num_threads
+        for num_threads in args.threads:
+            yield "direct", entry_point, "%t", True, num_threads
+        if args.shared:
+            for num_threads in args.threads:
+                yield "shared", entry_point, "%t", True, num_threads
+    for num_threads in args.threads:
+        yield "baseline", "baseline", "%t", False, num_threads
+
+
+def result_key(result):
+    return (
+        result["scenario"],
+        result["entry_point"],
+        result["prefix"],
+        result["enabled"],
+        result["threads"],
+    )
+
+
+def compare(results, file_name):
+    """
+    Compare the results with those found in the specified file and write the
+    ratio of the time per call for each matching scenario.
+    """
+    with open(file_name) as f:
+        baseline = {result_key(r): r for r in json.load(f)["results"]}
+    for result in results:
+        other = baseline.get(result_key(result))
+        if other is None:
+            continue
+        ratio = result["ns_per_call"] / other["ns_per_call"]
+        print(
+            "%-8s %-20s %-16r %-5s %3d threads: %9.1f ns -> %9.1f ns (%.2fx)"
+            % (
+                result["scenario"],
+                result["entry_point"],
+                result["prefix"],
+                "on" if result["enabled"] else "off",
+                result["threads"],
+                other["ns_per_call"],
+                result["ns_per_call"],
+                ratio,
+            ),
+            file=sys.stderr,
+        )
+
+
+def main():
+    default_dir = "/dev/shm" if os.path.isdir("/dev/shm") else None
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-o", "--output", help="file to write JSON results to")
+    parser.add_argument("--compare", help="JSON results to compare against")
+    parser.add_argument("--dir", default=default_dir, help="log directory")
+    parser.add_argument("--calls", type=int, default=20000)
+    parser.add_argument("--max-files", type=int, default=10)
+    parser.add_argument("--max-file-size", type=int, default=64 * 1024)
+    parser.add_argument(
+        "--shared",
+        action="store_true",
+        help="also log through shared memory to a collector thread",
+    )
+    parser.add_argument("--ring-size", type=int, default=64 * 1024 * 1024)
+    parser.add_argument(
+        "--threads",
+        type=lambda s: [int(i) for i in s.split(",")],
+        default=[1, 4, 16, 64],
+    )
+    parser.add_argument(
+        "--entry-points",
+        type=lambda s: s.split(","),
+        default=ENTRY_POINTS,
+    )
+    args = parser.parse_args()
+    args.dir = tempfile.mkdtemp(prefix="cx_Logging_bench_", dir=args.dir)
+    try:
+        results = [run_scenario(args, *s) for s in scenarios(args)]
+    finally:
+        shutil.rmtree(args.dir)
+    output = dict(
+        version=cx_Logging.version,
+        buildtime=cx_Logging.buildtime,
+        python=sys.version,
+        platform=platform.platform(),
+        directory=os.path.dirname(args.dir),
+        results=results,
+    )
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(output, f, indent=2)
+    else:
+        json.dump(output, sys.stdout, indent=2)
+        print()
+    if args.compare:
+        compare(results, args.compare)
+
+
+if __name__ == "__main__":
+    main()
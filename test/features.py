@@ -0,0 +1,437 @@
+import cx_Logging
+import os
+import sys
+import tempfile
+import threading
+import time
+
+
+def read_lines(file_name):
+    with open(file_name) as f:
+        return [line.rstrip("\n") for line in f]
+
+
+def read_messages(file_name):
+    return [line.split(" ", 1)[1] for line in read_lines(file_name)]
+
+
+def start_logging(file_name="test.log", level=cx_Logging.DEBUG, **kwargs):
+    kwargs.setdefault("prefix", "%t")
+    cx_Logging.StartLogging(file_name, level, **kwargs)
+
+
+def check_sinks():
+    received = []
+    start_logging()
+    cx_Logging.AddSink("warnings.log", cx_Logging.WARNING)
+    cx_Logging.AddSink("info.log", cx_Logging.INFO, maxLevel=cx_Logging.INFO)
+    cx_Logging.AddSink(received.extend, cx_Logging.ERROR, intervalMs=10)
+    cx_Logging.Debug("debug message")
+    cx_Logging.Info("info message")
+    cx_Logging.Warning("warning message")
+    cx_Logging.Error("error message %d", 1)
+    cx_Logging.StopLogging()
+    assert read_messages("test.log")[1:-1] == [
+        "debug message",
+        "info message",
+        "warning message",
+        "error message 1",
+    ]
+    assert read_messages("warnings.log") == [
+        "starting logging at level WARN",
+        "warning message",
+        "error message 1",
+        "ending logging",
+    ]
+    assert read_messages("info.log")[1:-1] == ["info message"]
+    assert len(received) == 1
+    timestamp, level, thread_id, message = received[0]
+    assert level == cx_Logging.ERROR
+    assert thread_id == threading.get_ident()
+    assert message == "error message 1"
+    assert abs(timestamp - time.time()) < 60
+
+
+def check_routes():
+    start_logging(
+        routes=[
+            ("errors.log", cx_Logging.ERROR),
+            ("infos.log", cx_Logging.INFO, cx_Logging.WARNING, 1, 1024),
+        ]
+    )
+    cx_Logging.Debug("debug message")
+    cx_Logging.Info("info message")
+    cx_Logging.Warning("warning message")
+    cx_Logging.Error("error message")
+    cx_Logging.Critical("critical message")
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    assert len(read_lines("test.log")) == 7
+    assert read_messages("errors.log")[1:-1] == [
+        "error message",
+        "critical message",
+    ]
+    assert read_messages("infos.log")[1:-1] == [
+        "info message",
+        "warning message",
+    ]
+    assert counters["messages"][cx_Logging.ERROR] == 1
+    assert counters["messages"][cx_Logging.CRITICAL] == 1
+
+
+def check_rate_limit():
+    start_logging(rateLimit=5)
+    for i in range(20):
+        cx_Logging.Info("limited %d", i)
+    cx_Logging.Info("other site")
+    counters = cx_Logging.GetCounters()
+    assert counters["rateLimited"] == 0
+    time.sleep(1.1)
+    cx_Logging.Info("limited %d", 20)
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    assert counters["rateLimited"] == 15
+    assert read_messages("test.log")[1:-1] == [
+        "limited 0",
+        "limited 1",
+        "limited 2",
+        "limited 3",
+        "limited 4",
+        "other site",
+        "rate limit exceeded: 15 messages were suppressed",
+        "limited 20",
+    ]
+
+    # sites which stopped logging do not limit new ones
+    start_logging(rateLimit=5)
+    for i in range(2000):
+        cx_Logging.Info("distinct message %d" % i)
+    time.sleep(1.1)
+    for i in range(5):
+        for j in range(200):
+            cx_Logging.Info("new site %d" % j)
+    cx_Logging.StopLogging()
+    messages = read_messages("test.log")
+    assert len([m for m in messages if m.startswith("new site")]) == 1000
+
+
+def check_suppress_repeats():
+    start_logging(suppressRepeats=True)
+    for i in range(5):
+        cx_Logging.Warning("same message")
+    cx_Logging.Warning("different message")
+    cx_Logging.Warning("same message")
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    assert counters["repeated"] == 4
+    assert read_messages("test.log")[1:-1] == [
+        "same message",
+        "last message repeated 4 times",
+        "different message",
+        "same message",
+    ]
+
+
+def check_sampling():
+    start_logging(sampleRates={cx_Logging.DEBUG: 4, cx_Logging.INFO: 1})
+    for i in range(20):
+        cx_Logging.Debug("sampled %d", i)
+        cx_Logging.Info("not sampled %d", i)
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    messages = read_messages("test.log")
+    sampled = [m for m in messages if m.startswith("sampled")]
+    assert sampled == ["sampled %d" % i for i in range(0, 20, 4)]
+    assert len([m for m in messages if m.startswith("not sampled")]) == 20
+    assert counters["sampled"][cx_Logging.DEBUG] == 15
+    assert counters["sampled"][cx_Logging.INFO] == 0
+    assert counters["messages"][cx_Logging.DEBUG] == 5
+
+    start_logging(sampleRates={cx_Logging.DEBUG: 4}, sampleRandomly=True)
+    for i in range(4000):
+        cx_Logging.Debug("sampled %d", i)
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    written = counters["messages"][cx_Logging.DEBUG]
+    assert written + counters["sampled"][cx_Logging.DEBUG] == 4000
+    assert 700 < written < 1300
+
+
+def raise_error(value):
+    raise ValueError("value %d" % value)
+
+
+def check_exceptions():
+    start_logging(exceptionDedupWindow=60)
+    for i in range(3):
+        try:
+            raise_error(i)
+        except ValueError:
+            cx_Logging.LogException()
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    messages = read_messages("test.log")[1:-1]
+    assert messages[0] == "Python exception encountered:"
+    assert "    Exception Id: #1" in messages
+    assert "    Type => <class 'ValueError'>" in messages
+    assert "    Value => value 0" in messages
+    start = messages.index("    Traceback (most recent call last):")
+    assert messages[start + 3].endswith(", in raise_error")
+    assert messages[start + 5] == "    ValueError: value 0"
+    assert messages[-2:] == [
+        "exception #1 repeated (1)",
+        "exception #1 repeated (2)",
+    ]
+    assert counters["messages"][cx_Logging.ERROR] == len(messages)
+
+    # with no exception being handled, None is logged
+    start_logging()
+    cx_Logging.LogException()
+    cx_Logging.StopLogging()
+    assert read_messages("test.log")[1:-1] == [
+        "Python exception encountered:",
+        "    Internal Message: Python exception encountered:",
+        "    Type => <class 'NoneType'>",
+        "    Value => None",
+        "    NoneType: None",
+    ]
+
+    # the lines of each exception are written together
+    start_logging(prefix="%i %t")
+    threads = []
+    for i in range(4):
+        thread = threading.Thread(target=log_exceptions, args=(i,))
+        threads.append(thread)
+        thread.start()
+    for thread in threads:
+        thread.join()
+    cx_Logging.StopLogging()
+    check_exception_records(read_lines("test.log")[1:-1], 4 * 50)
+
+
+def log_exceptions(value):
+    for i in range(50):
+        try:
+            raise_error(value)
+        except ValueError:
+            cx_Logging.LogException()
+
+
+def check_exception_records(lines, num_records):
+    assert len(lines) % num_records == 0
+    lines_per_record = len(lines) // num_records
+    for i in range(0, len(lines), lines_per_record):
+        record = lines[i:i + lines_per_record]
+        assert len(set(line.split()[0] for line in record)) == 1
+        assert record[0].endswith(" Python exception encountered:")
+
+
+def log_records(record_num):
+    for i in range(100):
+        with cx_Logging.Record(cx_Logging.INFO) as record:
+            for j in range(10):
+                record.AppendLine("record %d.%d line %d", record_num, i, j)
+
+
+def check_records(**kwargs):
+    start_logging(prefix="%i %t", **kwargs)
+    with cx_Logging.Record(cx_Logging.DEBUG) as record:
+        assert record.AppendLine("first line")
+        assert record.AppendLine("second line\nthird line")
+    with cx_Logging.Record(cx_Logging.DEBUG - 1) as record:
+        assert not record.AppendLine("not written")
+    threads = []
+    for i in range(4):
+        thread = threading.Thread(target=log_records, args=(i,))
+        threads.append(thread)
+        thread.start()
+    for thread in threads:
+        thread.join()
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    lines = read_lines("test.log")[1:-1]
+    assert [line.split(" ", 2)[2] for line in lines[:3]] == [
+        "first line",
+        "second line",
+        "third line",
+    ]
+    lines = lines[3:]
+    assert len(lines) == 4 * 100 * 10
+    for i in range(0, len(lines), 10):
+        record = [line.split(" ", 2) for line in lines[i:i + 10]]
+        assert len(set(r[0] for r in record)) == 1
+        prefix = record[0][2].rsplit(" ", 1)[0]
+        expected = ["%s %d" % (prefix, j) for j in range(10)]
+        assert [r[2] for r in record] == expected
+    assert counters["messages"][cx_Logging.INFO] == 4000
+
+
+def check_fork():
+    if not hasattr(os, "fork"):
+        return
+
+    # without reopening, the child writes to the same file
+    start_logging(prefix="%i %t")
+    cx_Logging.Info("before fork")
+    pid = os.fork()
+    if pid == 0:
+        cx_Logging.Info("in child %d", os.getpid())
+        cx_Logging.StopLogging()
+        os._exit(0)
+    os.waitpid(pid, 0)
+    cx_Logging.Info("after fork")
+    cx_Logging.StopLogging()
+    messages = [line.split(" ", 2)[2] for line in read_lines("test.log")]
+    assert "in child %d" % pid in messages
+    assert messages[-2:] == ["after fork", "ending logging"]
+    os.remove("test.log")
+
+    # reopening, the child writes to files of its own
+    start_logging(
+        reopenAfterFork=True, routes=[("errors.log", cx_Logging.ERROR)]
+    )
+    cx_Logging.AddSink("warnings.log", cx_Logging.WARNING)
+    cx_Logging.Error("before fork")
+    pid = os.fork()
+    if pid == 0:
+        cx_Logging.Error("in child")
+        cx_Logging.StopLogging()
+        os._exit(0)
+    os.waitpid(pid, 0)
+    cx_Logging.Error("after fork")
+    cx_Logging.StopLogging()
+    for name in ("test", "errors", "warnings"):
+        messages = read_messages("%s.log" % name)
+        assert messages[1:] == ["before fork", "after fork", "ending logging"]
+        messages = read_messages("%s.%d.log" % (name, pid))
+        assert messages[1:] == [
+            "continuing logging after fork from process %d" % os.getpid(),
+            "in child",
+            "ending logging",
+        ]
+
+
+def check_collector():
+    if sys.platform == "win32":
+        return
+    name = "/cx_Logging_test_%d" % os.getpid()
+    thread = threading.Thread(
+        target=cx_Logging.RunCollector, args=(name, "collected.log")
+    )
+    thread.start()
+    for i in range(100):
+        try:
+            start_logging(name, sharedMemory=True)
+            break
+        except Exception:
+            time.sleep(0.05)
+    else:
+        raise AssertionError("collector did not start")
+    pid = os.fork()
+    if pid == 0:
+        for i in range(100):
+            cx_Logging.Info("child message %d", i)
+        cx_Logging.StopLogging()
+        os._exit(0)
+    for i in range(100):
+        cx_Logging.Info("parent message %d", i)
+    with cx_Logging.Record(cx_Logging.INFO) as record:
+        for i in range(5):
+            record.AppendLine("record line %d", i)
+    os.waitpid(pid, 0)
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    cx_Logging.StopCollector()
+    thread.join()
+    assert counters["dropped"] == 0
+    assert counters["messages"][cx_Logging.INFO] == 101
+    messages = read_messages("collected.log")
+    parent = [m for m in messages if m.startswith("parent message")]
+    child = [m for m in messages if m.startswith("child message")]
+    assert parent == ["parent message %d" % i for i in range(100)]
+    assert child == ["child message %d" % i for i in range(100)]
+    start = messages.index("record line 0")
+    expected = ["record line %d" % i for i in range(5)]
+    assert messages[start:start + 5] == expected
+
+
+def log_durable(thread_num):
+    for i in range(50):
+        cx_Logging.Error("thread %d message %d", thread_num, i)
+
+
+def check_durability():
+    start_logging(
+        durability=cx_Logging.DURABILITY_LEVEL, durableLevel=cx_Logging.ERROR
+    )
+    cx_Logging.Warning("not synced")
+    counters = cx_Logging.GetCounters()
+    assert counters["syncs"] == 0
+    cx_Logging.Error("synced")
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    assert counters["syncs"] == 1
+
+    if sys.platform == "win32":
+        return
+    start_logging(durability=cx_Logging.DURABILITY_GROUP_COMMIT)
+    threads = []
+    for i in range(8):
+        thread = threading.Thread(target=log_durable, args=(i,))
+        threads.append(thread)
+        thread.start()
+    for thread in threads:
+        thread.join()
+    counters = cx_Logging.GetCounters()
+    cx_Logging.StopLogging()
+    assert 0 < counters["syncs"] <= 400
+    messages = read_messages("test.log")
+    for i in range(8):
+        expected = ["thread %d message %d" % (i, j) for j in range(50)]
+        prefix = "thread %d " % i
+        assert [m for m in messages if m.startswith(prefix)] == expected
+
+    # stopping logging while writers wait for a sync
+    start_logging(durability=cx_Logging.DURABILITY_GROUP_COMMIT)
+    threads = []
+    for i in range(8):
+        thread = threading.Thread(target=log_durable, args=(i,))
+        threads.append(thread)
+        thread.start()
+    cx_Logging.StopLogging()
+    for thread in threads:
+        thread.join()
+
+
+def remove_files():
+    for name in os.listdir("."):
+        os.remove(name)
+
+
+if __name__ == "__main__":
+    checks = [
+        check_sinks,
+        check_routes,
+        check_rate_limit,
+        check_suppress_repeats,
+        check_sampling,
+        check_exceptions,
+        check_records,
+        check_fork,
+        check_collector,
+        check_durability,
+    ]
+    directory = tempfile.mkdtemp()
+    os.chdir(directory)
+    for check in checks:
+        remove_files()
+        print("Running %s..." % check.__name__)
+        check()
+    if sys.platform != "win32":
+        remove_files()
+        print("Running check_records with directWrite...")
+        check_records(directWrite=True)
+    remove_files()
+    os.chdir(os.path.dirname(directory))
+    os.rmdir(directory)
+    print("All checks passed.")